@@ -0,0 +1,916 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  User space implementation of the kernel services declared in include/HostKernel.h.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include "HostKernel.h"
+
+
+task_t      kernel_task = (task_t)&kernel_task;
+vm_size_t   page_size = 4096;
+
+static bool                 sLogging = (getenv("VSP_HOST_LOG") != NULL);
+static HostMessageHandler   sMessageHandler = NULL;
+static void                 *sMessageContext = NULL;
+static HostCounters         sCounters;          // Changed with __atomic builtins
+
+
+#pragma mark Logging and Memory
+
+void HostSetLogging(bool enabled){
+
+    sLogging = enabled;
+}
+
+
+void IOLog(const char *format, ...){
+    va_list args;
+
+    if (!sLogging) return;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+
+void Debugger(const char *message){
+
+    fprintf(stderr, "Debugger: %s\n", message);
+    abort();
+}
+
+
+void* IOMalloc(vm_size_t size){
+
+    return malloc(size);
+}
+
+
+void IOFree(void *address, vm_size_t size){
+
+    free(address);
+}
+
+
+#pragma mark Waiting
+
+// Every thread that has called assert_wait is on its event's bucket until it is woken. Like the kernel's
+// hashed wait queues, a wakeup only looks at the threads whose events share its bucket, which matters
+// once there are a thousand readers asleep.
+#define kWaitBuckets    256
+
+typedef struct Waiter{
+    struct Waiter   *next;
+    struct Waiter   *prev;
+    struct WaitBucket   *bucket;    // The one it is queued on, whose lock covers the fields below
+    event_t         event;
+    wait_result_t   result;
+    pthread_cond_t  cond;
+    bool            queued;         // On the bucket, not yet woken
+    bool            asserted;       // assert_wait called, thread_block not yet
+}Waiter;
+
+typedef struct WaitBucket{
+    pthread_mutex_t lock;
+    Waiter          head;
+}WaitBucket;
+
+static WaitBucket       sBuckets[kWaitBuckets];
+static pthread_once_t   sBucketsOnce = PTHREAD_ONCE_INIT;
+static __thread Waiter  *sSelf = NULL;
+
+
+static void initBuckets(void){
+
+    for (int i = 0; i < kWaitBuckets; i++){
+        pthread_mutex_init(&sBuckets[i].lock, NULL);
+        sBuckets[i].head.next = &sBuckets[i].head;
+        sBuckets[i].head.prev = &sBuckets[i].head;
+    }
+}
+
+
+static WaitBucket* bucketFor(event_t event){
+    uintptr_t   hash = (uintptr_t)event;
+
+    hash ^= hash >> 17;
+    hash *= 0x9E3779B1;
+    return &sBuckets[(hash >> 8) % kWaitBuckets];
+}
+
+
+static Waiter* currentWaiter(void){
+
+    if (sSelf == NULL){
+        pthread_once(&sBucketsOnce, initBuckets);
+        sSelf = (Waiter*)calloc(1, sizeof(Waiter));
+        pthread_cond_init(&sSelf->cond, NULL);
+        sSelf->bucket = &sBuckets[0];
+    }
+    return sSelf;
+}
+
+
+static void unlinkWaiter(Waiter *waiter){
+
+    waiter->prev->next = waiter->next;
+    waiter->next->prev = waiter->prev;
+    waiter->queued = false;
+}
+
+
+wait_result_t assert_wait(event_t event, wait_interrupt_t interruptible){
+    Waiter      *self = currentWaiter();
+    WaitBucket  *bucket = bucketFor(event);
+
+    // Only this thread moves itself between buckets, a wakeup just takes it off.
+    if (self->bucket != bucket){
+        pthread_mutex_lock(&self->bucket->lock);
+        if (self->queued)
+            unlinkWaiter(self);
+        pthread_mutex_unlock(&self->bucket->lock);
+    }
+
+    pthread_mutex_lock(&bucket->lock);
+    if (self->queued)
+        unlinkWaiter(self);
+    self->bucket = bucket;
+    self->event = event;
+    self->result = THREAD_WAITING;
+    self->next = &bucket->head;
+    self->prev = bucket->head.prev;
+    bucket->head.prev->next = self;
+    bucket->head.prev = self;
+    self->queued = true;
+    self->asserted = true;
+    pthread_mutex_unlock(&bucket->lock);
+
+    return THREAD_WAITING;
+}
+
+
+wait_result_t thread_block(thread_continue_t continuation){
+    Waiter          *self = currentWaiter();
+    WaitBucket      *bucket = self->bucket;
+    wait_result_t   result;
+
+    pthread_mutex_lock(&bucket->lock);
+    if (!self->asserted){
+        // Nothing asserted, the kernel returns straight away too.
+        pthread_mutex_unlock(&bucket->lock);
+        return THREAD_AWAKENED;
+    }
+    while (self->result == THREAD_WAITING)
+        pthread_cond_wait(&self->cond, &bucket->lock);
+    result = self->result;
+    self->asserted = false;
+    pthread_mutex_unlock(&bucket->lock);
+
+    if (continuation)
+        continuation(NULL, result);
+    return result;
+}
+
+
+kern_return_t thread_wakeup_prim(event_t event, boolean_t one_thread, wait_result_t result){
+    WaitBucket  *bucket;
+    Waiter      *waiter, *next;
+
+    __atomic_add_fetch(&sCounters.wakeups, 1, __ATOMIC_RELAXED);
+    pthread_once(&sBucketsOnce, initBuckets);
+    bucket = bucketFor(event);
+    pthread_mutex_lock(&bucket->lock);
+    for (waiter = bucket->head.next; waiter != &bucket->head; waiter = next){
+        next = waiter->next;
+        if (waiter->event != event)
+            continue;
+
+        unlinkWaiter(waiter);
+        waiter->result = result;
+        pthread_cond_signal(&waiter->cond);
+        if (one_thread)
+            break;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+
+    return KERN_SUCCESS;
+}
+
+
+struct _IOLock{
+    pthread_mutex_t mutex;
+};
+
+
+IOLock* IOLockAlloc(void){
+    IOLock  *lock = (IOLock*)malloc(sizeof(IOLock));
+
+    if (lock)
+        pthread_mutex_init(&lock->mutex, NULL);
+    return lock;
+}
+
+
+void IOLockFree(IOLock *lock){
+
+    pthread_mutex_destroy(&lock->mutex);
+    free(lock);
+}
+
+
+void IOLockLock(IOLock *lock){
+
+    pthread_mutex_lock(&lock->mutex);
+}
+
+
+bool IOLockTryLock(IOLock *lock){
+
+    return pthread_mutex_trylock(&lock->mutex) == 0;
+}
+
+
+void IOLockUnlock(IOLock *lock){
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+
+// Asserting the wait before dropping the lock means a wakeup sent in between isn't lost.
+int IOLockSleep(IOLock *lock, void *event, UInt32 interType){
+    int result;
+
+    assert_wait(event, interType);
+    IOLockUnlock(lock);
+    result = thread_block(THREAD_CONTINUE_NULL);
+    IOLockLock(lock);
+
+    return result;
+}
+
+
+void IOLockWakeup(IOLock *lock, void *event, bool oneThread){
+
+    thread_wakeup_prim(event, oneThread, THREAD_AWAKENED);
+}
+
+
+#pragma mark Time
+
+void clock_get_uptime(uint64_t *result){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *result = ((uint64_t)now.tv_sec * NSEC_PER_SEC) + now.tv_nsec;
+}
+
+
+void clock_interval_to_deadline(UInt32 interval, UInt32 scale_factor, uint64_t *result){
+    uint64_t    now;
+
+    clock_get_uptime(&now);
+    *result = now + ((uint64_t)interval * scale_factor);
+}
+
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result){
+
+    *result = nanoseconds;
+}
+
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result){
+
+    *result = abstime;
+}
+
+
+#pragma mark Thread Calls
+
+struct thread_call{
+    struct thread_call  *next;          // On sCalls while pending
+    thread_call_func_t  func;
+    thread_call_param_t param0;
+    uint64_t            deadline;
+    bool                pending;
+    bool                running;
+    bool                freed;          // thread_call_free came while it ran, the worker frees it
+};
+
+static pthread_mutex_t  sCallLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   sCallCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   sCallDone = PTHREAD_COND_INITIALIZER;
+static thread_call_t    sCalls = NULL;          // Sorted by deadline
+static bool             sCallThreadStarted = false;
+
+
+static void unlinkCall(thread_call_t call){
+    thread_call_t   *link;
+
+    for (link = &sCalls; *link; link = &(*link)->next){
+        if (*link == call){
+            *link = call->next;
+            break;
+        }
+    }
+    call->pending = false;
+}
+
+
+static void* callThread(void *unused){
+    struct timespec wake;
+    uint64_t        now;
+
+    pthread_mutex_lock(&sCallLock);
+    for (;;){
+        if (sCalls == NULL){
+            pthread_cond_wait(&sCallCond, &sCallLock);
+            continue;
+        }
+
+        clock_get_uptime(&now);
+        if (sCalls->deadline > now){
+            wake.tv_sec = sCalls->deadline / NSEC_PER_SEC;
+            wake.tv_nsec = sCalls->deadline % NSEC_PER_SEC;
+            pthread_cond_timedwait(&sCallCond, &sCallLock, &wake);
+            continue;
+        }
+
+        thread_call_t call = sCalls;
+        unlinkCall(call);
+        call->running = true;
+        pthread_mutex_unlock(&sCallLock);
+
+        call->func(call->param0, NULL);
+
+        pthread_mutex_lock(&sCallLock);
+        call->running = false;
+        if (call->freed)
+            free(call);
+        pthread_cond_broadcast(&sCallDone);
+    }
+
+    return NULL;
+}
+
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0){
+    thread_call_t   call = (thread_call_t)calloc(1, sizeof(struct thread_call));
+
+    if (call == NULL) return NULL;
+    call->func = func;
+    call->param0 = param0;
+
+    pthread_mutex_lock(&sCallLock);
+    if (!sCallThreadStarted){
+        pthread_condattr_t  attr;
+        pthread_t           thread;
+
+        // Deadlines are CLOCK_MONOTONIC, so the timed waits must be too.
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_destroy(&sCallCond);
+        pthread_cond_init(&sCallCond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        pthread_create(&thread, NULL, callThread, NULL);
+        pthread_detach(thread);
+        sCallThreadStarted = true;
+    }
+    pthread_mutex_unlock(&sCallLock);
+
+    return call;
+}
+
+
+boolean_t thread_call_enter_delayed(thread_call_t call, uint64_t deadline){
+    thread_call_t   *link;
+    boolean_t       wasPending;
+
+    __atomic_add_fetch(&sCounters.threadCalls, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&sCallLock);
+    wasPending = call->pending;
+    if (wasPending)
+        unlinkCall(call);
+
+    call->deadline = deadline;
+    for (link = &sCalls; *link && ((*link)->deadline <= deadline); link = &(*link)->next)
+        ;
+    call->next = *link;
+    *link = call;
+    call->pending = true;
+    pthread_cond_signal(&sCallCond);
+    pthread_mutex_unlock(&sCallLock);
+
+    return wasPending;
+}
+
+
+boolean_t thread_call_enter(thread_call_t call){
+    uint64_t    now;
+
+    // Like the kernel, entering a call that is already pending leaves it where it is.
+    pthread_mutex_lock(&sCallLock);
+    bool pending = call->pending;
+    pthread_mutex_unlock(&sCallLock);
+    if (pending) return TRUE;
+
+    clock_get_uptime(&now);
+    return thread_call_enter_delayed(call, now);
+}
+
+
+boolean_t thread_call_cancel(thread_call_t call){
+    boolean_t   wasPending;
+
+    pthread_mutex_lock(&sCallLock);
+    wasPending = call->pending;
+    if (wasPending)
+        unlinkCall(call);
+    pthread_mutex_unlock(&sCallLock);
+
+    return wasPending;
+}
+
+
+// Also waits for a run already under way, so that the call's owner can be freed straight after.
+boolean_t thread_call_cancel_wait(thread_call_t call){
+    boolean_t   wasPending;
+
+    pthread_mutex_lock(&sCallLock);
+    wasPending = call->pending;
+    if (wasPending)
+        unlinkCall(call);
+    while (call->running)
+        pthread_cond_wait(&sCallDone, &sCallLock);
+    pthread_mutex_unlock(&sCallLock);
+
+    return wasPending;
+}
+
+
+// Like the kernel's, this refuses a pending call and doesn't wait for a running one: the call goes once it
+// returns, but whatever it was given to work on had better still be there.
+boolean_t thread_call_free(thread_call_t call){
+
+    pthread_mutex_lock(&sCallLock);
+    if (call->pending){
+        pthread_mutex_unlock(&sCallLock);
+        return FALSE;
+    }
+    if (call->running){
+        call->freed = true;
+        pthread_mutex_unlock(&sCallLock);
+        return TRUE;
+    }
+    pthread_mutex_unlock(&sCallLock);
+
+    free(call);
+    return TRUE;
+}
+
+
+#pragma mark Mach Messages
+
+void HostGetCounters(HostCounters *counters){
+
+    counters->wakeups = __atomic_load_n(&sCounters.wakeups, __ATOMIC_RELAXED);
+    counters->threadCalls = __atomic_load_n(&sCounters.threadCalls, __ATOMIC_RELAXED);
+    counters->messages = __atomic_load_n(&sCounters.messages, __ATOMIC_RELAXED);
+    counters->calls = __atomic_load_n(&sCounters.calls, __ATOMIC_RELAXED);
+}
+
+
+void HostSetMessageHandler(HostMessageHandler handler, void *context){
+
+    sMessageHandler = handler;
+    sMessageContext = context;
+}
+
+
+kern_return_t mach_msg_send_from_kernel(mach_msg_header_t *msg, mach_msg_size_t size){
+
+    __atomic_add_fetch(&sCounters.messages, 1, __ATOMIC_RELAXED);
+    if (sMessageHandler)
+        sMessageHandler(msg, size, sMessageContext);
+    return KERN_SUCCESS;
+}
+
+
+#pragma mark OSObject
+
+// Out of line, GCC mistakes the pair for mismatched when it inlines them into a new-expression.
+void* OSObject::operator new(size_t size){
+
+    return memset(::operator new(size), 0, size);
+}
+
+
+void OSObject::operator delete(void *p){
+
+    ::operator delete(p);
+}
+
+
+void OSObject::retain(void) const{
+
+    __sync_fetch_and_add(&((OSObject*)this)->fRetainCount, 1);
+}
+
+
+void OSObject::release(void) const{
+
+    if (__sync_sub_and_fetch(&((OSObject*)this)->fRetainCount, 1) == 0)
+        ((OSObject*)this)->free();
+}
+
+
+#pragma mark Memory Descriptors
+
+IOMemoryMap::IOMemoryMap(IOMemoryDescriptor *memory, mach_vm_address_t address) : fMemory(memory), fAddress(address){
+
+    fMemory->retain();
+}
+
+
+IOMemoryMap::~IOMemoryMap(){
+
+    fMemory->release();
+}
+
+
+IOByteCount IOMemoryMap::getLength(void){
+
+    return fMemory->getLength();
+}
+
+
+IOMemoryDescriptor* IOMemoryDescriptor::withAddress(void *address, IOByteCount length, IODirection direction){
+    IOMemoryDescriptor  *memory = new IOMemoryDescriptor;
+
+    memory->fBytes = (UInt8*)address;
+    memory->fLength = length;
+    memory->fDirection = direction;
+    return memory;
+}
+
+
+IOMemoryDescriptor* IOMemoryDescriptor::withAddressRange(mach_vm_address_t address, mach_vm_address_t length,
+                                                         IOOptionBits options, task_t task){
+
+    return withAddress((void*)(uintptr_t)address, length, options & kIODirectionInOut);
+}
+
+
+IOReturn IOMemoryDescriptor::prepare(IODirection forDirection){
+
+    __sync_fetch_and_add(&fPrepareCount, 1);
+    return kIOReturnSuccess;
+}
+
+
+IOReturn IOMemoryDescriptor::complete(IODirection forDirection){
+
+    if (__sync_sub_and_fetch(&fPrepareCount, 1) < 0)
+        Debugger("IOMemoryDescriptor::complete without prepare");
+    return kIOReturnSuccess;
+}
+
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void *bytes, IOByteCount length){
+
+    if (offset >= fLength) return 0;
+    if (length > (fLength - offset))
+        length = fLength - offset;
+    bcopy(fBytes + offset, bytes, length);
+    return length;
+}
+
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void *bytes, IOByteCount length){
+
+    if (offset >= fLength) return 0;
+    if (length > (fLength - offset))
+        length = fLength - offset;
+    bcopy(bytes, fBytes + offset, length);
+    return length;
+}
+
+
+IOMemoryMap* IOMemoryDescriptor::createMappingInTask(task_t intoTask, mach_vm_address_t atAddress, IOOptionBits options,
+                                                     mach_vm_address_t offset, mach_vm_address_t length){
+
+    return new IOMemoryMap(this, (mach_vm_address_t)(uintptr_t)(fBytes + offset));
+}
+
+
+IOBufferMemoryDescriptor::~IOBufferMemoryDescriptor(){
+
+    ::free(fBytes);
+}
+
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::withOptions(IOOptionBits options, vm_size_t capacity, vm_size_t alignment){
+    IOBufferMemoryDescriptor    *memory;
+    void                        *bytes = NULL;
+
+    if (alignment < sizeof(void*))
+        alignment = sizeof(void*);
+    if (posix_memalign(&bytes, alignment, capacity ? capacity : 1) != 0)
+        return NULL;
+
+    memory = new IOBufferMemoryDescriptor;
+    memory->fBytes = (UInt8*)bytes;
+    memory->fLength = capacity;
+    memory->fDirection = options & kIODirectionInOut;
+    return memory;
+}
+
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::withCapacity(vm_size_t capacity, IODirection direction){
+
+    return withOptions(direction, capacity, 1);
+}
+
+
+#pragma mark IOService
+
+IOService::IOService() : fOpenClient(NULL), fProviderService(NULL), fChildren(NULL), fNextSibling(NULL), fInactive(false){
+
+    pthread_mutex_init(&fOpenLock, NULL);
+}
+
+
+IOService::~IOService(){
+
+    pthread_mutex_destroy(&fOpenLock);
+}
+
+
+void IOService::free(void){
+
+    while (fChildren)
+        fChildren->detach(this);
+    OSObject::free();
+}
+
+
+bool IOService::start(IOService *provider){
+
+    return true;
+}
+
+
+void IOService::stop(IOService *provider){
+}
+
+
+// The provider keeps a reference on each attached child until it is detached.
+bool IOService::attach(IOService *provider){
+
+    if (provider == NULL || fProviderService) return false;
+
+    retain();
+    fProviderService = provider;
+    pthread_mutex_lock(&provider->fOpenLock);
+    fNextSibling = provider->fChildren;
+    provider->fChildren = this;
+    pthread_mutex_unlock(&provider->fOpenLock);
+    return true;
+}
+
+
+void IOService::detach(IOService *provider){
+    IOService   **link;
+    bool        found = false;
+
+    if (provider == NULL || fProviderService != provider) return;
+
+    pthread_mutex_lock(&provider->fOpenLock);
+    for (link = &provider->fChildren; *link; link = &(*link)->fNextSibling){
+        if (*link == this){
+            *link = fNextSibling;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&provider->fOpenLock);
+
+    fProviderService = NULL;
+    if (found)
+        release();
+}
+
+
+bool IOService::open(IOService *forClient, IOOptionBits options, void *arg){
+
+    if (fInactive) return false;
+    return handleOpen(forClient, options, arg);
+}
+
+
+void IOService::close(IOService *forClient, IOOptionBits options){
+
+    if (handleIsOpen(forClient))
+        handleClose(forClient, options);
+}
+
+
+bool IOService::isOpen(const IOService *forClient) const{
+
+    return handleIsOpen(forClient);
+}
+
+
+bool IOService::handleOpen(IOService *forClient, IOOptionBits options, void *arg){
+    bool    opened = false;
+
+    pthread_mutex_lock(&fOpenLock);
+    if ((fOpenClient == NULL) || (fOpenClient == forClient)){
+        fOpenClient = forClient;
+        opened = true;
+    }
+    pthread_mutex_unlock(&fOpenLock);
+
+    return opened;
+}
+
+
+void IOService::handleClose(IOService *forClient, IOOptionBits options){
+
+    pthread_mutex_lock(&fOpenLock);
+    if (fOpenClient == forClient)
+        fOpenClient = NULL;
+    pthread_mutex_unlock(&fOpenLock);
+}
+
+
+bool IOService::handleIsOpen(const IOService *forClient) const{
+    bool    open;
+
+    pthread_mutex_lock(&fOpenLock);
+    open = forClient ? (fOpenClient == forClient) : (fOpenClient != NULL);
+    pthread_mutex_unlock(&fOpenLock);
+
+    return open;
+}
+
+
+// No registry to walk, so termination is the three notifications on this one object.
+bool IOService::terminate(IOOptionBits options){
+    bool    defer = false;
+
+    if (fInactive) return false;
+    fInactive = true;
+
+    willTerminate(fProviderService, options);
+    didTerminate(fProviderService, options, &defer);
+    finalize(options);
+    if (fProviderService){
+        stop(fProviderService);
+        detach(fProviderService);
+    }
+    return true;
+}
+
+
+#pragma mark IOUserClient
+
+bool IOUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type){
+
+    return init();
+}
+
+
+// Checks the argument counts against the dispatch entry the way IOUserClient does, then calls it.
+IOReturn IOUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+                                      IOExternalMethodDispatch *dispatch, OSObject *target, void *reference){
+
+    if (dispatch == NULL || dispatch->function == NULL) return kIOReturnUnsupported;
+
+    if ((dispatch->checkScalarInputCount != kIOUCVariableStructureSize) &&
+        (dispatch->checkScalarInputCount != arguments->scalarInputCount))
+        return kIOReturnBadArgument;
+
+    if (dispatch->checkStructureInputSize != kIOUCVariableStructureSize){
+        UInt32 size = arguments->structureInputDescriptor ? (UInt32)arguments->structureInputDescriptor->getLength()
+                                                          : arguments->structureInputSize;
+        if (dispatch->checkStructureInputSize != size)
+            return kIOReturnBadArgument;
+    }
+
+    if ((dispatch->checkScalarOutputCount != kIOUCVariableStructureSize) &&
+        (dispatch->checkScalarOutputCount != arguments->scalarOutputCount))
+        return kIOReturnBadArgument;
+
+    if (dispatch->checkStructureOutputSize != kIOUCVariableStructureSize){
+        UInt32 size = arguments->structureOutputDescriptor ? (UInt32)arguments->structureOutputDescriptor->getLength()
+                                                           : arguments->structureOutputSize;
+        if (dispatch->checkStructureOutputSize != size)
+            return kIOReturnBadArgument;
+    }
+
+    return dispatch->function(target ? target : this, reference, arguments);
+}
+
+
+IOReturn IOUserClient::clientClose(void){
+
+    return kIOReturnUnsupported;
+}
+
+
+IOReturn IOUserClient::clientDied(void){
+
+    return clientClose();
+}
+
+
+IOReturn IOUserClient::registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon){
+
+    return kIOReturnUnsupported;
+}
+
+
+IOReturn IOUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory){
+
+    return kIOReturnUnsupported;
+}
+
+
+IOReturn IOUserClient::sendAsyncResult64(OSAsyncReference64 reference, IOReturn result,
+                                         io_user_reference_t args[], UInt32 numArgs){
+    HostAsyncCallout    callout = (HostAsyncCallout)(uintptr_t)reference[kIOAsyncCalloutFuncIndex];
+
+    if (callout)
+        callout((void*)(uintptr_t)reference[kIOAsyncCalloutRefconIndex], result, args, numArgs);
+    return kIOReturnSuccess;
+}
+
+
+#pragma mark Host Hooks
+
+IOReturn HostCallMethod(IOUserClient *client, uint32_t selector,
+                        const uint64_t *input, UInt32 inputCount, const void *inputStruct, size_t inputStructSize,
+                        uint64_t *output, UInt32 *outputCount, void *outputStruct, size_t *outputStructSize,
+                        io_user_reference_t *asyncReference){
+    IOExternalMethodArguments   arguments;
+    uint64_t                    scalarOutput[16];
+    IOReturn                    result;
+
+    __atomic_add_fetch(&sCounters.calls, 1, __ATOMIC_RELAXED);
+    bzero(&arguments, sizeof(arguments));
+    bzero(scalarOutput, sizeof(scalarOutput));
+    arguments.selector = selector;
+    arguments.scalarInput = input;
+    arguments.scalarInputCount = inputCount;
+    arguments.scalarOutput = scalarOutput;
+    arguments.scalarOutputCount = outputCount ? *outputCount : 0;
+    if (arguments.scalarOutputCount > 16) return kIOReturnBadArgument;
+
+    if (asyncReference){
+        arguments.asyncWakePort = 1;
+        arguments.asyncReference = asyncReference;
+        arguments.asyncReferenceCount = kOSAsyncRef64Count;
+    }
+
+    if (inputStructSize > kHostInlineStructSize){
+        arguments.structureInputDescriptor = IOMemoryDescriptor::withAddress((void*)inputStruct, inputStructSize, kIODirectionOut);
+    } else {
+        arguments.structureInput = inputStruct;
+        arguments.structureInputSize = (UInt32)inputStructSize;
+    }
+
+    size_t outputSize = outputStructSize ? *outputStructSize : 0;
+    if (outputSize > kHostInlineStructSize){
+        arguments.structureOutputDescriptor = IOMemoryDescriptor::withAddress(outputStruct, outputSize, kIODirectionIn);
+        arguments.structureOutputDescriptorSize = (UInt32)outputSize;
+    } else {
+        arguments.structureOutput = outputStruct;
+        arguments.structureOutputSize = (UInt32)outputSize;
+    }
+
+    result = client->externalMethod(selector, &arguments, NULL, NULL, NULL);
+
+    if (outputCount){
+        for (UInt32 i = 0; i < arguments.scalarOutputCount; i++)
+            output[i] = scalarOutput[i];
+        *outputCount = arguments.scalarOutputCount;
+    }
+    if (outputStructSize)
+        *outputStructSize = arguments.structureOutputDescriptor ? arguments.structureOutputDescriptorSize
+                                                                : arguments.structureOutputSize;
+
+    if (arguments.structureInputDescriptor)
+        arguments.structureInputDescriptor->release();
+    if (arguments.structureOutputDescriptor)
+        arguments.structureOutputDescriptor->release();
+
+    return result;
+}
@@ -0,0 +1,1776 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Throughput and latency of the port engine, driven the same way as vsp-host-test: the tty side
+//  through the IOSerialDriverSync methods, the client side through the user client's selectors.
+//
+//  Each scenario prints one JSON object per line on stdout:
+//
+//    scenario          name, see sScenarios
+//    bytes, seconds    data moved (both directions for bidir and pingpong) and the time it took
+//    bytes_per_sec
+//    p50_us, p99_us    latency of a write: from handing it over until its last byte is read on the
+//                      other side. For pingpong, the round trip. For read-timeouts, how late a read
+//                      that timed out came back. For the responder, from the tty's write to the
+//                      answer being read.
+//    cpu_ms_per_mib    user and system time of the whole process
+//    wakeups_per_mib   voluntary context switches, i.e. threads that slept and were woken
+//    transactions_per_sec  requests the responder answered, responder scenarios only
+//    messages_per_change   kPortDeltaID notifications per burst of settings, notify scenarios only,
+//                          with serialRequestLock's acquisitions and hold time per burst and its
+//                          longest hold when vsp-bench is built with LOCK_STATS=1
+//    syscalls_per_mib      user client calls the client side made, calls scenarios only
+//
+//  A line per scenario also goes to stderr for people. With -b, each scenario is compared with
+//  the same scenario in an earlier run's output, and a drop in bytes_per_sec or a rise in p99_us of
+//  more than -t percent is a regression; vsp-bench then exits with 1.
+//
+//    vsp-bench [-m MiB] [-n round trips] [-q queue chunk] [-b baseline] [-t percent] [-l] [-v] [scenario ...]
+//
+//  A scenario argument selects every scenario whose name starts with it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VSPFixture.h"
+#include "VSPQueue.h"
+
+
+static UInt64   sStreamBytes = 16 * 1024 * 1024;
+static UInt32   sRoundTrips = 10000;
+static UInt32   sQueueChunk = 256;
+
+#define kMaxWrites      (256 * 1024)        // Small write scenarios move at most this many writes
+#define kBulkSize       (64 * 1024)
+#define kReadsInFlight  4
+
+
+#pragma mark Latency
+
+// Writers publish each write before making it; readers turn writes whose last byte has arrived
+// into samples. Only one thread writes and one reads a given Latency.
+typedef struct{
+    UInt32      capacity;
+    double      *starts;
+    UInt64      *ends;              // Stream offset just past each write
+    double      *samples;
+    UInt32      published;          // Written with __atomic builtins
+    UInt32      arrived;
+}Latency;
+
+
+static void initLatency(Latency *latency, UInt32 capacity){
+
+    bzero(latency, sizeof(Latency));
+    latency->capacity = capacity;
+    latency->starts = (double*)calloc(capacity, sizeof(double));
+    latency->ends = (UInt64*)calloc(capacity, sizeof(UInt64));
+    latency->samples = (double*)calloc(capacity, sizeof(double));
+}
+
+
+static void freeLatency(Latency *latency){
+
+    free(latency->starts);
+    free(latency->ends);
+    free(latency->samples);
+}
+
+
+static void writeStarted(Latency *latency, UInt64 end){
+    UInt32  index = latency->published;
+
+    if (index == latency->capacity) return;
+    latency->starts[index] = now();
+    latency->ends[index] = end;
+    __atomic_store_n(&latency->published, index + 1, __ATOMIC_RELEASE);
+}
+
+
+static void bytesArrived(Latency *latency, UInt64 received){
+    UInt32  published = __atomic_load_n(&latency->published, __ATOMIC_ACQUIRE);
+    double  time = 0;
+
+    while ((latency->arrived < published) && (latency->ends[latency->arrived] <= received)){
+        if (time == 0)
+            time = now();
+        latency->samples[latency->arrived] = time - latency->starts[latency->arrived];
+        latency->arrived++;
+    }
+}
+
+
+#pragma mark Results
+
+typedef struct{
+    const char  *name;
+    UInt64      bytes;
+    double      seconds;
+    double      cpuSeconds;
+    long        wakeups;
+    double      *samples;
+    UInt32      numSamples;
+    bool        ok;
+    double      idleBytes;          // Queue memory per idle port, open scenarios only
+    double      poolBytes;          // and what the buffer pool keeps for the next open
+    UInt64      timeouts;           // Read timeouts, timeout scenarios only
+    UInt64      wheelRuns;          // and the timer wheel runs that fired them
+    UInt64      transactions;       // Requests answered, responder scenarios only
+    UInt64      changes;            // Bursts of settings, notify scenarios only
+    UInt64      deltas;             // and the kPortDeltaID messages they produced
+    bool        lockStats;          // serialRequestLock's counters below were read
+    UInt64      lockAcquisitions;
+    UInt64      lockHoldTime;       // Nanoseconds
+    UInt64      lockMaxHoldTime;
+    UInt64      calls;              // HostCallMethod calls, calls scenarios only
+    // Filled in by finishResult
+    double      p50;
+    double      p99;
+}Result;
+
+
+typedef struct{
+    double          start;
+    struct rusage   usage;
+}Meter;
+
+
+static void startMeter(Meter *meter){
+
+    getrusage(RUSAGE_SELF, &meter->usage);
+    meter->start = now();
+}
+
+
+static double cpuTime(const struct rusage *usage){
+
+    return usage->ru_utime.tv_sec + (usage->ru_utime.tv_usec / 1e6) + usage->ru_stime.tv_sec + (usage->ru_stime.tv_usec / 1e6);
+}
+
+
+static void stopMeter(Meter *meter, Result *result){
+    struct rusage   usage;
+
+    result->seconds = now() - meter->start;
+    getrusage(RUSAGE_SELF, &usage);
+    result->cpuSeconds = cpuTime(&usage) - cpuTime(&meter->usage);
+    result->wakeups = usage.ru_nvcsw - meter->usage.ru_nvcsw;
+}
+
+
+// Collect the samples of one or more Latency records into the result.
+static void addSamples(Result *result, const Latency *latency){
+    double  *samples = (double*)realloc(result->samples, (result->numSamples + latency->arrived) * sizeof(double));
+
+    if (samples == NULL) return;
+    memcpy(samples + result->numSamples, latency->samples, latency->arrived * sizeof(double));
+    result->samples = samples;
+    result->numSamples += latency->arrived;
+}
+
+
+static int compareDoubles(const void *a, const void *b){
+    double  x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static void finishResult(Result *result){
+
+    if (result->numSamples){
+        qsort(result->samples, result->numSamples, sizeof(double), compareDoubles);
+        result->p50 = result->samples[result->numSamples / 2];
+        result->p99 = result->samples[((UInt64)result->numSamples * 99) / 100];
+    }
+    free(result->samples);
+    result->samples = NULL;
+}
+
+
+#pragma mark tty Side
+
+// One side of one direction. The writer and reader of a direction share its Latency.
+typedef struct{
+    Fixture     *fixture;
+    UInt64      total;
+    UInt64      done;
+    UInt32      chunkSize;          // Writers: the size of each write
+    Latency     *latency;
+    IOReturn    result;
+}Stream;
+
+
+static void initStream(Stream *stream, Fixture *f, UInt64 total, UInt32 chunkSize, Latency *latency){
+
+    bzero(stream, sizeof(Stream));
+    stream->fixture = f;
+    stream->total = total;
+    stream->chunkSize = chunkSize;
+    stream->latency = latency;
+}
+
+
+// Read everything the client sends, sleeping in watchState while the RX queue is empty.
+static void* ttyReader(void *context){
+    Stream      *stream = (Stream*)context;
+    Fixture     *f = stream->fixture;
+    UInt8       *buffer = (UInt8*)malloc(kBulkSize);
+    UInt32      size, count, state;
+
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        size = (UInt32)((stream->total - stream->done < kBulkSize) ? stream->total - stream->done : kBulkSize);
+        stream->result = f->port->dequeueData(buffer, size, &count, 0, f->refCon);
+        if (stream->result != kIOReturnSuccess) break;
+
+        if (count){
+            stream->done += count;
+            bytesArrived(stream->latency, stream->done);
+            continue;
+        }
+
+        state = 0;
+        stream->result = f->port->watchState(&state, PD_S_RXQ_EMPTY, f->refCon);
+        if (stream->result != kIOReturnSuccess) break;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+// Write from the tty side, sleeping in enqueueData when the TX queue is full.
+static void* ttyWriter(void *context){
+    Stream      *stream = (Stream*)context;
+    Fixture     *f = stream->fixture;
+    UInt8       *buffer = (UInt8*)malloc(stream->chunkSize);
+    UInt32      size, count;
+
+    fillPattern(buffer, 0, stream->chunkSize);
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        size = (UInt32)((stream->total - stream->done < stream->chunkSize) ? stream->total - stream->done : stream->chunkSize);
+
+        writeStarted(stream->latency, stream->done + size);
+        stream->result = f->port->enqueueData(buffer, size, &count, true, f->refCon);
+        stream->done += count;
+        if (stream->result != kIOReturnSuccess) break;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+#pragma mark Client Side
+
+// Send with kSendBlocking, which returns once all of the write is queued.
+static void* clientSender(void *context){
+    Stream      *stream = (Stream*)context;
+    UInt8       *buffer = (UInt8*)malloc(stream->chunkSize);
+    UInt32      size, accepted;
+
+    fillPattern(buffer, 0, stream->chunkSize);
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        size = (UInt32)((stream->total - stream->done < stream->chunkSize) ? stream->total - stream->done : stream->chunkSize);
+
+        writeStarted(stream->latency, stream->done + size);
+        stream->result = sendBuffer(stream->fixture, kSendBlocking, buffer, size, &accepted);
+        stream->done += accepted;
+        if (stream->result != kIOReturnSuccess) break;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+// Send with kSendData, kMessageBufferSize bytes at a time, under kOverflowBlock.
+static void* dataSender(void *context){
+    Stream          *stream = (Stream*)context;
+    TRBufferStruct  message;
+    uint64_t        output;
+    UInt32          size, outputCount;
+
+    fillPattern(message.buffer, 0, kMessageBufferSize);
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        size = (UInt32)((stream->total - stream->done < kMessageBufferSize) ? stream->total - stream->done : kMessageBufferSize);
+        message.numBytes = size;
+        outputCount = 1;
+
+        writeStarted(stream->latency, stream->done + size);
+        stream->result = HostCallMethod(stream->fixture->client, kSendData, NULL, 0, &message, sizeof(message),
+                                        &output, &outputCount, NULL, NULL);
+        stream->done += output;
+        if (stream->result != kIOReturnSuccess) break;
+    }
+
+    return NULL;
+}
+
+
+// Write into the mapped RX ring, waiting for room whenever it is full.
+static void* ringWriter(void *context){
+    Stream      *stream = (Stream*)context;
+    UInt8       *buffer = (UInt8*)malloc(stream->chunkSize);
+    UInt32      size, written, count;
+
+    fillPattern(buffer, 0, stream->chunkSize);
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        size = (UInt32)((stream->total - stream->done < stream->chunkSize) ? stream->total - stream->done : stream->chunkSize);
+
+        writeStarted(stream->latency, stream->done + size);
+        for (written = 0; written < size; written += count){
+            count = writeRing(stream->fixture, buffer + written, size - written);
+            if (!count && !waitForRing(stream->fixture, kSharedRXRing)){
+                stream->result = kIOReturnTimeout;
+                break;
+            }
+        }
+        stream->done += written;
+        if (stream->result != kIOReturnSuccess) break;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+// Read from the mapped TX ring, waiting whenever it is empty.
+static void* ringReader(void *context){
+    Stream      *stream = (Stream*)context;
+    UInt8       *buffer = (UInt8*)malloc(kBulkSize);
+    UInt32      size, count;
+
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        size = (UInt32)((stream->total - stream->done < kBulkSize) ? stream->total - stream->done : kBulkSize);
+
+        count = readRing(stream->fixture, buffer, size);
+        if (count){
+            stream->done += count;
+            bytesArrived(stream->latency, stream->done);
+            continue;
+        }
+        if (!waitForRing(stream->fixture, kSharedTXRing)){
+            stream->result = kIOReturnTimeout;
+            break;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+typedef struct{
+    UInt8               *buffer;
+    UInt64              size;
+    Completion          completion;
+    OSAsyncReference64  reference;
+}PostedRead;
+
+
+static IOReturn postRead(Fixture *f, PostedRead *read, UInt64 size, UInt64 minimum, UInt64 timeout){
+    uint64_t    input[4] = { (uint64_t)(uintptr_t)read->buffer, size, minimum, timeout };
+
+    read->size = size;
+    read->completion.outstanding = 1;
+    return HostCallMethod(f->client, kReadAsync, input, 4, NULL, 0, NULL, NULL, NULL, NULL, read->reference);
+}
+
+
+static void waitForRead(PostedRead *read){
+
+    pthread_mutex_lock(&read->completion.lock);
+    while (read->completion.outstanding)
+        pthread_cond_wait(&read->completion.cond, &read->completion.lock);
+    pthread_mutex_unlock(&read->completion.lock);
+}
+
+
+// Read with kReadAsync, keeping kReadsInFlight reads posted. The reads posted never ask for more
+// than is still to come, so none is left waiting at the end.
+static void* clientReader(void *context){
+    Stream      *stream = (Stream*)context;
+    PostedRead  reads[kReadsInFlight];
+    UInt64      asked = 0;
+    UInt32      head = 0, posted = 0;
+
+    for (UInt32 i = 0; i < kReadsInFlight; i++){
+        reads[i].buffer = (UInt8*)malloc(kBulkSize);
+        initCompletion(&reads[i].completion);
+        makeReference(reads[i].reference, &reads[i].completion);
+    }
+
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        while ((posted < kReadsInFlight) && (asked < stream->total - stream->done)){
+            UInt64 size = stream->total - stream->done - asked;
+
+            if (size > kBulkSize) size = kBulkSize;
+            stream->result = postRead(stream->fixture, &reads[(head + posted) % kReadsInFlight], size, 1, 0);
+            if (stream->result != kIOReturnSuccess) break;
+            asked += size;
+            posted++;
+        }
+        if ((stream->result != kIOReturnSuccess) || !posted) break;
+
+        PostedRead *read = &reads[head];
+        waitForRead(read);
+        head = (head + 1) % kReadsInFlight;
+        posted--;
+        asked -= read->size;
+
+        stream->result = read->completion.result;
+        if (stream->result != kIOReturnSuccess) break;
+        stream->done += read->completion.count;
+        bytesArrived(stream->latency, stream->done);
+    }
+
+    for (; posted; posted--, head = (head + 1) % kReadsInFlight)
+        waitForRead(&reads[head]);
+    for (UInt32 i = 0; i < kReadsInFlight; i++)
+        free(reads[i].buffer);
+    return NULL;
+}
+
+
+#pragma mark Directions
+
+// Client to tty and tty to client as pairs of threads that can be started together.
+typedef struct{
+    Latency     latency;
+    Stream      writer;
+    Stream      reader;
+    pthread_t   writeThread;
+    pthread_t   readThread;
+}Direction;
+
+
+static UInt64 streamBytes(UInt32 writeSize){
+
+    return ((UInt64)writeSize * kMaxWrites < sStreamBytes) ? (UInt64)writeSize * kMaxWrites : sStreamBytes;
+}
+
+
+static void initDirection(Direction *direction, Fixture *f, UInt64 total, UInt32 writeSize){
+
+    initLatency(&direction->latency, (UInt32)((total + writeSize - 1) / writeSize));
+    initStream(&direction->writer, f, total, writeSize, &direction->latency);
+    initStream(&direction->reader, f, total, writeSize, &direction->latency);
+}
+
+
+static void startDirection(Direction *direction, bool toTTY){
+
+    pthread_create(&direction->readThread, NULL, toTTY ? ttyReader : clientReader, &direction->reader);
+    pthread_create(&direction->writeThread, NULL, toTTY ? clientSender : ttyWriter, &direction->writer);
+}
+
+
+static void finishDirection(Direction *direction){
+
+    pthread_join(direction->writeThread, NULL);
+    pthread_join(direction->readThread, NULL);
+}
+
+
+static void addDirection(Direction *direction, Result *result){
+
+    result->bytes += direction->reader.done;
+    result->ok = result->ok && (direction->writer.result == kIOReturnSuccess) && (direction->reader.result == kIOReturnSuccess) &&
+                 (direction->reader.done == direction->reader.total);
+    addSamples(result, &direction->latency);
+    freeLatency(&direction->latency);
+}
+
+
+#pragma mark Scenarios
+
+// Opens a port with the given queue sizes; 0 leaves a queue at its default size.
+static bool openBenchFixture(Fixture *f, UInt32 rxQueueSize, UInt32 txQueueSize){
+
+    if (!openFixture(f, kOverflowDropNewest))
+        return false;
+    if (rxQueueSize && (f->port->executeEvent(PD_E_RXQ_SIZE, rxQueueSize, f->refCon) != kIOReturnSuccess)){
+        fprintf(stderr, "    PD_E_RXQ_SIZE %u failed\n", rxQueueSize);
+        return false;
+    }
+    if (txQueueSize && (f->port->executeEvent(PD_E_TXQ_SIZE, txQueueSize, f->refCon) != kIOReturnSuccess)){
+        fprintf(stderr, "    PD_E_TXQ_SIZE %u failed\n", txQueueSize);
+        return false;
+    }
+    return true;
+}
+
+
+// How the line is set up for a stream, see kSetLineFormat.
+enum{
+    kCoding8N1,             // Bytes cross unchanged
+    kCoding7E1,             // 7E1 at both ends, bytes are masked
+    kCoding7N1To8N1,        // 7N1 into 8N1, bytes are looked up
+    kCodingFaults           // 8N1 with bit errors, duplicates and bursts both ways, see kSetFaults. Nothing
+                            // is lost, so the reader still gets its count.
+};
+
+
+static bool setCoding(Fixture *f, UInt32 coding){
+
+    switch (coding){
+        case kCoding7E1:
+            return (f->port->executeEvent(PD_E_DATA_SIZE, 7 << 1, f->refCon) == kIOReturnSuccess) &&
+                   (f->port->executeEvent(PD_E_DATA_INTEGRITY, PD_RS232_PARITY_EVEN, f->refCon) == kIOReturnSuccess);
+        case kCoding7N1To8N1:
+            return callScalar(f, kSetLineFormat, 7, PD_RS232_PARITY_NONE, 2) == kIOReturnSuccess;
+        case kCodingFaults:{
+            FaultConfig config;
+
+            bzero(&config, sizeof(config));
+            config.Seed = 1;
+            config.BitErrorInterval = 100000;
+            config.DuplicateInterval = 10000;
+            config.BurstInterval = 100000;
+            config.BurstLength = 16;
+            return (setFaults(f, kFaultsToTTY, &config) == kIOReturnSuccess) &&
+                   (setFaults(f, kFaultsFromTTY, &config) == kIOReturnSuccess);
+        }
+        default:
+            return true;
+    }
+}
+
+
+// Streams in one direction (toTTY is client to tty) or both at once, with writes of writeSize.
+static void runStream(Result *result, bool toTTY, bool bidirectional, UInt32 writeSize, UInt32 queueSize, UInt32 coding){
+    Fixture     f;
+    Direction   forward, back;
+    Meter       meter;
+    UInt64      total = streamBytes(writeSize);
+
+    if (openBenchFixture(&f, queueSize, queueSize) && setCoding(&f, coding)){
+        result->ok = true;
+        initDirection(&forward, &f, total, writeSize);
+        if (bidirectional)
+            initDirection(&back, &f, total, writeSize);
+
+        startMeter(&meter);
+        startDirection(&forward, toTTY);
+        if (bidirectional)
+            startDirection(&back, !toTTY);
+        finishDirection(&forward);
+        if (bidirectional)
+            finishDirection(&back);
+        stopMeter(&meter, result);
+
+        addDirection(&forward, result);
+        if (bidirectional)
+            addDirection(&back, result);
+    }
+    closeFixture(&f);
+}
+
+
+// How the client moves the data in the calls scenarios.
+enum{
+    kCallsSendData,         // Client to tty with kSendData
+    kCallsSendBuffer,       // with kSendBlocking
+    kCallsRXRing,           // through the shared RX ring
+    kCallsReadAsync,        // tty to client with kReadAsync
+    kCallsTXRing            // through the shared TX ring
+};
+
+
+// Streams one way, counting the calls the client makes into the user client: on a real kernel each
+// is a system call.
+static void runCalls(Result *result, UInt32 writeSize, UInt32 path){
+    Fixture         f;
+    Direction       direction;
+    Meter           meter;
+    HostCounters    before, after;
+    UInt64          total = streamBytes(writeSize);
+    bool            toTTY = (path != kCallsReadAsync) && (path != kCallsTXRing);
+    void*           (*client)(void*);
+
+    switch (path){
+        case kCallsSendData:    client = dataSender;    break;
+        case kCallsSendBuffer:  client = clientSender;  break;
+        case kCallsRXRing:      client = ringWriter;    break;
+        case kCallsReadAsync:   client = clientReader;  break;
+        default:                client = ringReader;    break;
+    }
+
+    if (openBenchFixture(&f, 0, 0) &&
+        ((path != kCallsSendData) || (callScalar(&f, kSetOverflowPolicy, kOverflowBlock) == kIOReturnSuccess)) &&
+        ((path != kCallsRXRing) || mapRing(&f, kSharedRXRing)) &&
+        ((path != kCallsTXRing) || mapRing(&f, kSharedTXRing))){
+        result->ok = true;
+        initDirection(&direction, &f, total, writeSize);
+
+        HostGetCounters(&before);
+        startMeter(&meter);
+        pthread_create(&direction.readThread, NULL, toTTY ? ttyReader : client, &direction.reader);
+        pthread_create(&direction.writeThread, NULL, toTTY ? client : ttyWriter, &direction.writer);
+        finishDirection(&direction);
+        stopMeter(&meter, result);
+        HostGetCounters(&after);
+
+        result->calls = after.calls - before.calls;
+        addDirection(&direction, result);
+    }
+    closeFixture(&f);
+}
+
+
+// Client to tty on several ports at once, each moving its share of the bytes.
+static void runPorts(Result *result, UInt32 numPorts){
+    Fixture     *fixtures = (Fixture*)calloc(numPorts, sizeof(Fixture));
+    Direction   *directions = (Direction*)calloc(numPorts, sizeof(Direction));
+    Meter       meter;
+    UInt64      total = sStreamBytes / numPorts;
+    UInt32      opened;
+
+    result->ok = true;
+    for (opened = 0; opened < numPorts; opened++){
+        if (!openBenchFixture(&fixtures[opened], 0, 0)){
+            result->ok = false;
+            break;
+        }
+        initDirection(&directions[opened], &fixtures[opened], total, kBulkSize);
+    }
+
+    if (result->ok){
+        startMeter(&meter);
+        for (UInt32 i = 0; i < numPorts; i++)
+            startDirection(&directions[i], true);
+        for (UInt32 i = 0; i < numPorts; i++)
+            finishDirection(&directions[i]);
+        stopMeter(&meter, result);
+
+        for (UInt32 i = 0; i < numPorts; i++)
+            addDirection(&directions[i], result);
+    }
+
+    for (UInt32 i = 0; i <= opened && i < numPorts; i++)
+        closeFixture(&fixtures[i]);
+    free(directions);
+    free(fixtures);
+}
+
+
+// Send back whatever the client sends until the port goes inactive. If the echo fails, the
+// client's read times out.
+static void* ttyEcho(void *context){
+    Fixture     *f = (Fixture*)context;
+    UInt8       buffer[kBulkSize];
+    UInt32      count, written, state;
+
+    for (;;){
+        if (f->port->dequeueData(buffer, sizeof(buffer), &count, 0, f->refCon) != kIOReturnSuccess)
+            break;
+
+        if (count){
+            if (f->port->enqueueData(buffer, count, &written, true, f->refCon) != kIOReturnSuccess)
+                break;
+            continue;
+        }
+
+        state = 0;
+        if (f->port->watchState(&state, PD_S_RXQ_EMPTY, f->refCon) != kIOReturnSuccess)
+            break;
+    }
+
+    return NULL;
+}
+
+
+// Round trips of size byte messages: kSendBuffer, echoed by the tty, read back with kReadAsync.
+static void runPingPong(Result *result, UInt32 size){
+    Fixture     f;
+    PostedRead  read;
+    pthread_t   echoThread;
+    Meter       meter;
+    UInt8       *message = (UInt8*)malloc(size);
+    double      *samples = (double*)calloc(sRoundTrips, sizeof(double));
+    UInt32      trips = 0, accepted;
+    IOReturn    status = kIOReturnSuccess;
+
+    read.buffer = (UInt8*)malloc(size);
+    initCompletion(&read.completion);
+    makeReference(read.reference, &read.completion);
+    fillPattern(message, 0, size);
+
+    if (openBenchFixture(&f, 0, 0)){
+        pthread_create(&echoThread, NULL, ttyEcho, &f);
+
+        startMeter(&meter);
+        for (; trips < sRoundTrips; trips++){
+            double start = now();
+
+            status = postRead(&f, &read, size, size, 1000);
+            if (status != kIOReturnSuccess) break;
+            status = sendBuffer(&f, kSendBlocking, message, size, &accepted);
+            waitForRead(&read);
+            if (status == kIOReturnSuccess)
+                status = read.completion.result;
+            if ((status != kIOReturnSuccess) || (read.completion.count != size)) break;
+
+            samples[trips] = now() - start;
+        }
+        stopMeter(&meter, result);
+
+        f.port->executeEvent(PD_E_ACTIVE, false, f.refCon);
+        pthread_join(echoThread, NULL);
+
+        result->bytes = (UInt64)trips * size * 2;
+        result->ok = (trips == sRoundTrips);
+        result->samples = samples;
+        result->numSamples = trips;
+        samples = NULL;
+    }
+    closeFixture(&f);
+    free(samples);
+    free(message);
+    free(read.buffer);
+}
+
+
+#pragma mark Credits
+
+// The latest credit notification, for the credit scenarios.
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    UInt64          notifications;
+}sCredits = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+// And the delta notifications, for the notify scenarios.
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    UInt64          notifications;
+}sDeltas = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+
+static void messageHandler(mach_msg_header_t *msg, mach_msg_size_t size, void *context){
+
+    if (msg->msgh_id == kRingWakeupID){
+        ringWakeupArrived((RingWakeupNotification*)msg);
+        return;
+    }
+    if (msg->msgh_id == kPortDeltaID){
+        pthread_mutex_lock(&sDeltas.lock);
+        sDeltas.notifications++;
+        pthread_cond_broadcast(&sDeltas.cond);
+        pthread_mutex_unlock(&sDeltas.lock);
+        return;
+    }
+    if (msg->msgh_id != kCreditID) return;
+
+    pthread_mutex_lock(&sCredits.lock);
+    sCredits.notifications++;
+    pthread_cond_broadcast(&sCredits.cond);
+    pthread_mutex_unlock(&sCredits.lock);
+}
+
+
+// Send only as much as the credit allows with kSendNormal, and sleep until the next credit
+// notification when there is none. The tty drains the queue, and credit comes back each time it
+// passes low water, so lowWater sets how much comes back per wakeup.
+static void* creditSender(void *context){
+    Stream      *stream = (Stream*)context;
+    UInt8       *buffer = (UInt8*)malloc(kBulkSize);
+    uint64_t    output[2];
+    UInt32      outputCount, accepted;
+    UInt64      seen;
+
+    fillPattern(buffer, 0, kBulkSize);
+    stream->result = kIOReturnSuccess;
+    while (stream->done < stream->total){
+        pthread_mutex_lock(&sCredits.lock);
+        seen = sCredits.notifications;
+        pthread_mutex_unlock(&sCredits.lock);
+
+        outputCount = 2;
+        stream->result = HostCallMethod(stream->fixture->client, kGetCredits, NULL, 0, NULL, 0, output, &outputCount, NULL, NULL);
+        if (stream->result != kIOReturnSuccess) break;
+
+        UInt64 credit = output[0] - output[1];
+        if (credit == 0){
+            pthread_mutex_lock(&sCredits.lock);
+            while (sCredits.notifications == seen)
+                pthread_cond_wait(&sCredits.cond, &sCredits.lock);
+            pthread_mutex_unlock(&sCredits.lock);
+            continue;
+        }
+
+        UInt32 size = (UInt32)((credit < kBulkSize) ? credit : kBulkSize);
+        if (size > stream->total - stream->done)
+            size = (UInt32)(stream->total - stream->done);
+        writeStarted(stream->latency, stream->done + size);
+        stream->result = sendBuffer(stream->fixture, kSendNormal, buffer, size, &accepted);
+        stream->done += accepted;
+        if ((stream->result != kIOReturnSuccess) || (accepted != size)) break;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+static void runCredits(Result *result, UInt32 queueSize, UInt32 lowWater){
+    Fixture     f;
+    Direction   direction;
+    Meter       meter;
+
+    if (openBenchFixture(&f, queueSize, 0) &&
+        (f.port->executeEvent(PD_E_RXQ_HIGH_WATER, (queueSize * 3) / 4, f.refCon) == kIOReturnSuccess) &&
+        (f.port->executeEvent(PD_E_RXQ_LOW_WATER, lowWater, f.refCon) == kIOReturnSuccess)){
+        result->ok = true;
+        initDirection(&direction, &f, sStreamBytes, kBulkSize);
+
+        startMeter(&meter);
+        pthread_create(&direction.readThread, NULL, ttyReader, &direction.reader);
+        pthread_create(&direction.writeThread, NULL, creditSender, &direction.writer);
+        finishDirection(&direction);
+        stopMeter(&meter, result);
+
+        addDirection(&direction, result);
+    }
+    closeFixture(&f);
+}
+
+
+#pragma mark Open and Close
+
+// Opens numPorts ports and closes them again, then reopens them in turn sRoundTrips times, timing each
+// acquirePort and PD_E_ACTIVE. The queue memory left per port once they are all closed is idleBytes,
+// not counting the buffers the pool keeps, which is poolBytes.
+static void runOpenClose(Result *result, UInt32 numPorts){
+    Fixture         *fixtures = (Fixture*)calloc(numPorts, sizeof(Fixture));
+    double          *samples = (double*)calloc(sRoundTrips, sizeof(double));
+    QueuePoolStats  base, idle;
+    Meter           meter;
+    UInt32          opened, trips = 0;
+
+    GetQueuePoolStats(&base);
+    result->ok = true;
+    for (opened = 0; opened < numPorts; opened++){
+        if (!openBenchFixture(&fixtures[opened], 0, 0)){
+            result->ok = false;
+            break;
+        }
+    }
+
+    if (result->ok){
+        for (UInt32 i = 0; i < numPorts; i++)
+            fixtures[i].port->releasePort(fixtures[i].refCon);
+        GetQueuePoolStats(&idle);
+        result->idleBytes = (double)(SInt64)((idle.Allocated - idle.Cached) - (base.Allocated - base.Cached)) / numPorts;
+        result->poolBytes = idle.Cached;
+
+        startMeter(&meter);
+        for (; trips < sRoundTrips; trips++){
+            Fixture *f = &fixtures[trips % numPorts];
+            double  start = now();
+
+            if ((f->port->acquirePort(false, f->refCon) != kIOReturnSuccess) ||
+                (f->port->executeEvent(PD_E_ACTIVE, true, f->refCon) != kIOReturnSuccess))
+                break;
+            samples[trips] = now() - start;
+            f->port->releasePort(f->refCon);
+        }
+        stopMeter(&meter, result);
+
+        result->ok = (trips == sRoundTrips);
+        result->samples = samples;
+        result->numSamples = trips;
+        samples = NULL;
+    }
+
+    for (UInt32 i = 0; i <= opened && i < numPorts; i++)
+        closeFixture(&fixtures[i]);
+    free(samples);
+    free(fixtures);
+}
+
+
+#pragma mark Read Timeouts
+
+// Every port has a reader in dequeueData waiting for a byte that never comes, with PD_E_DATA_LATENCY
+// set, so each read is one timer on the wheel. The samples are how late each read came back.
+#define kTimeoutSeconds     2.0
+
+typedef struct{
+    Fixture     *fixture;
+    UInt32      latency;            // Microseconds
+    UInt32      reads;
+    double      *samples;
+    bool        ok;
+}TimeoutReader;
+
+
+static void* timeoutReader(void *context){
+    TimeoutReader   *reader = (TimeoutReader*)context;
+    UInt8           buffer[1];
+    UInt32          count;
+
+    reader->ok = true;
+    for (UInt32 i = 0; i < reader->reads; i++){
+        double  start = now();
+
+        if ((reader->fixture->port->dequeueData(buffer, 1, &count, 1, reader->fixture->refCon) != kIOReturnSuccess) || count){
+            reader->ok = false;
+            break;
+        }
+        reader->samples[i] = now() - start - (reader->latency / 1e6);
+    }
+    return NULL;
+}
+
+
+static void runReadTimeouts(Result *result, UInt32 numPorts, UInt32 latency){
+    Fixture         *fixtures = (Fixture*)calloc(numPorts, sizeof(Fixture));
+    TimeoutReader   *readers = (TimeoutReader*)calloc(numPorts, sizeof(TimeoutReader));
+    pthread_t       *threads = (pthread_t*)calloc(numPorts, sizeof(pthread_t));
+    UInt32          reads = (UInt32)(kTimeoutSeconds / (latency / 1e6));
+    UInt32          opened, started = 0;
+    TimerWheelStats before, after;
+    pthread_attr_t  attributes;
+    Meter           meter;
+
+    result->ok = true;
+    for (opened = 0; opened < numPorts; opened++){
+        if (!openBenchFixture(&fixtures[opened], 0, 0) ||
+            (fixtures[opened].port->executeEvent(PD_E_DATA_LATENCY, latency, fixtures[opened].refCon) != kIOReturnSuccess)){
+            result->ok = false;
+            break;
+        }
+        readers[opened].fixture = &fixtures[opened];
+        readers[opened].latency = latency;
+        readers[opened].reads = reads;
+        readers[opened].samples = (double*)calloc(reads, sizeof(double));
+    }
+
+    if (result->ok){
+        pthread_attr_init(&attributes);
+        pthread_attr_setstacksize(&attributes, 256 * 1024);
+        GetTimerWheelStats(&before);
+        startMeter(&meter);
+        for (; started < numPorts; started++){
+            if (pthread_create(&threads[started], &attributes, timeoutReader, &readers[started]) != 0){
+                result->ok = false;
+                break;
+            }
+        }
+        for (UInt32 i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        stopMeter(&meter, result);
+        GetTimerWheelStats(&after);
+        pthread_attr_destroy(&attributes);
+
+        result->timeouts = after.Expired - before.Expired;
+        result->wheelRuns = after.Runs - before.Runs;
+        result->samples = (double*)calloc((size_t)numPorts * reads, sizeof(double));
+        for (UInt32 i = 0; i < started; i++){
+            result->ok &= readers[i].ok;
+            memcpy(result->samples + result->numSamples, readers[i].samples, reads * sizeof(double));
+            result->numSamples += reads;
+        }
+    }
+
+    for (UInt32 i = 0; i <= opened && i < numPorts; i++){
+        closeFixture(&fixtures[i]);
+        free(readers[i].samples);
+    }
+    free(threads);
+    free(readers);
+    free(fixtures);
+}
+
+
+#pragma mark Responder
+
+#define TEXT(string)    string, (UInt32)(sizeof(string) - 1)
+
+enum{
+    kResponderModem,            // AT commands, one a line, answered by the fourth rule
+    kResponderModbus            // Read holding registers, CRC checked and added
+};
+
+// sRoundTrips requests written on the tty side and answered by the port's responder, each read back before
+// the next goes. Answers go into RX before enqueueData returns, so nothing here waits.
+static void runResponder(Result *result, UInt32 device){
+    Fixture         f;
+    RuleTable       *rules = (RuleTable*)malloc(sizeof(RuleTable));
+    ResponderStats  stats;
+    Meter           meter;
+    UInt8           answer[kMaxResponderReply];
+    double          *samples = (double*)calloc(sRoundTrips, sizeof(double));
+    const char      *request;
+    UInt32          requestSize, answerSize = 0, trips = 0, count;
+
+    if (device == kResponderModem){
+        beginRules(rules, kFramingDelimiter, '\r', 0, 0);
+        addRule(rules, kMatchLiteral, TEXT("AT"), TEXT("\r\nOK\r\n"));
+        addRule(rules, kMatchLiteral, TEXT("ATI"), TEXT("\r\nVSP modem\r\nOK\r\n"));
+        addRule(rules, kMatchPattern, TEXT("ATD*#"), TEXT("\r\nCONNECT $2\r\n"));
+        addRule(rules, kMatchPrefix, TEXT("AT+"), TEXT("\r\n+$1: 23,99\r\nOK\r\n"));
+        request = "AT+CSQ\r";
+        requestSize = 7;
+        answerSize = 19;
+    } else {
+        beginRules(rules, kFramingFixed, 0, 8, 0);
+        addRule(rules, kMatchPattern, TEXT("\x01\x06" "??????"), TEXT("$0"), kRuleCheckCRC);
+        addRule(rules, kMatchPattern, TEXT("\x01\x03" "??????"), TEXT("\x01\x03\x04$3$4$5$6$c"), kRuleCheckCRC);
+        request = "\x01\x03\x00\x05\x00\x02\xD4\x0A";
+        requestSize = 8;
+        answerSize = 9;
+    }
+
+    if (openBenchFixture(&f, 0, 0) && (setResponder(&f, rules) == kIOReturnSuccess)){
+        startMeter(&meter);
+        for (; trips < sRoundTrips; trips++){
+            double start = now();
+
+            if ((f.port->enqueueData((UInt8*)request, requestSize, &count, false, f.refCon) != kIOReturnSuccess) ||
+                (count != requestSize))
+                break;
+            if ((f.port->dequeueData(answer, sizeof(answer), &count, 0, f.refCon) != kIOReturnSuccess) ||
+                (count != answerSize))
+                break;
+
+            samples[trips] = now() - start;
+        }
+        stopMeter(&meter, result);
+
+        result->ok = (trips == sRoundTrips) && (getResponderStats(&f, false, &stats) == kIOReturnSuccess) &&
+                     (stats.Matched == trips);
+        result->bytes = (UInt64)trips * (requestSize + answerSize);
+        result->transactions = trips;
+        result->samples = samples;
+        result->numSamples = trips;
+        samples = NULL;
+    }
+    closeFixture(&f);
+    free(samples);
+    free(rules);
+}
+
+
+#pragma mark Notifications
+
+// What a tcsetattr turns into, as IOSerialBSDClient issues it: rates, sizes, parity and stop bits for
+// both directions, then flow control, the flow control characters and the latency. The RX settings
+// follow TX as it sends them; bursts switch between two sets of the rest, so each of those is a change.
+#define kNotifyBursts   1000
+
+static const UInt32 sTermiosEvents[] = {
+    PD_E_DATA_RATE, PD_E_RX_DATA_RATE, PD_E_DATA_SIZE, PD_E_RX_DATA_SIZE, PD_E_DATA_INTEGRITY,
+    PD_E_RX_DATA_INTEGRITY, PD_RS232_E_STOP_BITS, PD_RS232_E_RX_STOP_BITS, PD_E_FLOW_CONTROL,
+    PD_RS232_E_XON_BYTE, PD_RS232_E_XOFF_BYTE, PD_E_DATA_LATENCY
+};
+
+static const UInt32 sTermiosValues[2][sizeof(sTermiosEvents) / sizeof(sTermiosEvents[0])] = {
+    { 9600 << 1, 0, 8 << 1, 0, PD_RS232_PARITY_NONE, PD_RS232_PARITY_DEFAULT, 2, 0, 0, 0x11, 0x13, 0 },
+    { 115200 << 1, 0, 7 << 1, 0, PD_RS232_PARITY_EVEN, PD_RS232_PARITY_DEFAULT, 4, 0,
+      PD_RS232_A_TXO | PD_RS232_A_RXO, 0x12, 0x14, 1000 }
+};
+
+
+static UInt64 deltaCount(void){
+    UInt64  count;
+
+    pthread_mutex_lock(&sDeltas.lock);
+    count = sDeltas.notifications;
+    pthread_mutex_unlock(&sDeltas.lock);
+    return count;
+}
+
+
+// Wait up to a second for a delta after the seen'th.
+static bool waitForDelta(UInt64 seen){
+    struct timespec deadline;
+    bool            arrived;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_mutex_lock(&sDeltas.lock);
+    while ((sDeltas.notifications == seen) &&
+           (pthread_cond_timedwait(&sDeltas.cond, &sDeltas.lock, &deadline) == 0)){}
+    arrived = (sDeltas.notifications != seen);
+    pthread_mutex_unlock(&sDeltas.lock);
+    return arrived;
+}
+
+
+// serialRequestLock's totals, read and cleared. False in a driver built without VSP_LOCK_STATS.
+static bool takeStateLockStats(Fixture *f, LockStats *stats){
+    uint64_t    input[2] = { kLockSerialRequest, true };
+    size_t      size = sizeof(LockStats);
+
+    return (HostCallMethod(f->client, kGetLockStats, input, 2, NULL, 0, NULL, NULL, stats, &size) == kIOReturnSuccess) &&
+           (size == sizeof(LockStats));
+}
+
+
+// kNotifyBursts bursts of settings with the client's notify window at window microseconds, each waited
+// on until its first delta has arrived. The samples are that wait, from the first event of the burst.
+// With a window, each burst has to come out as one delta.
+static void runNotify(Result *result, UInt32 window){
+    Fixture     f;
+    Meter       meter;
+    LockStats   stats;
+    UInt32      bursts = (sRoundTrips < kNotifyBursts) ? sRoundTrips : kNotifyBursts;
+    UInt32      numEvents = sizeof(sTermiosEvents) / sizeof(sTermiosEvents[0]);
+    double      *samples = (double*)calloc(bursts, sizeof(double));
+    UInt64      first, seen;
+    UInt32      done = 0, event;
+
+    if (openBenchFixture(&f, 0, 0) && (callScalar(&f, kSetNotifyWindow, window) == kIOReturnSuccess)){
+        // Start from the second set, the one the first burst isn't, with nothing still to come.
+        for (event = 0; event < numEvents; event++)
+            f.port->executeEvent(sTermiosEvents[event], sTermiosValues[1][event], f.refCon);
+        sleepMilliseconds(2 * (window / 1000) + 10);
+        result->lockStats = takeStateLockStats(&f, &stats);
+        first = deltaCount();
+
+        startMeter(&meter);
+        for (; done < bursts; done++){
+            double start = now();
+
+            seen = deltaCount();
+            for (event = 0; event < numEvents; event++){
+                if (f.port->executeEvent(sTermiosEvents[event], sTermiosValues[done & 1][event], f.refCon) != kIOReturnSuccess)
+                    break;
+            }
+            if ((event < numEvents) || !waitForDelta(seen))
+                break;
+            samples[done] = now() - start;
+        }
+        stopMeter(&meter, result);
+
+        // Let the last window close before counting.
+        sleepMilliseconds(2 * (window / 1000) + 10);
+        result->changes = done;
+        result->deltas = deltaCount() - first;
+        result->ok = (done == bursts) && (!window || (result->deltas == done));
+        if (result->lockStats && takeStateLockStats(&f, &stats)){
+            result->lockAcquisitions = stats.Acquisitions;
+            result->lockHoldTime = stats.HoldTime;
+            result->lockMaxHoldTime = stats.MaxHoldTime;
+        } else {
+            result->lockStats = false;
+        }
+        result->samples = samples;
+        result->numSamples = done;
+        samples = NULL;
+    }
+    closeFixture(&f);
+    free(samples);
+}
+
+
+#pragma mark Queues
+
+// The queues on their own, without a port around them: sQueueChunk byte adds and removes on a queue kept
+// half full, so both ends wrap. The overwrite variants add to a full queue and never remove. The C API,
+// and the byte at a time CirQueue it replaced, run on a queue of the same size as the template. The
+// chunk is a run time value so the copies aren't specialised for one constant size, which the driver's
+// callers never have.
+#define kMaxQueueChunk  4096
+
+enum{
+    kQueueByteLoop,             // The reference, see ByteQueue
+    kQueueByteLoopOverwrite,
+    kQueueCAPI,
+    kQueueCAPIOverwrite,
+    kQueueUnlockedReject,
+    kQueueUnlockedOverwrite,
+    kQueueLockedReject,
+    kQueueLockedOverwrite,
+    kQueueSPSCReject,
+    kQueueSPSCThreads           // A producer and a consumer thread
+};
+
+// The C API behind the template's add and remove.
+class CAPIQueue{
+    CirQueue    Queue;
+    UInt8       *Buffer;
+public:
+    bool init(UInt32 size){ Buffer = (UInt8*)malloc(size); InitQueue(&Queue, Buffer, size); return Buffer; }
+    void free(void){ CloseQueue(&Queue); ::free(Buffer); }
+    UInt32 used(void){ return UsedSpaceinQueue(&Queue); }
+    UInt32 add(const UInt8 *buffer, UInt32 size, UInt32 *dropped = NULL){
+        if (dropped){
+            *dropped = AddtoQueueOverwrite(&Queue, (UInt8*)buffer, size);
+            return size;
+        }
+        return AddtoQueue(&Queue, (UInt8*)buffer, size);
+    }
+    UInt32 remove(UInt8 *buffer, UInt32 size){ return RemovefromQueue(&Queue, buffer, size); }
+};
+
+
+// The CirQueue functions as they were before VSPQueue, kept here as the reference the others are timed
+// against: pointers that wrap with a compare on every byte, and AddtoQueue and RemovefromQueue moving one
+// byte per AddBytetoQueue or GetBytetoQueue call. Copied from SccQueue.cpp with only the names changed.
+typedef struct{
+    UInt8   *Start;
+    UInt8   *End;
+    UInt8   *NextChar;
+    UInt8   *LastChar;
+    UInt32  Size;
+    UInt32  InQueue;
+}ByteQueueState;
+
+static QueueStatus byteAddByte(ByteQueueState *Queue, char Value){
+
+    if ((Queue->NextChar == Queue->LastChar) && Queue->InQueue)
+        return queueFull;
+
+    *Queue->NextChar++ = Value;
+    Queue->InQueue++;
+    if (Queue->NextChar >= Queue->End)
+        Queue->NextChar = Queue->Start;
+    return queueNoError;
+}
+
+static QueueStatus byteGetByte(ByteQueueState *Queue, UInt8 *Value){
+
+    if ((Queue->NextChar == Queue->LastChar) && !Queue->InQueue)
+        return queueEmpty;
+
+    *Value = *Queue->LastChar++;
+    Queue->InQueue--;
+    if (Queue->LastChar >= Queue->End)
+        Queue->LastChar = Queue->Start;
+    return queueNoError;
+}
+
+static UInt32 byteAdd(ByteQueueState *Queue, const UInt8 *Buffer, UInt32 Size){
+    UInt32  BytesWritten = 0;
+
+    while ((Queue->Size - Queue->InQueue) && (Size > BytesWritten)){
+        byteAddByte(Queue, *Buffer++);
+        BytesWritten++;
+    }
+    return BytesWritten;
+}
+
+static UInt32 byteAddOverwrite(ByteQueueState *Queue, const UInt8 *Buffer, UInt32 Size){
+    UInt32  BytesDropped = 0;
+    UInt32  Free;
+
+    if (Size > Queue->Size){
+        BytesDropped = Size - Queue->Size;
+        Buffer += BytesDropped;
+        Size = Queue->Size;
+    }
+
+    Free = Queue->Size - Queue->InQueue;
+    if (Size > Free){
+        UInt32 Discard = Size - Free;
+
+        Queue->LastChar += Discard;
+        if (Queue->LastChar >= Queue->End)
+            Queue->LastChar -= Queue->Size;
+        Queue->InQueue -= Discard;
+        BytesDropped += Discard;
+    }
+
+    byteAdd(Queue, Buffer, Size);
+    return BytesDropped;
+}
+
+static UInt32 byteRemove(ByteQueueState *Queue, UInt8 *Buffer, UInt32 MaxSize){
+    UInt32  BytesReceived = 0;
+    UInt8   Value;
+
+    while ((MaxSize > BytesReceived) && (byteGetByte(Queue, &Value) == queueNoError)){
+        *Buffer++ = Value;
+        BytesReceived++;
+    }
+    return BytesReceived;
+}
+
+
+class ByteQueue{
+    ByteQueueState  Queue;
+public:
+    bool init(UInt32 size){
+        UInt8 *buffer = (UInt8*)malloc(size);
+
+        Queue.Start = Queue.NextChar = Queue.LastChar = buffer;
+        Queue.End = buffer + size;
+        Queue.Size = size;
+        Queue.InQueue = 0;
+        return buffer;
+    }
+    void free(void){ ::free(Queue.Start); }
+    UInt32 used(void){ return Queue.InQueue; }
+    UInt32 add(const UInt8 *buffer, UInt32 size, UInt32 *dropped = NULL){
+        if (dropped){
+            *dropped = byteAddOverwrite(&Queue, buffer, size);
+            return size;
+        }
+        return byteAdd(&Queue, buffer, size);
+    }
+    UInt32 remove(UInt8 *buffer, UInt32 size){ return byteRemove(&Queue, buffer, size); }
+};
+
+
+template <class Queue>
+static void runQueueLoop(Result *result, Queue *queue, UInt32 capacity, bool overwrite){
+    UInt8       in[kMaxQueueChunk], out[kMaxQueueChunk];
+    UInt32      chunk = sQueueChunk, dropped = 0, count;
+    UInt64      done;
+    Meter       meter;
+
+    fillPattern(in, 0, chunk);
+    bzero(out, sizeof(out));
+    for (count = 0; count < (overwrite ? capacity : capacity / 2); count += chunk)
+        queue->add(in, chunk);
+
+    startMeter(&meter);
+    if (overwrite){
+        for (done = 0; done < sStreamBytes; done += chunk)
+            queue->add(in, chunk, &dropped);
+    } else {
+        for (done = 0; done < sStreamBytes; done += chunk){
+            queue->add(in, chunk);
+            queue->remove(out, chunk);
+        }
+    }
+    stopMeter(&meter, result);
+
+    result->bytes = done;
+    result->ok = (queue->used() == (overwrite ? capacity : capacity / 2)) && (!overwrite || (dropped == chunk));
+    while (result->ok && queue->used())
+        result->ok = (queue->remove(out, chunk) == chunk) && (memcmp(in, out, chunk) == 0);
+}
+
+
+template <class Queue>
+struct QueueThreads{
+    Queue       *queue;
+    UInt8       counter[kMaxQueueChunk + 256];      // counter[i] == (UInt8)i, so any offset starts a run
+    bool        ok;
+};
+
+
+template <class Queue>
+static void* queueProducer(void *context){
+    QueueThreads<Queue>     *threads = (QueueThreads<Queue>*)context;
+    UInt64                  sent = 0;
+
+    while (sent < sStreamBytes){
+        UInt32 size = (UInt32)((sStreamBytes - sent < sQueueChunk) ? sStreamBytes - sent : sQueueChunk);
+        UInt32 added = threads->queue->add(threads->counter + (sent & 0xFF), size);
+
+        sent += added;
+        if (added == 0) sched_yield();
+    }
+    return NULL;
+}
+
+
+template <class Queue>
+static void* queueConsumer(void *context){
+    QueueThreads<Queue>     *threads = (QueueThreads<Queue>*)context;
+    UInt8                   out[kMaxQueueChunk];
+    UInt64                  received = 0;
+
+    threads->ok = true;
+    while (received < sStreamBytes){
+        UInt32 removed = threads->queue->remove(out, sQueueChunk);
+
+        if (memcmp(out, threads->counter + (received & 0xFF), removed)){
+            threads->ok = false;
+            break;
+        }
+        received += removed;
+        if (removed == 0) sched_yield();
+    }
+    return NULL;
+}
+
+
+template <UInt32 Capacity>
+static void runQueue(Result *result, UInt32 variant){
+    switch (variant){
+        case kQueueByteLoop:
+        case kQueueByteLoopOverwrite:{
+            ByteQueue queue;
+
+            if (queue.init(Capacity)){
+                runQueueLoop(result, &queue, Capacity, variant == kQueueByteLoopOverwrite);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueCAPI:
+        case kQueueCAPIOverwrite:{
+            CAPIQueue queue;
+
+            if (queue.init(Capacity)){
+                runQueueLoop(result, &queue, Capacity, variant == kQueueCAPIOverwrite);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueUnlockedReject:{
+            static VSPQueue<Capacity, kQueueUnlocked, kQueueRejectNew> queue;
+
+            if (queue.init()){
+                runQueueLoop(result, &queue, Capacity, false);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueUnlockedOverwrite:{
+            static VSPQueue<Capacity, kQueueUnlocked, kQueueOverwriteOld> queue;
+
+            if (queue.init()){
+                runQueueLoop(result, &queue, Capacity, true);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueLockedReject:{
+            static VSPQueue<Capacity, kQueueLocked, kQueueRejectNew> queue;
+
+            if (queue.init()){
+                runQueueLoop(result, &queue, Capacity, false);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueLockedOverwrite:{
+            static VSPQueue<Capacity, kQueueLocked, kQueueOverwriteOld> queue;
+
+            if (queue.init()){
+                runQueueLoop(result, &queue, Capacity, true);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueSPSCReject:{
+            static VSPQueue<Capacity, kQueueSPSC, kQueueRejectNew> queue;
+
+            if (queue.init()){
+                runQueueLoop(result, &queue, Capacity, false);
+                queue.free();
+            }
+            break;
+        }
+        case kQueueSPSCThreads:{
+            typedef VSPQueue<Capacity, kQueueSPSC, kQueueRejectNew> Queue;
+            static Queue                queue;
+            static QueueThreads<Queue>  threads;
+            pthread_t                   producer, consumer;
+            Meter                       meter;
+
+            if (!queue.init()) break;
+            threads.queue = &queue;
+            for (UInt32 i = 0; i < sizeof(threads.counter); i++)
+                threads.counter[i] = (UInt8)i;
+
+            startMeter(&meter);
+            pthread_create(&consumer, NULL, queueConsumer<Queue>, &threads);
+            pthread_create(&producer, NULL, queueProducer<Queue>, &threads);
+            pthread_join(producer, NULL);
+            pthread_join(consumer, NULL);
+            stopMeter(&meter, result);
+
+            result->bytes = sStreamBytes;
+            result->ok = threads.ok;
+            queue.free();
+            break;
+        }
+    }
+}
+
+
+#pragma mark Table
+
+typedef enum{
+    kClientToTTY,
+    kTTYToClient,
+    kBidirectional,
+    kPingPong,
+    kPorts,
+    kCredits,
+    kClientToTTYCoded,
+    kTTYToClientCoded,
+    kQueue,
+    kOpenClose,
+    kReadTimeouts,
+    kResponder,
+    kNotify,
+    kCalls
+}Kind;
+
+typedef struct{
+    const char  *name;
+    Kind        kind;
+    UInt32      arg0;           // Write size, message size, number of ports, queue size, kResponder... device
+                                // or the notify window in microseconds
+    UInt32      arg1;           // Queue size, low water for kCredits, kCoding... for the coded streams, kQueue... for
+                                // kQueue, kCalls... for kCalls or the read timeout in microseconds
+}Scenario;
+
+static const Scenario sScenarios[] = {
+    { "c2t-write-16",           kClientToTTY,   16,         0 },
+    { "c2t-write-256",          kClientToTTY,   256,        0 },
+    { "c2t-write-4096",         kClientToTTY,   4096,       0 },
+    { "c2t-write-65536",        kClientToTTY,   65536,      0 },
+    { "t2c-write-16",           kTTYToClient,   16,         0 },
+    { "t2c-write-256",          kTTYToClient,   256,        0 },
+    { "t2c-write-4096",         kTTYToClient,   4096,       0 },
+    { "t2c-write-65536",        kTTYToClient,   65536,      0 },
+    { "bidir-write-4096",       kBidirectional, 4096,       0 },
+    { "bidir-write-65536",      kBidirectional, 65536,      0 },
+    { "pingpong-1",             kPingPong,      1,          0 },
+    { "pingpong-64",            kPingPong,      64,         0 },
+    { "pingpong-1024",          kPingPong,      1024,       0 },
+    { "ports-2",                kPorts,         2,          0 },
+    { "ports-4",                kPorts,         4,          0 },
+    { "ports-8",                kPorts,         8,          0 },
+    { "c2t-queue-1024",         kClientToTTY,   65536,      1024 },
+    { "c2t-queue-16384",        kClientToTTY,   65536,      16384 },
+    { "c2t-queue-262144",       kClientToTTY,   65536,      262144 },
+    { "t2c-queue-1024",         kTTYToClient,   65536,      1024 },
+    { "t2c-queue-16384",        kTTYToClient,   65536,      16384 },
+    { "t2c-queue-262144",       kTTYToClient,   65536,      262144 },
+    { "credit-lowwater-1024",   kCredits,       16384,      1024 },
+    { "credit-lowwater-4096",   kCredits,       16384,      4096 },
+    { "credit-lowwater-12288",  kCredits,       16384,      12288 },
+    { "c2t-7e1-65536",          kClientToTTYCoded,  65536,  kCoding7E1 },
+    { "c2t-7n1-8n1-65536",      kClientToTTYCoded,  65536,  kCoding7N1To8N1 },
+    { "t2c-7e1-65536",          kTTYToClientCoded,  65536,  kCoding7E1 },
+    { "c2t-faults-65536",       kClientToTTYCoded,  65536,  kCodingFaults },
+    { "t2c-faults-65536",       kTTYToClientCoded,  65536,  kCodingFaults },
+    { "open-close-1",           kOpenClose,     1,          0 },
+    { "open-close-8",           kOpenClose,     8,          0 },
+    { "read-timeouts-1",        kReadTimeouts,  1,          50000 },
+    { "read-timeouts-100",      kReadTimeouts,  100,        50000 },
+    { "read-timeouts-1000",     kReadTimeouts,  1000,       50000 },
+    { "responder-modem",        kResponder,     kResponderModem,    0 },
+    { "responder-modbus",       kResponder,     kResponderModbus,   0 },
+    { "notify-window-0",        kNotify,        0,          0 },
+    { "notify-window-1000",     kNotify,        1000,       0 },
+    { "c2t-calls-data-64",      kCalls,         64,         kCallsSendData },
+    { "c2t-calls-buffer-4096",  kCalls,         4096,       kCallsSendBuffer },
+    { "c2t-calls-buffer-65536", kCalls,         65536,      kCallsSendBuffer },
+    { "c2t-calls-ring-4096",    kCalls,         4096,       kCallsRXRing },
+    { "t2c-calls-readasync-4096", kCalls,       4096,       kCallsReadAsync },
+    { "t2c-calls-ring-4096",    kCalls,         4096,       kCallsTXRing },
+    { "queue-byteloop-4096",    kQueue,         4096,       kQueueByteLoop },
+    { "queue-capi-4096",        kQueue,         4096,       kQueueCAPI },
+    { "queue-unlocked-4096",    kQueue,         4096,       kQueueUnlockedReject },
+    { "queue-locked-4096",      kQueue,         4096,       kQueueLockedReject },
+    { "queue-spsc-4096",        kQueue,         4096,       kQueueSPSCReject },
+    { "queue-byteloop-65536",   kQueue,         65536,      kQueueByteLoop },
+    { "queue-capi-65536",       kQueue,         65536,      kQueueCAPI },
+    { "queue-unlocked-65536",   kQueue,         65536,      kQueueUnlockedReject },
+    { "queue-locked-65536",     kQueue,         65536,      kQueueLockedReject },
+    { "queue-spsc-65536",       kQueue,         65536,      kQueueSPSCReject },
+    { "queue-drop-byteloop-4096", kQueue,       4096,       kQueueByteLoopOverwrite },
+    { "queue-drop-capi-4096",   kQueue,         4096,       kQueueCAPIOverwrite },
+    { "queue-drop-unlocked-4096", kQueue,       4096,       kQueueUnlockedOverwrite },
+    { "queue-drop-locked-4096", kQueue,         4096,       kQueueLockedOverwrite },
+    { "queue-threads-spsc-65536", kQueue,       65536,      kQueueSPSCThreads },
+};
+
+
+static void runScenario(const Scenario *scenario, Result *result){
+
+    bzero(result, sizeof(Result));
+    result->name = scenario->name;
+
+    switch (scenario->kind){
+        case kClientToTTY:      runStream(result, true, false, scenario->arg0, scenario->arg1, kCoding8N1);     break;
+        case kTTYToClient:      runStream(result, false, false, scenario->arg0, scenario->arg1, kCoding8N1);    break;
+        case kBidirectional:    runStream(result, true, true, scenario->arg0, scenario->arg1, kCoding8N1);      break;
+        case kClientToTTYCoded: runStream(result, true, false, scenario->arg0, 0, scenario->arg1);              break;
+        case kTTYToClientCoded: runStream(result, false, false, scenario->arg0, 0, scenario->arg1);             break;
+        case kPingPong:         runPingPong(result, scenario->arg0);                                break;
+        case kPorts:            runPorts(result, scenario->arg0);                                   break;
+        case kCredits:          runCredits(result, scenario->arg0, scenario->arg1);                 break;
+        case kQueue:
+            if (scenario->arg0 == 4096) runQueue<4096>(result, scenario->arg1);
+            else                        runQueue<65536>(result, scenario->arg1);
+            break;
+        case kOpenClose:        runOpenClose(result, scenario->arg0);                               break;
+        case kReadTimeouts:     runReadTimeouts(result, scenario->arg0, scenario->arg1);            break;
+        case kResponder:        runResponder(result, scenario->arg0);                               break;
+        case kNotify:           runNotify(result, scenario->arg0);                                  break;
+        case kCalls:            runCalls(result, scenario->arg0, scenario->arg1);                   break;
+    }
+
+    finishResult(result);
+}
+
+
+#pragma mark Output
+
+static void printResult(const Result *result){
+    double  mib = result->bytes / 1048576.0;
+    double  rate = result->seconds ? result->bytes / result->seconds : 0;
+
+    printf("{\"scenario\":\"%s\",\"bytes\":%llu,\"seconds\":%.6f,\"bytes_per_sec\":%.0f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f,\"cpu_ms_per_mib\":%.3f,\"wakeups_per_mib\":%.1f,",
+           result->name, (unsigned long long)result->bytes, result->seconds, rate,
+           result->p50 * 1e6, result->p99 * 1e6,
+           mib ? (result->cpuSeconds * 1000) / mib : 0, mib ? result->wakeups / mib : 0);
+    if (result->timeouts)
+        printf("\"timeouts_per_sec\":%.0f,\"cpu_us_per_timeout\":%.2f,\"timeouts_per_wheel_run\":%.1f,",
+               result->timeouts / result->seconds, (result->cpuSeconds * 1e6) / result->timeouts,
+               result->wheelRuns ? (double)result->timeouts / result->wheelRuns : 0);
+    else if (result->transactions)
+        printf("\"transactions_per_sec\":%.0f,", result->transactions / result->seconds);
+    else if (result->changes){
+        printf("\"messages_per_change\":%.2f,", (double)result->deltas / result->changes);
+        if (result->lockStats)
+            printf("\"lock_acquisitions_per_change\":%.1f,\"lock_hold_ns_per_change\":%.0f,\"lock_max_hold_ns\":%llu,",
+                   (double)result->lockAcquisitions / result->changes, (double)result->lockHoldTime / result->changes,
+                   (unsigned long long)result->lockMaxHoldTime);
+    }
+    else if (result->calls)
+        printf("\"syscalls_per_mib\":%.1f,", mib ? result->calls / mib : 0);
+    else if (result->numSamples && !result->bytes)
+        printf("\"idle_bytes_per_port\":%.0f,\"pool_bytes\":%.0f,", result->idleBytes, result->poolBytes);
+    printf("\"ok\":%s}\n", result->ok ? "true" : "false");
+    fflush(stdout);
+
+    fprintf(stderr, "  %-24s %9.1f MiB/s  p50 %9.1f us  p99 %9.1f us  %8.2f cpu ms/MiB  %9.1f wakeups/MiB%s\n",
+            result->name, rate / 1048576.0, result->p50 * 1e6, result->p99 * 1e6,
+            mib ? (result->cpuSeconds * 1000) / mib : 0, mib ? result->wakeups / mib : 0,
+            result->ok ? "" : "  FAILED");
+    if (result->timeouts)
+        fprintf(stderr, "  %-24s %9.0f timeouts/s, %.2f cpu us each, %.1f per wheel run\n", "",
+                result->timeouts / result->seconds, (result->cpuSeconds * 1e6) / result->timeouts,
+                result->wheelRuns ? (double)result->timeouts / result->wheelRuns : 0);
+    else if (result->transactions)
+        fprintf(stderr, "  %-24s %9.0f transactions/s\n", "", result->transactions / result->seconds);
+    else if (result->changes && result->lockStats)
+        fprintf(stderr, "  %-24s %9.2f messages per change, serialRequestLock taken %.1f times for %.0f ns, %llu ns at most\n",
+                "", (double)result->deltas / result->changes, (double)result->lockAcquisitions / result->changes,
+                (double)result->lockHoldTime / result->changes, (unsigned long long)result->lockMaxHoldTime);
+    else if (result->changes)
+        fprintf(stderr, "  %-24s %9.2f messages per change\n", "", (double)result->deltas / result->changes);
+    else if (result->calls)
+        fprintf(stderr, "  %-24s %9.1f syscalls/MiB\n", "", mib ? result->calls / mib : 0);
+    else if (result->numSamples && !result->bytes)
+        fprintf(stderr, "  %-24s %9.0f idle queue bytes per port, %.0f in the pool\n", "", result->idleBytes, result->poolBytes);
+}
+
+
+// Pull "key":number out of one line of earlier output.
+static bool findNumber(const char *line, const char *key, double *value){
+    char        pattern[64];
+    const char  *found;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    found = strstr(line, pattern);
+    if (found == NULL) return false;
+    *value = strtod(found + strlen(pattern), NULL);
+    return true;
+}
+
+
+// Compare with the same scenario in the baseline file. Returns false for a regression.
+static bool compareResult(const Result *result, FILE *baseline, double threshold){
+    char    line[512], name[128];
+    double  baseRate, baseP99;
+    double  rate = result->seconds ? result->bytes / result->seconds : 0;
+    bool    ok = true;
+
+    snprintf(name, sizeof(name), "\"scenario\":\"%s\"", result->name);
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline)){
+        if (strstr(line, name) == NULL) continue;
+
+        if (findNumber(line, "bytes_per_sec", &baseRate) && (rate < baseRate * (1 - threshold))){
+            fprintf(stderr, "  %-24s regression: %.1f MiB/s, was %.1f\n", result->name, rate / 1048576.0, baseRate / 1048576.0);
+            ok = false;
+        }
+        if (findNumber(line, "p99_us", &baseP99) && (baseP99 > 0) && (result->p99 * 1e6 > baseP99 * (1 + threshold))){
+            fprintf(stderr, "  %-24s regression: p99 %.1f us, was %.1f\n", result->name, result->p99 * 1e6, baseP99);
+            ok = false;
+        }
+        break;
+    }
+    return ok;
+}
+
+
+#pragma mark main
+
+int main(int argc, char *argv[]){
+    FILE        *baseline = NULL;
+    double      threshold = 0.2;
+    bool        failed = false;
+    int         option;
+
+    while ((option = getopt(argc, argv, "m:n:q:b:t:lv")) != -1){
+        switch (option){
+            case 'm':   sStreamBytes = strtoull(optarg, NULL, 0) * 1024 * 1024;    break;
+            case 'n':   sRoundTrips = (UInt32)strtoul(optarg, NULL, 0);             break;
+            case 'q':   sQueueChunk = (UInt32)strtoul(optarg, NULL, 0);             break;
+            case 't':   threshold = strtod(optarg, NULL) / 100;                     break;
+            case 'v':   HostSetLogging(true);                                       break;
+            case 'b':
+                baseline = fopen(optarg, "r");
+                if (baseline == NULL){
+                    perror(optarg);
+                    return 2;
+                }
+                break;
+            case 'l':
+                for (size_t i = 0; i < sizeof(sScenarios) / sizeof(sScenarios[0]); i++)
+                    printf("%s\n", sScenarios[i].name);
+                return 0;
+            default:
+                fprintf(stderr, "usage: %s [-m MiB] [-n round trips] [-q queue chunk] [-b baseline] [-t percent] [-l] [-v] [scenario ...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if ((sStreamBytes == 0) || (sRoundTrips == 0)){
+        fprintf(stderr, "-m and -n must be at least 1\n");
+        return 2;
+    }
+    if ((sQueueChunk == 0) || (sQueueChunk > kMaxQueueChunk) || (sQueueChunk & (sQueueChunk - 1))){
+        fprintf(stderr, "-q must be a power of two up to %u\n", kMaxQueueChunk);
+        return 2;
+    }
+
+    HostSetMessageHandler(messageHandler, NULL);
+
+    for (size_t i = 0; i < sizeof(sScenarios) / sizeof(sScenarios[0]); i++){
+        bool    selected = (optind == argc);
+        Result  result;
+
+        for (int arg = optind; arg < argc; arg++)
+            selected |= (strncmp(sScenarios[i].name, argv[arg], strlen(argv[arg])) == 0);
+        if (!selected) continue;
+
+        runScenario(&sScenarios[i], &result);
+        printResult(&result);
+        failed |= !result.ok;
+        if (baseline)
+            failed |= !compareResult(&result, baseline, threshold);
+    }
+
+    if (baseline)
+        fclose(baseline);
+    return failed ? 1 : 0;
+}
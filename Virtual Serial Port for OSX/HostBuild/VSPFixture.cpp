@@ -0,0 +1,380 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  The host programs' shared fixture, see VSPFixture.h.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VSPFixture.h"
+
+
+#pragma mark Pattern
+
+void fillPattern(UInt8 *buffer, UInt64 offset, UInt32 size){
+
+    for (UInt32 i = 0; i < size; i++)
+        buffer[i] = pattern(offset + i);
+}
+
+
+bool checkPattern(const UInt8 *buffer, UInt64 offset, UInt32 size){
+
+    for (UInt32 i = 0; i < size; i++){
+        if (buffer[i] != pattern(offset + i)){
+            fprintf(stderr, "    data mismatch at byte %llu: got 0x%02x, expected 0x%02x\n",
+                    (unsigned long long)(offset + i), buffer[i], pattern(offset + i));
+            return false;
+        }
+    }
+    return true;
+}
+
+
+double now(void){
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + (time.tv_nsec / 1e9);
+}
+
+
+void sleepMilliseconds(UInt32 milliseconds){
+
+    usleep(milliseconds * 1000);
+}
+
+
+#pragma mark Fixture
+
+IOReturn callScalar(Fixture *f, uint32_t selector, uint64_t in0, uint64_t in1, UInt32 inCount){
+    uint64_t    input[2] = { in0, in1 };
+
+    return HostCallMethod(f->client, selector, input, inCount, NULL, 0, NULL, NULL, NULL, NULL);
+}
+
+
+IOReturn sendBuffer(Fixture *f, UInt32 mode, const UInt8 *buffer, UInt32 size, UInt32 *accepted,
+                    io_user_reference_t *asyncReference){
+    uint64_t    input = mode;
+    uint64_t    output[2] = { 0, 0 };
+    UInt32      outputCount = 2;
+    IOReturn    result;
+
+    result = HostCallMethod(f->client, kSendBuffer, &input, 1, buffer, size, output, &outputCount, NULL, NULL, asyncReference);
+    if (accepted)
+        *accepted = (UInt32)output[0];
+    return result;
+}
+
+
+IOReturn setFraming(Fixture *f, UInt32 mode, UInt32 parameter, UInt32 maxSize){
+    uint64_t    input[3] = { mode, parameter, maxSize };
+
+    return HostCallMethod(f->client, kSetFraming, input, 3, NULL, 0, NULL, NULL, NULL, NULL);
+}
+
+
+IOReturn setFaults(Fixture *f, UInt32 direction, const FaultConfig *config){
+    uint64_t    input = direction;
+
+    return HostCallMethod(f->client, kSetFaults, &input, 1, config, sizeof(FaultConfig), NULL, NULL, NULL, NULL);
+}
+
+
+bool openFixture(Fixture *f, UInt32 policy){
+    IOUserClient    *userClient;
+
+    bzero(f, sizeof(Fixture));
+    f->nub = new IOService;
+    f->port = new VirtualSerialPort;
+    if (!f->port->init() || !f->port->attach(f->nub) || !f->port->start(f->nub)){
+        fprintf(stderr, "    VirtualSerialPort failed to start\n");
+        return false;
+    }
+
+    f->client = new VSPUserClient;
+    userClient = f->client;
+    if (!userClient->initWithTask(kernel_task, NULL, 0) || !f->client->attach(f->port) || !f->client->start(f->port)){
+        fprintf(stderr, "    VSPUserClient failed to start\n");
+        return false;
+    }
+    if (HostCallMethod(f->client, kClientOpen, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL) != kIOReturnSuccess){
+        fprintf(stderr, "    kClientOpen failed\n");
+        return false;
+    }
+    userClient->registerNotificationPort(1, 0, 0);
+
+    f->refCon = &f->port->fPort;
+    if ((f->port->acquirePort(false, f->refCon) != kIOReturnSuccess) ||
+        (f->port->executeEvent(PD_E_ACTIVE, true, f->refCon) != kIOReturnSuccess)){
+        fprintf(stderr, "    could not open the tty side\n");
+        return false;
+    }
+
+    return callScalar(f, kSetOverflowPolicy, policy) == kIOReturnSuccess;
+}
+
+
+void closeFixture(Fixture *f){
+    IOUserClient    *userClient = f->client;
+
+    if (f->port && (f->port->getState(f->refCon) & PD_S_ACQUIRED))
+        f->port->releasePort(f->refCon);
+
+    if (f->client){
+        userClient->clientClose();
+        f->client->release();
+    }
+    for (UInt32 type = 0; type < kNumberOfSharedRings; type++){
+        if (f->ringMaps[type])
+            f->ringMaps[type]->release();
+    }
+    if (f->statusMap)
+        f->statusMap->release();
+
+    if (f->port){
+        f->port->stop(f->nub);
+        f->port->detach(f->nub);
+        f->port->release();
+    }
+    if (f->nub)
+        f->nub->release();
+}
+
+
+// What IOConnectMapMemory does: the descriptor is released once it is mapped, the map keeps it.
+static IOMemoryMap* mapMemory(Fixture *f, UInt32 type){
+    IOUserClient        *userClient = f->client;
+    IOMemoryDescriptor  *memory;
+    IOMemoryMap         *map;
+    IOOptionBits        options = 0;
+
+    if (userClient->clientMemoryForType(type, &options, &memory) != kIOReturnSuccess)
+        return NULL;
+    map = memory->createMappingInTask(kernel_task, 0, options | kIOMapAnywhere);
+    memory->release();
+    return map;
+}
+
+
+const PortStatusPage* mapStatusPage(Fixture *f){
+
+    f->statusMap = mapMemory(f, kPortStatusPage);
+    if (!f->statusMap)
+        return NULL;
+    return (const PortStatusPage*)(uintptr_t)f->statusMap->getAddress();
+}
+
+
+#pragma mark Shared Rings
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    UInt32          counts[kNumberOfSharedRings];
+}sRingWakeups = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0} };
+
+
+SharedRing* mapRing(Fixture *f, UInt32 type){
+
+    f->ringMaps[type] = mapMemory(f, type);
+    if (!f->ringMaps[type])
+        return NULL;
+    f->rings[type] = (SharedRing*)(uintptr_t)f->ringMaps[type]->getAddress();
+    return f->rings[type];
+}
+
+
+static void ringDoorbell(Fixture *f){
+
+    HostCallMethod(f->client, kRingDoorbell, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
+}
+
+
+// Into kSharedRXRing. An empty ring is one the driver has stopped looking at.
+UInt32 writeRing(Fixture *f, const UInt8 *buffer, UInt32 size){
+    SharedRing  *ring = f->rings[kSharedRXRing];
+    UInt32      head = __atomic_load_n(&ring->Head, __ATOMIC_RELAXED);
+    UInt32      tail = __atomic_load_n(&ring->Tail, __ATOMIC_SEQ_CST);
+    UInt32      offset, chunk, written = 0;
+
+    if (size > kSharedRingSize - (head - tail))
+        size = kSharedRingSize - (head - tail);
+    if (!size) return 0;
+
+    while (written < size){
+        offset = (head + written) & (kSharedRingSize - 1);
+        chunk = kSharedRingSize - offset;
+        if (chunk > size - written)
+            chunk = size - written;
+        memcpy(&ring->Data[offset], buffer + written, chunk);
+        written += chunk;
+    }
+
+    __atomic_store_n(&ring->Head, head + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->Tail, __ATOMIC_SEQ_CST) == head)
+        ringDoorbell(f);
+    return size;
+}
+
+
+// From kSharedTXRing. A full ring is one the driver has stopped filling.
+UInt32 readRing(Fixture *f, UInt8 *buffer, UInt32 size){
+    SharedRing  *ring = f->rings[kSharedTXRing];
+    UInt32      tail = __atomic_load_n(&ring->Tail, __ATOMIC_RELAXED);
+    UInt32      head = __atomic_load_n(&ring->Head, __ATOMIC_SEQ_CST);
+    UInt32      offset, chunk, read = 0;
+
+    if (head - tail > kSharedRingSize) return 0;
+    if (size > head - tail)
+        size = head - tail;
+    if (!size) return 0;
+
+    while (read < size){
+        offset = (tail + read) & (kSharedRingSize - 1);
+        chunk = kSharedRingSize - offset;
+        if (chunk > size - read)
+            chunk = size - read;
+        memcpy(buffer + read, &ring->Data[offset], chunk);
+        read += chunk;
+    }
+
+    __atomic_store_n(&ring->Tail, tail + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->Head, __ATOMIC_SEQ_CST) == tail + kSharedRingSize)
+        ringDoorbell(f);
+    return size;
+}
+
+
+static bool ringReady(SharedRing *ring, UInt32 type){
+    UInt32  used = __atomic_load_n(&ring->Head, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->Tail, __ATOMIC_SEQ_CST);
+
+    return (type == kSharedRXRing) ? (used < kSharedRingSize) : (used != 0);
+}
+
+
+bool waitForRing(Fixture *f, UInt32 type){
+    SharedRing      *ring = f->rings[type];
+    struct timespec deadline;
+    UInt32          seen;
+    int             status = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += kRingWaitSeconds;
+
+    // Asked for under the lock the notification is counted under, so it can't slip past.
+    pthread_mutex_lock(&sRingWakeups.lock);
+    seen = sRingWakeups.counts[type];
+    __atomic_store_n(&ring->WakeupRequested, 1, __ATOMIC_SEQ_CST);
+    while (!ringReady(ring, type) && (sRingWakeups.counts[type] == seen) && (status == 0))
+        status = pthread_cond_timedwait(&sRingWakeups.cond, &sRingWakeups.lock, &deadline);
+    pthread_mutex_unlock(&sRingWakeups.lock);
+
+    return status == 0;
+}
+
+
+void ringWakeupArrived(const RingWakeupNotification *notification){
+
+    if (notification->Ring >= kNumberOfSharedRings) return;
+    pthread_mutex_lock(&sRingWakeups.lock);
+    sRingWakeups.counts[notification->Ring]++;
+    pthread_cond_broadcast(&sRingWakeups.cond);
+    pthread_mutex_unlock(&sRingWakeups.lock);
+}
+
+
+UInt32 ringWakeups(UInt32 type){
+    UInt32  count;
+
+    pthread_mutex_lock(&sRingWakeups.lock);
+    count = sRingWakeups.counts[type];
+    pthread_mutex_unlock(&sRingWakeups.lock);
+    return count;
+}
+
+
+#pragma mark Responder
+
+void beginRules(RuleTable *table, UInt32 framing, UInt32 parameter, UInt32 maxSize, UInt32 flags){
+    ResponderHeader *header = (ResponderHeader*)table->bytes;
+
+    bzero(header, sizeof(ResponderHeader));
+    header->Framing = framing;
+    header->Parameter = parameter;
+    header->MaxSize = maxSize;
+    header->Flags = flags;
+    table->size = sizeof(ResponderHeader);
+}
+
+
+void addRule(RuleTable *table, UInt16 match, const void *pattern, UInt32 patternSize, const void *response,
+             UInt32 responseSize, UInt16 flags, UInt32 delay, UInt32 interval){
+    ResponderRule   *rule = (ResponderRule*)(table->bytes + table->size);
+    UInt32          size = sizeof(ResponderRule) + patternSize + responseSize;
+
+    if (table->size + ((size + 7) & ~7) > sizeof(table->bytes)) abort();
+    bzero(rule, (size + 7) & ~7);
+    rule->Match = match;
+    rule->Flags = flags;
+    rule->PatternSize = patternSize;
+    rule->ResponseSize = responseSize;
+    rule->Delay = delay;
+    rule->Interval = interval;
+    memcpy(rule + 1, pattern, patternSize);
+    memcpy((UInt8*)(rule + 1) + patternSize, response, responseSize);
+    table->size += (size + 7) & ~7;
+    ((ResponderHeader*)table->bytes)->Count++;
+}
+
+
+IOReturn setResponder(Fixture *f, const RuleTable *table){
+
+    return HostCallMethod(f->client, kSetResponder, NULL, 0, table ? table->bytes : NULL, table ? table->size : 0,
+                          NULL, NULL, NULL, NULL);
+}
+
+
+IOReturn getResponderStats(Fixture *f, bool clear, ResponderStats *stats){
+    uint64_t    input = clear;
+    size_t      size = sizeof(ResponderStats);
+
+    return HostCallMethod(f->client, kGetResponderStats, &input, 1, NULL, 0, NULL, NULL, stats, &size);
+}
+
+
+#pragma mark Completions
+
+void initCompletion(Completion *completion){
+
+    bzero(completion, sizeof(Completion));
+    pthread_mutex_init(&completion->lock, NULL);
+    pthread_cond_init(&completion->cond, NULL);
+}
+
+
+static void completionCallout(void *refcon, IOReturn result, io_user_reference_t *args, UInt32 numArgs){
+    Completion  *completion = (Completion*)refcon;
+
+    // outstanding and completedBytes are stored atomically as well, for tests that poll them without the lock.
+    pthread_mutex_lock(&completion->lock);
+    __atomic_store_n(&completion->outstanding, completion->outstanding - 1, __ATOMIC_RELEASE);
+    completion->count = numArgs ? (UInt32)args[0] : 0;
+    __atomic_store_n(&completion->completedBytes, completion->completedBytes + completion->count, __ATOMIC_RELEASE);
+    if (result != kIOReturnSuccess)
+        completion->result = result;
+    pthread_cond_broadcast(&completion->cond);
+    pthread_mutex_unlock(&completion->lock);
+}
+
+
+void makeReference(OSAsyncReference64 reference, Completion *completion){
+
+    bzero(reference, sizeof(OSAsyncReference64));
+    reference[kIOAsyncCalloutFuncIndex] = (io_user_reference_t)(uintptr_t)&completionCallout;
+    reference[kIOAsyncCalloutRefconIndex] = (io_user_reference_t)(uintptr_t)completion;
+}
@@ -0,0 +1,100 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  What the host programs share: one driver instance with a user client attached and the tty side
+//  open, the stream pattern every byte is checked against, and completions for async calls.
+//
+
+#ifndef VSP_FIXTURE_H
+#define VSP_FIXTURE_H
+
+#include "VirtualSerialPort.h"
+
+
+#pragma mark Pattern
+
+// The data sent in every test is a function of its offset in the stream, so the receiving
+// side can check each byte without knowing how the stream was chunked.
+static inline UInt8 pattern(UInt64 offset){
+
+    return (UInt8)(offset ^ (offset >> 8) ^ (offset >> 16) ^ 0x5A);
+}
+
+void    fillPattern(UInt8 *buffer, UInt64 offset, UInt32 size);
+bool    checkPattern(const UInt8 *buffer, UInt64 offset, UInt32 size);
+double  now(void);
+void    sleepMilliseconds(UInt32 milliseconds);
+
+
+#pragma mark Fixture
+
+// One driver instance with a single user client attached and the tty side acquired and active.
+typedef struct{
+    IOService           *nub;
+    VirtualSerialPort   *port;
+    VSPUserClient       *client;
+    void                *refCon;        // What the stream nub passes to the driver
+    IOMemoryMap         *ringMaps[kNumberOfSharedRings];
+    SharedRing          *rings[kNumberOfSharedRings];       // Set by mapRing
+    IOMemoryMap         *statusMap;
+}Fixture;
+
+bool        openFixture(Fixture *f, UInt32 policy);
+void        closeFixture(Fixture *f);
+IOReturn    callScalar(Fixture *f, uint32_t selector, uint64_t in0, uint64_t in1 = 0, UInt32 inCount = 1);
+IOReturn    sendBuffer(Fixture *f, UInt32 mode, const UInt8 *buffer, UInt32 size, UInt32 *accepted,
+                       io_user_reference_t *asyncReference = NULL);
+IOReturn    setFraming(Fixture *f, UInt32 mode, UInt32 parameter, UInt32 maxSize);
+IOReturn    setFaults(Fixture *f, UInt32 direction, const FaultConfig *config);
+const PortStatusPage* mapStatusPage(Fixture *f);
+
+
+#pragma mark Shared Rings
+
+// The user space side of the shared rings, following the protocol in Shared.h. writeRing and readRing
+// move what they can without waiting and ring kRingDoorbell when the driver has to be told. waitForRing
+// sleeps until the RX ring has room or the TX ring has data, and gives up after kRingWaitSeconds. The
+// programs' message handlers pass kRingWakeupID notifications on to ringWakeupArrived.
+#define kRingWaitSeconds    10
+
+SharedRing* mapRing(Fixture *f, UInt32 type);
+UInt32      writeRing(Fixture *f, const UInt8 *buffer, UInt32 size);
+UInt32      readRing(Fixture *f, UInt8 *buffer, UInt32 size);
+bool        waitForRing(Fixture *f, UInt32 type);
+void        ringWakeupArrived(const RingWakeupNotification *notification);
+UInt32      ringWakeups(UInt32 type);
+
+
+#pragma mark Responder
+
+// A kSetResponder table, built with beginRules and addRule.
+#define kRuleTableSize  (16 * 1024)
+
+typedef struct{
+    UInt8       bytes[kRuleTableSize];
+    UInt32      size;
+}RuleTable;
+
+void        beginRules(RuleTable *table, UInt32 framing, UInt32 parameter, UInt32 maxSize, UInt32 flags);
+void        addRule(RuleTable *table, UInt16 match, const void *pattern, UInt32 patternSize, const void *response,
+                    UInt32 responseSize, UInt16 flags = 0, UInt32 delay = 0, UInt32 interval = 0);
+IOReturn    setResponder(Fixture *f, const RuleTable *table);      // NULL takes the responder away
+IOReturn    getResponderStats(Fixture *f, bool clear, ResponderStats *stats);
+
+
+#pragma mark Completions
+
+// Counts the async calls made with a reference from makeReference until they complete.
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    UInt32          outstanding;
+    UInt64          completedBytes;
+    IOReturn        result;
+    UInt32          count;
+}Completion;
+
+void    initCompletion(Completion *completion);
+void    makeReference(OSAsyncReference64 reference, Completion *completion);
+
+#endif
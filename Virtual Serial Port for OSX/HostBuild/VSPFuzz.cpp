@@ -0,0 +1,1233 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Feeds the driver random sequences of events, modem line changes, batches and data from both sides,
+//  the way the tty and user space can, and after every step checks that the port still adds up: each
+//  queue's pointers and counts agree, the PD_S_..Q bits match what is in the queues, the status page
+//  matches fPort, a rejected event changes nothing, and an accepted one reads back through requestEvent.
+//  Steps that take too long, or make the driver wake threads and send messages far out of proportion
+//  to the work, are saved and reported as slow.
+//
+//  An input is a byte string decoded into at most kMaxSteps steps, so any mutation of it is another
+//  valid input. With GCC's -fsanitize-coverage=trace-pc on the driver sources the loop here keeps the
+//  inputs that reach new edges; `make fuzz` builds that with ASan and UBSan into build-fuzz. Built
+//  without coverage it still mutates the seeds blindly, which is what `make check` runs. Compiled with
+//  clang, -fsanitize=fuzzer and -DVSP_LIBFUZZER, LLVMFuzzerTestOneInput is all libFuzzer needs.
+//
+//    vsp-fuzz [-s seconds] [-r seed] [-c corpus] [-o dir] [-v] [input ...]
+//
+//  Failing, slow and timed out inputs are written to dir as failure-, slow- and timeout-<hash>. Given
+//  inputs, it runs each once and exits, to reproduce one.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VSPFixture.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+
+#define kMaxInput           4096
+#define kMaxSteps           64
+#define kMaxData            (16 * 1024)
+#define kMaxBatch           16
+#define kSlowMilliseconds   100             // One step taking longer than this is slow
+#define kStormLimit         64              // Wakeups, thread calls and messages per unit of work
+#define kTimeoutSeconds     10              // One input taking longer than this has hung
+
+static Fixture      sFixture;
+static UInt8        sData[kMaxData];
+static char         sWhy[256];              // What the last failed check found
+static char         sSlow[256];             // Why the last input was slow, empty if it wasn't
+static const char   *sOutput = ".";
+static bool         sVerbose;
+
+#define CHECK(condition, ...)                                                   \
+    do {                                                                        \
+        if (!(condition)){                                                      \
+            snprintf(sWhy, sizeof(sWhy), __VA_ARGS__);                          \
+            return false;                                                       \
+        }                                                                       \
+    } while (0)
+
+
+#pragma mark Coverage
+
+// Edges are hashed from pairs of call sites into a map of hit counts, bucketed like AFL's so that
+// running a loop more often counts as new behaviour too.
+#define kMapSize    (1 << 16)
+
+static UInt8    sHits[kMapSize];            // This input
+static UInt8    sSeen[kMapSize];            // Buckets seen by any input
+
+#ifndef VSP_LIBFUZZER
+static __thread uintptr_t sLastPC;
+
+extern "C" void __sanitizer_cov_trace_pc(void){
+    uintptr_t   pc = (uintptr_t)__builtin_return_address(0);
+    UInt32      edge = (UInt32)(((pc ^ sLastPC) * 0x9E3779B97F4A7C15ULL) >> 48);
+
+    sLastPC = pc >> 1;
+    if (sHits[edge] < 255)
+        sHits[edge]++;
+}
+#endif
+
+
+static UInt8 bucket(UInt8 hits){
+
+    if (hits < 4)   return (hits == 3) ? 4 : hits;
+    if (hits < 8)   return 8;
+    if (hits < 16)  return 16;
+    if (hits < 32)  return 32;
+    if (hits < 128) return 64;
+    return 128;
+}
+
+
+// Fold this input's hits into sSeen, returning whether it found anything new.
+static bool collectCoverage(void){
+    bool    found = false;
+
+    for (UInt32 i = 0; i < kMapSize; i++){
+        if (sHits[i]){
+            UInt8 b = bucket(sHits[i]);
+            if (!(sSeen[i] & b)){
+                sSeen[i] |= b;
+                found = true;
+            }
+            sHits[i] = 0;
+        }
+    }
+    return found;
+}
+
+
+static UInt32 countEdges(void){
+    UInt32  edges = 0;
+
+    for (UInt32 i = 0; i < kMapSize; i++)
+        edges += (sSeen[i] != 0);
+    return edges;
+}
+
+
+#pragma mark Input
+
+typedef struct{
+    const UInt8 *data;
+    size_t      size;
+    size_t      offset;
+}Input;
+
+// Reading past the end gives zeros, so every input decodes to something.
+static UInt8 take8(Input *in){
+
+    return (in->offset < in->size) ? in->data[in->offset++] : 0;
+}
+
+
+static UInt16 take16(Input *in){
+
+    return (UInt16)(take8(in) | (take8(in) << 8));
+}
+
+
+static UInt32 take32(Input *in){
+
+    return (UInt32)(take16(in) | ((UInt32)take16(in) << 16));
+}
+
+
+static const UInt32 sEvents[] = {
+    PD_E_ACTIVE, PD_E_FLOW_CONTROL, PD_E_DELAY, PD_E_DATA_LATENCY, PD_E_RXQ_SIZE, PD_E_TXQ_SIZE,
+    PD_E_RXQ_HIGH_WATER, PD_E_RXQ_LOW_WATER, PD_E_TXQ_HIGH_WATER, PD_E_TXQ_LOW_WATER,
+    PD_E_RXQ_AVAILABLE, PD_E_TXQ_AVAILABLE, PD_E_RXQ_FLUSH, PD_E_TXQ_FLUSH, PD_E_DATA_RATE,
+    PD_E_RX_DATA_RATE, PD_E_DATA_SIZE, PD_E_RX_DATA_SIZE, PD_E_DATA_INTEGRITY, PD_E_RX_DATA_INTEGRITY,
+    PD_E_SPECIAL_BYTE, PD_E_VALID_DATA_BYTE, PD_E_EOQ, PD_E_DATA_BYTE, PD_E_SW_OVERRUN_ERROR,
+    PD_RS232_E_XON_BYTE, PD_RS232_E_XOFF_BYTE, PD_RS232_E_LINE_BREAK, PD_RS232_E_MIN_LATENCY,
+    PD_RS232_E_STOP_BITS, PD_RS232_E_RX_STOP_BITS,
+};
+
+// What kSendEvent accepts, and its most likely mistakes.
+static const UInt32 sSentEvents[] = {
+    PD_E_DATA_BYTE, PD_E_FRAMING_BYTE, PD_E_PARITY_BYTE, PD_E_INTEGRITY_ERROR, PD_E_FRAMING_ERROR,
+    PD_E_PARITY_ERROR, PD_E_HW_OVERRUN_ERROR, PD_RS232_E_LINE_BREAK, PD_E_SW_OVERRUN_ERROR, PD_E_EOQ,
+};
+
+static const UInt32 sInteresting[] = {
+    0, 1, 2, 3, 4, 5, 7, 8, 9, 16, 20, 21, 31, 32, 63, 64, 65, 255, 256, 257, 1024, 4095, 4096, 4097,
+    9600 << 1, kMaxBaudRate << 1, (kMaxBaudRate + 1) << 1, kMaxCirBufferLimit, kMaxCirBufferLimit + 1,
+    4294967, 4294968, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFE, 0xFFFFFFFF,
+};
+
+#define countof(a)  (sizeof(a) / sizeof((a)[0]))
+
+
+static UInt32 pickEvent(Input *in){
+    UInt8   pick = take8(in);
+
+    return (pick & 0x80) ? take32(in) : sEvents[pick % countof(sEvents)];
+}
+
+
+static UInt32 pickSentEvent(Input *in){
+    UInt8   pick = take8(in);
+
+    return (pick & 0x80) ? pickEvent(in) : sSentEvents[pick % countof(sSentEvents)];
+}
+
+
+static UInt32 pickData(Input *in){
+    UInt8   pick = take8(in);
+
+    switch (pick & 3){
+        case 0:     return sInteresting[(pick >> 2) % countof(sInteresting)];
+        case 1:     return take8(in);
+        case 2:     return take16(in);
+        default:    return take32(in);
+    }
+}
+
+
+#pragma mark Invariants
+
+// The frame lengths must account for every byte in the RX queue, and none may be longer than allowed.
+static bool checkFrames(FrameQueue *frames, CirQueue *queue){
+    UInt32  size = GetQueueSize(queue);
+    UInt32  limit = (frames->MaxSize && (frames->MaxSize < size)) ? frames->MaxSize : size;
+    UInt32  total = frames->Partial;
+
+    CHECK((frames->Count <= kMaxQueuedFrames) && (frames->First < kMaxQueuedFrames), "%u frames from %u", frames->Count, frames->First);
+    if (frames->Mode == kFramingNone){
+        CHECK(!frames->Count && !frames->Partial, "frames in an unframed queue");
+        return true;
+    }
+    CHECK(frames->Partial < limit, "a %u byte partial frame with a limit of %u", frames->Partial, limit);
+    for (UInt32 i = 0; i < frames->Count; i++){
+        UInt32 length = frames->Lengths[(frames->First + i) % kMaxQueuedFrames];
+
+        CHECK((length > 0) && (length <= limit), "frame %u is %u bytes with a limit of %u", i, length, limit);
+        total += length;
+    }
+    CHECK(total == UsedSpaceinQueue(queue), "frames hold %u bytes of %u", total, UsedSpaceinQueue(queue));
+    return true;
+}
+
+
+// Events can only be queued at positions the stream has reached, and in order.
+static bool checkEvents(const char *name, EventRing *events, BufferMarks *marks){
+    UInt64  last = 0;
+
+    CHECK(events->Head - events->Tail <= kEventRingSize, "%s: %u events in a ring of %u", name,
+          events->Head - events->Tail, kEventRingSize);
+    for (UInt32 i = events->Tail; i != events->Head; i++){
+        EventEntry  *entry = &events->Entries[i & (kEventRingSize - 1)];
+
+        CHECK((entry->Position >= last) && (entry->Position <= marks->BytesIn), "%s: event 0x%x at %llu, after %llu with %llu in",
+              name, entry->Event, (unsigned long long)entry->Position, (unsigned long long)last, (unsigned long long)marks->BytesIn);
+        last = entry->Position;
+    }
+    return true;
+}
+
+
+// The queue's own bookkeeping, and the PD_S_..Q bits for it while the port is acquired. A framed RX
+// queue is empty until a frame is complete, and full once it holds kMaxQueuedFrames frames. The RX
+// queue's PD_S_RX_EVENT is set while the oldest event is due.
+static bool checkQueue(const char *name, CirQueue *queue, BufferMarks *marks, FrameQueue *frames, EventRing *events,
+                       UInt32 state, bool isTX){
+    UInt32  used = UsedSpaceinQueue(queue);
+    UInt32  free = FreeSpaceinQueue(queue);
+    UInt32  size = GetQueueSize(queue);
+    UInt32  readable = used;
+
+    // A released port gives its rings back until the next acquirePort.
+    if (!(state & PD_S_ACQUIRED) && (queue->buffer() == NULL)){
+        CHECK((size == 0) && (used == 0) && (marks->BufferSize == 0), "%s: an idle queue of %u holding %u",
+              name, size, used);
+        CHECK(marks->BytesIn == marks->BytesOut, "%s: %llu more in than out with no queue", name,
+              (unsigned long long)(marks->BytesIn - marks->BytesOut));
+        return checkEvents(name, events, marks);
+    }
+    CHECK(size && !(size & (size - 1)), "%s: a %u byte queue is not a power of two", name, size);
+    CHECK(used <= size, "%s: %u bytes in a %u byte queue", name, used, size);
+    CHECK(used + free == size, "%s: %u used and %u free in %u", name, used, free, size);
+    CHECK(marks->BytesIn - marks->BytesOut == used, "%s: %u queued but %llu more in than out", name, used,
+          (unsigned long long)(marks->BytesIn - marks->BytesOut));
+    CHECK(marks->BufferSize == size, "%s: BufferSize %lu for a %u byte queue", name, marks->BufferSize, size);
+    CHECK((marks->LowWater <= marks->HighWater) && (marks->HighWater < marks->BufferSize),
+          "%s: water marks %lu and %lu in %lu", name, marks->LowWater, marks->HighWater, marks->BufferSize);
+
+    if (frames){
+        if (!checkFrames(frames, queue))
+            return false;
+        readable = used - frames->Partial;
+    }
+    if (!checkEvents(name, events, marks))
+        return false;
+    if (!(state & PD_S_ACQUIRED)) return true;
+
+    UInt32  expected = 0;
+    UInt32  mask = isTX ? PD_S_TXQ_MASK : (PD_S_RXQ_MASK | PD_S_RX_EVENT);
+
+    if (!isTX && (events->Head != events->Tail) &&
+        (events->Entries[events->Tail & (kEventRingSize - 1)].Position <= marks->BytesOut))
+        expected |= PD_S_RX_EVENT;
+
+    if (frames && (frames->Count == kMaxQueuedFrames))
+        free = 0;
+    if (free == 0)                  expected |= isTX ? PD_S_TXQ_FULL : PD_S_RXQ_FULL;
+    else if (readable == 0)         expected |= isTX ? PD_S_TXQ_EMPTY : PD_S_RXQ_EMPTY;
+    if ((used < marks->LowWater) || ((used == 0) && marks->BufferSize))
+        expected |= isTX ? PD_S_TXQ_LOW_WATER : PD_S_RXQ_LOW_WATER;
+    if (used > marks->HighWater)    expected |= isTX ? PD_S_TXQ_HIGH_WATER : PD_S_RXQ_HIGH_WATER;
+    CHECK((state & mask) == expected, "%s: state bits 0x%08x for %u of %u bytes, expected 0x%08x",
+          name, state & mask, used, size, expected);
+    return true;
+}
+
+
+// Every step finishes with updateStatus, so the page should be exactly fPort. privateWatchState
+// raises CAR without going through writePortState, so the page may not have caught up with that.
+static bool checkStatus(VirtualSerialPort *port){
+    PortStatusPage  *page = (PortStatusPage*)port->getStatusPage()->getBytesNoCopy();
+    PortInfo        *info = &port->fPort;
+    UInt32          state = port->readPortState();
+
+    const struct{
+        UInt32  field;
+        UInt64  value;
+    }fields[] = {
+        { kPortFieldCharLength,         info->CharLength },
+        { kPortFieldStopBits,           info->StopBits },
+        { kPortFieldTXParity,           info->TX_Parity },
+        { kPortFieldRXParity,           info->RX_Parity },
+        { kPortFieldBaudRate,           info->BaudRate },
+        { kPortFieldMinLatency,         info->MinLatency },
+        { kPortFieldXONchar,            info->XONchar },
+        { kPortFieldXOFFchar,           info->XOFFchar },
+        { kPortFieldFlowControl,        info->FlowControl },
+        { kPortFieldFlowControlState,   info->FlowControlState },
+        { kPortFieldRXOstate,           (UInt64)(SInt64)info->RXOstate },
+        { kPortFieldTXOstate,           (UInt64)(SInt64)info->TXOstate },
+        { kPortFieldRXOverflowPolicy,   info->RXOverflowPolicy },
+        { kPortFieldRXOverRuns,         info->RXStats.OverRunCount },
+    };
+
+    CHECK(!(page->Sequence & 1), "status page left mid update");
+    CHECK(!((page->Values[kPortFieldState] ^ state) & ~PD_RS232_S_CAR),
+          "status page state 0x%08llx, port 0x%08x", (unsigned long long)page->Values[kPortFieldState], state);
+    for (UInt32 i = 0; i < countof(fields); i++){
+        CHECK(page->Values[fields[i].field] == fields[i].value, "status page field %u is %llu, fPort has %llu",
+              fields[i].field, (unsigned long long)page->Values[fields[i].field], (unsigned long long)fields[i].value);
+    }
+    CHECK((page->RXUsed == UsedSpaceinQueue(&info->RX)) && (page->RXSize == GetQueueSize(&info->RX)) &&
+          (page->TXUsed == UsedSpaceinQueue(&info->TX)) && (page->TXSize == GetQueueSize(&info->TX)),
+          "status page queue levels are stale");
+    CHECK((page->RXBytesIn == info->RXStats.BytesIn) && (page->RXBytesOut == info->RXStats.BytesOut) &&
+          (page->TXBytesIn == info->TXStats.BytesIn) && (page->TXBytesOut == info->TXStats.BytesOut),
+          "status page byte counts are stale");
+    CHECK((page->RXParityErrors == info->RXParityErrors) && (page->RXFramingErrors == info->RXFramingErrors),
+          "status page error counts are stale");
+    CHECK((page->RXFaults == info->RXFaults.Injected) && (page->TXFaults == info->TXFaults.Injected),
+          "status page fault counts are stale");
+    return true;
+}
+
+
+// The line tables follow both ends' formats, and only identical formats skip the lookup. Bytes only skip
+// the line altogether when they cross it unchanged and no faults are on.
+static bool checkLine(PortInfo *info){
+    UInt32  remoteLength = info->RemoteCharLength ? info->RemoteCharLength : info->CharLength;
+    UInt32  remoteParity = info->RemoteParity ? info->RemoteParity : info->TX_Parity;
+    UInt32  expected = kLineDecode;
+
+    if ((remoteLength == info->CharLength) && (remoteParity == info->TX_Parity))
+        expected = (remoteLength == 8) ? kLineTransparent : kLineMask;
+    CHECK((info->RXLine.Mode == expected) && (info->TXLine.Mode == expected), "line modes %u and %u for %u%u against %u%u",
+          info->RXLine.Mode, info->TXLine.Mode, info->CharLength, info->TX_Parity, remoteLength, remoteParity);
+    CHECK((info->RXLine.Mask == (1 << info->CharLength) - 1) && (info->TXLine.Mask == (1 << remoteLength) - 1),
+          "line masks 0x%x and 0x%x", info->RXLine.Mask, info->TXLine.Mask);
+    CHECK((info->RXLine.Direct == ((expected == kLineTransparent) && !info->RXFaults.Enabled)) &&
+          (info->TXLine.Direct == ((expected == kLineTransparent) && !info->TXFaults.Enabled)),
+          "Direct is %u and %u with line mode %u", info->RXLine.Direct, info->TXLine.Direct, expected);
+    CHECK(!info->RXFaults.Holding && !info->TXFaults.Holding, "bytes held without jitter");
+    return true;
+}
+
+
+static bool checkPort(VirtualSerialPort *port){
+    UInt32  state = port->readPortState();
+
+    return checkQueue("RX", &port->fPort.RX, &port->fPort.RXStats, &port->fPort.RXFrames, &port->fPort.RXEvents, state, false) &&
+           checkQueue("TX", &port->fPort.TX, &port->fPort.TXStats, NULL, &port->fPort.TXEvents, state, true) &&
+           checkLine(&port->fPort) && checkStatus(port);
+}
+
+
+// What requestEvent should give back after executeEvent accepted data, for the events that have a
+// setting to read. Rates and sizes are sent doubled, so their low bit is lost. Queue sizes round up
+// to a power of two.
+static bool expectedReadback(UInt32 event, UInt32 data, UInt32 *expected){
+
+    switch (event){
+        case PD_E_DATA_RATE:
+        case PD_E_DATA_SIZE:
+            *expected = data & ~1U;
+            return true;
+        case PD_E_ACTIVE:
+        case PD_RS232_E_MIN_LATENCY:
+        case PD_RS232_E_LINE_BREAK:
+            *expected = (data != 0);
+            return true;
+        case PD_E_RXQ_SIZE:
+        case PD_E_TXQ_SIZE:
+            for (*expected = 1; *expected < data; *expected <<= 1){}
+            return true;
+        case PD_E_FLOW_CONTROL:
+        case PD_E_DELAY:
+        case PD_E_DATA_LATENCY:
+        case PD_E_RXQ_HIGH_WATER:
+        case PD_E_RXQ_LOW_WATER:
+        case PD_E_TXQ_HIGH_WATER:
+        case PD_E_TXQ_LOW_WATER:
+        case PD_E_DATA_INTEGRITY:
+        case PD_E_RX_DATA_INTEGRITY:
+        case PD_E_RX_DATA_RATE:
+        case PD_E_RX_DATA_SIZE:
+        case PD_RS232_E_XON_BYTE:
+        case PD_RS232_E_XOFF_BYTE:
+        case PD_RS232_E_STOP_BITS:
+        case PD_RS232_E_RX_STOP_BITS:
+            *expected = data;
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// Compare two copies of fPort, leaving out one field.
+static bool samePort(const PortInfo *a, const PortInfo *b, size_t skipOffset, size_t skipSize){
+
+    return (memcmp(a, b, skipOffset) == 0) &&
+           (memcmp((const UInt8*)a + skipOffset + skipSize, (const UInt8*)b + skipOffset + skipSize,
+                   sizeof(PortInfo) - skipOffset - skipSize) == 0);
+}
+
+
+#pragma mark Steps
+
+enum{
+    kStepExecuteEvent,
+    kStepRequestEvent,
+    kStepSetState,
+    kStepWatchState,
+    kStepEnqueue,
+    kStepDequeue,
+    kStepSend,
+    kStepReceive,
+    kStepBatch,
+    kStepPolicy,
+    kStepClient,
+    kStepDequeueEvent,
+    kStepEnqueueEvent,
+    kStepResponder,
+    kStepOpenClose,
+    kNumberOfSteps
+};
+
+static const char *sStepNames[kNumberOfSteps] = {
+    "executeEvent", "requestEvent", "setState", "watchState", "enqueueData", "dequeueData", "kSendBuffer",
+    "receiveData", "kExecuteBatch", "kSetOverflowPolicy", "client", "dequeueEvent", "enqueueEvent",
+    "kSetResponder", "open/close",
+};
+
+// kOverflowBlock is left out, one thread would sleep in it for good.
+static const UInt32 sPolicies[] = { kOverflowDropNewest, kOverflowDropOldest, kOverflowDropOldest + 1, 0xFFFFFFFF };
+
+
+static bool stepExecuteEvent(Input *in){
+    VirtualSerialPort   *port = sFixture.port;
+    UInt32              event = pickEvent(in);
+    UInt32              data = pickData(in);
+    UInt32              expected, value;
+    PortInfo            before = port->fPort;
+    IOReturn            result;
+
+    result = port->executeEvent(event, data, sFixture.refCon);
+    if (result != kIOReturnSuccess){
+        CHECK(samePort(&before, &port->fPort, 0, 0), "executeEvent(0x%x, 0x%x) failed with 0x%x but changed fPort", event, data, result);
+        return true;
+    }
+
+    if ((event == PD_E_SPECIAL_BYTE) || (event == PD_E_VALID_DATA_BYTE)){
+        CHECK(samePort(&before, &port->fPort, offsetof(PortInfo, SWspecial), sizeof(before.SWspecial)),
+              "executeEvent(0x%x, 0x%x) changed more than SWspecial", event, data);
+    }
+
+    if (expectedReadback(event, data, &expected)){
+        value = ~expected;
+        result = port->requestEvent(event, &value, sFixture.refCon);
+        CHECK((result == kIOReturnSuccess) && (value == expected),
+              "executeEvent(0x%x, 0x%x) then requestEvent gives 0x%x, 0x%x", event, data, result, value);
+    }
+    return true;
+}
+
+
+static bool stepRequestEvent(Input *in){
+    UInt32  value;
+
+    sFixture.port->requestEvent(pickEvent(in), &value, sFixture.refCon);
+    return true;
+}
+
+
+static bool stepSetState(Input *in){
+    UInt32  state = take32(in);
+    UInt32  mask = take32(in);
+
+    sFixture.port->setState(state, mask, sFixture.refCon);
+    sFixture.port->getState(sFixture.refCon);
+    return true;
+}
+
+
+// Watch for the state the port is already in, so it returns straight away. privateWatchState raises
+// CAR before it looks, so ask for that too; with nothing else in the mask it would wait for the port
+// to close.
+static bool stepWatchState(Input *in){
+    UInt32  mask = take32(in) | PD_RS232_S_CAR;
+    UInt32  state = sFixture.port->readPortState() | PD_RS232_S_CAR;
+
+    sFixture.port->watchState(&state, mask, sFixture.refCon);
+    return true;
+}
+
+
+static bool stepEnqueue(Input *in){
+    UInt32  size = take16(in) % (kMaxData + 1);
+    UInt32  count = 0;
+
+    fillPattern(sData, 0, size);
+    sFixture.port->enqueueData(sData, size, &count, false, sFixture.refCon);
+    CHECK(count <= size, "enqueueData took %u of %u bytes", count, size);
+    return true;
+}
+
+
+static bool stepDequeue(Input *in){
+    UInt32  size = take16(in) % (kMaxData + 1);
+    UInt32  min = (take8(in) & 1) ? size + 1 : 0;      // min > size is refused, anything else may sleep
+    UInt32  count = 0;
+    FrameQueue  *frames = &sFixture.port->fPort.RXFrames;
+    UInt32  frame = frames->Count ? frames->Lengths[frames->First] : 0;
+    bool    framed = (frames->Mode != kFramingNone);
+
+    sFixture.port->dequeueData(sData, size, &count, min, sFixture.refCon);
+    CHECK(count <= size, "dequeueData gave %u bytes for %u", count, size);
+    CHECK(!framed || (count <= frame), "dequeueData gave %u bytes from a %u byte frame", count, frame);
+    return true;
+}
+
+
+static bool stepSend(Input *in){
+    UInt32  size = take16(in) % (kMaxData + 1);
+    UInt32  accepted = 0;
+
+    fillPattern(sData, 0, size);
+    sendBuffer(&sFixture, kSendNormal, sData, size, &accepted);
+    CHECK(accepted <= size, "kSendBuffer took %u of %u bytes", accepted, size);
+    return true;
+}
+
+
+// Followed by runTXEvents, as the user client does.
+static bool stepReceive(Input *in){
+    UInt32  size = take16(in) % (kMaxData + 1);
+    UInt32  count = 0;
+
+    sFixture.port->receiveData(sData, size, &count);
+    sFixture.port->runTXEvents();
+    CHECK(count <= size, "receiveData gave %u bytes for %u", count, size);
+    return true;
+}
+
+
+// A packed list as user space would build it, sometimes with a kBatchSend that claims more bytes
+// than follow, an unknown command, or too little room for the results.
+static bool stepBatch(Input *in, UInt32 *units){
+    UInt8           commands[kMaxBatch * (sizeof(BatchCommand) + 520)];
+    BatchResult     results[kMaxBatch + 1];
+    UInt32          number = 1 + (take8(in) % kMaxBatch);
+    UInt32          size = 0;
+
+    for (UInt32 i = 0; i < number; i++){
+        BatchCommand    *command = (BatchCommand*)(commands + size);
+        UInt8           kind = take8(in) % 7;
+        UInt32          length = 0;
+
+        bzero(command, sizeof(BatchCommand));
+        size += sizeof(BatchCommand);
+        switch (kind){
+            case 0:
+                command->Command = kBatchExecuteEvent;
+                command->Arg0 = pickEvent(in);
+                command->Arg1 = pickData(in);
+                break;
+            case 1:
+                command->Command = kBatchRequestEvent;
+                command->Arg0 = pickEvent(in);
+                break;
+            case 2:
+                command->Command = kBatchSetState;
+                command->Arg0 = take32(in);
+                command->Arg1 = take32(in);
+                break;
+            case 3:
+                command->Command = kBatchGetState;
+                break;
+            case 4:
+                command->Command = kBatchSend;
+                length = take16(in) % 513;
+                command->Arg1 = (take8(in) & 1) ? length + take8(in) + 1 : length;
+                fillPattern(commands + size, 0, length);
+                size += (length + 7) & ~7U;
+                break;
+            case 5:
+                command->Command = kBatchSendEvent;
+                command->Arg0 = pickSentEvent(in);
+                command->Arg1 = pickData(in);
+                break;
+            default:
+                command->Command = take32(in);
+                command->Arg0 = take32(in);
+                command->Arg1 = take32(in);
+                break;
+        }
+    }
+
+    size_t  resultSize = (take8(in) % (number + 2)) * sizeof(BatchResult);
+    size_t  capacity = resultSize;
+
+    HostCallMethod(sFixture.client, kExecuteBatch, NULL, 0, commands, size, NULL, NULL, results, &resultSize);
+    CHECK(resultSize <= capacity, "kExecuteBatch wrote %zu bytes of results into %zu", resultSize, capacity);
+    *units = number;
+    return true;
+}
+
+
+static bool stepPolicy(Input *in){
+
+    callScalar(&sFixture, kSetOverflowPolicy, sPolicies[take8(in) % countof(sPolicies)]);
+    return true;
+}
+
+
+// Arguments are taken into locals first, the order they are evaluated in a call is unspecified.
+static bool stepClient(Input *in){
+    uint64_t    output[2];
+    UInt32      outputCount = 2;
+    UInt32      a, b;
+    UInt64      c;
+    FaultConfig config;
+
+    switch (take8(in) % 8){
+        case 0:
+            callScalar(&sFixture, kSetNotifyWindow, pickData(in));
+            break;
+        case 1:
+            a = take32(in);
+            c = (UInt64)take32(in) << 32;
+            c |= take32(in);
+            callScalar(&sFixture, kSetSubscription, a, c, 2);
+            break;
+        case 2:
+            HostCallMethod(sFixture.client, kClientGetInfo, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
+            break;
+        case 3:
+            a = take8(in) % (kFramingFixed + 2);
+            b = pickData(in);
+            setFraming(&sFixture, a, b, (take8(in) & 1) ? pickData(in) : 0);
+            break;
+        case 4:
+            a = pickSentEvent(in);
+            b = pickData(in);
+            callScalar(&sFixture, kSendEvent, a, b, 2);
+            break;
+        case 5:
+            a = take8(in) % 10;
+            b = take8(in) % 8;
+            callScalar(&sFixture, kSetLineFormat, a, b, 2);
+            break;
+        case 6:
+            // Short intervals so faults strike within an input. No jitter, its timer would race the checks,
+            // and breaks sparse enough that the client's notifications for them don't look like a storm.
+            bzero(&config, sizeof(config));
+            a = take8(in) % 3;
+            config.Seed = take32(in);
+            config.BitErrorInterval = take8(in) % 64;
+            config.DropInterval = take8(in) % 16;
+            config.DuplicateInterval = take8(in) % 16;
+            config.BurstInterval = take8(in) % 64;
+            config.BurstLength = take8(in) % 8;
+            config.BreakInterval = (take8(in) % 4) * 1024;
+            setFaults(&sFixture, a, &config);
+            break;
+        default:
+            HostCallMethod(sFixture.client, kGetCredits, NULL, 0, NULL, 0, output, &outputCount, NULL, NULL);
+            CHECK(output[1] <= output[0], "credit limit %llu is behind the %llu bytes sent",
+                  (unsigned long long)output[0], (unsigned long long)output[1]);
+            break;
+    }
+    return true;
+}
+
+
+static bool stepDequeueEvent(Input *in){
+    UInt32      event, data;
+    EventRing   *events = &sFixture.port->fPort.RXEvents;
+    UInt32      queued = events->Head - events->Tail;
+
+    sFixture.port->dequeueEvent(&event, &data, false, sFixture.refCon);
+    CHECK((event == PD_E_EOQ) || (events->Head - events->Tail < queued), "dequeueEvent gave 0x%x from an unchanged ring", event);
+    return true;
+}
+
+
+// Never asked to sleep, it would wait for the client to read.
+static bool stepEnqueueEvent(Input *in){
+    UInt32  event = pickEvent(in);
+    UInt32  data = pickData(in);
+
+    sFixture.port->enqueueEvent(event, data, false, sFixture.refCon);
+    return true;
+}
+
+
+// Pattern and response bytes, weighted to the ones rules give meaning to.
+static const UInt8 sRuleBytes[] = { '?', '*', '#', '\\', '$', '0', '1', '9', 'c', 'x', 'A', 'T', '\r', '\n', 0x00, 0xFF };
+
+static UInt32 takeRuleBytes(Input *in, UInt8 *bytes, UInt32 max){
+    UInt32  size = take8(in) % (max + 1);
+
+    for (UInt32 i = 0; i < size; i++)
+        bytes[i] = sRuleBytes[take8(in) % countof(sRuleBytes)];
+    return size;
+}
+
+
+// A random table, often one the driver turns down, then a message from the tty for whatever was set. No
+// delays, the timer would race the checks. A responder that consumes what it is sent has to take all of it.
+static bool stepResponder(Input *in){
+    static RuleTable    rules;
+    UInt8               pattern[16], response[24];
+    UInt32              rulesCount, patternSize, responseSize, flags, size, count = 0;
+    bool                consumes = false;
+
+    if (take8(in) % 4 == 0){
+        setResponder(&sFixture, NULL);
+    } else {
+        UInt32 framing = take8(in) % (kFramingFixed + 2);
+        UInt32 parameter = (take8(in) & 1) ? take8(in) : take8(in) % 5;
+        UInt32 maxSize = take8(in) % 32;
+
+        flags = take8(in) % 3;
+        beginRules(&rules, framing, parameter, maxSize, flags);
+        rulesCount = take8(in) % 5;
+        for (UInt32 i = 0; i < rulesCount; i++){
+            UInt16 match = take8(in) % (kMatchPattern + 2);
+            UInt16 flags = take8(in) % 3;
+
+            patternSize = takeRuleBytes(in, pattern, sizeof(pattern));
+            responseSize = takeRuleBytes(in, response, sizeof(response));
+            addRule(&rules, match, pattern, patternSize, response, responseSize, flags);
+        }
+        consumes = (setResponder(&sFixture, &rules) == kIOReturnSuccess) && !(flags & kResponderPassThrough);
+    }
+
+    size = takeRuleBytes(in, sData, 64);
+    if ((sFixture.port->enqueueData(sData, size, &count, false, sFixture.refCon) == kIOReturnSuccess) && consumes)
+        CHECK(count == size, "the responder took %u of %u bytes", count, size);
+    return true;
+}
+
+
+// acquirePort is only ever asked not to sleep, there is no one else to release the port.
+static bool stepOpenClose(Input *in){
+    VirtualSerialPort   *port = sFixture.port;
+
+    switch (take8(in) % 3){
+        case 0:
+            port->releasePort(sFixture.refCon);
+            break;
+        case 1:
+            port->acquirePort(false, sFixture.refCon);
+            break;
+        default:
+            port->releasePort(sFixture.refCon);
+            if (port->acquirePort(false, sFixture.refCon) == kIOReturnSuccess)
+                port->executeEvent(PD_E_ACTIVE, true, sFixture.refCon);
+            break;
+    }
+    return true;
+}
+
+
+static bool runStep(UInt32 step, Input *in, UInt32 *units){
+
+    *units = 1;
+    switch (step){
+        case kStepExecuteEvent:     return stepExecuteEvent(in);
+        case kStepRequestEvent:     return stepRequestEvent(in);
+        case kStepSetState:         return stepSetState(in);
+        case kStepWatchState:       return stepWatchState(in);
+        case kStepEnqueue:          return stepEnqueue(in);
+        case kStepDequeue:          return stepDequeue(in);
+        case kStepSend:             return stepSend(in);
+        case kStepReceive:          return stepReceive(in);
+        case kStepBatch:            return stepBatch(in, units);
+        case kStepPolicy:           return stepPolicy(in);
+        case kStepClient:           return stepClient(in);
+        case kStepDequeueEvent:     return stepDequeueEvent(in);
+        case kStepEnqueueEvent:     return stepEnqueueEvent(in);
+        case kStepResponder:        return stepResponder(in);
+        default:                    return stepOpenClose(in);
+    }
+}
+
+
+#pragma mark Running Inputs
+
+// Every input starts from a port that has just been opened, with the fixture's client defaults.
+static void resetPort(void){
+    VirtualSerialPort   *port = sFixture.port;
+    FaultConfig         faults;
+
+    if (port->readPortState() & PD_S_ACQUIRED)
+        port->releasePort(sFixture.refCon);
+    callScalar(&sFixture, kSetOverflowPolicy, kOverflowDropNewest);
+    callScalar(&sFixture, kSetNotifyWindow, 0);
+    callScalar(&sFixture, kSetSubscription, ~0ULL, ~0ULL, 2);
+    port->acquirePort(false, sFixture.refCon);
+    port->executeEvent(PD_E_ACTIVE, true, sFixture.refCon);
+    setFraming(&sFixture, kFramingNone, 0, 0);
+    callScalar(&sFixture, kSetLineFormat, 0, 0, 2);
+    bzero(&faults, sizeof(faults));
+    setFaults(&sFixture, kFaultsToTTY, &faults);
+    setFaults(&sFixture, kFaultsFromTTY, &faults);
+    setResponder(&sFixture, NULL);
+}
+
+
+static UInt64 work(void){
+    HostCounters    counters;
+
+    HostGetCounters(&counters);
+    return counters.wakeups + counters.threadCalls + counters.messages;
+}
+
+
+// Returns false if a check failed, with sWhy saying which. sSlow is set if a step was slow.
+static bool runInput(const UInt8 *data, size_t size){
+    Input   in = { data, size, 0 };
+    UInt32  steps = 0;
+
+    sSlow[0] = 0;
+    resetPort();
+    if (!checkPort(sFixture.port))
+        return false;
+
+    while ((in.offset < in.size) && (steps++ < kMaxSteps)){
+        UInt32  step = take8(&in) % kNumberOfSteps;
+        UInt32  units;
+        UInt64  startWork = work();
+        double  start = now();
+
+        bool passed = runStep(step, &in, &units) && checkPort(sFixture.port);
+
+        double  elapsed = (now() - start) * 1000.0;
+        UInt64  done = work() - startWork;
+        if (sVerbose)
+            fprintf(stderr, "      %-18s %8.3f ms %6llu wakeups, calls and messages\n", sStepNames[step], elapsed, (unsigned long long)done);
+        if (!passed){
+            char why[sizeof(sWhy)];
+
+            strncpy(why, sWhy, sizeof(why));
+            snprintf(sWhy, sizeof(sWhy), "step %u, %s: %.200s", steps, sStepNames[step], why);
+            return false;
+        }
+        if (!sSlow[0] && (elapsed > kSlowMilliseconds))
+            snprintf(sSlow, sizeof(sSlow), "step %u, %s took %.1f ms", steps, sStepNames[step], elapsed);
+        if (!sSlow[0] && (done > kStormLimit * (UInt64)units))
+            snprintf(sSlow, sizeof(sSlow), "step %u, %s caused %llu wakeups, calls and messages", steps,
+                     sStepNames[step], (unsigned long long)done);
+    }
+    return true;
+}
+
+
+#ifdef VSP_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    static bool opened = false;
+
+    if (!opened){
+        if (!openFixture(&sFixture, kOverflowDropNewest)) abort();
+        opened = true;
+    }
+    if (!runInput(data, size)){
+        fprintf(stderr, "%s\n", sWhy);
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+#pragma mark Corpus
+
+typedef struct{
+    UInt8   *data;
+    UInt32  size;
+}Entry;
+
+static Entry        *sCorpus;
+static UInt32       sCorpusCount, sCorpusCapacity;
+static const char   *sCorpusDirectory;
+
+static const UInt8  *sCurrent;              // The input being run, for the crash and timeout handlers
+static size_t       sCurrentSize;
+
+
+static UInt64 hashInput(const UInt8 *data, size_t size){
+    UInt64  hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+
+// Called from signal handlers too, so only open, write and close.
+static void writeInput(const char *directory, const char *prefix, const UInt8 *data, size_t size, char *path, size_t pathSize){
+    static const char   hex[] = "0123456789abcdef";
+    UInt64              hash = hashInput(data, size);
+    size_t              length = 0;
+
+    for (const char *c = directory; *c && (length < pathSize - 40); c++) path[length++] = *c;
+    path[length++] = '/';
+    for (const char *c = prefix; *c && (length < pathSize - 20); c++) path[length++] = *c;
+    for (int shift = 60; shift >= 0; shift -= 4) path[length++] = hex[(hash >> shift) & 15];
+    path[length] = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0){
+        if (write(fd, data, size) < 0) {}
+        close(fd);
+    }
+}
+
+
+static void addToCorpus(const UInt8 *data, size_t size, bool save){
+    char    path[1024];
+
+    if (sCorpusCount == sCorpusCapacity){
+        sCorpusCapacity = sCorpusCapacity ? sCorpusCapacity * 2 : 64;
+        sCorpus = (Entry*)realloc(sCorpus, sCorpusCapacity * sizeof(Entry));
+    }
+    sCorpus[sCorpusCount].data = (UInt8*)malloc(size ? size : 1);
+    memcpy(sCorpus[sCorpusCount].data, data, size);
+    sCorpus[sCorpusCount].size = (UInt32)size;
+    sCorpusCount++;
+
+    if (save && sCorpusDirectory)
+        writeInput(sCorpusDirectory, "", data, size, path, sizeof(path));
+}
+
+
+static bool readFile(const char *path, UInt8 *buffer, size_t *size){
+    FILE    *file = fopen(path, "rb");
+
+    if (!file) return false;
+    *size = fread(buffer, 1, kMaxInput, file);
+    fclose(file);
+    return true;
+}
+
+
+// One short input per step kind, and one per event with each kind of data, so the loop has somewhere
+// to start from even without a corpus.
+static void addSeeds(void){
+    UInt8   seed[16];
+
+    for (UInt32 step = 0; step < kNumberOfSteps; step++){
+        for (UInt32 i = 0; i < sizeof(seed); i++)
+            seed[i] = (UInt8)(step + (i * 37));
+        seed[0] = (UInt8)step;
+        addToCorpus(seed, sizeof(seed), false);
+    }
+    for (UInt32 event = 0; event < countof(sEvents); event++){
+        for (UInt32 pick = 0; pick < 4; pick++){
+            UInt8 eventSeed[] = { kStepExecuteEvent, (UInt8)event, (UInt8)pick, 0xFF, 0x01, 0x00, 0x00,
+                                  kStepRequestEvent, (UInt8)event };
+            addToCorpus(eventSeed, sizeof(eventSeed), false);
+        }
+    }
+}
+
+
+static void loadCorpus(const char *directory){
+    UInt8   buffer[kMaxInput];
+    char    path[1024];
+    size_t  size;
+    DIR     *dir = opendir(directory);
+    struct dirent *entry;
+
+    if (!dir) return;
+    while ((entry = readdir(dir)) != NULL){
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (readFile(path, buffer, &size))
+            addToCorpus(buffer, size, false);
+    }
+    closedir(dir);
+}
+
+
+#pragma mark Mutation
+
+static UInt32 sSeed = 1;
+
+static UInt32 random32(void){
+
+    sSeed ^= sSeed << 13;
+    sSeed ^= sSeed >> 17;
+    sSeed ^= sSeed << 5;
+    return sSeed;
+}
+
+
+// A few random edits of a corpus entry, now and then spliced with another.
+static size_t mutate(UInt8 *data, size_t size){
+    UInt32  edits = 1 + (random32() % 4);
+
+    for (UInt32 i = 0; i < edits; i++){
+        size_t  at = size ? random32() % size : 0;
+        UInt32  length = 1 + (random32() % 16);
+
+        switch (size ? random32() % 8 : 4){
+            case 0:
+                data[at] ^= (UInt8)(1 << (random32() & 7));
+                break;
+            case 1:
+                data[at] = (UInt8)random32();
+                break;
+            case 2:
+                data[at] = (UInt8)((const UInt8[]){ 0, 1, 0x7F, 0x80, 0xFF })[random32() % 5];
+                break;
+            case 3:
+                if (size >= 4){
+                    UInt32 value = sInteresting[random32() % countof(sInteresting)];
+                    at = random32() % (size - 3);
+                    memcpy(data + at, &value, 4);
+                }
+                break;
+            case 4:
+                if (size + length > kMaxInput) length = (UInt32)(kMaxInput - size);
+                memmove(data + at + length, data + at, size - at);
+                for (UInt32 j = 0; j < length; j++)
+                    data[at + j] = (UInt8)random32();
+                size += length;
+                break;
+            case 5:
+                if (length > size - at) length = (UInt32)(size - at);
+                memmove(data + at, data + at + length, size - at - length);
+                size -= length;
+                break;
+            case 6:
+                if (size > 1){
+                    size_t from = random32() % size;
+                    if (length > size - from) length = (UInt32)(size - from);
+                    if (length > size - at) length = (UInt32)(size - at);
+                    memmove(data + at, data + from, length);
+                }
+                break;
+            default:{
+                Entry   *other = &sCorpus[random32() % sCorpusCount];
+                size_t  from = other->size ? random32() % other->size : 0;
+                size_t  tail = other->size - from;
+
+                if (at + tail > kMaxInput) tail = kMaxInput - at;
+                memcpy(data + at, other->data + from, tail);
+                size = at + tail;
+                break;
+            }
+        }
+    }
+    return size;
+}
+
+
+#pragma mark Failures
+
+static void deathCallback(void){
+    char    path[1024];
+
+    if (sCurrent){
+        writeInput(sOutput, "crash-", sCurrent, sCurrentSize, path, sizeof(path));
+        if (write(STDERR_FILENO, "crashing input saved as ", 24) < 0 || write(STDERR_FILENO, path, strlen(path)) < 0 ||
+            write(STDERR_FILENO, "\n", 1) < 0) {}
+    }
+}
+
+
+static void timeoutHandler(int signal){
+    char    path[1024];
+
+    if (write(STDERR_FILENO, "input timed out\n", 16) < 0) {}
+    if (sCurrent)
+        writeInput(sOutput, "timeout-", sCurrent, sCurrentSize, path, sizeof(path));
+    _exit(1);
+}
+
+
+// Run one input with the alarm set, saving it if it fails or is slow.
+static bool runSaved(const UInt8 *data, size_t size, UInt32 *slow){
+    char    path[1024];
+    bool    passed;
+
+    sCurrent = data;
+    sCurrentSize = size;
+    alarm(kTimeoutSeconds);
+    passed = runInput(data, size);
+    alarm(0);
+    sCurrent = NULL;
+
+    if (!passed){
+        writeInput(sOutput, "failure-", data, size, path, sizeof(path));
+        fprintf(stderr, "    %s\n    input saved as %s\n", sWhy, path);
+    } else if (sSlow[0]){
+        writeInput(sOutput, "slow-", data, size, path, sizeof(path));
+        if (sVerbose || (*slow < 10))
+            fprintf(stderr, "    slow: %s, saved as %s\n", sSlow, path);
+        (*slow)++;
+    }
+    return passed;
+}
+
+
+#pragma mark main
+
+int main(int argc, char *argv[]){
+    UInt32  seconds = 60;
+    UInt32  slow = 0;
+    int     option;
+
+    while ((option = getopt(argc, argv, "s:r:c:o:v")) != -1){
+        switch (option){
+            case 's':   seconds = (UInt32)strtoul(optarg, NULL, 0);                 break;
+            case 'r':   sSeed = (UInt32)strtoul(optarg, NULL, 0) | 1;               break;
+            case 'c':   sCorpusDirectory = optarg;                                  break;
+            case 'o':   sOutput = optarg;                                           break;
+            case 'v':   sVerbose = true;                                            break;
+            default:
+                fprintf(stderr, "usage: %s [-s seconds] [-r seed] [-c corpus] [-o dir] [-v] [input ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+#if defined(__SANITIZE_ADDRESS__)
+    __sanitizer_set_death_callback(deathCallback);
+#endif
+    signal(SIGALRM, timeoutHandler);
+
+    if (!openFixture(&sFixture, kOverflowDropNewest)){
+        closeFixture(&sFixture);
+        return 1;
+    }
+
+    // Reproduce: run each input given once.
+    if (optind < argc){
+        UInt8   buffer[kMaxInput];
+        size_t  size;
+        int     failures = 0;
+
+        for (int i = optind; i < argc; i++){
+            if (!readFile(argv[i], buffer, &size)){
+                fprintf(stderr, "    can't read %s\n", argv[i]);
+                failures++;
+                continue;
+            }
+            sCurrent = buffer;
+            sCurrentSize = size;
+            bool passed = runInput(buffer, size);
+            sCurrent = NULL;
+            fprintf(stderr, "%s: %s%s%s\n", argv[i], passed ? "passed" : sWhy,
+                    sSlow[0] ? ", slow: " : "", sSlow);
+            failures += !passed;
+        }
+        closeFixture(&sFixture);
+        return failures ? 1 : 0;
+    }
+
+    addSeeds();
+    if (sCorpusDirectory){
+        mkdir(sCorpusDirectory, 0755);
+        loadCorpus(sCorpusDirectory);
+    }
+
+    // Run the starting corpus once to learn its coverage.
+    UInt32  initial = sCorpusCount;
+    bool    failed = false;
+    double  start = now(), report = start + 5;
+
+    for (UInt32 i = 0; (i < initial) && !failed; i++){
+        failed = !runSaved(sCorpus[i].data, sCorpus[i].size, &slow);
+        collectCoverage();
+    }
+
+    UInt8   input[kMaxInput];
+    UInt64  execs = initial;
+
+    while (!failed && (now() - start < seconds)){
+        Entry   *parent = &sCorpus[random32() % sCorpusCount];
+        size_t  size;
+
+        memcpy(input, parent->data, parent->size);
+        size = mutate(input, parent->size);
+
+        failed = !runSaved(input, size, &slow);
+        execs++;
+        if (collectCoverage())
+            addToCorpus(input, size, true);
+
+        if (now() > report){
+            fprintf(stderr, "    %4.0f s  %llu execs  %u in corpus  %u edges\n", now() - start,
+                    (unsigned long long)execs, sCorpusCount, countEdges());
+            report += 5;
+        }
+    }
+
+    double  elapsed = now() - start;
+
+    printf("{\"execs\":%llu,\"execs_per_sec\":%.1f,\"corpus\":%u,\"edges\":%u,\"slow\":%u,\"failed\":%s}\n",
+           (unsigned long long)execs, execs / elapsed, sCorpusCount, countEdges(), slow, failed ? "true" : "false");
+    fprintf(stderr, failed ? "fuzzing stopped at a failure\n" : "no failures in %llu inputs\n", (unsigned long long)execs);
+
+    closeFixture(&sFixture);
+    return failed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,1914 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Drives VirtualSerialPort and VSPUserClient from ordinary threads: one side plays the tty, calling
+//  the IOSerialDriverSync methods the way IOSerialFamily would, the other plays VSPTester through the
+//  user client's selectors. Every byte is checked, and the data tests print their throughput.
+//
+//    vsp-host-test [-m MiB] [-v] [test ...]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VSPFixture.h"
+
+
+static UInt64   sStreamBytes = 16 * 1024 * 1024;
+static int      sFailures;
+
+#define CHECK(condition, ...)                                                   \
+    do {                                                                        \
+        if (!(condition)){                                                      \
+            fprintf(stderr, "    %s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            fprintf(stderr, __VA_ARGS__);                                       \
+            fprintf(stderr, "\n");                                              \
+            sFailures++;                                                        \
+        }                                                                       \
+    } while (0)
+
+
+#pragma mark Notifications
+
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    UInt32          counts[kCreditID + 1];
+    UInt64          creditLimit;
+    UInt64          creditSent;
+}Messages;
+
+static Messages sMessages = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, 0 };
+
+
+static void messageHandler(mach_msg_header_t *msg, mach_msg_size_t size, void *context){
+
+    pthread_mutex_lock(&sMessages.lock);
+    if ((msg->msgh_id >= 0) && (msg->msgh_id <= kCreditID))
+        sMessages.counts[msg->msgh_id]++;
+    if (msg->msgh_id == kCreditID){
+        sMessages.creditLimit = ((CreditNotification*)msg)->Limit;
+        sMessages.creditSent = ((CreditNotification*)msg)->Sent;
+    }
+    pthread_cond_broadcast(&sMessages.cond);
+    pthread_mutex_unlock(&sMessages.lock);
+
+    if (msg->msgh_id == kRingWakeupID)
+        ringWakeupArrived((RingWakeupNotification*)msg);
+}
+
+
+static UInt32 messageCount(int id){
+    UInt32  count;
+
+    pthread_mutex_lock(&sMessages.lock);
+    count = sMessages.counts[id];
+    pthread_mutex_unlock(&sMessages.lock);
+    return count;
+}
+
+
+#pragma mark tty Side
+
+typedef struct{
+    Fixture     *fixture;
+    UInt64      total;
+    UInt64      received;
+    bool        ok;
+}Reader;
+
+
+// Read everything the client sends, sleeping in watchState while the RX queue is empty.
+static void* ttyReader(void *context){
+    Reader      *reader = (Reader*)context;
+    Fixture     *f = reader->fixture;
+    UInt8       buffer[1024];
+    UInt32      count, state;
+    IOReturn    result;
+
+    reader->ok = true;
+    while (reader->received < reader->total){
+        result = f->port->dequeueData(buffer, sizeof(buffer), &count, 0, f->refCon);
+        if (result != kIOReturnSuccess){
+            fprintf(stderr, "    dequeueData returned 0x%x\n", result);
+            reader->ok = false;
+            break;
+        }
+
+        if (count){
+            if (!checkPattern(buffer, reader->received, count)){
+                reader->ok = false;
+                break;
+            }
+            reader->received += count;
+            continue;
+        }
+
+        state = 0;
+        result = f->port->watchState(&state, PD_S_RXQ_EMPTY, f->refCon);
+        if (result != kIOReturnSuccess){
+            fprintf(stderr, "    watchState returned 0x%x\n", result);
+            reader->ok = false;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+typedef struct{
+    Fixture     *fixture;
+    UInt64      total;
+    UInt64      sent;
+    IOReturn    result;
+}Writer;
+
+
+// Write the pattern from the tty side in odd sized pieces, sleeping in enqueueData when the TX queue is full.
+static void* ttyWriter(void *context){
+    Writer      *writer = (Writer*)context;
+    Fixture     *f = writer->fixture;
+    UInt8       buffer[3001];
+    UInt32      size, count;
+
+    writer->result = kIOReturnSuccess;
+    while (writer->sent < writer->total){
+        size = (UInt32)((writer->total - writer->sent < sizeof(buffer)) ? writer->total - writer->sent : sizeof(buffer));
+        fillPattern(buffer, writer->sent, size);
+
+        writer->result = f->port->enqueueData(buffer, size, &count, true, f->refCon);
+        writer->sent += count;
+        if (writer->result != kIOReturnSuccess)
+            break;
+    }
+
+    return NULL;
+}
+
+
+#pragma mark Client Side
+
+typedef struct{
+    Fixture     *fixture;
+    UInt32      mode;
+    UInt64      total;
+    UInt64      sent;
+    IOReturn    result;
+}Sender;
+
+
+// Send the pattern through kSendBuffer in sizes from a few bytes to a few pages.
+static void* clientSender(void *context){
+    Sender      *sender = (Sender*)context;
+    UInt8       *buffer = (UInt8*)malloc(16 * 1024);
+    UInt32      size, accepted;
+    UInt32      seed = 1;
+
+    sender->result = kIOReturnSuccess;
+    while (sender->sent < sender->total){
+        seed = (seed * 1103515245) + 12345;
+        size = 1 + ((seed >> 8) % (16 * 1024));
+        if (size > sender->total - sender->sent)
+            size = (UInt32)(sender->total - sender->sent);
+        fillPattern(buffer, sender->sent, size);
+
+        sender->result = sendBuffer(sender->fixture, sender->mode, buffer, size, &accepted);
+        sender->sent += accepted;
+        if ((sender->result != kIOReturnSuccess) || (accepted != size))
+            break;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+#pragma mark Tests
+
+static void report(const char *name, UInt64 bytes, double seconds){
+
+    if (bytes)
+        printf("  %-28s %6.1f MiB  %8.1f MiB/s\n", name, bytes / 1048576.0, (bytes / 1048576.0) / seconds);
+    else
+        printf("  %-28s\n", name);
+}
+
+
+// Client to tty with kSendBlocking, or with kSendNormal under kOverflowBlock.
+static void streamToTTY(const char *name, UInt32 mode, UInt32 policy){
+    Fixture     f;
+    Reader      reader = { &f, sStreamBytes, 0, false };
+    Sender      sender = { &f, mode, sStreamBytes, 0, kIOReturnSuccess };
+    pthread_t   readThread, sendThread;
+
+    if (!openFixture(&f, policy)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    double start = now();
+    pthread_create(&readThread, NULL, ttyReader, &reader);
+    pthread_create(&sendThread, NULL, clientSender, &sender);
+    pthread_join(sendThread, NULL);
+    pthread_join(readThread, NULL);
+    double elapsed = now() - start;
+
+    CHECK(sender.result == kIOReturnSuccess, "send returned 0x%x", sender.result);
+    CHECK(sender.sent == sStreamBytes, "sent %llu bytes", (unsigned long long)sender.sent);
+    CHECK(reader.ok && (reader.received == sStreamBytes), "received %llu bytes", (unsigned long long)reader.received);
+    CHECK(f.port->fPort.RXStats.OverRunCount == 0, "%llu bytes overrun", (unsigned long long)f.port->fPort.RXStats.OverRunCount);
+
+    closeFixture(&f);
+    report(name, sStreamBytes, elapsed);
+}
+
+
+static void testStreamBlocking(void){
+
+    streamToTTY("stream kSendBlocking", kSendBlocking, kOverflowDropNewest);
+}
+
+
+static void testStreamPolicyBlock(void){
+
+    streamToTTY("stream kOverflowBlock", kSendNormal, kOverflowBlock);
+}
+
+
+// Client to tty with up to kMaxPendingSends async sends in flight.
+static void testStreamAsync(void){
+    Fixture             f;
+    Reader              reader = { &f, sStreamBytes, 0, false };
+    Completion          completion;
+    OSAsyncReference64  reference;
+    pthread_t           readThread;
+    UInt8               *buffers[kMaxPendingSends];
+    UInt32              size = 32 * 1024;
+    UInt32              accepted;
+    UInt64              sent = 0;
+    UInt32              next = 0;
+
+    initCompletion(&completion);
+    makeReference(reference, &completion);
+    for (UInt32 i = 0; i < kMaxPendingSends; i++)
+        buffers[i] = (UInt8*)malloc(size);
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    double start = now();
+    pthread_create(&readThread, NULL, ttyReader, &reader);
+    while (sent < sStreamBytes){
+        UInt32 chunk = (sStreamBytes - sent < size) ? (UInt32)(sStreamBytes - sent) : size;
+
+        // Each buffer is reused only after every send posted before it has completed.
+        pthread_mutex_lock(&completion.lock);
+        while (completion.outstanding == kMaxPendingSends)
+            pthread_cond_wait(&completion.cond, &completion.lock);
+        completion.outstanding++;
+        pthread_mutex_unlock(&completion.lock);
+
+        fillPattern(buffers[next], sent, chunk);
+        IOReturn result = sendBuffer(&f, kSendAsync, buffers[next], chunk, &accepted, reference);
+        if (result != kIOReturnSuccess){
+            CHECK(result == kIOReturnSuccess, "async send returned 0x%x", result);
+            pthread_mutex_lock(&completion.lock);
+            completion.outstanding--;
+            pthread_mutex_unlock(&completion.lock);
+            break;
+        }
+        sent += chunk;
+        next = (next + 1) % kMaxPendingSends;
+    }
+
+    pthread_mutex_lock(&completion.lock);
+    while (completion.outstanding)
+        pthread_cond_wait(&completion.cond, &completion.lock);
+    pthread_mutex_unlock(&completion.lock);
+    pthread_join(readThread, NULL);
+    double elapsed = now() - start;
+
+    CHECK(completion.result == kIOReturnSuccess, "a send completed with 0x%x", completion.result);
+    CHECK(completion.completedBytes == sStreamBytes, "completions covered %llu bytes", (unsigned long long)completion.completedBytes);
+    CHECK(reader.ok && (reader.received == sStreamBytes), "received %llu bytes", (unsigned long long)reader.received);
+
+    closeFixture(&f);
+    for (UInt32 i = 0; i < kMaxPendingSends; i++)
+        free(buffers[i]);
+    report("stream kSendAsync", sStreamBytes, elapsed);
+}
+
+
+// tty to client, the client reading with kReadAsync.
+static void testStreamFromTTY(void){
+    Fixture             f;
+    Writer              writer = { &f, sStreamBytes, 0, kIOReturnSuccess };
+    Completion          completion;
+    OSAsyncReference64  reference;
+    pthread_t           writeThread;
+    UInt32              size = 16 * 1024;
+    UInt8               *buffer = (UInt8*)malloc(size);
+    UInt64              received = 0;
+    bool                ok = true;
+
+    initCompletion(&completion);
+    makeReference(reference, &completion);
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        free(buffer);
+        return;
+    }
+
+    double start = now();
+    pthread_create(&writeThread, NULL, ttyWriter, &writer);
+    while (ok && (received < sStreamBytes)){
+        uint64_t input[4] = { (uint64_t)(uintptr_t)buffer, size, 1, 1000 };
+
+        pthread_mutex_lock(&completion.lock);
+        completion.outstanding++;
+        pthread_mutex_unlock(&completion.lock);
+
+        IOReturn result = HostCallMethod(f.client, kReadAsync, input, 4, NULL, 0, NULL, NULL, NULL, NULL, reference);
+        CHECK(result == kIOReturnSuccess, "kReadAsync returned 0x%x", result);
+        if (result != kIOReturnSuccess) break;
+
+        pthread_mutex_lock(&completion.lock);
+        while (completion.outstanding)
+            pthread_cond_wait(&completion.cond, &completion.lock);
+        pthread_mutex_unlock(&completion.lock);
+
+        CHECK(completion.result == kIOReturnSuccess, "read completed with 0x%x", completion.result);
+        ok = (completion.result == kIOReturnSuccess) && checkPattern(buffer, received, completion.count);
+        received += completion.count;
+    }
+    pthread_join(writeThread, NULL);
+    double elapsed = now() - start;
+
+    CHECK(writer.result == kIOReturnSuccess, "enqueueData returned 0x%x", writer.result);
+    CHECK(ok && (received == sStreamBytes), "received %llu bytes", (unsigned long long)received);
+
+    closeFixture(&f);
+    free(buffer);
+    report("stream kReadAsync", sStreamBytes, elapsed);
+}
+
+
+// Credit tracks free RX space exactly and comes back once the tty drains past low water, or empties the
+// queue when low water is 0.
+static void testCredits(void){
+    Fixture             f;
+    UInt8               buffer[kMaxCirBufferSize + 1];
+    UInt8               drained[kMaxCirBufferSize];
+    uint64_t            output[2];
+    UInt32              outputCount = 2;
+    UInt32              accepted, count;
+    UInt64              completed;
+    Completion          sends;
+    OSAsyncReference64  reference;
+
+    initCompletion(&sends);
+    makeReference(reference, &sends);
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    HostCallMethod(f.client, kGetCredits, NULL, 0, NULL, 0, output, &outputCount, NULL, NULL);
+    UInt64 credit = output[0] - output[1];
+    CHECK(credit == kMaxCirBufferSize, "initial credit %llu", (unsigned long long)credit);
+
+    fillPattern(buffer, 0, sizeof(buffer));
+    sendBuffer(&f, kSendNormal, buffer, (UInt32)credit, &accepted);
+    CHECK(accepted == credit, "only %u of %llu bytes accepted within credit", accepted, (unsigned long long)credit);
+    sendBuffer(&f, kSendNormal, buffer, 1, &accepted);
+    CHECK(accepted == 0, "a byte beyond the credit was accepted");
+
+    UInt32 credits = messageCount(kCreditID);
+    f.port->dequeueData(buffer, 3000, &count, 0, f.refCon);
+    CHECK(count == 3000, "dequeued %u bytes", count);
+    CHECK(checkPattern(buffer, 0, count), "wrong data");
+    CHECK(messageCount(kCreditID) == credits + 1, "no credit notification at the low water crossing");
+    CHECK(sMessages.creditLimit - sMessages.creditSent == 3000, "notified credit %llu",
+          (unsigned long long)(sMessages.creditLimit - sMessages.creditSent));
+
+    // With low water at 0 credit comes back once the tty empties the queue, and an async send goes on as
+    // soon as the tty makes any room at all.
+    CHECK(f.port->executeEvent(PD_E_RXQ_LOW_WATER, 0, f.refCon) == kIOReturnSuccess, "PD_E_RXQ_LOW_WATER 0 refused");
+    sends.outstanding = 1;
+    CHECK(sendBuffer(&f, kSendAsync, buffer, kMaxCirBufferSize, &accepted, reference) == kIOReturnSuccess,
+          "async send failed");
+    CHECK(accepted == 3000, "async send queued %u bytes at once", accepted);
+    f.port->dequeueData(drained, 1000, &count, 0, f.refCon);
+    for (int i = 0; (i < 1000) && !(f.port->getState(f.refCon) & PD_S_RXQ_FULL); i++)
+        sleepMilliseconds(1);
+    CHECK(f.port->getState(f.refCon) & PD_S_RXQ_FULL, "the async send didn't go on when the tty made room");
+
+    credits = messageCount(kCreditID);
+    for (int i = 0; (i < 1000) && __atomic_load_n(&sends.outstanding, __ATOMIC_ACQUIRE); i++){
+        f.port->dequeueData(drained, sizeof(drained), &count, 0, f.refCon);
+        sleepMilliseconds(1);
+    }
+    do {
+        f.port->dequeueData(drained, sizeof(drained), &count, 0, f.refCon);
+    } while (count);
+    completed = __atomic_load_n(&sends.completedBytes, __ATOMIC_ACQUIRE);
+    CHECK((__atomic_load_n(&sends.outstanding, __ATOMIC_ACQUIRE) == 0) && (completed == kMaxCirBufferSize),
+          "async send of %u bytes completed %llu", kMaxCirBufferSize, (unsigned long long)completed);
+    CHECK(messageCount(kCreditID) > credits, "no credit notification when the queue emptied");
+    CHECK(sMessages.creditLimit - sMessages.creditSent == kMaxCirBufferSize, "notified credit %llu at empty",
+          (unsigned long long)(sMessages.creditLimit - sMessages.creditSent));
+
+    closeFixture(&f);
+    report("credits", 0, 0);
+}
+
+
+// kOverflowDropOldest keeps the newest bytes and reports the loss through dequeueEvent.
+static void testDropOldest(void){
+    Fixture     f;
+    UInt8       buffer[kMaxCirBufferSize + 1000];
+    UInt32      accepted, count, event = 0, data = 0;
+
+    if (!openFixture(&f, kOverflowDropOldest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    fillPattern(buffer, 0, sizeof(buffer));
+    sendBuffer(&f, kSendNormal, buffer, sizeof(buffer), &accepted);
+    CHECK(accepted == sizeof(buffer), "%u bytes accepted", accepted);
+    CHECK(f.port->getState(f.refCon) & PD_S_RX_EVENT, "PD_S_RX_EVENT not set");
+
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK(event == PD_E_SW_OVERRUN_ERROR, "event 0x%x", event);
+    CHECK(data == 1000, "%u bytes reported lost", data);
+
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK(count == kMaxCirBufferSize, "dequeued %u bytes", count);
+    CHECK(checkPattern(buffer, 1000, count), "wrong bytes kept");
+
+    closeFixture(&f);
+    report("drop oldest", 0, 0);
+}
+
+
+// A framed RX queue gives the tty whole frames, one per dequeueData, and drops whole frames.
+static void testFraming(void){
+    Fixture     f;
+    UInt8       buffer[5000];
+    UInt8       frame[302];
+    UInt32      accepted, count, available, event = 0, data = 0;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    CHECK(setFraming(&f, kFramingDelimiter, 0x100, 0) == kIOReturnBadArgument, "delimiter 0x100 accepted");
+    CHECK(setFraming(&f, kFramingLengthPrefix, 3, 0) == kIOReturnBadArgument, "3 byte prefix accepted");
+    CHECK(setFraming(&f, kFramingDelimiter, '\n', 0) == kIOReturnSuccess, "delimiter framing refused");
+
+    // Half a frame is invisible to the tty, and a small buffer takes a frame in pieces.
+    sendBuffer(&f, kSendNormal, (const UInt8*)"ab\ncd", 5, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 3) && !memcmp(buffer, "ab\n", 3), "first frame %u bytes", count);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    f.port->requestEvent(PD_E_RXQ_AVAILABLE, &available, f.refCon);
+    CHECK((count == 0) && (available == 0), "part of a frame readable, %u bytes, %u available", count, available);
+    CHECK(f.port->getState(f.refCon) & PD_S_RXQ_EMPTY, "PD_S_RXQ_EMPTY clear with only part of a frame");
+    sendBuffer(&f, kSendNormal, (const UInt8*)"e\nf", 3, &accepted);
+    CHECK(!(f.port->getState(f.refCon) & PD_S_RXQ_EMPTY), "PD_S_RXQ_EMPTY set with a whole frame");
+    f.port->dequeueData(buffer, 2, &count, 0, f.refCon);
+    CHECK((count == 2) && !memcmp(buffer, "cd", 2), "first piece %u bytes", count);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 2) && !memcmp(buffer, "e\n", 2), "second piece %u bytes", count);
+    CHECK(setFraming(&f, kFramingLengthPrefix, 2, 0) == kIOReturnBusy, "framing changed with data queued");
+
+    // A length prefixed frame sent in pieces, with the start of the next one behind it.
+    f.port->releasePort(f.refCon);
+    f.port->acquirePort(false, f.refCon);
+    f.port->executeEvent(PD_E_ACTIVE, true, f.refCon);
+    CHECK(setFraming(&f, kFramingLengthPrefix, 2, 0) == kIOReturnSuccess, "length framing refused");
+    frame[0] = 300 >> 8;
+    frame[1] = 300 & 0xFF;
+    fillPattern(frame + 2, 0, 300);
+    sendBuffer(&f, kSendNormal, frame, 1, &accepted);
+    sendBuffer(&f, kSendNormal, frame + 1, 150, &accepted);
+    sendBuffer(&f, kSendNormal, frame + 151, 151, &accepted);
+    sendBuffer(&f, kSendNormal, frame, 10, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 302) && !memcmp(buffer, frame, 302), "length prefixed frame %u bytes", count);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK(count == 0, "%u bytes of an incomplete frame", count);
+
+    // Dropping the oldest data drops the oldest whole frames.
+    f.port->releasePort(f.refCon);
+    f.port->acquirePort(false, f.refCon);
+    f.port->executeEvent(PD_E_ACTIVE, true, f.refCon);
+    callScalar(&f, kSetOverflowPolicy, kOverflowDropOldest);
+    CHECK(setFraming(&f, kFramingFixed, 0, 1000) == kIOReturnSuccess, "fixed framing refused");
+    fillPattern(buffer, 0, sizeof(buffer));
+    sendBuffer(&f, kSendNormal, buffer, sizeof(buffer), &accepted);
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK((event == PD_E_SW_OVERRUN_ERROR) && (data == 1000), "event 0x%x, %u bytes reported lost", event, data);
+    for (UInt64 offset = 1000; offset < sizeof(buffer); offset += 1000){
+        f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+        CHECK((count == 1000) && checkPattern(buffer, offset, count), "frame at %llu: %u bytes", (unsigned long long)offset, count);
+    }
+
+    closeFixture(&f);
+    report("framing", 0, 0);
+}
+
+
+typedef struct{
+    Fixture     *fixture;
+    UInt32      event;
+    UInt32      data;
+    IOReturn    result;
+}Waiter;
+
+
+static void* eventWaiter(void *context){
+    Waiter  *waiter = (Waiter*)context;
+
+    waiter->result = waiter->fixture->port->dequeueEvent(&waiter->event, &waiter->data, true, waiter->fixture->refCon);
+    return NULL;
+}
+
+
+// Events arrive in band: the tty reads up to an event, takes it, then reads on. The tty's own events
+// wait for the client to read what the tty wrote before them.
+static void testEvents(void){
+    Fixture             f;
+    Waiter              waiter = { &f, 0, 0, kIOReturnSuccess };
+    Completion          reads;
+    OSAsyncReference64  reference;
+    pthread_t           waitThread;
+    UInt8               buffer[64];
+    UInt32              accepted, count, event = 0, data = 0;
+
+    initCompletion(&reads);
+    makeReference(reference, &reads);
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    CHECK(callScalar(&f, kSendEvent, PD_E_ACTIVE, 0, 2) == kIOReturnBadArgument, "PD_E_ACTIVE sent");
+    CHECK(callScalar(&f, kSendEvent, PD_E_PARITY_BYTE, 0x100, 2) == kIOReturnBadArgument, "parity byte 0x100 sent");
+
+    sendBuffer(&f, kSendNormal, (const UInt8*)"abc", 3, &accepted);
+    CHECK(callScalar(&f, kSendEvent, PD_E_PARITY_BYTE, 'd', 2) == kIOReturnSuccess, "kSendEvent failed");
+    sendBuffer(&f, kSendNormal, (const UInt8*)"efgh", 4, &accepted);
+    CHECK(!(f.port->getState(f.refCon) & PD_S_RX_EVENT), "PD_S_RX_EVENT set before the data ahead of the event was read");
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK(event == PD_E_EOQ, "event 0x%x ahead of its data", event);
+
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 3) && !memcmp(buffer, "abc", 3), "read %u bytes up to the event", count);
+    CHECK(f.port->getState(f.refCon) & PD_S_RX_EVENT, "PD_S_RX_EVENT not set");
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK((event == PD_E_PARITY_BYTE) && (data == 'd'), "event 0x%x, data %u", event, data);
+    CHECK(!(f.port->getState(f.refCon) & PD_S_RX_EVENT), "PD_S_RX_EVENT still set");
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 4) && !memcmp(buffer, "efgh", 4), "read %u bytes after the event", count);
+
+    // A sleeping dequeueEvent wakes for the next event.
+    pthread_create(&waitThread, NULL, eventWaiter, &waiter);
+    sleepMilliseconds(20);
+    callScalar(&f, kSendEvent, PD_RS232_E_LINE_BREAK, 1, 2);
+    pthread_join(waitThread, NULL);
+    CHECK((waiter.result == kIOReturnSuccess) && (waiter.event == PD_RS232_E_LINE_BREAK),
+          "woke with 0x%x, event 0x%x", waiter.result, waiter.event);
+
+    // The tty's line break waits behind its data.
+    f.port->enqueueData((UInt8*)"wxyz", 4, &count, false, f.refCon);
+    CHECK(f.port->enqueueEvent(PD_RS232_E_LINE_BREAK, true, false, f.refCon) == kIOReturnSuccess, "enqueueEvent failed");
+    CHECK(!(f.port->getState(f.refCon) & PD_RS232_S_BRK), "break ran ahead of the data");
+
+    uint64_t input[4] = { (uint64_t)(uintptr_t)buffer, sizeof(buffer), 4, 1000 };
+    reads.outstanding = 1;
+    HostCallMethod(f.client, kReadAsync, input, 4, NULL, 0, NULL, NULL, NULL, NULL, reference);
+    pthread_mutex_lock(&reads.lock);
+    while (reads.outstanding)
+        pthread_cond_wait(&reads.cond, &reads.lock);
+    pthread_mutex_unlock(&reads.lock);
+    CHECK((reads.count == 4) && !memcmp(buffer, "wxyz", 4), "client read %u bytes", reads.count);
+    CHECK(f.port->getState(f.refCon) & PD_RS232_S_BRK, "break not run once the data was read");
+
+    // With nothing queued ahead of it an event runs straight away.
+    f.port->enqueueEvent(PD_RS232_E_LINE_BREAK, false, false, f.refCon);
+    CHECK(!(f.port->getState(f.refCon) & PD_RS232_S_BRK), "break not cleared");
+
+    closeFixture(&f);
+    report("events", 0, 0);
+}
+
+
+// Bytes cross the line in the tty's format and the client's, with errors reported ahead of the bytes.
+static void testLineCoding(void){
+    Fixture     f;
+    UInt8       buffer[1000];
+    UInt8       wire[1000];
+    UInt32      accepted, count, event = 0, data = 0;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    CHECK(callScalar(&f, kSetLineFormat, 9, 0, 2) == kIOReturnBadArgument, "9 data bits accepted");
+    CHECK(callScalar(&f, kSetLineFormat, 0, PD_RS232_PARITY_ANY, 2) == kIOReturnBadArgument, "PD_RS232_PARITY_ANY accepted");
+
+    // 8N1 passes every byte through.
+    for (UInt32 i = 0; i < 256; i++)
+        wire[i] = (UInt8)i;
+    sendBuffer(&f, kSendNormal, wire, 256, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 256) && !memcmp(buffer, wire, 256), "8N1 changed the data, %u bytes", count);
+
+    // 7 data bits at both ends, both ways.
+    f.port->executeEvent(PD_E_DATA_SIZE, 7 << 1, f.refCon);
+    fillPattern(wire, 0, sizeof(wire));
+    sendBuffer(&f, kSendNormal, wire, sizeof(wire), &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    bool masked = (count == sizeof(wire));
+    for (UInt32 i = 0; masked && (i < count); i++)
+        masked = (buffer[i] == (wire[i] & 0x7F));
+    CHECK(masked, "7 bit data to the tty, %u bytes", count);
+    f.port->enqueueData(wire, 13, &count, false, f.refCon);
+    f.port->receiveData(buffer, sizeof(buffer), &count);
+    masked = (count == 13);
+    for (UInt32 i = 0; masked && (i < count); i++)
+        masked = (buffer[i] == (wire[i] & 0x7F));
+    CHECK(masked, "7 bit data to the client, %u bytes", count);
+
+    // 7E1 read from 7O1 gets every parity bit wrong.
+    f.port->executeEvent(PD_E_DATA_INTEGRITY, PD_RS232_PARITY_EVEN, f.refCon);
+    callScalar(&f, kSetLineFormat, 0, PD_RS232_PARITY_ODD, 2);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"ab", 2, &accepted);
+    CHECK(f.port->getState(f.refCon) & PD_S_RX_EVENT, "PD_S_RX_EVENT not set");
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK((event == PD_E_PARITY_ERROR) && (data == 'a'), "event 0x%x, data 0x%x", event, data);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 1) && (buffer[0] == 'a'), "%u bytes after the first parity error", count);
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK((event == PD_E_PARITY_ERROR) && (data == 'b'), "event 0x%x, data 0x%x", event, data);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 1) && (buffer[0] == 'b'), "%u bytes after the second parity error", count);
+    CHECK(f.port->fPort.RXParityErrors == 2, "%llu parity errors counted", (unsigned long long)f.port->fPort.RXParityErrors);
+
+    // Unless the tty ignores parity.
+    f.port->executeEvent(PD_E_RX_DATA_INTEGRITY, PD_RS232_PARITY_ANY, f.refCon);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"ab", 2, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 2) && !(f.port->getState(f.refCon) & PD_S_RX_EVENT), "%u bytes with parity ignored", count);
+
+    // 8N1 read as 7N1 takes the top data bit for the stop bit.
+    f.port->executeEvent(PD_E_DATA_INTEGRITY, PD_RS232_PARITY_NONE, f.refCon);
+    callScalar(&f, kSetLineFormat, 8, 0, 2);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"\xC1\x41", 2, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 1) && (buffer[0] == 0x41), "%u bytes ahead of the framing error", count);
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK((event == PD_E_FRAMING_ERROR) && (data == 0x41), "event 0x%x, data 0x%x", event, data);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 1) && (buffer[0] == 0x41), "%u bytes after the framing error", count);
+    CHECK(f.port->fPort.RXFramingErrors == 1, "%llu framing errors counted", (unsigned long long)f.port->fPort.RXFramingErrors);
+
+    closeFixture(&f);
+    report("line coding", 0, 0);
+}
+
+
+#define kFaultBytes     (64 * 1024)
+
+// Restart the faults and stream the pattern through them, reading back everything the tty gets as it goes.
+static UInt32 faultyRun(Fixture *f, const FaultConfig *config, UInt8 *received, UInt32 size, UInt32 *events){
+    UInt8       chunk[4096];
+    UInt32      accepted, count, event, data;
+    UInt32      total = 0;
+
+    setFaults(f, kFaultsToTTY, config);
+    *events = 0;
+    for (UInt32 sent = 0; sent < kFaultBytes; sent += sizeof(chunk)){
+        fillPattern(chunk, sent, sizeof(chunk));
+        sendBuffer(f, kSendNormal, chunk, sizeof(chunk), &accepted);
+        for (;;){
+            f->port->dequeueData(received + total, size - total, &count, 0, f->refCon);
+            total += count;
+            event = PD_E_EOQ;
+            f->port->dequeueEvent(&event, &data, false, f->refCon);
+            if (event != PD_E_EOQ)
+                (*events)++;
+            else if (!count)
+                break;
+        }
+    }
+
+    return total;
+}
+
+
+static void testFaults(void){
+    Fixture     f;
+    FaultConfig config;
+    UInt8       buffer[16];
+    UInt32      size = 2 * kFaultBytes;
+    UInt8       *first = (UInt8*)malloc(size);
+    UInt8       *second = (UInt8*)malloc(size);
+    UInt32      firstSize, secondSize, firstEvents, secondEvents;
+    UInt32      accepted, count, event = 0, data = 0;
+    UInt64      injected;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        free(first);
+        free(second);
+        return;
+    }
+
+    bzero(&config, sizeof(config));
+    config.MaxJitter = kMaxFaultJitter + 1;
+    CHECK(setFaults(&f, kFaultsToTTY, &config) == kIOReturnBadArgument, "MaxJitter over the limit accepted");
+    config.MaxJitter = 0;
+    CHECK(setFaults(&f, kFaultsFromTTY + 1, &config) == kIOReturnBadArgument, "bad direction accepted");
+
+    // The same seed gives the same faults.
+    config.Seed = 42;
+    config.BitErrorInterval = 2000;
+    config.DropInterval = 300;
+    config.DuplicateInterval = 300;
+    config.BurstInterval = 5000;
+    config.BurstLength = 4;
+    firstSize = faultyRun(&f, &config, first, size, &firstEvents);
+    injected = f.port->fPort.RXFaults.Injected;
+    secondSize = faultyRun(&f, &config, second, size, &secondEvents);
+    CHECK((firstSize == secondSize) && !memcmp(first, second, firstSize) && (firstEvents == secondEvents) &&
+          (injected == f.port->fPort.RXFaults.Injected), "runs differ, %u and %u bytes, %u and %u events",
+          firstSize, secondSize, firstEvents, secondEvents);
+    CHECK((injected > 200) && firstEvents, "%llu faults, %u events", (unsigned long long)injected, firstEvents);
+    fillPattern(second, 0, kFaultBytes);
+    CHECK(memcmp(first, second, min(firstSize, kFaultBytes)), "the data came through intact");
+    CHECK(f.port->fPort.RXStats.BytesIn == f.port->fPort.RXStats.BytesOut, "byte counts out of step");
+
+    // An interval of 1 strikes every character.
+    bzero(&config, sizeof(config));
+    config.DropInterval = 1;
+    setFaults(&f, kFaultsToTTY, &config);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"abc", 3, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((accepted == 3) && (count == 0) && (f.port->fPort.RXStats.BytesIn == f.port->fPort.RXStats.BytesOut),
+          "%u of 3 dropped bytes accepted, %u read", accepted, count);
+
+    bzero(&config, sizeof(config));
+    config.DuplicateInterval = 1;
+    setFaults(&f, kFaultsToTTY, &config);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"abc", 3, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 6) && !memcmp(buffer, "aabbcc", 6), "%u bytes with every byte doubled", count);
+
+    bzero(&config, sizeof(config));
+    config.BreakInterval = 1;
+    setFaults(&f, kFaultsToTTY, &config);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"x", 1, &accepted);
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((event == PD_RS232_E_LINE_BREAK) && (count == 1) && (buffer[0] == 'x'), "event 0x%x then %u bytes", event, count);
+
+    // A break the other way turns PD_RS232_S_BRK on and off ahead of the byte, here straight away as
+    // nothing is queued in front of it.
+    setFaults(&f, kFaultsFromTTY, &config);
+    f.port->enqueueData((UInt8*)"yz", 2, &count, false, f.refCon);
+    CHECK(f.port->fPort.TXEvents.Head - f.port->fPort.TXEvents.Tail == 2, "%u TX events queued",
+          f.port->fPort.TXEvents.Head - f.port->fPort.TXEvents.Tail);
+    f.port->receiveData(buffer, sizeof(buffer), &count);
+    f.port->runTXEvents();
+    CHECK((count == 2) && (f.port->fPort.TXEvents.Head == f.port->fPort.TXEvents.Tail) &&
+          !(f.port->getState(f.refCon) & PD_RS232_S_BRK) && (f.port->fPort.TXFaults.Injected == 2),
+          "%u bytes, break events left behind", count);
+
+    // Jitter holds the data back, then lets it all go.
+    bzero(&config, sizeof(config));
+    setFaults(&f, kFaultsFromTTY, &config);
+    config.Seed = 7;
+    config.JitterInterval = 1;
+    config.MaxJitter = 50000;
+    setFaults(&f, kFaultsToTTY, &config);
+    sendBuffer(&f, kSendNormal, (const UInt8*)"abc", 3, &accepted);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 0) && (f.port->getState(f.refCon) & PD_S_RXQ_EMPTY), "%u bytes came through a hold", count);
+    sleepMilliseconds(100);
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK((count == 3) && !memcmp(buffer, "abc", 3), "%u bytes after the hold", count);
+
+    bzero(&config, sizeof(config));
+    setFaults(&f, kFaultsToTTY, &config);
+    CHECK(f.port->fPort.RXLine.Direct && f.port->fPort.TXLine.Direct, "faults still on");
+
+    closeFixture(&f);
+    free(first);
+    free(second);
+    report("faults", 0, 0);
+}
+
+
+typedef struct{
+    Fixture         *fixture;
+    bool            stop;           // Read and written with __atomic builtins
+    UInt32          changes;
+    UInt32          errors;
+}Churn;
+
+
+// Toggle DTR and the baud rate as fast as possible.
+static void* stateToggler(void *context){
+    Churn   *churn = (Churn*)context;
+    Fixture *f = churn->fixture;
+
+    for (UInt32 i = 0; i < 20000; i++){
+        if (f->port->setState((i & 1) ? PD_RS232_S_DTR : 0, PD_RS232_S_DTR, f->refCon) != kIOReturnSuccess)
+            __atomic_add_fetch(&churn->errors, 1, __ATOMIC_RELAXED);
+        if (f->port->executeEvent(PD_E_DATA_RATE, (9600 + (i % 4) * 100) << 1, f->refCon) != kIOReturnSuccess)
+            __atomic_add_fetch(&churn->errors, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+// Wait for DTR to change until the port goes inactive.
+static void* stateWatcher(void *context){
+    Churn       *churn = (Churn*)context;
+    Fixture     *f = churn->fixture;
+    UInt32      state = f->port->getState(f->refCon);
+    IOReturn    result;
+
+    for (;;){
+        state = (state ^ PD_RS232_S_DTR) & PD_RS232_S_DTR;
+        result = f->port->watchState(&state, PD_RS232_S_DTR, f->refCon);
+        if (result != kIOReturnSuccess)
+            break;
+        churn->changes++;
+    }
+
+    return NULL;
+}
+
+
+// Batches of state and event commands from the client at the same time.
+static void* batchRunner(void *context){
+    Churn           *churn = (Churn*)context;
+    Fixture         *f = churn->fixture;
+    BatchCommand    commands[3];
+    BatchResult     results[3];
+    UInt32          pass = 0;
+
+    commands[0].Command = kBatchSetState;
+    commands[0].Arg0 = PD_RS232_S_CTS;
+    commands[1].Command = kBatchRequestEvent;
+    commands[1].Arg0 = PD_E_DATA_RATE;
+    commands[1].Arg1 = 0;
+    commands[2].Command = kBatchGetState;
+    commands[2].Arg0 = 0;
+    commands[2].Arg1 = 0;
+
+    while (!__atomic_load_n(&churn->stop, __ATOMIC_ACQUIRE)){
+        size_t resultSize = sizeof(results);
+
+        commands[0].Arg1 = (pass++ & 1) ? PD_RS232_S_CTS : 0;
+        IOReturn result = HostCallMethod(f->client, kExecuteBatch, NULL, 0, commands, sizeof(commands),
+                                         NULL, NULL, results, &resultSize);
+        if ((result != kIOReturnSuccess) || (resultSize != sizeof(results)) ||
+            (results[0].Result != kIOReturnSuccess) || (results[1].Result != kIOReturnSuccess))
+            __atomic_add_fetch(&churn->errors, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+static void testStateChurn(void){
+    Fixture     f;
+    Churn       churn = { &f, false, 0, 0 };
+    pthread_t   toggleThread, watchThread, batchThread;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    UInt32 deltas = messageCount(kPortDeltaID);
+    double start = now();
+    pthread_create(&watchThread, NULL, stateWatcher, &churn);
+    pthread_create(&batchThread, NULL, batchRunner, &churn);
+    pthread_create(&toggleThread, NULL, stateToggler, &churn);
+    pthread_join(toggleThread, NULL);
+    __atomic_store_n(&churn.stop, true, __ATOMIC_RELEASE);
+    pthread_join(batchThread, NULL);
+
+    // Deactivating the port ends the watcher's wait with kIOReturnIOError.
+    f.port->executeEvent(PD_E_ACTIVE, false, f.refCon);
+    pthread_join(watchThread, NULL);
+    double elapsed = now() - start;
+
+    CHECK(churn.errors == 0, "%u calls failed", churn.errors);
+    CHECK(churn.changes > 0, "watchState never saw DTR change");
+    CHECK(messageCount(kPortDeltaID) > deltas, "no delta notifications");
+
+    closeFixture(&f);
+    printf("  %-28s %6u changes seen  %8.0f toggles/s\n", "state churn", churn.changes, 20000 / elapsed);
+}
+
+
+// Readers of the status page never take fStatusLock, so observers snapshot it while one thread steps the
+// baud rate and XON byte and another flips RTS and DTR together. The config thread stores XON before the
+// baud rate and updateStatus reads the baud rate first, so a consistent page has XON equal to the step
+// of the baud rate or one ahead; a page torn across updates has them further apart. The queues are
+// filled first and left alone, so their levels, counters and State bits must match on every snapshot.
+#define kStatusBaseBaud     9600
+#define kStatusRXBytes      1000
+#define kStatusTXBytes      500
+#define kStatusSteps        20000
+#define kStatusObservers    3
+
+typedef struct{
+    Fixture                 *fixture;
+    const PortStatusPage    *page;
+    bool                    stop;           // Read and written with __atomic builtins
+    UInt32                  snapshots;
+    UInt32                  retries;
+    UInt32                  errors;
+}StatusChurn;
+
+
+// The protocol in Shared.h, counting the passes that had to start again. pause yields between the baud
+// rate and XON loads on the first pass, so the writers get to overtake the copy.
+static void snapshotStatus(const PortStatusPage *page, PortStatusPage *copy, bool pause, UInt32 *retries){
+    const UInt64    *from = page->Values;
+    UInt64          *to = copy->Values;
+    UInt32          count = (sizeof(PortStatusPage) - offsetof(PortStatusPage, Values)) / sizeof(UInt64);
+    UInt32          sequence;
+
+    for (;;){
+        sequence = __atomic_load_n(&page->Sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1){
+            sched_yield();          // The writer may have been preempted mid update
+        } else {
+            for (UInt32 i = 0; i < count; i++){
+                to[i] = __atomic_load_n(&from[i], __ATOMIC_ACQUIRE);
+                if (pause && (i == kPortFieldBaudRate))
+                    sched_yield();
+            }
+            if (__atomic_load_n(&page->Sequence, __ATOMIC_ACQUIRE) == sequence)
+                break;
+        }
+        (*retries)++;
+        pause = false;
+    }
+    copy->Sequence = sequence;
+}
+
+
+static void* statusObserver(void *context){
+    StatusChurn     *churn = (StatusChurn*)context;
+    PortStatusPage  copy;
+    UInt32          last = 0, snapshots = 0, retries = 0, errors = 0;
+
+    while (!__atomic_load_n(&churn->stop, __ATOMIC_ACQUIRE)){
+        snapshotStatus(churn->page, &copy, (snapshots & 255) == 0, &retries);
+        snapshots++;
+
+        UInt64 state = copy.Values[kPortFieldState];
+        UInt64 step = copy.Values[kPortFieldBaudRate] - kStatusBaseBaud;
+        bool consistent = !(copy.Sequence & 1) && (copy.Sequence >= last) && (step <= 0xFF) &&
+                          ((UInt8)(copy.Values[kPortFieldXONchar] - step) <= 1) &&
+                          (!(state & PD_RS232_S_RTS) == !(state & PD_RS232_S_DTR)) &&
+                          (copy.RXUsed == kStatusRXBytes) && (copy.RXBytesIn - copy.RXBytesOut == copy.RXUsed) &&
+                          (copy.TXUsed == kStatusTXBytes) && (copy.TXBytesIn - copy.TXBytesOut == copy.TXUsed) &&
+                          !(state & (PD_S_RXQ_EMPTY | PD_S_TXQ_EMPTY));
+        if (!consistent){
+            if (!errors)
+                fprintf(stderr, "    torn snapshot: sequence %u after %u, baud %llu, XON %llu, state 0x%llx, "
+                        "RX %llu TX %llu\n", copy.Sequence, last,
+                        (unsigned long long)copy.Values[kPortFieldBaudRate],
+                        (unsigned long long)copy.Values[kPortFieldXONchar], (unsigned long long)state,
+                        (unsigned long long)copy.RXUsed, (unsigned long long)copy.TXUsed);
+            errors++;
+        }
+        last = copy.Sequence;
+    }
+
+    __atomic_add_fetch(&churn->snapshots, snapshots, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&churn->retries, retries, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&churn->errors, errors, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+
+static void* statusLineToggler(void *context){
+    StatusChurn *churn = (StatusChurn*)context;
+    Fixture     *f = churn->fixture;
+    UInt32      pass = 0;
+
+    while (!__atomic_load_n(&churn->stop, __ATOMIC_ACQUIRE)){
+        UInt32 lines = (pass++ & 1) ? (PD_RS232_S_RTS | PD_RS232_S_DTR) : 0;
+        if (f->port->setState(lines, PD_RS232_S_RTS | PD_RS232_S_DTR, f->refCon) != kIOReturnSuccess)
+            __atomic_add_fetch(&churn->errors, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+static void testStatusPage(void){
+    Fixture         f;
+    StatusChurn     churn = { &f, NULL, false, 0, 0, 0 };
+    pthread_t       observers[kStatusObservers], toggleThread;
+    UInt8           buffer[kStatusRXBytes];
+    UInt32          accepted = 0, count = 0;
+
+    if (!openFixture(&f, kOverflowDropNewest) || !(churn.page = mapStatusPage(&f))){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    // Start from step 0 with no automatic flow control, which would own RTS, then fill both queues;
+    // nothing reads them.
+    fillPattern(buffer, 0, sizeof(buffer));
+    f.port->executeEvent(PD_E_FLOW_CONTROL, 0, f.refCon);
+    f.port->executeEvent(PD_RS232_E_XON_BYTE, 0, f.refCon);
+    f.port->executeEvent(PD_E_DATA_RATE, kStatusBaseBaud << 1, f.refCon);
+    sendBuffer(&f, kSendNormal, buffer, kStatusRXBytes, &accepted);
+    f.port->enqueueData(buffer, kStatusTXBytes, &count, false, f.refCon);
+    CHECK((accepted == kStatusRXBytes) && (count == kStatusTXBytes), "queued %u and %u bytes", accepted, count);
+
+    double start = now();
+    for (UInt32 i = 0; i < kStatusObservers; i++)
+        pthread_create(&observers[i], NULL, statusObserver, &churn);
+    pthread_create(&toggleThread, NULL, statusLineToggler, &churn);
+
+    for (UInt32 step = 1; step <= kStatusSteps; step++){
+        if ((f.port->executeEvent(PD_RS232_E_XON_BYTE, step & 0xFF, f.refCon) != kIOReturnSuccess) ||
+            (f.port->executeEvent(PD_E_DATA_RATE, (kStatusBaseBaud + (step & 0xFF)) << 1, f.refCon) != kIOReturnSuccess))
+            __atomic_add_fetch(&churn.errors, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&churn.stop, true, __ATOMIC_RELEASE);
+    pthread_join(toggleThread, NULL);
+    for (UInt32 i = 0; i < kStatusObservers; i++)
+        pthread_join(observers[i], NULL);
+    double elapsed = now() - start;
+
+    CHECK(churn.errors == 0, "%u torn snapshots or failed calls", churn.errors);
+    CHECK(churn.snapshots > 0, "no snapshots taken");
+
+    closeFixture(&f);
+    printf("  %-28s %6u snapshots  %6u retries  %8.0f steps/s\n", "status page", churn.snapshots, churn.retries,
+           kStatusSteps / elapsed);
+}
+
+
+// Results come back inline or, for a buffer over 4 KB, through a descriptor; either way the size returned
+// covers the commands run. kBatchSetState only moves the DCE's lines, and only while the tty has the port.
+static void testBatchResults(void){
+    Fixture         f;
+    BatchCommand    commands[kMaxBatchCommands];
+    BatchResult     *results = (BatchResult*)calloc(kMaxBatchCommands * 2, sizeof(BatchResult));
+    size_t          resultSize;
+    IOReturn        result;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        free(results);
+        return;
+    }
+
+    bzero(commands, sizeof(commands));
+    for (UInt32 i = 0; i < kMaxBatchCommands; i++)
+        commands[i].Command = kBatchGetState;
+
+    resultSize = 4 * sizeof(BatchResult);
+    result = HostCallMethod(f.client, kExecuteBatch, NULL, 0, commands, 2 * sizeof(BatchCommand), NULL, NULL, results, &resultSize);
+    CHECK((result == kIOReturnSuccess) && (resultSize == 2 * sizeof(BatchResult)), "inline: 0x%x, %zu bytes", result, resultSize);
+
+    resultSize = kMaxBatchCommands * 2 * sizeof(BatchResult);
+    result = HostCallMethod(f.client, kExecuteBatch, NULL, 0, commands, 2 * sizeof(BatchCommand), NULL, NULL, results, &resultSize);
+    CHECK((result == kIOReturnSuccess) && (resultSize == 2 * sizeof(BatchResult)), "descriptor: 0x%x, %zu bytes", result, resultSize);
+
+    resultSize = kMaxBatchCommands * 2 * sizeof(BatchResult);
+    result = HostCallMethod(f.client, kExecuteBatch, NULL, 0, commands, sizeof(commands), NULL, NULL, results, &resultSize);
+    CHECK((result == kIOReturnSuccess) && (resultSize == sizeof(commands)), "a full batch: 0x%x, %zu bytes", result, resultSize);
+    CHECK((results[kMaxBatchCommands - 1].Command == kBatchGetState) &&
+          (results[kMaxBatchCommands - 1].Value == f.port->getState(f.refCon)), "last result wrong");
+
+    f.port->setState(PD_RS232_S_DTR, PD_RS232_S_DTR, f.refCon);
+    commands[0].Command = kBatchSetState;
+    commands[0].Arg0 = PD_RS232_S_DTR | PD_RS232_S_CTS;
+    commands[0].Arg1 = 0;
+    commands[1].Command = kBatchSetState;
+    commands[1].Arg0 = PD_RS232_S_CTS | PD_RS232_S_DSR | PD_RS232_S_CAR | PD_RS232_S_RNG;
+    commands[1].Arg1 = PD_RS232_S_DSR | PD_RS232_S_CAR;
+    resultSize = 2 * sizeof(BatchResult);
+    HostCallMethod(f.client, kExecuteBatch, NULL, 0, commands, 2 * sizeof(BatchCommand), NULL, NULL, results, &resultSize);
+    CHECK(results[0].Result == kIOReturnBadArgument, "kBatchSetState took DTR, 0x%x", results[0].Result);
+    CHECK(results[1].Result == kIOReturnSuccess, "kBatchSetState of the DCE's lines returned 0x%x", results[1].Result);
+    UInt32 state = f.port->getState(f.refCon);
+    CHECK(state & PD_RS232_S_DTR, "the tty's DTR changed, 0x%x", state);
+    CHECK((state & (PD_RS232_S_CTS | PD_RS232_S_DSR | PD_RS232_S_CAR | PD_RS232_S_RNG)) == (PD_RS232_S_DSR | PD_RS232_S_CAR),
+          "DCE lines 0x%x", state);
+
+    f.port->releasePort(f.refCon);
+    resultSize = sizeof(BatchResult);
+    HostCallMethod(f.client, kExecuteBatch, NULL, 0, &commands[1], sizeof(BatchCommand), NULL, NULL, results, &resultSize);
+    CHECK(results[0].Result == kIOReturnNotOpen, "kBatchSetState on a released port returned 0x%x", results[0].Result);
+
+    closeFixture(&f);
+    free(results);
+    report("batch results", 0, 0);
+}
+
+
+typedef struct{
+    Fixture     *fixture;
+    UInt32      mode;
+    UInt32      sent;
+    IOReturn    result;
+}Blocked;
+
+
+static void* blockedSender(void *context){
+    Blocked     *blocked = (Blocked*)context;
+    UInt8       buffer[kMaxCirBufferSize * 2];
+
+    fillPattern(buffer, 0, sizeof(buffer));
+    blocked->result = sendBuffer(blocked->fixture, blocked->mode, buffer, sizeof(buffer), &blocked->sent);
+    return NULL;
+}
+
+
+// Closing the tty side has to release a blocked sender and complete pending reads and sends.
+static void testCloseReleasesWaiters(void){
+    Fixture             f;
+    Blocked             blocked = { &f, kSendBlocking, 0, kIOReturnSuccess };
+    Completion          reads, sends;
+    OSAsyncReference64  readReference, sendReference;
+    pthread_t           sendThread;
+    UInt8               readBuffer[64];
+    UInt8               sendBuffer_[128];
+    UInt32              accepted;
+
+    initCompletion(&reads);
+    initCompletion(&sends);
+    makeReference(readReference, &reads);
+    makeReference(sendReference, &sends);
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    pthread_create(&sendThread, NULL, blockedSender, &blocked);
+    while (!(f.port->getState(f.refCon) & PD_S_RXQ_FULL))
+        sleepMilliseconds(1);
+
+    // Nothing will arrive from the tty, and the RX queue is full, so both of these stay pending.
+    uint64_t input[4] = { (uint64_t)(uintptr_t)readBuffer, sizeof(readBuffer), 1, 0 };
+    reads.outstanding = 1;
+    CHECK(HostCallMethod(f.client, kReadAsync, input, 4, NULL, 0, NULL, NULL, NULL, NULL, readReference) == kIOReturnSuccess,
+          "kReadAsync failed");
+    sends.outstanding = 1;
+    fillPattern(sendBuffer_, 0, sizeof(sendBuffer_));
+    CHECK(sendBuffer(&f, kSendAsync, sendBuffer_, sizeof(sendBuffer_), &accepted, sendReference) == kIOReturnSuccess,
+          "async send failed");
+
+    sleepMilliseconds(20);
+    CHECK(reads.outstanding == 1, "read completed early");
+    CHECK(sends.outstanding == 1, "send completed early");
+
+    f.port->releasePort(f.refCon);
+    pthread_join(sendThread, NULL);
+
+    CHECK(blocked.result == kIOReturnIOError, "blocked send returned 0x%x", blocked.result);
+    CHECK(blocked.sent == kMaxCirBufferSize, "blocked send queued %u bytes", blocked.sent);
+    CHECK((reads.outstanding == 0) && (reads.result == kIOReturnNotOpen), "read not completed with kIOReturnNotOpen");
+    CHECK((sends.outstanding == 0) && (sends.result == kIOReturnNotOpen), "send not completed with kIOReturnNotOpen");
+
+    closeFixture(&f);
+    report("close releases waiters", 0, 0);
+}
+
+
+// A kOverflowBlock sender counts what it has queued before it sleeps, so an event sent meanwhile goes in
+// behind those bytes and credit doesn't count them as still to come.
+static void testBlockedSenderPosition(void){
+    Fixture     f;
+    Blocked     blocked = { &f, kSendNormal, 0, kIOReturnSuccess };
+    pthread_t   sendThread;
+    UInt8       buffer[kMaxCirBufferSize];
+    uint64_t    output[2];
+    UInt32      outputCount = 2;
+    UInt32      count, event = 0, data = 0;
+
+    if (!openFixture(&f, kOverflowBlock)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    pthread_create(&sendThread, NULL, blockedSender, &blocked);
+    while (!(f.port->getState(f.refCon) & PD_S_RXQ_FULL))
+        sleepMilliseconds(1);
+    sleepMilliseconds(10);
+
+    HostCallMethod(f.client, kGetCredits, NULL, 0, NULL, 0, output, &outputCount, NULL, NULL);
+    CHECK(output[1] == kMaxCirBufferSize, "%llu bytes sent while %u are queued", (unsigned long long)output[1], kMaxCirBufferSize);
+    CHECK(output[0] == output[1], "credit %llu with the queue full", (unsigned long long)(output[0] - output[1]));
+
+    CHECK(callScalar(&f, kSendEvent, PD_E_PARITY_BYTE, 'e', 2) == kIOReturnSuccess, "kSendEvent failed");
+    f.port->dequeueData(buffer, sizeof(buffer), &count, 0, f.refCon);
+    CHECK(count == kMaxCirBufferSize, "read %u bytes ahead of the event", count);
+    f.port->dequeueEvent(&event, &data, false, f.refCon);
+    CHECK((event == PD_E_PARITY_BYTE) && (data == 'e'), "event 0x%x, data %u", event, data);
+
+    f.port->releasePort(f.refCon);
+    pthread_join(sendThread, NULL);
+
+    closeFixture(&f);
+    report("blocked sender position", 0, 0);
+}
+
+
+// The rings are only held while the tty has the port, and come back from the pool on the next open.
+static void testIdleRings(void){
+    Fixture         f;
+    UInt8           buffer[100];
+    uint64_t        output[2];
+    UInt32          outputCount = 2;
+    UInt32          accepted, size = 0;
+    QueuePoolStats  before, after;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    CHECK(f.port->executeEvent(PD_E_RXQ_SIZE, 16384, f.refCon) == kIOReturnSuccess, "PD_E_RXQ_SIZE failed");
+    CHECK(f.port->executeEvent(PD_E_TXQ_SIZE, 5000, f.refCon) == kIOReturnSuccess, "PD_E_TXQ_SIZE failed");
+    f.port->requestEvent(PD_E_TXQ_SIZE, &size, f.refCon);
+    CHECK((size == 8192) && (GetQueueSize(&f.port->fPort.TX) == 8192), "a 5000 byte TX queue became %u", size);
+    fillPattern(buffer, 0, sizeof(buffer));
+    sendBuffer(&f, kSendNormal, buffer, sizeof(buffer), &accepted);
+    CHECK(accepted == sizeof(buffer), "%u bytes accepted", accepted);
+
+    f.port->releasePort(f.refCon);
+    CHECK((GetQueueSize(&f.port->fPort.RX) == 0) && (GetQueueSize(&f.port->fPort.TX) == 0),
+          "an idle port holds %u + %u queue bytes", GetQueueSize(&f.port->fPort.RX), GetQueueSize(&f.port->fPort.TX));
+    CHECK(f.port->fPort.RXStats.BytesIn == f.port->fPort.RXStats.BytesOut, "bytes left in the RX queue were not counted out");
+    sendBuffer(&f, kSendNormal, buffer, sizeof(buffer), &accepted);
+    CHECK(accepted == 0, "%u bytes accepted by a closed port", accepted);
+
+    GetQueuePoolStats(&before);
+    CHECK(f.port->acquirePort(false, f.refCon) == kIOReturnSuccess, "acquirePort failed");
+    GetQueuePoolStats(&after);
+    CHECK(after.Hits > before.Hits, "the rings did not come from the pool");
+    CHECK((GetQueueSize(&f.port->fPort.RX) == kMaxCirBufferSize) && (GetQueueSize(&f.port->fPort.TX) == kMaxCirBufferSize),
+          "queue sizes %u and %u after acquirePort", GetQueueSize(&f.port->fPort.RX), GetQueueSize(&f.port->fPort.TX));
+    HostCallMethod(f.client, kGetCredits, NULL, 0, NULL, 0, output, &outputCount, NULL, NULL);
+    CHECK(output[0] - output[1] == kMaxCirBufferSize, "credit %llu after acquirePort", (unsigned long long)(output[0] - output[1]));
+
+    closeFixture(&f);
+    report("idle rings", 0, 0);
+}
+
+
+// One user space side of a shared ring, see writeRing and readRing.
+typedef struct{
+    Fixture     *fixture;
+    UInt64      total;
+    UInt64      done;
+    UInt32      waits;              // Written with __atomic builtins
+    bool        ok;
+}RingUser;
+
+
+// Fill the RX ring with the pattern in odd sized pieces, waiting whenever it is full.
+static void* ringProducer(void *context){
+    RingUser    *user = (RingUser*)context;
+    UInt8       buffer[5001];
+    UInt32      size, written;
+    UInt32      seed = 1;
+
+    user->ok = true;
+    while (user->done < user->total){
+        seed = (seed * 1103515245) + 12345;
+        size = 1 + ((seed >> 8) % sizeof(buffer));
+        if (size > user->total - user->done)
+            size = (UInt32)(user->total - user->done);
+        fillPattern(buffer, user->done, size);
+
+        written = writeRing(user->fixture, buffer, size);
+        user->done += written;
+        if (written) continue;
+
+        __atomic_add_fetch(&user->waits, 1, __ATOMIC_RELAXED);
+        if (!waitForRing(user->fixture, kSharedRXRing)){
+            fprintf(stderr, "    no room in the RX ring after %llu bytes\n", (unsigned long long)user->done);
+            user->ok = false;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Empty the TX ring, checking the pattern and waiting whenever there is nothing in it.
+static void* ringConsumer(void *context){
+    RingUser    *user = (RingUser*)context;
+    UInt8       buffer[3001];
+    UInt32      size, read;
+
+    user->ok = true;
+    while (user->done < user->total){
+        size = (UInt32)((user->total - user->done < sizeof(buffer)) ? user->total - user->done : sizeof(buffer));
+
+        read = readRing(user->fixture, buffer, size);
+        if (read){
+            if (!checkPattern(buffer, user->done, read)){
+                user->ok = false;
+                break;
+            }
+            user->done += read;
+            continue;
+        }
+
+        __atomic_add_fetch(&user->waits, 1, __ATOMIC_RELAXED);
+        if (!waitForRing(user->fixture, kSharedTXRing)){
+            fprintf(stderr, "    nothing in the TX ring after %llu bytes\n", (unsigned long long)user->done);
+            user->ok = false;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Where the ring indices start, so they wrap past 2^32 early in the stream as well as wrapping the data.
+#define kRingStart  ((UInt32)0 - (5 * kSharedRingSize / 2) + 7)
+
+// Both ways at once through the mapped rings. Each ring user starts before the tty side it talks to, so
+// the RX ring fills and the TX ring sits empty: both have to wait for a kRingWakeupID before data flows,
+// and the RX ring needs a doorbell before the driver looks at it at all.
+static void testSharedRings(void){
+    Fixture         f;
+    RingUser        producer = { &f, sStreamBytes, 0, 0, false };
+    RingUser        consumer = { &f, sStreamBytes, 0, 0, false };
+    Reader          reader = { &f, sStreamBytes, 0, false };
+    Writer          writer = { &f, sStreamBytes, 0, kIOReturnSuccess };
+    pthread_t       produceThread, consumeThread, readThread, writeThread;
+    HostCounters    before, after;
+    UInt32          rxWakeups, txWakeups;
+
+    if (!openFixture(&f, kOverflowDropNewest) || !mapRing(&f, kSharedRXRing) || !mapRing(&f, kSharedTXRing)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+    // Each side's own index first, so the driver never sees a fill level that makes sense in between.
+    __atomic_store_n(&f.rings[kSharedRXRing]->Head, kRingStart, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&f.rings[kSharedRXRing]->Tail, kRingStart, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&f.rings[kSharedTXRing]->Tail, kRingStart, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&f.rings[kSharedTXRing]->Head, kRingStart, __ATOMIC_SEQ_CST);
+
+    rxWakeups = ringWakeups(kSharedRXRing);
+    txWakeups = ringWakeups(kSharedTXRing);
+    HostGetCounters(&before);
+
+    double start = now();
+    pthread_create(&produceThread, NULL, ringProducer, &producer);
+    pthread_create(&consumeThread, NULL, ringConsumer, &consumer);
+    for (UInt32 i = 0; (i < kRingWaitSeconds * 1000) && !(__atomic_load_n(&producer.waits, __ATOMIC_RELAXED) &&
+                                                         __atomic_load_n(&consumer.waits, __ATOMIC_RELAXED)); i++)
+        sleepMilliseconds(1);
+    pthread_create(&readThread, NULL, ttyReader, &reader);
+    pthread_create(&writeThread, NULL, ttyWriter, &writer);
+    pthread_join(produceThread, NULL);
+    pthread_join(readThread, NULL);
+    pthread_join(writeThread, NULL);
+    pthread_join(consumeThread, NULL);
+    double elapsed = now() - start;
+    HostGetCounters(&after);
+
+    CHECK(producer.ok && (producer.done == sStreamBytes), "%llu bytes written to the RX ring", (unsigned long long)producer.done);
+    CHECK(reader.ok && (reader.received == sStreamBytes), "tty received %llu bytes", (unsigned long long)reader.received);
+    CHECK(writer.result == kIOReturnSuccess, "enqueueData returned 0x%x", writer.result);
+    CHECK(consumer.ok && (consumer.done == sStreamBytes), "%llu bytes read from the TX ring", (unsigned long long)consumer.done);
+    CHECK(f.rings[kSharedRXRing]->Tail == (UInt32)(kRingStart + sStreamBytes), "RX ring Tail ended at 0x%x", f.rings[kSharedRXRing]->Tail);
+    CHECK(f.rings[kSharedTXRing]->Head == (UInt32)(kRingStart + sStreamBytes), "TX ring Head ended at 0x%x", f.rings[kSharedTXRing]->Head);
+    CHECK(producer.waits && (ringWakeups(kSharedRXRing) > rxWakeups), "%u waits for RX ring room, no kRingWakeupID", producer.waits);
+    CHECK(consumer.waits && (ringWakeups(kSharedTXRing) > txWakeups), "%u waits for TX ring data, no kRingWakeupID", consumer.waits);
+    CHECK(after.calls > before.calls, "no doorbell was rung");
+
+    closeFixture(&f);
+    report("shared rings", 2 * sStreamBytes, elapsed);
+    printf("  %-28s %6.1f doorbells/MiB\n", "", (after.calls - before.calls) / (2 * sStreamBytes / 1048576.0));
+}
+
+
+// A dequeueData that waits for min bytes, on another thread.
+typedef struct{
+    Fixture     *fixture;
+    UInt32      min;
+    UInt32      count;
+    IOReturn    result;
+    double      seconds;
+}TimedRead;
+
+
+static void* timedReader(void *context){
+    TimedRead   *read = (TimedRead*)context;
+    UInt8       buffer[64];
+    double      start = now();
+
+    read->result = read->fixture->port->dequeueData(buffer, sizeof(buffer), &read->count, read->min, read->fixture->refCon);
+    read->seconds = now() - start;
+    return NULL;
+}
+
+
+// dequeueData waits for min bytes: for ever, until PD_E_DATA_LATENCY from the start, or PD_E_DELAY
+// after the last byte, and the port closing ends the wait.
+static void testReadTimeouts(void){
+    Fixture         f;
+    TimedRead       read = { &f, 4, 0, kIOReturnSuccess, 0 };
+    pthread_t       thread;
+    UInt8           buffer[8];
+    UInt32          accepted, count;
+    TimerWheelStats stats;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+    fillPattern(buffer, 0, sizeof(buffer));
+
+    // Nothing arrives, the data latency runs out.
+    f.port->executeEvent(PD_E_DATA_LATENCY, 20000, f.refCon);
+    CHECK(f.port->dequeueData(buffer, sizeof(buffer), &count, 4, f.refCon) == kIOReturnSuccess, "timed read failed");
+    CHECK(count == 0, "%u bytes from an empty queue", count);
+
+    // Two bytes are there, and that is what comes back once the time is up.
+    sendBuffer(&f, kSendNormal, buffer, 2, &accepted);
+    pthread_create(&thread, NULL, timedReader, &read);
+    pthread_join(thread, NULL);
+    CHECK((read.result == kIOReturnSuccess) && (read.count == 2), "read gave 0x%x, %u bytes", read.result, read.count);
+    CHECK(read.seconds >= 0.020, "data latency ran out after %.1f ms", read.seconds * 1000);
+
+    // The rest arrive while it waits.
+    f.port->executeEvent(PD_E_DATA_LATENCY, 0, f.refCon);
+    pthread_create(&thread, NULL, timedReader, &read);
+    sleepMilliseconds(10);
+    sendBuffer(&f, kSendNormal, buffer, 4, &accepted);
+    pthread_join(thread, NULL);
+    CHECK((read.result == kIOReturnSuccess) && (read.count == 4), "read gave 0x%x, %u bytes", read.result, read.count);
+
+    // The gap after the first byte runs out.
+    f.port->executeEvent(PD_E_DELAY, 10000, f.refCon);
+    sendBuffer(&f, kSendNormal, buffer, 1, &accepted);
+    pthread_create(&thread, NULL, timedReader, &read);
+    pthread_join(thread, NULL);
+    CHECK((read.result == kIOReturnSuccess) && (read.count == 1), "read gave 0x%x, %u bytes", read.result, read.count);
+    CHECK(read.seconds >= 0.010, "character gap ran out after %.1f ms", read.seconds * 1000);
+
+    // With no bytes there is no gap to time, only closing the port ends it.
+    pthread_create(&thread, NULL, timedReader, &read);
+    sleepMilliseconds(20);
+    f.port->releasePort(f.refCon);
+    pthread_join(thread, NULL);
+    CHECK(read.result == kIOReturnNotOpen, "read ended with 0x%x when the port closed", read.result);
+
+    GetTimerWheelStats(&stats);
+    CHECK(stats.Pending == 0, "%u timers left on the wheel", stats.Pending);
+
+    closeFixture(&f);
+    report("read timeouts", 0, 0);
+}
+
+
+#define kWheelTestTimers    200
+
+typedef struct{
+    double      armed;
+    double      fired;
+}WheelTestTimer;
+
+
+static void wheelTestFired(void *owner, void *argument){
+
+    ((WheelTestTimer*)argument)->fired = now();
+}
+
+
+// Timers from level 0 up to the third level all fire once, never early, and cancelled ones never do.
+// Timers due together fire on one run of the wheel.
+static void testTimerWheel(void){
+    static WheelTimer       timers[kWheelTestTimers];
+    static WheelTestTimer   records[kWheelTestTimers];
+    TimerWheelStats         before, after, together;
+    UInt64                  interval[kWheelTestTimers];
+    UInt32                  late = 0;
+
+    if (!StartTimerWheel()){
+        sFailures++;
+        return;
+    }
+    GetTimerWheelStats(&before);
+
+    // 0 up to about 1.2 s, which is past level 1 (2^12 ticks, about 270 ms). The cancelled ones go straight
+    // away, before the shortest of them can fire under a slow build.
+    for (UInt32 i = 0; i < kWheelTestTimers; i++){
+        interval[i] = ((UInt64)i * i * i * 150) % 1200000000;
+        records[i].fired = 0;
+        records[i].armed = now();
+        InitTimer(&timers[i], wheelTestFired, NULL, &records[i]);
+        ArmTimer(&timers[i], interval[i]);
+        if ((i % 4) == 1)
+            CHECK(CancelTimer(&timers[i]), "timer %u was not armed", i);
+    }
+
+    sleepMilliseconds(1300);
+    for (UInt32 i = 0; i < kWheelTestTimers; i++)
+        FinishTimer(&timers[i]);
+    GetTimerWheelStats(&after);
+    StopTimerWheel();
+
+    for (UInt32 i = 0; i < kWheelTestTimers; i++){
+        double  elapsed = records[i].fired - records[i].armed;
+
+        if ((i % 4) == 1){
+            CHECK(records[i].fired == 0, "cancelled timer %u fired", i);
+            continue;
+        }
+        CHECK(records[i].fired != 0, "timer %u for %llu ns never fired", i, (unsigned long long)interval[i]);
+        CHECK(!records[i].fired || (elapsed >= interval[i] / 1e9), "timer %u for %llu ns fired after %.0f ns", i,
+              (unsigned long long)interval[i], elapsed * 1e9);
+        if (elapsed > ((interval[i] + (interval[i] >> kWheelSlackShift)) / 1e9) + 0.020)
+            late++;
+    }
+    CHECK(late < kWheelTestTimers / 20, "%u timers more than 20 ms past their slack", late);
+    CHECK(after.Expired - before.Expired == kWheelTestTimers - (kWheelTestTimers / 4), "%llu timers expired",
+          (unsigned long long)(after.Expired - before.Expired));
+    CHECK(after.Cascaded > before.Cascaded, "nothing came down from the upper levels");
+
+    if (!StartTimerWheel()){
+        sFailures++;
+        return;
+    }
+    for (UInt32 i = 0; i < kWheelTestTimers; i++)
+        ArmTimer(&timers[i], 20000000);
+    sleepMilliseconds(40);
+    for (UInt32 i = 0; i < kWheelTestTimers; i++)
+        FinishTimer(&timers[i]);
+    GetTimerWheelStats(&together);
+    StopTimerWheel();
+    CHECK(together.Expired - after.Expired == kWheelTestTimers, "%llu of the timers expired",
+          (unsigned long long)(together.Expired - after.Expired));
+    CHECK(together.Runs - after.Runs <= 4, "%llu runs for timers all due at once", (unsigned long long)(together.Runs - after.Runs));
+
+    report("timer wheel", 0, 0);
+}
+
+
+#pragma mark Lock Stats
+
+#define kLockTestBytes  (1024 * 1024)
+
+static IOReturn getLockStats(Fixture *f, UInt32 lock, bool clear, LockStats *stats, UInt32 maxStats, UInt32 *numStats){
+    uint64_t    input[2] = { lock, clear };
+    size_t      size = maxStats * sizeof(LockStats);
+    IOReturn    result;
+
+    result = HostCallMethod(f->client, kGetLockStats, input, 2, NULL, 0, NULL, NULL, stats, &size);
+    *numStats = (UInt32)(size / sizeof(LockStats));
+    return result;
+}
+
+
+// A stream to the tty shows up on RXBufferLock, split between the places that take it, and the sites add
+// up to the lock. Reading with clear starts the counters again. Without VSP_LOCK_STATS kGetLockStats is
+// turned down.
+static void testLockStats(void){
+    Fixture             f;
+    static LockStats    stats[kMaxLockSites + 1];
+    UInt32              numStats;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        return;
+    }
+
+#ifndef VSP_LOCK_STATS
+    CHECK(getLockStats(&f, kLockRXBuffer, false, stats, kMaxLockSites + 1, &numStats) == kIOReturnUnsupported,
+          "kGetLockStats works without VSP_LOCK_STATS");
+#else
+    Reader      reader = { &f, kLockTestBytes, 0, false };
+    Sender      sender = { &f, kSendBlocking, kLockTestBytes, 0, kIOReturnSuccess };
+    pthread_t   readThread, sendThread;
+    LockStats   sum;
+    bool        sawReader = false, sawSender = false;
+
+    CHECK(getLockStats(&f, kNumberOfLocks, false, stats, kMaxLockSites + 1, &numStats) == kIOReturnBadArgument,
+          "lock %u was found", kNumberOfLocks);
+    CHECK(getLockStats(&f, kLockRXBuffer, true, stats, kMaxLockSites + 1, &numStats) == kIOReturnSuccess,
+          "clearing RXBufferLock failed");
+
+    pthread_create(&readThread, NULL, ttyReader, &reader);
+    pthread_create(&sendThread, NULL, clientSender, &sender);
+    pthread_join(sendThread, NULL);
+    pthread_join(readThread, NULL);
+    CHECK(reader.ok && (reader.received == kLockTestBytes), "received %llu bytes", (unsigned long long)reader.received);
+
+    CHECK(getLockStats(&f, kLockRXBuffer, true, stats, kMaxLockSites + 1, &numStats) == kIOReturnSuccess,
+          "reading RXBufferLock failed");
+    CHECK(numStats > 2, "RXBufferLock was taken from %u places", numStats - 1);
+    CHECK(stats[0].Acquisitions > 0, "RXBufferLock was never taken");
+    CHECK(stats[0].Contended <= stats[0].Acquisitions, "%llu of %llu acquisitions contended",
+          (unsigned long long)stats[0].Contended, (unsigned long long)stats[0].Acquisitions);
+    CHECK(stats[0].HoldTime >= stats[0].MaxHoldTime, "held %llu ns in all, %llu ns at most",
+          (unsigned long long)stats[0].HoldTime, (unsigned long long)stats[0].MaxHoldTime);
+
+    bzero(&sum, sizeof(sum));
+    for (UInt32 i = 1; i < numStats; i++){
+        sum.Acquisitions += stats[i].Acquisitions;
+        sum.Contended += stats[i].Contended;
+        sum.HoldTime += stats[i].HoldTime;
+        if (stats[i].MaxHoldTime > sum.MaxHoldTime)
+            sum.MaxHoldTime = stats[i].MaxHoldTime;
+        sawReader |= (strcmp(stats[i].Function, "dequeueData") == 0);
+        sawSender |= (strncmp(stats[i].Function, "sendBuffer", strlen("sendBuffer")) == 0);
+    }
+    CHECK((sum.Acquisitions == stats[0].Acquisitions) && (sum.Contended == stats[0].Contended) &&
+          (sum.HoldTime == stats[0].HoldTime) && (sum.MaxHoldTime == stats[0].MaxHoldTime),
+          "the places don't add up to the lock");
+    CHECK(sawReader && sawSender, "dequeueData %s, sendBuffer %s", sawReader ? "seen" : "missing", sawSender ? "seen" : "missing");
+
+    CHECK(getLockStats(&f, kLockRXBuffer, false, stats, kMaxLockSites + 1, &numStats) == kIOReturnSuccess,
+          "reading RXBufferLock again failed");
+    CHECK((numStats == 1) && (stats[0].Acquisitions == 0), "%llu acquisitions left after clearing",
+          (unsigned long long)stats[0].Acquisitions);
+
+    CHECK(getLockStats(&f, kLockSerialRequest, false, stats, 1, &numStats) == kIOReturnSuccess,
+          "reading serialRequestLock failed");
+    CHECK((numStats == 1) && (stats[0].Acquisitions > 0), "serialRequestLock was never taken");
+#endif
+
+    closeFixture(&f);
+    report("lock stats", 0, 0);
+}
+
+
+#pragma mark Responder
+
+#define TEXT(string)    string, (UInt32)(sizeof(string) - 1)
+
+// The tty writes, then takes whatever has come back for it.
+static UInt32 ttyExchange(Fixture *f, const char *request, UInt32 size, UInt8 *reply, UInt32 replySize){
+    UInt32  count = 0;
+
+    f->port->enqueueData((UInt8*)request, size, &count, false, f->refCon);
+    if (count != size) return 0;
+    f->port->dequeueData(reply, replySize, &count, 0, f->refCon);
+    return count;
+}
+
+
+// Bit at a time, to check the driver's table against.
+static UInt16 modbusCRC(const UInt8 *data, UInt32 size){
+    UInt16  crc = 0xFFFF;
+
+    for (UInt32 i = 0; i < size; i++){
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+
+// A modem, a Modbus slave and a GPS answered in the driver: messages split across writes, literal, prefix
+// and pattern rules with their captures, the CRC and NMEA escapes, pacing, pass through, and tables that
+// are turned down.
+static void testResponder(void){
+    Fixture         f;
+    RuleTable       *rules = (RuleTable*)malloc(sizeof(RuleTable));
+    ResponderStats  stats;
+    UInt8           reply[kMaxResponderReply];
+    UInt8           expected[16];
+    UInt32          count;
+    UInt16          crc;
+    double          start;
+
+    if (!openFixture(&f, kOverflowDropNewest)){
+        sFailures++;
+        closeFixture(&f);
+        free(rules);
+        return;
+    }
+
+    CHECK(getResponderStats(&f, false, &stats) == kIOReturnNotFound, "stats without a responder");
+    beginRules(rules, kFramingDelimiter, 0x100, 0, 0);
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "delimiter 0x100 accepted");
+    beginRules(rules, kFramingNone, 0, 0, 0);
+    addRule(rules, kMatchPattern, TEXT("AT\\"), TEXT("OK"));
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "pattern ending in \\ accepted");
+    beginRules(rules, kFramingNone, 0, 0, 0);
+    addRule(rules, kMatchPrefix, TEXT("AT"), TEXT("$2"));
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "$2 accepted with one capture");
+    beginRules(rules, kFramingNone, 0, 0, 0);
+    addRule(rules, kMatchLiteral, TEXT("AT"), TEXT("$q"));
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "$q accepted");
+    beginRules(rules, kFramingNone, 0, 0, 0);
+    addRule(rules, kMatchPattern, TEXT("**********"), TEXT(""));
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "ten captures accepted");
+    beginRules(rules, kFramingNone, 0, 0, 0);
+    addRule(rules, kMatchLiteral, TEXT("AT"), TEXT("$0$0$0$0$0"));
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "a response longer than kMaxResponderReply accepted");
+    beginRules(rules, kFramingNone, 0, 0, 0);
+    addRule(rules, kMatchLiteral, TEXT("AT"), TEXT("OK"));
+    addRule(rules, kMatchLiteral, TEXT("ATZ"), TEXT("OK"));
+    rules->size -= 8;
+    CHECK(setResponder(&f, rules) == kIOReturnBadArgument, "a cut short table accepted");
+
+    // A modem, one command per line.
+    beginRules(rules, kFramingDelimiter, '\r', 0, 0);
+    addRule(rules, kMatchLiteral, TEXT("AT"), TEXT("\r\nOK\r\n"));
+    addRule(rules, kMatchPrefix, TEXT("AT+ECHO="), TEXT("$1\r\nOK\r\n"));
+    addRule(rules, kMatchPattern, TEXT("ATD*#"), TEXT("DIAL $2 BY $1\r\n"));
+    addRule(rules, kMatchPattern, TEXT("AT\\?"), TEXT("$$?\r\n"));
+    addRule(rules, kMatchLiteral, TEXT("GPS"), TEXT("$$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*$x\r\n"));
+    CHECK(setResponder(&f, rules) == kIOReturnSuccess, "modem rules refused");
+
+    f.port->enqueueData((UInt8*)"A", 1, &count, false, f.refCon);
+    f.port->dequeueData(reply, sizeof(reply), &count, 0, f.refCon);
+    CHECK(count == 0, "%u bytes for half a command", count);
+    count = ttyExchange(&f, TEXT("T\r"), reply, sizeof(reply));
+    CHECK((count == 6) && !memcmp(reply, "\r\nOK\r\n", 6), "AT gave %u bytes", count);
+    count = ttyExchange(&f, TEXT("AT+ECHO=hello\rAT\r"), reply, sizeof(reply));
+    CHECK((count == 17) && !memcmp(reply, "hello\r\nOK\r\n\r\nOK\r\n", 17), "two commands gave %u bytes", count);
+    count = ttyExchange(&f, TEXT("ATDT5551234\r"), reply, sizeof(reply));
+    CHECK((count == 19) && !memcmp(reply, "DIAL 5551234 BY T\r\n", 19), "ATD gave %.*s", (int)count, reply);
+    count = ttyExchange(&f, TEXT("AT?\rATX\r"), reply, sizeof(reply));
+    CHECK((count == 4) && !memcmp(reply, "$?\r\n", 4), "AT? gave %.*s", (int)count, reply);
+    count = ttyExchange(&f, TEXT("GPS\r"), reply, sizeof(reply));
+    CHECK((count > 5) && !memcmp(reply + count - 5, "*47\r\n", 5), "NMEA sentence %.*s", (int)count, reply);
+    count = 0;
+    f.port->receiveData(reply, sizeof(reply), &count);
+    CHECK(count == 0, "the client got %u bytes the responder took", count);
+
+    CHECK(getResponderStats(&f, true, &stats) == kIOReturnSuccess, "stats refused");
+    CHECK((stats.Messages == 7) && (stats.Matched == 6) && (stats.Dropped == 0), "%llu messages, %llu matched, %llu dropped",
+          (unsigned long long)stats.Messages, (unsigned long long)stats.Matched, (unsigned long long)stats.Dropped);
+    getResponderStats(&f, false, &stats);
+    CHECK(stats.Messages == 0, "%llu messages after clearing", (unsigned long long)stats.Messages);
+
+    // A Modbus slave reading two holding registers, the CRC checked on the way in and worked out on the way out.
+    beginRules(rules, kFramingFixed, 0, 8, 0);
+    addRule(rules, kMatchPattern, TEXT("\x01\x03" "??" "\x00\x02" "??"), TEXT("\x01\x03\x04\x00\x2A$2\x07$c"), kRuleCheckCRC);
+    CHECK(setResponder(&f, rules) == kIOReturnSuccess, "Modbus rules refused");
+    count = ttyExchange(&f, "\x01\x03\x00\x05\x00\x02\xD4\x0A", 8, reply, sizeof(reply));
+    memcpy(expected, "\x01\x03\x04\x00\x2A\x05\x07", 7);
+    crc = modbusCRC(expected, 7);
+    expected[7] = crc & 0xFF;
+    expected[8] = crc >> 8;
+    CHECK((count == 9) && !memcmp(reply, expected, 9), "Modbus reply %u bytes", count);
+    count = ttyExchange(&f, "\x01\x03\x00\x05\x00\x02\xD4\x0B", 8, reply, sizeof(reply));
+    CHECK(count == 0, "%u bytes for a bad CRC", count);
+
+    // Paced, then one due at once that waits its turn behind it. Passed through, the client sees the commands.
+    beginRules(rules, kFramingNone, 0, 0, kResponderPassThrough);
+    addRule(rules, kMatchLiteral, TEXT("P"), TEXT("abcd"), 0, 20000, 5000);
+    addRule(rules, kMatchLiteral, TEXT("Q"), TEXT("z"));
+    CHECK(setResponder(&f, rules) == kIOReturnSuccess, "paced rules refused");
+    start = now();
+    count = ttyExchange(&f, TEXT("P"), reply, sizeof(reply));
+    CHECK(count == 0, "%u bytes before the delay", count);
+    count = ttyExchange(&f, TEXT("Q"), reply, sizeof(reply));
+    CHECK(count == 0, "%u bytes jumped the queue", count);
+    f.port->dequeueData(reply, sizeof(reply), &count, 5, f.refCon);
+    CHECK((count == 5) && !memcmp(reply, "abcdz", 5), "paced replies %.*s", (int)count, reply);
+    CHECK(now() - start >= 0.034, "paced replies took %.1f ms", (now() - start) * 1000);
+    count = 0;
+    f.port->receiveData(reply, sizeof(reply), &count);
+    CHECK((count == 2) && !memcmp(reply, "PQ", 2), "the client got %u bytes", count);
+
+    // Closing the port throws away what was waiting.
+    ttyExchange(&f, TEXT("P"), reply, sizeof(reply));
+    f.port->releasePort(f.refCon);
+    f.port->acquirePort(false, f.refCon);
+    f.port->executeEvent(PD_E_ACTIVE, true, f.refCon);
+    sleepMilliseconds(50);
+    f.port->dequeueData(reply, sizeof(reply), &count, 0, f.refCon);
+    CHECK(count == 0, "%u bytes reached the next session", count);
+
+    CHECK(setResponder(&f, NULL) == kIOReturnSuccess, "taking the responder away failed");
+    count = ttyExchange(&f, TEXT("Q"), reply, sizeof(reply));
+    CHECK(count == 0, "%u bytes without a responder", count);
+
+    closeFixture(&f);
+    free(rules);
+    report("responder", 0, 0);
+}
+
+
+#pragma mark main
+
+typedef struct{
+    const char  *name;
+    void        (*run)(void);
+}Test;
+
+static const Test sTests[] = {
+    { "blocking",   testStreamBlocking },
+    { "policy",     testStreamPolicyBlock },
+    { "async",      testStreamAsync },
+    { "readasync",  testStreamFromTTY },
+    { "credits",    testCredits },
+    { "dropoldest", testDropOldest },
+    { "framing",    testFraming },
+    { "events",     testEvents },
+    { "line",       testLineCoding },
+    { "faults",     testFaults },
+    { "churn",      testStateChurn },
+    { "status",     testStatusPage },
+    { "batch",      testBatchResults },
+    { "close",      testCloseReleasesWaiters },
+    { "blocked",    testBlockedSenderPosition },
+    { "idle",       testIdleRings },
+    { "rings",      testSharedRings },
+    { "timeouts",   testReadTimeouts },
+    { "wheel",      testTimerWheel },
+    { "responder",  testResponder },
+    { "locks",      testLockStats },
+};
+
+
+int main(int argc, char *argv[]){
+    int     option;
+
+    while ((option = getopt(argc, argv, "m:v")) != -1){
+        switch (option){
+            case 'm':   sStreamBytes = strtoull(optarg, NULL, 0) * 1024 * 1024;    break;
+            case 'v':   HostSetLogging(true);                                       break;
+            default:
+                fprintf(stderr, "usage: %s [-m MiB] [-v] [test ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    HostSetMessageHandler(messageHandler, NULL);
+
+    for (size_t i = 0; i < sizeof(sTests) / sizeof(sTests[0]); i++){
+        bool selected = (optind == argc);
+
+        for (int arg = optind; arg < argc; arg++)
+            selected |= (strcmp(argv[arg], sTests[i].name) == 0);
+        if (selected)
+            sTests[i].run();
+    }
+
+    if (sFailures){
+        printf("%d check(s) failed\n", sFailures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,346 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Client side of the vspd socket protocol, see VSPSocket.h.
+//
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "VSPSocket.h"
+
+
+// An async call waiting for its completion.
+typedef struct PendingCall{
+    struct PendingCall  *next;
+    UInt64              reference;
+    VSPAsyncCallback    callback;
+    void                *refcon;
+    UInt8               *readBuffer;        // kReadAsync: where the bytes in the completion go
+    UInt64              readSize;
+}PendingCall;
+
+struct VSPConnection{
+    int                 socket;
+    pthread_t           reader;
+    pthread_mutex_t     callLock;           // One call at a time, the replies aren't tagged
+    pthread_mutex_t     lock;               // Everything below
+    pthread_cond_t      cond;
+    bool                closed;
+    bool                replied;
+    VSPFrameHeader      reply;
+    UInt8               *replyPayload;
+    UInt32              replyPayloadSize;
+    PendingCall         *pending;
+    UInt64              nextReference;
+    VSPNotificationCallback notify;
+    void                *notifyContext;
+};
+
+
+static bool readFully(int socket, void *buffer, size_t size){
+    UInt8   *bytes = (UInt8*)buffer;
+    ssize_t count;
+
+    while (size){
+        count = read(socket, bytes, size);
+        if (count <= 0){
+            if ((count < 0) && (errno == EINTR)) continue;
+            return false;
+        }
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+static bool writeFrame(int socket, VSPFrameHeader *header, const void *payload, size_t payloadSize){
+    struct iovec    vector[2];
+    int             first = 0, count = payloadSize ? 2 : 1;
+    ssize_t         written;
+
+    header->Length = (UInt32)(sizeof(VSPFrameHeader) + payloadSize);
+    vector[0].iov_base = header;
+    vector[0].iov_len = sizeof(VSPFrameHeader);
+    vector[1].iov_base = (void*)payload;
+    vector[1].iov_len = payloadSize;
+
+    while (first < count){
+        written = writev(socket, vector + first, count - first);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while ((first < count) && ((size_t)written >= vector[first].iov_len)){
+            written -= vector[first].iov_len;
+            first++;
+        }
+        if (first < count){
+            vector[first].iov_base = (UInt8*)vector[first].iov_base + written;
+            vector[first].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+
+static PendingCall* takePending(VSPConnection *connection, UInt64 reference){
+    PendingCall **link;
+    PendingCall *call;
+
+    for (link = &connection->pending; (call = *link) != NULL; link = &call->next){
+        if (call->reference == reference){
+            *link = call->next;
+            return call;
+        }
+    }
+    return NULL;
+}
+
+
+// Reads frames until the socket closes. Replies are handed to the waiting caller; completions and
+// notifications are delivered from here.
+static void* readFrames(void *context){
+    VSPConnection   *connection = (VSPConnection*)context;
+    VSPFrameHeader  header;
+    UInt8           *payload;
+    UInt32          payloadSize;
+    PendingCall     *call;
+
+    for (;;){
+        if (!readFully(connection->socket, &header, sizeof(header))) break;
+        if ((header.Length < sizeof(header)) || (header.Length - sizeof(header) > kVSPMaxPayload)) break;
+        if (header.ScalarCount > kVSPMaxScalars) break;
+
+        payloadSize = header.Length - sizeof(header);
+        payload = (UInt8*)malloc(payloadSize ? payloadSize : 1);
+        if ((payload == NULL) || !readFully(connection->socket, payload, payloadSize)){
+            free(payload);
+            break;
+        }
+
+        switch (header.Type){
+            case kVSPFrameReply:
+                pthread_mutex_lock(&connection->lock);
+                connection->reply = header;
+                connection->replyPayload = payload;
+                connection->replyPayloadSize = payloadSize;
+                connection->replied = true;
+                pthread_cond_broadcast(&connection->cond);
+                pthread_mutex_unlock(&connection->lock);
+                payload = NULL;
+                break;
+
+            case kVSPFrameCompletion:
+                pthread_mutex_lock(&connection->lock);
+                call = takePending(connection, header.Reference);
+                pthread_mutex_unlock(&connection->lock);
+                if (call){
+                    if (call->readBuffer)
+                        memcpy(call->readBuffer, payload, (payloadSize < call->readSize) ? payloadSize : call->readSize);
+                    if (call->callback)
+                        call->callback(call->refcon, header.Result, header.Scalars, header.ScalarCount);
+                    free(call);
+                }
+                break;
+
+            case kVSPFrameNotification:
+                if (connection->notify && (payloadSize >= sizeof(mach_msg_header_t)))
+                    connection->notify(connection->notifyContext, (mach_msg_header_t*)payload, payloadSize);
+                break;
+        }
+        free(payload);
+    }
+
+    // vspd has gone, nothing still pending will complete.
+    pthread_mutex_lock(&connection->lock);
+    connection->closed = true;
+    call = connection->pending;
+    connection->pending = NULL;
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->lock);
+
+    while (call){
+        PendingCall *next = call->next;
+
+        if (call->callback)
+            call->callback(call->refcon, kIOReturnAborted, NULL, 0);
+        free(call);
+        call = next;
+    }
+
+    return NULL;
+}
+
+
+VSPConnection* VSPConnectionOpen(const char *path){
+    VSPConnection       *connection;
+    struct sockaddr_un  address;
+
+    if (strlen(path) >= sizeof(address.sun_path)) return NULL;
+
+    connection = (VSPConnection*)calloc(1, sizeof(VSPConnection));
+    if (connection == NULL) return NULL;
+
+    connection->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bzero(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if ((connection->socket < 0) || (connect(connection->socket, (struct sockaddr*)&address, sizeof(address)) < 0)){
+        if (connection->socket >= 0) close(connection->socket);
+        free(connection);
+        return NULL;
+    }
+
+    pthread_mutex_init(&connection->callLock, NULL);
+    pthread_mutex_init(&connection->lock, NULL);
+    pthread_cond_init(&connection->cond, NULL);
+    connection->nextReference = 1;
+    pthread_create(&connection->reader, NULL, readFrames, connection);
+
+    return connection;
+}
+
+
+void VSPConnectionClose(VSPConnection *connection){
+
+    if (connection == NULL) return;
+
+    shutdown(connection->socket, SHUT_RDWR);
+    pthread_join(connection->reader, NULL);
+    close(connection->socket);
+    free(connection->replyPayload);
+    pthread_cond_destroy(&connection->cond);
+    pthread_mutex_destroy(&connection->lock);
+    pthread_mutex_destroy(&connection->callLock);
+    free(connection);
+}
+
+
+// Send one frame and wait for the reply to it.
+static IOReturn call(VSPConnection *connection, VSPFrameHeader *header, const void *payload, size_t payloadSize,
+                     uint64_t *output, uint32_t *outputCount, void *outputStruct, size_t *outputStructSize){
+    IOReturn    result;
+
+    pthread_mutex_lock(&connection->callLock);
+
+    if (!writeFrame(connection->socket, header, payload, payloadSize)){
+        pthread_mutex_unlock(&connection->callLock);
+        return kIOReturnNotOpen;
+    }
+
+    pthread_mutex_lock(&connection->lock);
+    while (!connection->replied && !connection->closed)
+        pthread_cond_wait(&connection->cond, &connection->lock);
+    if (!connection->replied){
+        pthread_mutex_unlock(&connection->lock);
+        pthread_mutex_unlock(&connection->callLock);
+        return kIOReturnNotOpen;
+    }
+    connection->replied = false;
+    result = connection->reply.Result;
+
+    if (outputCount){
+        if (*outputCount > connection->reply.ScalarCount)
+            *outputCount = connection->reply.ScalarCount;
+        memcpy(output, connection->reply.Scalars, *outputCount * sizeof(uint64_t));
+    }
+    if (outputStructSize){
+        if (*outputStructSize > connection->replyPayloadSize)
+            *outputStructSize = connection->replyPayloadSize;
+        memcpy(outputStruct, connection->replyPayload, *outputStructSize);
+    }
+    free(connection->replyPayload);
+    connection->replyPayload = NULL;
+
+    pthread_mutex_unlock(&connection->lock);
+    pthread_mutex_unlock(&connection->callLock);
+
+    return result;
+}
+
+
+IOReturn VSPConnectionSetNotificationCallback(VSPConnection *connection, VSPNotificationCallback callback, void *context){
+    VSPFrameHeader  header;
+
+    pthread_mutex_lock(&connection->lock);
+    connection->notify = callback;
+    connection->notifyContext = context;
+    pthread_mutex_unlock(&connection->lock);
+
+    bzero(&header, sizeof(header));
+    header.Type = kVSPFrameSetNotify;
+    header.ScalarCount = 1;
+    header.Scalars[0] = (callback != NULL);
+    return call(connection, &header, NULL, 0, NULL, NULL, NULL, NULL);
+}
+
+
+IOReturn VSPConnectCallMethod(VSPConnection *connection, uint32_t selector,
+                              const uint64_t *input, uint32_t inputCount, const void *inputStruct, size_t inputStructSize,
+                              uint64_t *output, uint32_t *outputCount, void *outputStruct, size_t *outputStructSize){
+
+    return VSPConnectCallAsyncMethod(connection, selector, NULL, NULL, input, inputCount, inputStruct, inputStructSize,
+                                     output, outputCount, outputStruct, outputStructSize);
+}
+
+
+IOReturn VSPConnectCallAsyncMethod(VSPConnection *connection, uint32_t selector, VSPAsyncCallback callback, void *refcon,
+                                   const uint64_t *input, uint32_t inputCount, const void *inputStruct, size_t inputStructSize,
+                                   uint64_t *output, uint32_t *outputCount, void *outputStruct, size_t *outputStructSize){
+    VSPFrameHeader  header;
+    PendingCall     *pending = NULL;
+    IOReturn        result;
+
+    if ((inputCount > kVSPMaxScalars) || (inputStructSize > kVSPMaxPayload)) return kIOReturnBadArgument;
+    if (outputCount && (*outputCount > kVSPMaxScalars)) return kIOReturnBadArgument;
+
+    bzero(&header, sizeof(header));
+    header.Type = kVSPFrameCall;
+    header.Selector = selector;
+    header.ScalarCount = inputCount;
+    header.OutputCount = outputCount ? *outputCount : 0;
+    header.OutputStructSize = outputStructSize ? (UInt32)*outputStructSize : 0;
+    if (inputCount)
+        memcpy(header.Scalars, input, inputCount * sizeof(uint64_t));
+
+    // The completion can arrive before the reply, so the call is pending before it is sent.
+    if (callback){
+        pending = (PendingCall*)calloc(1, sizeof(PendingCall));
+        if (pending == NULL) return kIOReturnNoMemory;
+        pending->callback = callback;
+        pending->refcon = refcon;
+        if ((selector == kReadAsync) && (inputCount >= 2)){
+            pending->readBuffer = (UInt8*)(uintptr_t)input[0];
+            pending->readSize = input[1];
+        }
+
+        pthread_mutex_lock(&connection->lock);
+        if (connection->closed){
+            pthread_mutex_unlock(&connection->lock);
+            free(pending);
+            return kIOReturnNotOpen;
+        }
+        pending->reference = connection->nextReference++;
+        pending->next = connection->pending;
+        connection->pending = pending;
+        pthread_mutex_unlock(&connection->lock);
+        header.Reference = pending->reference;
+    }
+
+    result = call(connection, &header, inputStruct, inputStructSize, output, outputCount, outputStruct, outputStructSize);
+
+    // A call that failed never completes.
+    if (pending && (result != kIOReturnSuccess)){
+        pthread_mutex_lock(&connection->lock);
+        pending = takePending(connection, header.Reference);
+        pthread_mutex_unlock(&connection->lock);
+        free(pending);
+    }
+
+    return result;
+}
@@ -0,0 +1,72 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  The user client protocol as vspd serves it over a local socket, and the client side of it.
+//
+//  Each connection gets its own VSPUserClient. The selectors, their arguments and the notification
+//  messages are exactly the ones in Shared.h; only the transport is different. Every frame starts
+//  with a VSPFrameHeader, Length covers the header and the payload that follows it.
+//
+//  Differences from the kext:
+//   - kReadAsync's buffer address is the client's own. vspd reads into a buffer of its own and sends
+//     the bytes back with the completion, which VSPConnection copies into the client's buffer.
+//   - Shared memory (kSharedRXRing, kSharedTXRing, kPortStatusPage) can't be mapped over a socket.
+//
+
+#ifndef VSP_SOCKET_H
+#define VSP_SOCKET_H
+
+#include "HostKernel.h"
+#include "Shared.h"
+
+#define kVSPDefaultSocket   "/tmp/vsp.sock"
+#define kVSPMaxScalars      16
+#define kVSPMaxPayload      (kMaxSendBufferSize + 4096)
+
+enum{
+    kVSPFrameCall,          // Client to vspd: call Selector. The payload is the struct input.
+    kVSPFrameReply,         // vspd to client: the result of the last call. The payload is the struct output.
+    kVSPFrameCompletion,    // vspd to client: an async call has completed. Scalars are the completion args.
+    kVSPFrameNotification,  // vspd to client: a notification message from Shared.h, verbatim, as the payload.
+    kVSPFrameSetNotify      // Client to vspd: start (Scalars[0] = 1) or stop sending notifications. Gets a reply.
+};
+
+typedef struct{
+    UInt32  Length;
+    UInt32  Type;
+    UInt32  Selector;
+    SInt32  Result;             // IOReturn, in replies and completions
+    UInt32  ScalarCount;
+    UInt32  OutputCount;        // Calls: scalar outputs wanted
+    UInt32  OutputStructSize;   // Calls: size of the struct output buffer
+    UInt32  Reserved;
+    UInt64  Reference;          // Async calls: non zero, returned in the completion
+    UInt64  Scalars[kVSPMaxScalars];
+}VSPFrameHeader;
+
+
+#pragma mark Client
+
+// An open connection to vspd. Completions and notifications are delivered on a thread of the
+// connection's own, like IOKit delivers them on the run loop of the notification port.
+typedef struct VSPConnection VSPConnection;
+
+typedef void (*VSPAsyncCallback)(void *refcon, IOReturn result, uint64_t *args, UInt32 numArgs);
+typedef void (*VSPNotificationCallback)(void *context, mach_msg_header_t *msg, UInt32 size);
+
+VSPConnection*  VSPConnectionOpen(const char *path);
+void            VSPConnectionClose(VSPConnection *connection);
+
+// Where notification messages go. Registering a callback also registers a notification port
+// with the user client, so it is the equivalent of IOConnectSetNotificationPort.
+IOReturn    VSPConnectionSetNotificationCallback(VSPConnection *connection, VSPNotificationCallback callback, void *context);
+
+// IOConnectCallMethod and IOConnectCallAsyncMethod, with the same arguments.
+IOReturn    VSPConnectCallMethod(VSPConnection *connection, uint32_t selector,
+                                 const uint64_t *input, uint32_t inputCount, const void *inputStruct, size_t inputStructSize,
+                                 uint64_t *output, uint32_t *outputCount, void *outputStruct, size_t *outputStructSize);
+IOReturn    VSPConnectCallAsyncMethod(VSPConnection *connection, uint32_t selector, VSPAsyncCallback callback, void *refcon,
+                                      const uint64_t *input, uint32_t inputCount, const void *inputStruct, size_t inputStructSize,
+                                      uint64_t *output, uint32_t *outputCount, void *outputStruct, size_t *outputStructSize);
+
+#endif
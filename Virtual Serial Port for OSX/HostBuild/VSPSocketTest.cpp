@@ -0,0 +1,781 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Runs vspd and checks it end to end: serial software on the pty slave at one end, a client using
+//  VSPSocket.h at the other. Each direction streams checked data, and is timed next to a plain pipe
+//  moving the same amount for comparison. A second vspd then serves the tty side over RFC 2217 on
+//  loopback TCP, and the same is done with a telnet client in place of the serial software, after
+//  checking that its COM-PORT-OPTION settings reach the port and the port's lines reach it. A stream
+//  slower than its floor, a fraction of the pipe's rate, fails; -f sets one percentage for them all.
+//
+//    vsp-socket-test [-m MiB] [-f percent] path/to/vspd
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VSPSocket.h"
+#include "VSPTelnet.h"
+
+
+// Each stream's floor as a fraction of pipeRate. Through vspd the data is copied three times as often as
+// through a pipe, and the pty streams run at a quarter to a third of the pipe's rate, the telnet ones at
+// 0.55 to 0.7. The floors are about half that, low enough for a busy machine and high enough to catch a
+// real slowdown.
+#define kPtyFloor       0.15
+#define kTelnetFloor    0.35
+
+static UInt64   sStreamBytes = 16 * 1024 * 1024;
+static double   sMinFraction = 0;               // -f, in place of the floors above
+static int      sFailures;
+
+#define CHECK(condition, ...)                                                   \
+    do {                                                                        \
+        if (!(condition)){                                                      \
+            fprintf(stderr, "    %s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            fprintf(stderr, __VA_ARGS__);                                       \
+            fprintf(stderr, "\n");                                              \
+            sFailures++;                                                        \
+        }                                                                       \
+    } while (0)
+
+
+static inline UInt8 pattern(UInt64 offset){
+
+    return (UInt8)(offset ^ (offset >> 8) ^ (offset >> 16) ^ 0x5A);
+}
+
+
+static bool checkPattern(const UInt8 *buffer, UInt64 offset, size_t size){
+
+    for (size_t i = 0; i < size; i++){
+        if (buffer[i] != pattern(offset + i)){
+            fprintf(stderr, "    data mismatch at byte %llu: got 0x%02x, expected 0x%02x\n",
+                    (unsigned long long)(offset + i), buffer[i], pattern(offset + i));
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static double now(void){
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + (time.tv_nsec / 1e9);
+}
+
+
+#pragma mark Notifications
+
+static pthread_mutex_t  sLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   sCond = PTHREAD_COND_INITIALIZER;
+static UInt32           sNotifications[kCreditID + 1];
+
+
+static void notificationReceived(void *context, mach_msg_header_t *msg, UInt32 size){
+
+    pthread_mutex_lock(&sLock);
+    if ((msg->msgh_id >= 0) && (msg->msgh_id <= kCreditID))
+        sNotifications[msg->msgh_id]++;
+    pthread_cond_broadcast(&sCond);
+    pthread_mutex_unlock(&sLock);
+}
+
+
+// One command through kExecuteBatch, returning its Value, or 0 if it failed.
+static UInt32 runCommand(VSPConnection *connection, UInt32 which, UInt32 arg0, UInt64 arg1){
+    BatchCommand    command = { which, arg0, arg1 };
+    BatchResult     result;
+    size_t          resultSize = sizeof(result);
+
+    if ((VSPConnectCallMethod(connection, kExecuteBatch, NULL, 0, &command, sizeof(command),
+                              NULL, NULL, &result, &resultSize) != kIOReturnSuccess) || (result.Result != kIOReturnSuccess))
+        return 0;
+    return (UInt32)result.Value;
+}
+
+
+static UInt32 requestEvent(VSPConnection *connection, UInt32 event){
+
+    return runCommand(connection, kBatchRequestEvent, event, 0);
+}
+
+
+static UInt32 portState(VSPConnection *connection){
+
+    return runCommand(connection, kBatchGetState, 0, 0);
+}
+
+
+// The daemon notices opens and closes of the slave by polling, so give it a moment.
+static bool waitForState(VSPConnection *connection, UInt32 mask, UInt32 value){
+
+    for (int i = 0; i < 200; i++){
+        if ((portState(connection) & mask) == value) return true;
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+
+#pragma mark Streams
+
+typedef struct{
+    int             fd;
+    VSPConnection   *connection;
+    UInt64          total;
+    UInt64          done;
+    bool            ok;
+}Stream;
+
+
+static void* slaveReader(void *context){
+    Stream  *stream = (Stream*)context;
+    UInt8   buffer[64 * 1024];
+    ssize_t count;
+
+    stream->ok = true;
+    while (stream->done < stream->total){
+        count = read(stream->fd, buffer, sizeof(buffer));
+        if (count <= 0){
+            if ((count < 0) && (errno == EINTR)) continue;
+            stream->ok = false;
+            break;
+        }
+        if (!checkPattern(buffer, stream->done, count)){
+            stream->ok = false;
+            break;
+        }
+        stream->done += count;
+    }
+    return NULL;
+}
+
+
+static void* slaveWriter(void *context){
+    Stream  *stream = (Stream*)context;
+    UInt8   buffer[64 * 1024];
+    ssize_t count;
+    size_t  size;
+
+    stream->ok = true;
+    while (stream->done < stream->total){
+        size = (stream->total - stream->done < sizeof(buffer)) ? stream->total - stream->done : sizeof(buffer);
+        for (size_t i = 0; i < size; i++)
+            buffer[i] = pattern(stream->done + i);
+
+        for (size_t offset = 0; offset < size; offset += count){
+            count = write(stream->fd, buffer + offset, size - offset);
+            if (count < 0){
+                if (errno == EINTR){ count = 0; continue; }
+                stream->ok = false;
+                return NULL;
+            }
+        }
+        stream->done += size;
+    }
+    return NULL;
+}
+
+
+static void* clientSender(void *context){
+    Stream      *stream = (Stream*)context;
+    UInt8       *buffer = (UInt8*)malloc(64 * 1024);
+    uint64_t    mode = kSendBlocking;
+    uint64_t    output[2];
+    uint32_t    outputCount;
+    size_t      size;
+
+    stream->ok = true;
+    while (stream->done < stream->total){
+        size = (stream->total - stream->done < 64 * 1024) ? stream->total - stream->done : 64 * 1024;
+        for (size_t i = 0; i < size; i++)
+            buffer[i] = pattern(stream->done + i);
+
+        outputCount = 2;
+        IOReturn result = VSPConnectCallMethod(stream->connection, kSendBuffer, &mode, 1, buffer, size,
+                                               output, &outputCount, NULL, NULL);
+        if ((result != kIOReturnSuccess) || (output[0] != size)){
+            fprintf(stderr, "    kSendBuffer returned 0x%x after %llu bytes\n", result, (unsigned long long)output[0]);
+            stream->ok = false;
+            break;
+        }
+        stream->done += size;
+    }
+    free(buffer);
+    return NULL;
+}
+
+
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool            done;
+    IOReturn        result;
+    UInt64          count;
+}Completion;
+
+
+static void readCompleted(void *refcon, IOReturn result, uint64_t *args, UInt32 numArgs){
+    Completion  *completion = (Completion*)refcon;
+
+    pthread_mutex_lock(&completion->lock);
+    completion->done = true;
+    completion->result = result;
+    completion->count = numArgs ? args[0] : 0;
+    pthread_cond_signal(&completion->cond);
+    pthread_mutex_unlock(&completion->lock);
+}
+
+
+// The client half of tty to client, keeping up to kReadsInFlight reads posted with kReadAsync.
+// Reads complete in the order they were posted, so the data is checked in that order too. The
+// reads posted never ask for more than is still to come, or the last ones would sit out their timeout.
+#define kReadsInFlight  4
+#define kReadSize       (64 * 1024)
+
+typedef struct{
+    UInt8       *buffer;
+    UInt64      size;
+    Completion  completion;
+}PostedRead;
+
+
+static bool postRead(VSPConnection *connection, PostedRead *read, UInt64 size){
+    uint64_t input[4] = { (uint64_t)(uintptr_t)read->buffer, size, 1, 1000 };
+
+    read->size = size;
+    read->completion.done = false;
+    IOReturn result = VSPConnectCallAsyncMethod(connection, kReadAsync, readCompleted, &read->completion,
+                                                input, 4, NULL, 0, NULL, NULL, NULL, NULL);
+    if (result != kIOReturnSuccess)
+        fprintf(stderr, "    kReadAsync returned 0x%x\n", result);
+    return result == kIOReturnSuccess;
+}
+
+
+static bool clientReceive(VSPConnection *connection, UInt64 total){
+    PostedRead  reads[kReadsInFlight];
+    UInt64      received = 0, asked = 0;
+    UInt32      head = 0, posted = 0;
+    bool        ok = true;
+
+    for (UInt32 i = 0; i < kReadsInFlight; i++){
+        reads[i].buffer = (UInt8*)malloc(kReadSize);
+        pthread_mutex_init(&reads[i].completion.lock, NULL);
+        pthread_cond_init(&reads[i].completion.cond, NULL);
+    }
+
+    while (ok && (received < total)){
+        // Top up, then wait for the oldest.
+        while (ok && (posted < kReadsInFlight) && (asked < total - received)){
+            UInt64 size = total - received - asked;
+
+            if (size > kReadSize) size = kReadSize;
+            ok = postRead(connection, &reads[(head + posted) % kReadsInFlight], size);
+            if (ok){
+                asked += size;
+                posted++;
+            }
+        }
+        if (!ok || !posted) break;
+
+        PostedRead  *read = &reads[head];
+        Completion  *completion = &read->completion;
+
+        pthread_mutex_lock(&completion->lock);
+        while (!completion->done)
+            pthread_cond_wait(&completion->cond, &completion->lock);
+        pthread_mutex_unlock(&completion->lock);
+        head = (head + 1) % kReadsInFlight;
+        posted--;
+        asked -= read->size;
+
+        if (completion->result != kIOReturnSuccess){
+            fprintf(stderr, "    read completed with 0x%x after %llu bytes\n", completion->result, (unsigned long long)received);
+            ok = false;
+            break;
+        }
+        ok = checkPattern(read->buffer, received, completion->count);
+        received += completion->count;
+    }
+
+    // After a failure the reads still posted complete with their timeout.
+    for (; posted; posted--, head = (head + 1) % kReadsInFlight){
+        pthread_mutex_lock(&reads[head].completion.lock);
+        while (!reads[head].completion.done)
+            pthread_cond_wait(&reads[head].completion.cond, &reads[head].completion.lock);
+        pthread_mutex_unlock(&reads[head].completion.lock);
+    }
+    for (UInt32 i = 0; i < kReadsInFlight; i++)
+        free(reads[i].buffer);
+    return ok && (received == total);
+}
+
+
+// The same amount of data through a pipe, written and read in the same size pieces.
+static double pipeRate(UInt64 total){
+    int         fds[2];
+    Stream      reader, writer;
+    pthread_t   readThread, writeThread;
+
+    if (pipe(fds) < 0) return 0;
+    bzero(&reader, sizeof(reader));
+    bzero(&writer, sizeof(writer));
+    reader.fd = fds[0];
+    reader.total = total;
+    writer.fd = fds[1];
+    writer.total = total;
+
+    double start = now();
+    pthread_create(&readThread, NULL, slaveReader, &reader);
+    pthread_create(&writeThread, NULL, slaveWriter, &writer);
+    pthread_join(writeThread, NULL);
+    pthread_join(readThread, NULL);
+    double elapsed = now() - start;
+
+    close(fds[0]);
+    close(fds[1]);
+    return (total / 1048576.0) / elapsed;
+}
+
+
+// Print a stream's rate next to the pipe's, and fail it if it fell below floor of that.
+static void reportRate(const char *name, double elapsed, double floor){
+    double  rate = (sStreamBytes / 1048576.0) / elapsed;
+    double  pipe = pipeRate(sStreamBytes);
+
+    if (sMinFraction)
+        floor = sMinFraction;
+    printf("  %-28s %6.1f MiB  %8.1f MiB/s  (pipe %.1f MiB/s)\n", name, sStreamBytes / 1048576.0, rate, pipe);
+    CHECK(rate >= pipe * floor, "%s at %.1f MiB/s is under %.0f%% of the pipe's %.1f MiB/s", name, rate,
+          floor * 100, pipe);
+}
+
+
+#pragma mark Telnet
+
+// The client end of vspd -t.
+typedef struct{
+    int             fd;
+    TelnetDecoder   decoder;
+    UInt8           input[4096];
+    UInt32          offset;
+    UInt32          length;
+}TelnetClient;
+
+
+static int telnetConnect(const char *address){
+    const char      *colon = strrchr(address, ':');
+    struct addrinfo hints, *info;
+    char            host[128];
+    int             fd, one = 1;
+
+    if ((colon == NULL) || ((size_t)(colon - address) >= sizeof(host))) return -1;
+    memcpy(host, address, colon - address);
+    host[colon - address] = 0;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &info) != 0) return -1;
+    fd = socket(info->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((fd >= 0) && (connect(fd, info->ai_addr, info->ai_addrlen) < 0)){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+
+static bool sendAll(int fd, const UInt8 *buffer, size_t size){
+    ssize_t count;
+
+    for (size_t offset = 0; offset < size; offset += count){
+        count = write(fd, buffer + offset, size - offset);
+        if (count < 0){
+            if (errno == EINTR){ count = 0; continue; }
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool sendComPort(TelnetClient *client, UInt8 code, const UInt8 *value, UInt32 length){
+    UInt8   command[6 + 2 * 8];
+
+    return sendAll(client->fd, command, TelnetComPort(command, code, value, length));
+}
+
+
+// Waits for the server's subnegotiation with code, passing over anything else on the way. Returns the
+// length of its value, or -1 if it doesn't come.
+static int readComPort(TelnetClient *client, UInt8 code, UInt8 *value){
+    TelnetDecoder   *decoder = &client->decoder;
+    const UInt8     *data;
+    UInt32          dataLength, used;
+    ssize_t         count;
+
+    for (;;){
+        if (client->length == 0){
+            struct pollfd fd = { client->fd, POLLIN, 0 };
+
+            if (poll(&fd, 1, 2000) <= 0) return -1;
+            count = read(client->fd, client->input, sizeof(client->input));
+            if (count <= 0) return -1;
+            client->offset = 0;
+            client->length = (UInt32)count;
+        }
+
+        UInt32 result = TelnetNext(decoder, client->input + client->offset, client->length, &used, &data, &dataLength);
+        client->offset += used;
+        client->length -= used;
+        if ((result == kTelnetCommand) && (decoder->Verb == kTelnetSB) && (decoder->Option == kTelnetComPort) &&
+            decoder->Length && (decoder->Data[0] == code + kComPortServer)){
+            memcpy(value, decoder->Data + 1, decoder->Length - 1);
+            return decoder->Length - 1;
+        }
+    }
+}
+
+
+// A one byte setting, returning the value the server answers with or -1.
+static int setComPort(TelnetClient *client, UInt8 code, UInt8 value){
+    UInt8   reply[kTelnetMaxSubnegotiation];
+
+    if (!sendComPort(client, code, &value, 1) || (readComPort(client, code, reply) != 1))
+        return -1;
+    return reply[0];
+}
+
+
+// The telnet client's halves of each direction. The pattern has 0xFF bytes all through it, so both
+// escape and unescape are kept busy.
+static void* telnetReader(void *context){
+    Stream          *stream = (Stream*)context;
+    UInt8           *buffer = (UInt8*)malloc(64 * 1024);
+    TelnetDecoder   decoder;
+    const UInt8     *data;
+    UInt32          dataLength, used;
+    ssize_t         count;
+
+    TelnetInit(&decoder);
+    stream->ok = true;
+    while (stream->ok && (stream->done < stream->total)){
+        count = read(stream->fd, buffer, 64 * 1024);
+        if (count <= 0){
+            if ((count < 0) && (errno == EINTR)) continue;
+            stream->ok = false;
+            break;
+        }
+        for (UInt32 offset = 0; offset < (UInt32)count; offset += used){
+            if ((TelnetNext(&decoder, buffer + offset, (UInt32)count - offset, &used, &data, &dataLength) != kTelnetData))
+                continue;
+            if (!checkPattern(data, stream->done, dataLength)){
+                stream->ok = false;
+                break;
+            }
+            stream->done += dataLength;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+
+static void* telnetWriter(void *context){
+    Stream  *stream = (Stream*)context;
+    UInt8   *buffer = (UInt8*)malloc(64 * 1024);
+    UInt8   *wire = (UInt8*)malloc(2 * 64 * 1024);
+    size_t  size;
+
+    stream->ok = true;
+    while (stream->done < stream->total){
+        size = (stream->total - stream->done < 64 * 1024) ? stream->total - stream->done : 64 * 1024;
+        for (size_t i = 0; i < size; i++)
+            buffer[i] = pattern(stream->done + i);
+        if (!sendAll(stream->fd, wire, TelnetEscape(wire, buffer, (UInt32)size))){
+            stream->ok = false;
+            break;
+        }
+        stream->done += size;
+    }
+    free(buffer);
+    free(wire);
+    return NULL;
+}
+
+
+#pragma mark main
+
+// With a telnet address vspd serves the tty side there, and prints the address it got for the slave's name.
+static pid_t startDaemon(const char *path, const char *socketPath, const char *telnetAddress, char *slaveName, size_t size){
+    int     fds[2];
+    pid_t   pid;
+    FILE    *output;
+
+    if (pipe(fds) < 0) return -1;
+    pid = fork();
+    if (pid == 0){
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (telnetAddress)
+            execl(path, path, "-s", socketPath, "-t", telnetAddress, (char*)NULL);
+        else
+            execl(path, path, "-s", socketPath, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    // vspd prints the slave's name once it is ready for connections.
+    output = fdopen(fds[0], "r");
+    if ((output == NULL) || (fscanf(output, "%127s", slaveName) != 1)){
+        if (output) fclose(output);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    fclose(output);
+    return pid;
+}
+
+
+// vspd -t on loopback, with a telnet client where the serial software was.
+static void testTelnet(const char *path){
+    char            socketPath[64], address[128];
+    UInt8           value[kTelnetMaxSubnegotiation];
+    TelnetClient    client;
+    VSPConnection   *connection;
+    pthread_t       thread;
+    Stream          stream;
+    pid_t           daemon;
+    int             status;
+
+    snprintf(socketPath, sizeof(socketPath), "/tmp/vsp-test-%d-telnet.sock", (int)getpid());
+    daemon = startDaemon(path, socketPath, "127.0.0.1:0", address, sizeof(address));
+    CHECK(daemon > 0, "could not start %s -t", path);
+    if (daemon < 0) return;
+    connection = VSPConnectionOpen(socketPath);
+    CHECK(connection != NULL, "could not connect to %s", socketPath);
+    if (connection == NULL){
+        kill(daemon, SIGKILL);
+        waitpid(daemon, NULL, 0);
+        return;
+    }
+    CHECK(VSPConnectCallMethod(connection, kClientOpen, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL) == kIOReturnSuccess,
+          "kClientOpen failed");
+
+    // Connecting acquires the port.
+    bzero(&client, sizeof(client));
+    TelnetInit(&client.decoder);
+    client.fd = telnetConnect(address);
+    CHECK(client.fd >= 0, "could not connect to %s", address);
+    CHECK(waitForState(connection, PD_S_ACQUIRED | PD_S_ACTIVE, PD_S_ACQUIRED | PD_S_ACTIVE), "port not acquired by the connection");
+    printf("  %-28s %s\n", "telnet open", address);
+
+    static const UInt8 negotiate[] = { kTelnetIAC, kTelnetWILL, kTelnetComPort, kTelnetIAC, kTelnetWILL, kTelnetBinary,
+                                       kTelnetIAC, kTelnetDO, kTelnetBinary };
+    CHECK(sendAll(client.fd, negotiate, sizeof(negotiate)), "negotiation not sent");
+
+    // Settings reach the port, and the replies carry what it took.
+    static const UInt8 rate[4] = { 0x00, 0x01, 0xC2, 0x00 };
+    CHECK(sendComPort(&client, kComPortSetBaudRate, rate, sizeof(rate)) && (readComPort(&client, kComPortSetBaudRate, value) == 4) &&
+          !memcmp(value, rate, sizeof(rate)), "SET-BAUDRATE not answered with 115200");
+    CHECK(requestEvent(connection, PD_E_DATA_RATE) == (115200 << 1), "PD_E_DATA_RATE is %u", requestEvent(connection, PD_E_DATA_RATE) >> 1);
+    CHECK(setComPort(&client, kComPortSetDataSize, 7) == 7, "SET-DATASIZE 7 not answered");
+    CHECK(requestEvent(connection, PD_E_DATA_SIZE) == (7 << 1), "PD_E_DATA_SIZE is %u", requestEvent(connection, PD_E_DATA_SIZE) >> 1);
+    CHECK(setComPort(&client, kComPortSetParity, kComPortParityEven) == kComPortParityEven, "SET-PARITY even not answered");
+    CHECK(requestEvent(connection, PD_E_DATA_INTEGRITY) == PD_RS232_PARITY_EVEN, "PD_E_DATA_INTEGRITY is %u",
+          requestEvent(connection, PD_E_DATA_INTEGRITY));
+    CHECK(setComPort(&client, kComPortSetStopSize, 2) == 2, "SET-STOPSIZE 2 not answered");
+    CHECK(requestEvent(connection, PD_RS232_E_STOP_BITS) == 4, "PD_RS232_E_STOP_BITS is %u", requestEvent(connection, PD_RS232_E_STOP_BITS));
+    CHECK(setComPort(&client, kComPortSetControl, kComPortControlHardware) == kComPortControlHardware, "SET-CONTROL hardware not answered");
+    CHECK((requestEvent(connection, PD_E_FLOW_CONTROL) & (PD_RS232_A_TXO | PD_RS232_A_CTS | PD_RS232_A_RFR)) == (PD_RS232_A_CTS | PD_RS232_A_RFR),
+          "PD_E_FLOW_CONTROL is 0x%x", requestEvent(connection, PD_E_FLOW_CONTROL));
+    CHECK(setComPort(&client, kComPortSetControl, kComPortControlDTROn) == kComPortControlDTROn, "SET-CONTROL DTR on not answered");
+    CHECK(portState(connection) & PD_RS232_S_DTR, "DTR not raised");
+
+    setComPort(&client, kComPortSetDataSize, 8);
+    setComPort(&client, kComPortSetParity, kComPortParityNone);
+    setComPort(&client, kComPortSetStopSize, 1);
+    setComPort(&client, kComPortSetControl, kComPortControlNoFlow);
+    printf("  %-28s\n", "telnet settings");
+
+    // The port's lines and line events reach the telnet client.
+    // The port starts with CTS up.
+    runCommand(connection, kBatchSetState, PD_RS232_S_CTS, 0);
+    CHECK((readComPort(&client, kComPortNotifyModemState, value) == 1) &&
+          ((value[0] & (kComPortModemCTS | kComPortModemDeltaCTS)) == kComPortModemDeltaCTS),
+          "no NOTIFY-MODEMSTATE for CTS dropping");
+    runCommand(connection, kBatchSetState, PD_RS232_S_CTS, PD_RS232_S_CTS);
+    CHECK(setComPort(&client, kComPortSetLineMask, kComPortLineBreak) == kComPortLineBreak, "SET-LINESTATE-MASK not answered");
+    runCommand(connection, kBatchSendEvent, PD_RS232_E_LINE_BREAK, true);
+    CHECK((readComPort(&client, kComPortNotifyLineState, value) == 1) && (value[0] == kComPortLineBreak), "no NOTIFY-LINESTATE for the break");
+    printf("  %-28s\n", "telnet notifications");
+
+    // Client to telnet.
+    bzero(&stream, sizeof(stream));
+    stream.fd = client.fd;
+    stream.total = sStreamBytes;
+    Stream sender = stream;
+    sender.connection = connection;
+    double start = now();
+    pthread_create(&thread, NULL, telnetReader, &stream);
+    clientSender(&sender);
+    pthread_join(thread, NULL);
+    double elapsed = now() - start;
+    CHECK(sender.ok && stream.ok && (stream.done == sStreamBytes), "client to telnet moved %llu bytes", (unsigned long long)stream.done);
+    reportRate("client to telnet", elapsed, kTelnetFloor);
+
+    // Telnet to client.
+    bzero(&stream, sizeof(stream));
+    stream.fd = client.fd;
+    stream.total = sStreamBytes;
+    start = now();
+    pthread_create(&thread, NULL, telnetWriter, &stream);
+    bool received = clientReceive(connection, sStreamBytes);
+    pthread_join(thread, NULL);
+    elapsed = now() - start;
+    CHECK(received && stream.ok, "telnet to client failed after %llu bytes written", (unsigned long long)stream.done);
+    reportRate("telnet to client", elapsed, kTelnetFloor);
+
+    // Disconnecting releases the port.
+    close(client.fd);
+    CHECK(waitForState(connection, PD_S_ACQUIRED, 0), "port still acquired after the disconnect");
+    printf("  %-28s\n", "telnet close");
+
+    VSPConnectCallMethod(connection, kClientClose, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
+    VSPConnectionClose(connection);
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, &status, 0);
+    CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0), "vspd -t exited with status 0x%x", status);
+}
+
+
+int main(int argc, char *argv[]){
+    char            socketPath[64], slaveName[128];
+    VSPConnection   *connection;
+    struct termios  termios;
+    pthread_t       thread;
+    Stream          stream;
+    pid_t           daemon;
+    int             option, slave, status;
+
+    while ((option = getopt(argc, argv, "m:f:")) != -1){
+        switch (option){
+            case 'm':   sStreamBytes = strtoull(optarg, NULL, 0) * 1024 * 1024;    break;
+            case 'f':   sMinFraction = strtod(optarg, NULL) / 100;                  break;
+            default:
+                fprintf(stderr, "usage: %s [-m MiB] [-f percent] path/to/vspd\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1){
+        fprintf(stderr, "usage: %s [-m MiB] [-f percent] path/to/vspd\n", argv[0]);
+        return 2;
+    }
+
+    snprintf(socketPath, sizeof(socketPath), "/tmp/vsp-test-%d.sock", (int)getpid());
+    daemon = startDaemon(argv[optind], socketPath, NULL, slaveName, sizeof(slaveName));
+    if (daemon < 0){
+        fprintf(stderr, "could not start %s\n", argv[optind]);
+        return 1;
+    }
+
+    connection = VSPConnectionOpen(socketPath);
+    if (connection == NULL){
+        fprintf(stderr, "could not connect to %s\n", socketPath);
+        kill(daemon, SIGKILL);
+        return 1;
+    }
+    CHECK(VSPConnectCallMethod(connection, kClientOpen, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL) == kIOReturnSuccess,
+          "kClientOpen failed");
+    VSPConnectionSetNotificationCallback(connection, notificationReceived, NULL);
+
+    // Opening the slave acquires the port, and its settings show up in the port.
+    slave = open(slaveName, O_RDWR | O_NOCTTY);
+    CHECK(slave >= 0, "could not open %s", slaveName);
+    tcgetattr(slave, &termios);
+    cfmakeraw(&termios);
+    cfsetspeed(&termios, B115200);
+    tcsetattr(slave, TCSANOW, &termios);
+    CHECK(waitForState(connection, PD_S_ACQUIRED | PD_S_ACTIVE, PD_S_ACQUIRED | PD_S_ACTIVE), "port not acquired by the open");
+
+    UInt32 rate = 0;
+    for (int i = 0; (i < 200) && (rate != (115200 << 1)); i++){
+        rate = requestEvent(connection, PD_E_DATA_RATE);
+        usleep(10 * 1000);
+    }
+    CHECK(rate == (115200 << 1), "PD_E_DATA_RATE is %u", rate >> 1);
+    CHECK(sNotifications[kPortDeltaID] > 0, "no kPortDeltaID notifications");
+    CHECK((requestEvent(connection, PD_E_RXQ_SIZE) >= 64 * 1024) && (requestEvent(connection, PD_E_TXQ_SIZE) >= 64 * 1024),
+          "vspd left the queues at %u and %u bytes", requestEvent(connection, PD_E_RXQ_SIZE), requestEvent(connection, PD_E_TXQ_SIZE));
+    printf("  %-28s %s\n", "open", slaveName);
+
+    // Client to tty.
+    bzero(&stream, sizeof(stream));
+    stream.fd = slave;
+    stream.total = sStreamBytes;
+    Stream sender = stream;
+    sender.connection = connection;
+    double start = now();
+    pthread_create(&thread, NULL, slaveReader, &stream);
+    clientSender(&sender);
+    pthread_join(thread, NULL);
+    double elapsed = now() - start;
+    CHECK(sender.ok && stream.ok && (stream.done == sStreamBytes), "client to tty moved %llu bytes", (unsigned long long)stream.done);
+    reportRate("client to tty", elapsed, kPtyFloor);
+
+    // tty to client.
+    bzero(&stream, sizeof(stream));
+    stream.fd = slave;
+    stream.total = sStreamBytes;
+    start = now();
+    pthread_create(&thread, NULL, slaveWriter, &stream);
+    bool received = clientReceive(connection, sStreamBytes);
+    pthread_join(thread, NULL);
+    elapsed = now() - start;
+    CHECK(received && stream.ok, "tty to client failed after %llu bytes written", (unsigned long long)stream.done);
+    reportRate("tty to client", elapsed, kPtyFloor);
+
+    // Closing the slave releases the port.
+    close(slave);
+    CHECK(waitForState(connection, PD_S_ACQUIRED, 0), "port still acquired after the close");
+    printf("  %-28s\n", "close");
+
+    VSPConnectCallMethod(connection, kClientClose, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
+    VSPConnectionClose(connection);
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, &status, 0);
+    CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0), "vspd exited with status 0x%x", status);
+
+    testTelnet(argv[optind]);
+
+    if (sFailures){
+        printf("%d check(s) failed\n", sFailures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,507 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Runs everything that can touch one port at the same time, for as long as asked, to shake out races
+//  in the port state, the queue locks and the client list. Build it with SANITIZE=thread to have
+//  ThreadSanitizer watch.
+//
+//  The port is opened and closed over and over. Each session acquires the tty side and lets the workers
+//  loose on it for a random 10 to 200 ms, then releases it; releasing has to get every worker out of
+//  whatever it is blocked in, and each must be parked again within kParkSeconds or the run fails as
+//  stuck. Within a session, every byte each way is checked against the stream pattern.
+//
+//  At the end a line per worker goes to stdout, as JSON like vsp-bench, with the operations it
+//  completed and their rate.
+//
+//    vsp-stress [-s seconds] [-v]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VSPFixture.h"
+
+
+static UInt32   sSeconds = 10;
+static int      sFailures;              // Changed with __atomic builtins
+
+#define kParkSeconds    10
+#define kMaxWrite       (16 * 1024)
+
+#define FAIL(...)                                                               \
+    do {                                                                        \
+        fprintf(stderr, "    %s:%d: ", __FILE__, __LINE__);                     \
+        fprintf(stderr, __VA_ARGS__);                                           \
+        fprintf(stderr, "\n");                                                  \
+        __atomic_add_fetch(&sFailures, 1, __ATOMIC_RELAXED);                    \
+    } while (0)
+
+
+#pragma mark Sessions
+
+typedef struct Worker{
+    const char  *name;
+    void        (*run)(struct Worker *worker);      // One session's worth
+    pthread_t   thread;
+    UInt32      seed;
+    bool        parked;             // Under sSession.lock
+    UInt64      ops;                // Successful calls, read by the controller once parked
+    UInt64      bytes;
+    UInt64      sessionBytes;       // Stream workers: bytes moved in the current session
+}Worker;
+
+static Fixture  sFixture;
+
+// The controller opens a session, and workers run until it closes and then park. open is also read
+// without the lock, as a hint to stop early.
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    UInt32          session;
+    bool            open;
+    bool            quit;
+    UInt32          parked;
+}sSession = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false, false, 0 };
+
+
+static bool sessionOpen(void){
+
+    return __atomic_load_n(&sSession.open, __ATOMIC_ACQUIRE);
+}
+
+
+// Park after the last session and wait for the next one. Returns false when the run is over.
+static bool nextSession(Worker *worker, UInt32 *session){
+    bool    running;
+
+    pthread_mutex_lock(&sSession.lock);
+    if (*session){
+        worker->parked = true;
+        sSession.parked++;
+        pthread_cond_broadcast(&sSession.cond);
+    }
+    while (!sSession.quit && (sSession.session == *session))
+        pthread_cond_wait(&sSession.cond, &sSession.lock);
+    *session = sSession.session;
+    worker->parked = false;
+    running = !sSession.quit;
+    pthread_mutex_unlock(&sSession.lock);
+
+    return running;
+}
+
+
+static UInt32 random32(UInt32 *seed){
+
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+
+#pragma mark Workers
+
+static void* runWorker(void *context){
+    Worker  *worker = (Worker*)context;
+    UInt32  session = 0;
+
+    while (nextSession(worker, &session)){
+        worker->sessionBytes = 0;
+        worker->run(worker);
+    }
+    return NULL;
+}
+
+
+// Client to tty: kSendBlocking in random sizes.
+static void clientSender(Worker *worker){
+    UInt8       *buffer = (UInt8*)malloc(kMaxWrite);
+    UInt32      size, accepted;
+    IOReturn    result;
+
+    while (sessionOpen()){
+        size = 1 + (random32(&worker->seed) % kMaxWrite);
+        fillPattern(buffer, worker->sessionBytes, size);
+
+        result = sendBuffer(&sFixture, kSendBlocking, buffer, size, &accepted);
+        worker->sessionBytes += accepted;
+        worker->bytes += accepted;
+        if (result != kIOReturnSuccess) break;
+        worker->ops++;
+    }
+    free(buffer);
+}
+
+
+// The tty reading the client's stream, sleeping in watchState when there is nothing.
+static void ttyReader(Worker *worker){
+    Fixture     *f = &sFixture;
+    UInt8       buffer[4096];
+    UInt32      count, state;
+
+    while (sessionOpen()){
+        if (f->port->dequeueData(buffer, 1 + (random32(&worker->seed) % sizeof(buffer)), &count, 0, f->refCon) != kIOReturnSuccess)
+            break;
+
+        if (count){
+            if (!checkPattern(buffer, worker->sessionBytes, count)){
+                FAIL("client to tty data is wrong");
+                break;
+            }
+            worker->sessionBytes += count;
+            worker->bytes += count;
+            worker->ops++;
+            continue;
+        }
+
+        state = 0;
+        if (f->port->watchState(&state, PD_S_RXQ_EMPTY, f->refCon) != kIOReturnSuccess)
+            break;
+        worker->ops++;
+    }
+}
+
+
+// The tty writing, sleeping in enqueueData when the TX queue is full.
+static void ttyWriter(Worker *worker){
+    Fixture     *f = &sFixture;
+    UInt8       buffer[kMaxWrite];
+    UInt32      size, count;
+    IOReturn    result;
+
+    while (sessionOpen()){
+        size = 1 + (random32(&worker->seed) % sizeof(buffer));
+        fillPattern(buffer, worker->sessionBytes, size);
+
+        result = f->port->enqueueData(buffer, size, &count, true, f->refCon);
+        worker->sessionBytes += count;
+        worker->bytes += count;
+        if (result != kIOReturnSuccess) break;
+        worker->ops++;
+    }
+}
+
+
+// The client reading the tty's stream with kReadAsync, one read at a time with a short timeout.
+static void clientReader(Worker *worker){
+    UInt8               buffer[kMaxWrite];
+    Completion          completion;
+    OSAsyncReference64  reference;
+    IOReturn            result;
+
+    initCompletion(&completion);
+    makeReference(reference, &completion);
+
+    while (sessionOpen()){
+        uint64_t input[4] = { (uint64_t)(uintptr_t)buffer, 1 + (random32(&worker->seed) % sizeof(buffer)), 1, 50 };
+
+        completion.outstanding = 1;
+        result = HostCallMethod(sFixture.client, kReadAsync, input, 4, NULL, 0, NULL, NULL, NULL, NULL, reference);
+        if (result != kIOReturnSuccess){
+            // Every slot is taken only if reads leaked.
+            if (result == kIOReturnNoResources)
+                FAIL("kReadAsync has no free slots");
+            break;
+        }
+
+        pthread_mutex_lock(&completion.lock);
+        while (completion.outstanding)
+            pthread_cond_wait(&completion.cond, &completion.lock);
+        pthread_mutex_unlock(&completion.lock);
+
+        if (completion.count && !checkPattern(buffer, worker->sessionBytes, completion.count)){
+            FAIL("tty to client data is wrong");
+            break;
+        }
+        worker->sessionBytes += completion.count;
+        worker->bytes += completion.count;
+        if ((completion.result != kIOReturnSuccess) && (completion.result != kIOReturnTimeout)) break;
+        worker->ops++;
+    }
+}
+
+
+// Wait for DTR to change; the toggler keeps changing it.
+static void stateWatcher(Worker *worker){
+    Fixture     *f = &sFixture;
+    UInt32      state;
+
+    while (sessionOpen()){
+        state = (f->port->getState(f->refCon) ^ PD_RS232_S_DTR) & PD_RS232_S_DTR;
+        if (f->port->watchState(&state, PD_RS232_S_DTR, f->refCon) != kIOReturnSuccess)
+            break;
+        worker->ops++;
+    }
+}
+
+
+// DTR from the tty side, CTS and the baud rate from the client in batches.
+static void stateToggler(Worker *worker){
+    Fixture         *f = &sFixture;
+    BatchCommand    commands[3];
+    BatchResult     results[3];
+    UInt32          pass = 0;
+
+    commands[0].Command = kBatchSetState;
+    commands[0].Arg0 = PD_RS232_S_CTS;
+    commands[1].Command = kBatchExecuteEvent;
+    commands[1].Arg0 = PD_E_DATA_RATE;
+    commands[2].Command = kBatchGetState;
+    commands[2].Arg0 = 0;
+    commands[2].Arg1 = 0;
+
+    while (sessionOpen()){
+        size_t resultSize = sizeof(results);
+
+        pass++;
+        if (f->port->setState((pass & 1) ? PD_RS232_S_DTR : 0, PD_RS232_S_DTR, f->refCon) != kIOReturnSuccess)
+            break;
+
+        commands[0].Arg1 = (pass & 2) ? PD_RS232_S_CTS : 0;
+        commands[1].Arg1 = (9600 + (pass % 4) * 100) << 1;
+        if (HostCallMethod(f->client, kExecuteBatch, NULL, 0, commands, sizeof(commands), NULL, NULL, results, &resultSize) != kIOReturnSuccess)
+            break;
+        worker->ops++;
+    }
+}
+
+
+// Another tty trying to take the port it can't have.
+static void contender(Worker *worker){
+    Fixture     *f = &sFixture;
+    IOReturn    result;
+
+    while (sessionOpen()){
+        result = f->port->acquirePort(false, f->refCon);
+        if (result == kIOReturnSuccess){
+            // The controller closes the session before it releases the port, so this is only
+            // possible once the session is over.
+            bool open = sessionOpen();
+
+            f->port->releasePort(f->refCon);
+            if (open)
+                FAIL("acquirePort succeeded on a port that was already acquired");
+            break;
+        }
+        if (result != kIOReturnExclusiveAccess){
+            FAIL("acquirePort returned 0x%x", result);
+            break;
+        }
+        worker->ops++;
+        sched_yield();
+    }
+}
+
+
+static UInt32   sMessages;          // Changed with __atomic builtins
+
+
+static void messageHandler(mach_msg_header_t *msg, mach_msg_size_t size, void *context){
+
+    __atomic_add_fetch(&sMessages, 1, __ATOMIC_RELAXED);
+}
+
+
+// User clients coming and going while everything else runs.
+static void clientChurn(Worker *worker){
+    Fixture     *f = &sFixture;
+    uint64_t    subscription[2] = { ~0ULL, ~0ULL };
+    uint64_t    output[2];
+    UInt32      outputCount;
+
+    while (sessionOpen()){
+        VSPUserClient   *client = new VSPUserClient;
+        IOUserClient    *userClient = client;
+
+        if (!userClient->initWithTask(kernel_task, NULL, 0) || !client->attach(f->port) || !client->start(f->port)){
+            FAIL("VSPUserClient failed to start");
+            client->release();
+            break;
+        }
+        if (HostCallMethod(client, kClientOpen, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL) != kIOReturnSuccess){
+            FAIL("kClientOpen failed");
+        } else {
+            userClient->registerNotificationPort(2, 0, 0);
+            HostCallMethod(client, kSetSubscription, subscription, 2, NULL, 0, NULL, NULL, NULL, NULL);
+            outputCount = 2;
+            HostCallMethod(client, kGetCredits, NULL, 0, NULL, 0, output, &outputCount, NULL, NULL);
+            HostCallMethod(client, kClientGetInfo, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
+        }
+        userClient->clientClose();
+        client->release();
+        worker->ops++;
+    }
+}
+
+
+// Name and run, the rest is filled in as the workers go.
+static Worker sWorkers[] = {
+    { "client-send",    clientSender,   0, 0, false, 0, 0, 0 },
+    { "tty-read",       ttyReader,      0, 0, false, 0, 0, 0 },
+    { "tty-write",      ttyWriter,      0, 0, false, 0, 0, 0 },
+    { "client-read",    clientReader,   0, 0, false, 0, 0, 0 },
+    { "watch-1",        stateWatcher,   0, 0, false, 0, 0, 0 },
+    { "watch-2",        stateWatcher,   0, 0, false, 0, 0, 0 },
+    { "toggle",         stateToggler,   0, 0, false, 0, 0, 0 },
+    { "contend",        contender,      0, 0, false, 0, 0, 0 },
+    { "client-churn",   clientChurn,    0, 0, false, 0, 0, 0 },
+};
+
+#define kNumWorkers     (sizeof(sWorkers) / sizeof(sWorkers[0]))
+
+
+static Worker* findWorker(const char *name){
+
+    for (UInt32 i = 0; i < kNumWorkers; i++){
+        if (strcmp(sWorkers[i].name, name) == 0)
+            return &sWorkers[i];
+    }
+    return NULL;
+}
+
+
+#pragma mark Controller
+
+// Wait for every worker to park. Returns false if one doesn't in time.
+static bool waitForParked(void){
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += kParkSeconds;
+
+    pthread_mutex_lock(&sSession.lock);
+    while (sSession.parked < kNumWorkers){
+        if (pthread_cond_timedwait(&sSession.cond, &sSession.lock, &deadline) != 0)
+            break;
+    }
+    bool parked = (sSession.parked == kNumWorkers);
+    pthread_mutex_unlock(&sSession.lock);
+
+    return parked;
+}
+
+
+static bool runSession(UInt32 *seed){
+    Fixture *f = &sFixture;
+
+    IOReturn result = f->port->acquirePort(false, f->refCon);
+    if (result == kIOReturnSuccess)
+        result = f->port->executeEvent(PD_E_ACTIVE, true, f->refCon);
+    if (result != kIOReturnSuccess){
+        FAIL("session %u: could not open the tty side, 0x%x, state 0x%x", sSession.session + 1, result, f->port->readPortState());
+        return false;
+    }
+
+    pthread_mutex_lock(&sSession.lock);
+    sSession.session++;
+    sSession.parked = 0;
+    __atomic_store_n(&sSession.open, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&sSession.cond);
+    pthread_mutex_unlock(&sSession.lock);
+
+    sleepMilliseconds(10 + (random32(seed) % 190));
+
+    // Releasing the port has to get everyone out.
+    __atomic_store_n(&sSession.open, false, __ATOMIC_RELEASE);
+    f->port->releasePort(f->refCon);
+
+    if (!waitForParked()){
+        FAIL("session %u: workers still running %u seconds after the port was released", sSession.session, kParkSeconds);
+        pthread_mutex_lock(&sSession.lock);
+        for (UInt32 i = 0; i < kNumWorkers; i++){
+            if (!sWorkers[i].parked)
+                fprintf(stderr, "      %s is stuck\n", sWorkers[i].name);
+        }
+        pthread_mutex_unlock(&sSession.lock);
+        return false;
+    }
+
+    // Nothing can arrive that wasn't sent.
+    Worker *sender = findWorker("client-send"), *ttyRead = findWorker("tty-read");
+    Worker *ttyWrite = findWorker("tty-write"), *clientRead = findWorker("client-read");
+    if (ttyRead->sessionBytes > sender->sessionBytes)
+        FAIL("session %u: tty read %llu bytes of %llu sent", sSession.session,
+             (unsigned long long)ttyRead->sessionBytes, (unsigned long long)sender->sessionBytes);
+    if (clientRead->sessionBytes > ttyWrite->sessionBytes)
+        FAIL("session %u: client read %llu bytes of %llu written", sSession.session,
+             (unsigned long long)clientRead->sessionBytes, (unsigned long long)ttyWrite->sessionBytes);
+
+    return __atomic_load_n(&sFailures, __ATOMIC_RELAXED) == 0;
+}
+
+
+#pragma mark main
+
+int main(int argc, char *argv[]){
+    UInt32  seed = 0x2545F491;
+    int     option;
+
+    while ((option = getopt(argc, argv, "s:v")) != -1){
+        switch (option){
+            case 's':   sSeconds = (UInt32)strtoul(optarg, NULL, 0);  break;
+            case 'v':   HostSetLogging(true);                           break;
+            default:
+                fprintf(stderr, "usage: %s [-s seconds] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    HostSetMessageHandler(messageHandler, NULL);
+
+    // The fixture leaves the port open; the sessions do their own opening.
+    if (!openFixture(&sFixture, kOverflowDropNewest)){
+        closeFixture(&sFixture);
+        return 1;
+    }
+    sFixture.port->releasePort(sFixture.refCon);
+
+    for (UInt32 i = 0; i < kNumWorkers; i++){
+        sWorkers[i].seed = 0x9E3779B9 * (i + 1);
+        pthread_create(&sWorkers[i].thread, NULL, runWorker, &sWorkers[i]);
+    }
+
+    double start = now(), lastReport = start;
+    UInt32 sessions = 0;
+    while (now() - start < sSeconds){
+        if (!runSession(&seed))
+            break;
+        sessions++;
+
+        if (now() - lastReport >= 10){
+            fprintf(stderr, "  %4.0f s  %u sessions\n", now() - start, sessions);
+            lastReport = now();
+        }
+    }
+    double elapsed = now() - start;
+
+    // Stuck workers can't be joined.
+    if (__atomic_load_n(&sFailures, __ATOMIC_RELAXED) == 0){
+        pthread_mutex_lock(&sSession.lock);
+        sSession.quit = true;
+        pthread_cond_broadcast(&sSession.cond);
+        pthread_mutex_unlock(&sSession.lock);
+        for (UInt32 i = 0; i < kNumWorkers; i++)
+            pthread_join(sWorkers[i].thread, NULL);
+        closeFixture(&sFixture);
+    }
+
+    printf("{\"worker\":\"sessions\",\"ops\":%u,\"ops_per_sec\":%.1f,\"seconds\":%.1f}\n", sessions, sessions / elapsed, elapsed);
+    for (UInt32 i = 0; i < kNumWorkers; i++){
+        Worker *worker = &sWorkers[i];
+
+        printf("{\"worker\":\"%s\",\"ops\":%llu,\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.0f}\n", worker->name,
+               (unsigned long long)worker->ops, worker->ops / elapsed, worker->bytes / elapsed);
+        if (worker->ops == 0)
+            FAIL("%s never completed an operation", worker->name);
+    }
+    printf("{\"worker\":\"notifications\",\"ops\":%u,\"ops_per_sec\":%.1f}\n", sMessages, sMessages / elapsed);
+
+    if (sFailures){
+        fprintf(stderr, "%d check(s) failed\n", sFailures);
+        return 1;
+    }
+    fprintf(stderr, "no failures in %u sessions\n", sessions);
+    return 0;
+}
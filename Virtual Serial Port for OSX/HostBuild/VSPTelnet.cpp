@@ -0,0 +1,158 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Telnet framing for vspd -t and its clients, see VSPTelnet.h.
+//
+
+#include "VSPTelnet.h"
+
+
+enum{
+    kStateData,
+    kStateIAC,                  // After IAC
+    kStateOption,               // After IAC WILL, WONT, DO or DONT
+    kStateSubOption,            // After IAC SB
+    kStateSubData,
+    kStateSubIAC                // IAC inside a subnegotiation
+};
+
+
+void TelnetInit(TelnetDecoder *Decoder){
+
+    bzero(Decoder, sizeof(TelnetDecoder));
+    Decoder->State = kStateData;
+}
+
+
+// Data from Input up to the next IAC, or the end.
+static UInt32 dataRun(const UInt8 *Input, UInt32 Length){
+    const UInt8 *iac = (const UInt8*)memchr(Input, kTelnetIAC, Length);
+
+    return iac ? (UInt32)(iac - Input) : Length;
+}
+
+
+UInt32 TelnetNext(TelnetDecoder *Decoder, const UInt8 *Input, UInt32 Length, UInt32 *Used,
+                  const UInt8 **Data, UInt32 *DataLength){
+    UInt32  i = 0;
+
+    *Data = NULL;
+    *DataLength = 0;
+    while (i < Length){
+        UInt8 byte = Input[i];
+
+        switch (Decoder->State){
+            case kStateData:{
+                UInt32 run = dataRun(Input + i, Length - i);
+
+                if (run){
+                    *Data = Input + i;
+                    *DataLength = run;
+                    *Used = i + run;
+                    return kTelnetData;
+                }
+                Decoder->State = kStateIAC;
+                i++;
+                break;
+            }
+
+            case kStateIAC:
+                i++;
+                if (byte == kTelnetIAC){
+                    // An escaped 0xFF: the second one is the data, and so is whatever follows it.
+                    Decoder->State = kStateData;
+                    *Data = Input + i - 1;
+                    *DataLength = 1 + dataRun(Input + i, Length - i);
+                    *Used = i - 1 + *DataLength;
+                    return kTelnetData;
+                }
+                if ((byte >= kTelnetWILL) && (byte <= kTelnetDONT)){
+                    Decoder->Verb = byte;
+                    Decoder->State = kStateOption;
+                    break;
+                }
+                if (byte == kTelnetSB){
+                    Decoder->State = kStateSubOption;
+                    break;
+                }
+                Decoder->Verb = byte;
+                Decoder->State = kStateData;
+                *Used = i;
+                return kTelnetCommand;
+
+            case kStateOption:
+                Decoder->Option = byte;
+                Decoder->State = kStateData;
+                *Used = i + 1;
+                return kTelnetCommand;
+
+            case kStateSubOption:
+                Decoder->Option = byte;
+                Decoder->Length = 0;
+                Decoder->State = kStateSubData;
+                i++;
+                break;
+
+            case kStateSubData:
+                if (byte == kTelnetIAC)
+                    Decoder->State = kStateSubIAC;
+                else if (Decoder->Length < kTelnetMaxSubnegotiation)
+                    Decoder->Data[Decoder->Length++] = byte;
+                i++;
+                break;
+
+            case kStateSubIAC:
+                i++;
+                if (byte == kTelnetSE){
+                    Decoder->Verb = kTelnetSB;
+                    Decoder->State = kStateData;
+                    *Used = i;
+                    return kTelnetCommand;
+                }
+                if ((byte == kTelnetIAC) && (Decoder->Length < kTelnetMaxSubnegotiation))
+                    Decoder->Data[Decoder->Length++] = byte;
+                Decoder->State = kStateSubData;
+                break;
+        }
+    }
+
+    *Used = Length;
+    return kTelnetNeedMore;
+}
+
+
+UInt32 TelnetEscape(UInt8 *Output, const UInt8 *Input, UInt32 Length){
+    UInt8   *start = Output;
+    UInt32  run;
+
+    while (Length){
+        run = dataRun(Input, Length);
+        memcpy(Output, Input, run);
+        Output += run;
+        Input += run;
+        Length -= run;
+        if (Length){
+            *Output++ = kTelnetIAC;
+            *Output++ = kTelnetIAC;
+            Input++;
+            Length--;
+        }
+    }
+
+    return (UInt32)(Output - start);
+}
+
+
+UInt32 TelnetComPort(UInt8 *Output, UInt8 Code, const UInt8 *Value, UInt32 Length){
+    UInt32  size = 0;
+
+    Output[size++] = kTelnetIAC;
+    Output[size++] = kTelnetSB;
+    Output[size++] = kTelnetComPort;
+    Output[size++] = Code;
+    size += TelnetEscape(Output + size, Value, Length);
+    Output[size++] = kTelnetIAC;
+    Output[size++] = kTelnetSE;
+
+    return size;
+}
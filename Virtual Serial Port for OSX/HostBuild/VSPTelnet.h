@@ -0,0 +1,129 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Telnet with the RFC 2217 COM-PORT-OPTION, as vspd -t serves the tty side of the port, and the pieces a
+//  client needs to talk to it. Data moves in whole buffers: TelnetNext hands back runs of data where they
+//  lie in the input, so only an escaped 0xFF splits a run, and TelnetEscape doubles 0xFF bytes with one
+//  copy per run between them.
+//
+
+#ifndef VSP_TELNET_H
+#define VSP_TELNET_H
+
+#include "HostKernel.h"
+
+// Telnet commands, RFC 854.
+enum{
+    kTelnetSE       = 240,
+    kTelnetNOP      = 241,
+    kTelnetBreak    = 243,
+    kTelnetSB       = 250,
+    kTelnetWILL     = 251,
+    kTelnetWONT     = 252,
+    kTelnetDO       = 253,
+    kTelnetDONT     = 254,
+    kTelnetIAC      = 255
+};
+
+// Options.
+enum{
+    kTelnetBinary   = 0,
+    kTelnetEcho     = 1,
+    kTelnetSGA      = 3,
+    kTelnetComPort  = 44
+};
+
+// COM-PORT-OPTION subnegotiations, client to server. The server answers with the code + kComPortServer.
+enum{
+    kComPortSignature       = 0,
+    kComPortSetBaudRate     = 1,    // 4 bytes, big endian, 0 asks for the current rate
+    kComPortSetDataSize     = 2,    // 5 to 8, 0 asks
+    kComPortSetParity       = 3,    // kComPortParity..., 0 asks
+    kComPortSetStopSize     = 4,    // 1, 2, or 3 for 1.5, 0 asks
+    kComPortSetControl      = 5,    // kComPortControl...
+    kComPortNotifyLineState = 6,    // Server to client only
+    kComPortNotifyModemState = 7,
+    kComPortFlowSuspend     = 8,    // Stop sending data to the client
+    kComPortFlowResume      = 9,
+    kComPortSetLineMask     = 10,
+    kComPortSetModemMask    = 11,
+    kComPortPurgeData       = 12    // 1 data to the client, 2 data from it, 3 both
+};
+#define kComPortServer      100
+
+enum{
+    kComPortParityNone = 1,
+    kComPortParityOdd,
+    kComPortParityEven,
+    kComPortParityMark,
+    kComPortParitySpace
+};
+
+enum{
+    kComPortControlAskFlow = 0,
+    kComPortControlNoFlow,
+    kComPortControlXonXoff,
+    kComPortControlHardware,
+    kComPortControlAskBreak,
+    kComPortControlBreakOn,
+    kComPortControlBreakOff,
+    kComPortControlAskDTR,
+    kComPortControlDTROn,
+    kComPortControlDTROff,
+    kComPortControlAskRTS,
+    kComPortControlRTSOn,
+    kComPortControlRTSOff,
+    kComPortControlAskInbound,
+    kComPortControlInboundNone,
+    kComPortControlInboundXonXoff,
+    kComPortControlInboundHardware
+};
+
+// NOTIFY-MODEMSTATE and NOTIFY-LINESTATE bits.
+#define kComPortModemCD         0x80
+#define kComPortModemRI         0x40
+#define kComPortModemDSR        0x20
+#define kComPortModemCTS        0x10
+#define kComPortModemDeltaCD    0x08
+#define kComPortModemRIEnded    0x04
+#define kComPortModemDeltaDSR   0x02
+#define kComPortModemDeltaCTS   0x01
+
+#define kComPortLineBreak       0x10
+#define kComPortLineFraming     0x08
+#define kComPortLineParity      0x04
+#define kComPortLineOverrun     0x02
+
+
+#define kTelnetMaxSubnegotiation    64      // Longer ones are cut short, none we act on comes close
+
+enum{
+    kTelnetNeedMore,        // Everything was taken, any command it started isn't complete yet
+    kTelnetData,            // A run of data, left where it was in the input
+    kTelnetCommand          // A whole command, in the decoder
+};
+
+typedef struct{
+    UInt32  State;
+    UInt8   Verb;                           // The command: kTelnetWILL ... kTelnetDONT, kTelnetSB, or another
+    UInt8   Option;                         // Its option, and for kTelnetSB the bytes that followed
+    UInt8   Data[kTelnetMaxSubnegotiation];
+    UInt32  Length;
+}TelnetDecoder;
+
+void    TelnetInit(TelnetDecoder *Decoder);
+
+// Takes the next piece of input, setting Used to how much of it that was. For kTelnetData, Data points
+// at the DataLength bytes of data inside the input.
+UInt32  TelnetNext(TelnetDecoder *Decoder, const UInt8 *Input, UInt32 Length, UInt32 *Used,
+                   const UInt8 **Data, UInt32 *DataLength);
+
+// Copies Length bytes of data to Output with every 0xFF doubled and returns the size written. Output needs
+// room for twice the input.
+UInt32  TelnetEscape(UInt8 *Output, const UInt8 *Input, UInt32 Length);
+
+// Writes IAC SB COM-PORT-OPTION Code Value IAC SE to Output, escaping Value, and returns its size. Output
+// needs room for 6 + 2 * Length bytes.
+UInt32  TelnetComPort(UInt8 *Output, UInt8 Code, const UInt8 *Value, UInt32 Length);
+
+#endif
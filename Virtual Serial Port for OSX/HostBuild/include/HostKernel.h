@@ -0,0 +1,467 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Just enough of the kernel, libkern and IOKit for the driver sources to build and run as an
+//  ordinary user space program. Everything lives in this one header; the <IOKit/...>, <kern/...>
+//  and <libkern/...> headers next to it only include it. The PD_ values have the same shape as
+//  the ones in the macOS SDK, nothing in the driver depends on the exact numbers.
+//
+
+#ifndef HOST_KERNEL_H
+#define HOST_KERNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <new>
+
+
+#pragma mark Types
+
+typedef uint8_t     UInt8;
+typedef int8_t      SInt8;
+typedef uint16_t    UInt16;
+typedef int16_t     SInt16;
+typedef uint32_t    UInt32;
+typedef int32_t     SInt32;
+typedef uint64_t    UInt64;
+typedef int64_t     SInt64;
+typedef UInt32      IOOptionBits;
+typedef UInt64      IOByteCount;
+typedef int         kern_return_t;
+typedef kern_return_t   IOReturn;
+typedef int         boolean_t;
+typedef unsigned int    natural_t;
+typedef uint64_t    mach_vm_address_t;
+typedef uint64_t    io_user_reference_t;
+typedef uintptr_t   vm_size_t;
+typedef void*       task_t;
+typedef void*       event_t;
+typedef int         wait_result_t;
+typedef int         wait_interrupt_t;
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+#define NSEC_PER_SEC    1000000000ULL
+#define NSEC_PER_MSEC   1000000ULL
+#define NSEC_PER_USEC   1000ULL
+
+struct mach_timespec{
+    unsigned int    tv_sec;
+    int             tv_nsec;
+};
+typedef struct mach_timespec mach_timespec_t;
+
+extern task_t       kernel_task;
+extern vm_size_t    page_size;
+
+static inline unsigned int min(unsigned int a, unsigned int b){ return (a < b) ? a : b; }
+static inline unsigned long ulmin(unsigned long a, unsigned long b){ return (a < b) ? a : b; }
+static inline unsigned int max(unsigned int a, unsigned int b){ return (a > b) ? a : b; }
+
+
+#pragma mark IOReturn
+
+#define iokit_common_err(return)    ((IOReturn)(0xe0000000 | (return)))
+
+#define kIOReturnSuccess            0
+#define kIOReturnError              iokit_common_err(0x2bc)
+#define kIOReturnNoMemory           iokit_common_err(0x2bd)
+#define kIOReturnNoResources        iokit_common_err(0x2be)
+#define kIOReturnIPCError           iokit_common_err(0x2bf)
+#define kIOReturnBadArgument        iokit_common_err(0x2c2)
+#define kIOReturnExclusiveAccess    iokit_common_err(0x2c5)
+#define kIOReturnUnsupported        iokit_common_err(0x2c7)
+#define kIOReturnVMError            iokit_common_err(0x2c8)
+#define kIOReturnIOError            iokit_common_err(0x2ca)
+#define kIOReturnNotOpen            iokit_common_err(0x2cd)
+#define kIOReturnBusy               iokit_common_err(0x2d5)
+#define kIOReturnTimeout            iokit_common_err(0x2d6)
+#define kIOReturnOffline            iokit_common_err(0x2d7)
+#define kIOReturnNotReady           iokit_common_err(0x2d8)
+#define kIOReturnNotAttached        iokit_common_err(0x2d9)
+#define kIOReturnNoSpace            iokit_common_err(0x2db)
+#define kIOReturnAborted            iokit_common_err(0x2eb)
+#define kIOReturnNotFound           iokit_common_err(0x2f0)
+
+#define KERN_SUCCESS                0
+
+
+#pragma mark Logging and Memory
+
+void    IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void    Debugger(const char *message);
+void*   IOMalloc(vm_size_t size);
+void    IOFree(void *address, vm_size_t size);
+
+// libkern has strlcpy, glibc only from 2.38.
+static inline size_t vsp_strlcpy(char *dst, const char *src, size_t size){
+    size_t  length = strlen(src);
+
+    if (size){
+        size_t copy = (length < size) ? length : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = 0;
+    }
+    return length;
+}
+#define strlcpy vsp_strlcpy
+
+
+#pragma mark Waiting
+
+// Waits are keyed by an event address. A thread registers with assert_wait, drops whatever lock it
+// holds, then sleeps in thread_block until a thread_wakeup on the same event.
+#define THREAD_UNINT            0
+#define THREAD_INTERRUPTIBLE    1
+#define THREAD_ABORTSAFE        2
+
+#define THREAD_WAITING          -1
+#define THREAD_AWAKENED         0
+#define THREAD_TIMED_OUT        1
+#define THREAD_INTERRUPTED      2
+#define THREAD_RESTART          3
+
+typedef void (*thread_continue_t)(void *parameter, wait_result_t result);
+#define THREAD_CONTINUE_NULL    ((thread_continue_t)0)
+
+wait_result_t   assert_wait(event_t event, wait_interrupt_t interruptible);
+wait_result_t   thread_block(thread_continue_t continuation);
+kern_return_t   thread_wakeup_prim(event_t event, boolean_t one_thread, wait_result_t result);
+
+#define thread_wakeup(x)                    thread_wakeup_prim((x), FALSE, THREAD_AWAKENED)
+#define thread_wakeup_with_result(x, z)     thread_wakeup_prim((x), FALSE, (z))
+#define thread_wakeup_one(x)                thread_wakeup_prim((x), TRUE, THREAD_AWAKENED)
+
+typedef struct _IOLock IOLock;
+
+IOLock* IOLockAlloc(void);
+void    IOLockFree(IOLock *lock);
+void    IOLockLock(IOLock *lock);
+bool    IOLockTryLock(IOLock *lock);
+void    IOLockUnlock(IOLock *lock);
+int     IOLockSleep(IOLock *lock, void *event, UInt32 interType);
+void    IOLockWakeup(IOLock *lock, void *event, bool oneThread);
+
+
+#pragma mark Time
+
+// Absolute time is in nanoseconds of CLOCK_MONOTONIC.
+enum{
+    kNanosecondScale    = 1,
+    kMicrosecondScale   = 1000,
+    kMillisecondScale   = 1000 * 1000,
+    kSecondScale        = 1000 * 1000 * 1000
+};
+
+void    clock_get_uptime(uint64_t *result);
+void    clock_interval_to_deadline(UInt32 interval, UInt32 scale_factor, uint64_t *result);
+void    nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result);
+void    absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+
+
+#pragma mark Thread Calls
+
+// Calls run one at a time on a single worker thread, in deadline order.
+typedef void*   thread_call_param_t;
+typedef void    (*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+typedef struct thread_call* thread_call_t;
+
+thread_call_t   thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+boolean_t       thread_call_enter(thread_call_t call);
+boolean_t       thread_call_enter_delayed(thread_call_t call, uint64_t deadline);
+boolean_t       thread_call_cancel(thread_call_t call);
+boolean_t       thread_call_cancel_wait(thread_call_t call);
+boolean_t       thread_call_free(thread_call_t call);
+
+
+#pragma mark Atomics
+
+#define OSMemoryBarrier()   __sync_synchronize()
+
+static inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address){
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline bool OSCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *address){
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+
+#pragma mark Mach Messages
+
+typedef natural_t       mach_port_t;
+typedef natural_t       mach_port_name_t;
+typedef unsigned int    mach_msg_bits_t;
+typedef natural_t       mach_msg_size_t;
+typedef int             mach_msg_id_t;
+
+#define MACH_PORT_NULL              0
+#define MACH_MSG_TYPE_COPY_SEND     19
+#define MACH_MSGH_BITS(remote, local)   ((remote) | ((local) << 8))
+
+typedef struct{
+    mach_msg_bits_t     msgh_bits;
+    mach_msg_size_t     msgh_size;
+    mach_port_t         msgh_remote_port;
+    mach_port_t         msgh_local_port;
+    mach_port_name_t    msgh_reserved;
+    mach_msg_id_t       msgh_id;
+}mach_msg_header_t;
+
+kern_return_t   mach_msg_send_from_kernel(mach_msg_header_t *msg, mach_msg_size_t size);
+
+
+#pragma mark OSObject
+
+#define OSDeclareDefaultStructors(className)                        \
+    public:                                                         \
+        className();                                                \
+        virtual ~className();                                       \
+        virtual const char* getClassName(void) const { return #className; }
+
+#define OSDefineMetaClassAndStructors(className, superclassName)   \
+    className::className() : superclassName() {}                    \
+    className::~className() {}
+
+#define OSDynamicCast(type, inst)   dynamic_cast<type*>(inst)
+
+class OSObject{
+    volatile int    fRetainCount;
+
+public:
+    OSObject() : fRetainCount(1) {}
+    virtual ~OSObject() {}
+
+    // The kernel hands out zeroed objects, and the driver relies on it for members it never sets.
+    static void*    operator new(size_t size);
+    static void     operator delete(void *p);
+    virtual const char* getClassName(void) const { return "OSObject"; }
+
+    virtual bool init(void) { return true; }
+    virtual void free(void) { delete this; }
+    void    retain(void) const;
+    void    release(void) const;
+    int     getRetainCount(void) const { return fRetainCount; }
+};
+
+
+#pragma mark Memory Descriptors
+
+typedef UInt32  IODirection;
+
+enum{
+    kIODirectionNone    = 0x0,
+    kIODirectionIn      = 0x1,
+    kIODirectionOut     = 0x2,
+    kIODirectionInOut   = kIODirectionIn | kIODirectionOut
+};
+
+enum{
+    kIOMemoryKernelUserShared   = 0x00010000
+};
+
+enum{
+    kIOMapAnywhere      = 0x00000001,
+    kIOMapReadOnly      = 0x00001000
+};
+
+class IOMemoryDescriptor;
+
+class IOMemoryMap : public OSObject{
+    IOMemoryDescriptor  *fMemory;
+    mach_vm_address_t   fAddress;
+
+public:
+    IOMemoryMap(IOMemoryDescriptor *memory, mach_vm_address_t address);
+    virtual ~IOMemoryMap();
+    virtual const char* getClassName(void) const { return "IOMemoryMap"; }
+
+    mach_vm_address_t   getVirtualAddress(void) { return fAddress; }
+    mach_vm_address_t   getAddress(void) { return fAddress; }
+    IOByteCount         getLength(void);
+};
+
+// There is only one address space, so a descriptor is an address and a length and mapping it
+// gives back the same address.
+class IOMemoryDescriptor : public OSObject{
+protected:
+    UInt8           *fBytes;
+    IOByteCount     fLength;
+    IODirection     fDirection;
+    volatile int    fPrepareCount;
+
+public:
+    IOMemoryDescriptor() : fBytes(NULL), fLength(0), fDirection(kIODirectionNone), fPrepareCount(0) {}
+    virtual const char* getClassName(void) const { return "IOMemoryDescriptor"; }
+
+    static IOMemoryDescriptor*  withAddress(void *address, IOByteCount length, IODirection direction);
+    static IOMemoryDescriptor*  withAddressRange(mach_vm_address_t address, mach_vm_address_t length,
+                                                 IOOptionBits options, task_t task);
+
+    IOByteCount     getLength(void) const { return fLength; }
+    IODirection     getDirection(void) const { return fDirection; }
+    virtual IOReturn    prepare(IODirection forDirection = kIODirectionNone);
+    virtual IOReturn    complete(IODirection forDirection = kIODirectionNone);
+    IOByteCount     readBytes(IOByteCount offset, void *bytes, IOByteCount length);
+    IOByteCount     writeBytes(IOByteCount offset, const void *bytes, IOByteCount length);
+    IOMemoryMap*    createMappingInTask(task_t intoTask, mach_vm_address_t atAddress, IOOptionBits options,
+                                        mach_vm_address_t offset = 0, mach_vm_address_t length = 0);
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor{
+public:
+    virtual ~IOBufferMemoryDescriptor();
+    virtual const char* getClassName(void) const { return "IOBufferMemoryDescriptor"; }
+
+    static IOBufferMemoryDescriptor*    withOptions(IOOptionBits options, vm_size_t capacity, vm_size_t alignment = 1);
+    static IOBufferMemoryDescriptor*    withCapacity(vm_size_t capacity, IODirection direction);
+    void*   getBytesNoCopy(void) { return fBytes; }
+};
+
+
+#pragma mark IOService
+
+class IOService : public OSObject{
+    mutable pthread_mutex_t fOpenLock;
+    IOService       *fOpenClient;
+    IOService       *fProviderService;
+    IOService       *fChildren;             // Attached services, each retained
+    IOService       *fNextSibling;
+    volatile bool   fInactive;
+
+public:
+    IOService();
+    virtual ~IOService();
+    virtual const char* getClassName(void) const { return "IOService"; }
+    const char*     getName(void) const { return getClassName(); }
+
+    virtual void    free(void);
+    virtual bool    start(IOService *provider);
+    virtual void    stop(IOService *provider);
+
+    virtual bool    attach(IOService *provider);
+    virtual void    detach(IOService *provider);
+    IOService*      getProvider(void) const { return fProviderService; }
+
+    virtual bool    open(IOService *forClient, IOOptionBits options = 0, void *arg = 0);
+    virtual void    close(IOService *forClient, IOOptionBits options = 0);
+    virtual bool    isOpen(const IOService *forClient = 0) const;
+    virtual bool    handleOpen(IOService *forClient, IOOptionBits options, void *arg);
+    virtual void    handleClose(IOService *forClient, IOOptionBits options);
+    virtual bool    handleIsOpen(const IOService *forClient) const;
+
+    virtual void    registerService(IOOptionBits options = 0) {}
+    virtual bool    setProperty(const char *key, const char *value) { return true; }
+
+    bool            isInactive(void) const { return fInactive; }
+    virtual bool    terminate(IOOptionBits options = 0);
+    virtual bool    willTerminate(IOService *provider, IOOptionBits options) { return true; }
+    virtual bool    didTerminate(IOService *provider, IOOptionBits options, bool *defer) { return true; }
+    virtual bool    finalize(IOOptionBits options) { return true; }
+};
+
+
+#pragma mark IOUserClient
+
+#define kIOUCVariableStructureSize  0xffffffff
+
+enum{
+    kOSAsyncRef64Count  = 8,
+    kOSAsyncRef64Size   = kOSAsyncRef64Count * ((int) sizeof(io_user_reference_t))
+};
+typedef io_user_reference_t OSAsyncReference64[kOSAsyncRef64Count];
+
+// Where user space IOKit keeps the callback and refcon in an async reference.
+enum{
+    kIOAsyncReservedIndex       = 0,
+    kIOAsyncCalloutFuncIndex    = 1,
+    kIOAsyncCalloutRefconIndex  = 2
+};
+
+// The host stand-in for IOAsyncCallback: called by sendAsyncResult64 on the driver's thread.
+typedef void (*HostAsyncCallout)(void *refcon, IOReturn result, io_user_reference_t *args, UInt32 numArgs);
+
+struct IOExternalMethodArguments{
+    UInt32              version;
+    UInt32              selector;
+    mach_port_t         asyncWakePort;
+    io_user_reference_t *asyncReference;
+    UInt32              asyncReferenceCount;
+    const uint64_t      *scalarInput;
+    UInt32              scalarInputCount;
+    const void          *structureInput;
+    UInt32              structureInputSize;
+    IOMemoryDescriptor  *structureInputDescriptor;
+    uint64_t            *scalarOutput;
+    UInt32              scalarOutputCount;
+    void                *structureOutput;
+    UInt32              structureOutputSize;
+    IOMemoryDescriptor  *structureOutputDescriptor;
+    UInt32              structureOutputDescriptorSize;
+};
+
+typedef IOReturn (*IOExternalMethodAction)(OSObject *target, void *reference, IOExternalMethodArguments *arguments);
+
+struct IOExternalMethodDispatch{
+    IOExternalMethodAction  function;
+    UInt32                  checkScalarInputCount;
+    UInt32                  checkStructureInputSize;
+    UInt32                  checkScalarOutputCount;
+    UInt32                  checkStructureOutputSize;
+};
+
+class IOUserClient : public IOService{
+public:
+    virtual const char* getClassName(void) const { return "IOUserClient"; }
+
+    virtual bool        initWithTask(task_t owningTask, void *securityToken, UInt32 type);
+    virtual IOReturn    externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+                                       IOExternalMethodDispatch *dispatch = 0, OSObject *target = 0, void *reference = 0);
+    virtual IOReturn    clientClose(void);
+    virtual IOReturn    clientDied(void);
+    virtual IOReturn    registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon);
+    virtual IOReturn    clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+
+    static IOReturn     sendAsyncResult64(OSAsyncReference64 reference, IOReturn result,
+                                          io_user_reference_t args[], UInt32 numArgs);
+};
+
+
+#pragma mark Host Hooks
+
+// Everything the driver sends with mach_msg_send_from_kernel ends up here.
+typedef void (*HostMessageHandler)(mach_msg_header_t *msg, mach_msg_size_t size, void *context);
+void    HostSetMessageHandler(HostMessageHandler handler, void *context);
+
+// The user space side of IOConnectCallMethod and IOConnectCallAsyncMethod. Struct arguments over
+// kHostInlineStructSize bytes go in as memory descriptors, like they do through the real IOKit.
+// Pass an OSAsyncReference64 with the HostAsyncCallout and refcon filled in for an async call.
+#define kHostInlineStructSize   4096
+IOReturn    HostCallMethod(IOUserClient *client, uint32_t selector,
+                           const uint64_t *input, UInt32 inputCount, const void *inputStruct, size_t inputStructSize,
+                           uint64_t *output, UInt32 *outputCount, void *outputStruct, size_t *outputStructSize,
+                           io_user_reference_t *asyncReference = NULL);
+
+// IOLog output is thrown away unless VSP_HOST_LOG is set in the environment, or this is called.
+void    HostSetLogging(bool enabled);
+
+// Running totals of the work the driver has asked the kernel for, so a test can see how much
+// one call caused.
+typedef struct{
+    uint64_t    wakeups;            // thread_wakeup_prim, which IOLockWakeup also uses
+    uint64_t    threadCalls;        // thread_call_enter_delayed, and thread_call_enter unless already pending
+    uint64_t    messages;           // mach_msg_send_from_kernel
+    uint64_t    calls;              // HostCallMethod, the system calls user space would have made
+}HostCounters;
+
+void    HostGetCounters(HostCounters *counters);
+
+#endif
@@ -0,0 +1,5 @@
+// Host build stand-in, see HostKernel.h.
+#ifndef HOST_IOKIT_IOSERVICE_H
+#define HOST_IOKIT_IOSERVICE_H
+#include "HostKernel.h"
+#endif
@@ -0,0 +1,56 @@
+// Host build stand-in for the RS232 stream nub and the PD_RS232_ constants.
+#ifndef HOST_IORS232SERIALSTREAMSYNC_H
+#define HOST_IORS232SERIALSTREAMSYNC_H
+
+#include "IOSerialStreamSync.h"
+
+// Modem lines and flow control state, the low half of the port state
+#define PD_RS232_S_MASK         0x0000FFFFU
+#define PD_RS232_S_LE           0x00000001U
+#define PD_RS232_S_DTR          0x00000002U
+#define PD_RS232_S_RFR          0x00000004U
+#define PD_RS232_S_RTS          PD_RS232_S_RFR
+#define PD_RS232_S_ST           0x00000008U
+#define PD_RS232_S_SR           0x00000010U
+#define PD_RS232_S_CTS          0x00000020U
+#define PD_RS232_S_CAR          0x00000040U
+#define PD_RS232_S_DCD          PD_RS232_S_CAR
+#define PD_RS232_S_RNG          0x00000080U
+#define PD_RS232_S_RI           PD_RS232_S_RNG
+#define PD_RS232_S_DSR          0x00000100U
+#define PD_RS232_S_BRK          0x00000200U
+#define PD_RS232_S_LOOP         0x00000400U
+
+// Automatic flow control. The line bits share their positions with the modem lines they control, so
+// setState can mask out any line that is under automatic control.
+#define PD_RS232_A_TXO          0x00000800U
+#define PD_RS232_A_RXO          0x00001000U
+#define PD_RS232_A_XANY         0x00002000U
+#define PD_RS232_A_DTR          PD_RS232_S_DTR
+#define PD_RS232_A_RFR          PD_RS232_S_RFR
+#define PD_RS232_A_CTS          PD_RS232_S_CTS
+#define PD_RS232_A_DSR          PD_RS232_S_DSR
+#define PD_RS232_A_MASK         (PD_RS232_A_TXO | PD_RS232_A_RXO | PD_RS232_A_XANY | PD_RS232_A_DTR | \
+                                 PD_RS232_A_RFR | PD_RS232_A_CTS | PD_RS232_A_DSR)
+
+#define PD_RS232_E_XON_BYTE         ((64 << 2) | PD_DATA_BYTE)
+#define PD_RS232_E_XOFF_BYTE        ((65 << 2) | PD_DATA_BYTE)
+#define PD_RS232_E_LINE_BREAK       ((66 << 2) | PD_DATA_BYTE)
+#define PD_RS232_E_STOP_BITS        ((67 << 2) | PD_DATA_LONG)
+#define PD_RS232_E_RX_STOP_BITS     ((68 << 2) | PD_DATA_LONG)
+#define PD_RS232_E_MIN_LATENCY      ((69 << 2) | PD_DATA_BYTE)
+
+#define PD_RS232_PARITY_DEFAULT     0
+#define PD_RS232_PARITY_ANY         1
+#define PD_RS232_PARITY_NONE        2
+#define PD_RS232_PARITY_ODD         3
+#define PD_RS232_PARITY_EVEN        4
+#define PD_RS232_PARITY_MARK        5
+#define PD_RS232_PARITY_SPACE       6
+
+class IORS232SerialStreamSync : public IOSerialStreamSync{
+public:
+    virtual const char* getClassName(void) const { return "IORS232SerialStreamSync"; }
+};
+
+#endif
@@ -0,0 +1,25 @@
+// Host build stand-in for the IOSerialFamily driver base class.
+#ifndef HOST_IOSERIALDRIVERSYNC_H
+#define HOST_IOSERIALDRIVERSYNC_H
+
+#include "HostKernel.h"
+
+class IOSerialDriverSync : public IOService{
+public:
+    virtual const char* getClassName(void) const { return "IOSerialDriverSync"; }
+
+    virtual IOReturn acquirePort(bool sleep, void *refCon) = 0;
+    virtual IOReturn releasePort(void *refCon) = 0;
+    virtual IOReturn setState(UInt32 state, UInt32 mask, void *refCon) = 0;
+    virtual UInt32   getState(void *refCon) = 0;
+    virtual IOReturn watchState(UInt32 *state, UInt32 mask, void *refCon) = 0;
+    virtual UInt32   nextEvent(void *refCon) = 0;
+    virtual IOReturn executeEvent(UInt32 event, UInt32 data, void *refCon) = 0;
+    virtual IOReturn requestEvent(UInt32 event, UInt32 *data, void *refCon) = 0;
+    virtual IOReturn enqueueEvent(UInt32 event, UInt32 data, bool sleep, void *refCon) = 0;
+    virtual IOReturn dequeueEvent(UInt32 *event, UInt32 *data, bool sleep, void *refCon) = 0;
+    virtual IOReturn enqueueData(UInt8 *buffer, UInt32 size, UInt32 *count, bool sleep, void *refCon) = 0;
+    virtual IOReturn dequeueData(UInt8 *buffer, UInt32 size, UInt32 *count, UInt32 min, void *refCon) = 0;
+};
+
+#endif
@@ -0,0 +1,84 @@
+// Host build stand-in for the IOSerialFamily stream nub and the generic PD_ constants.
+#ifndef HOST_IOSERIALSTREAMSYNC_H
+#define HOST_IOSERIALSTREAMSYNC_H
+
+#include "HostKernel.h"
+
+// Port state
+#define PD_S_MASK               0xFFFF0000U
+
+#define PD_S_ACQUIRED           0x80000000U
+#define PD_S_ACTIVE             0x40000000U
+
+#define PD_S_TX_ENABLE          0x20000000U
+#define PD_S_TX_BUSY            0x10000000U
+#define PD_S_TX_EVENT           0x08000000U
+#define PD_S_TXQ_EMPTY          0x04000000U
+#define PD_S_TXQ_LOW_WATER      0x02000000U
+#define PD_S_TXQ_HIGH_WATER     0x01000000U
+#define PD_S_TXQ_FULL           0x00800000U
+#define PD_S_TXQ_MASK           (PD_S_TXQ_EMPTY | PD_S_TXQ_LOW_WATER | PD_S_TXQ_FULL | PD_S_TXQ_HIGH_WATER)
+
+#define PD_S_RX_ENABLE          0x00400000U
+#define PD_S_RX_BUSY            0x00200000U
+#define PD_S_RX_EVENT           0x00100000U
+#define PD_S_RXQ_EMPTY          0x00080000U
+#define PD_S_RXQ_LOW_WATER      0x00040000U
+#define PD_S_RXQ_HIGH_WATER     0x00020000U
+#define PD_S_RXQ_FULL           0x00010000U
+#define PD_S_RXQ_MASK           (PD_S_RXQ_EMPTY | PD_S_RXQ_LOW_WATER | PD_S_RXQ_FULL | PD_S_RXQ_HIGH_WATER)
+
+// Events are (index << 2) | the size of their data.
+#define PD_DATA_MASK            0x03U
+#define PD_DATA_VOID            0x00U
+#define PD_DATA_BYTE            0x01U
+#define PD_DATA_WORD            0x02U
+#define PD_DATA_LONG            0x03U
+#define PD_E_MASK               (~(UInt32)PD_DATA_MASK)
+
+#define PD_E_EOQ                ((0 << 2) | PD_DATA_VOID)
+#define PD_E_SPECIAL_BYTE       ((1 << 2) | PD_DATA_BYTE)
+#define PD_E_VALID_DATA_BYTE    ((2 << 2) | PD_DATA_BYTE)
+#define PD_E_DATA_BYTE          ((3 << 2) | PD_DATA_BYTE)
+#define PD_E_FRAMING_BYTE       ((4 << 2) | PD_DATA_BYTE)
+#define PD_E_PARITY_BYTE        ((5 << 2) | PD_DATA_BYTE)
+#define PD_E_INTEGRITY_ERROR    ((6 << 2) | PD_DATA_VOID)
+#define PD_E_FRAMING_ERROR      ((7 << 2) | PD_DATA_VOID)
+#define PD_E_PARITY_ERROR       ((8 << 2) | PD_DATA_VOID)
+#define PD_E_HW_OVERRUN_ERROR   ((9 << 2) | PD_DATA_VOID)
+#define PD_E_SW_OVERRUN_ERROR   ((10 << 2) | PD_DATA_VOID)
+
+#define PD_E_ACTIVE             ((16 << 2) | PD_DATA_BYTE)
+#define PD_E_FLOW_CONTROL       ((17 << 2) | PD_DATA_LONG)
+#define PD_E_DELAY              ((18 << 2) | PD_DATA_LONG)
+#define PD_E_DATA_LATENCY       ((19 << 2) | PD_DATA_LONG)
+#define PD_E_RXQ_SIZE           ((20 << 2) | PD_DATA_LONG)
+#define PD_E_TXQ_SIZE           ((21 << 2) | PD_DATA_LONG)
+#define PD_E_RXQ_HIGH_WATER     ((22 << 2) | PD_DATA_LONG)
+#define PD_E_RXQ_LOW_WATER      ((23 << 2) | PD_DATA_LONG)
+#define PD_E_TXQ_HIGH_WATER     ((24 << 2) | PD_DATA_LONG)
+#define PD_E_TXQ_LOW_WATER      ((25 << 2) | PD_DATA_LONG)
+#define PD_E_RXQ_AVAILABLE      ((26 << 2) | PD_DATA_LONG)
+#define PD_E_TXQ_AVAILABLE      ((27 << 2) | PD_DATA_LONG)
+#define PD_E_RXQ_FLUSH          ((28 << 2) | PD_DATA_VOID)
+#define PD_E_TXQ_FLUSH          ((29 << 2) | PD_DATA_VOID)
+#define PD_E_DATA_RATE          ((30 << 2) | PD_DATA_LONG)
+#define PD_E_RX_DATA_RATE       ((31 << 2) | PD_DATA_LONG)
+#define PD_E_DATA_SIZE          ((32 << 2) | PD_DATA_LONG)
+#define PD_E_RX_DATA_SIZE       ((33 << 2) | PD_DATA_LONG)
+#define PD_E_DATA_INTEGRITY     ((34 << 2) | PD_DATA_LONG)
+#define PD_E_RX_DATA_INTEGRITY  ((35 << 2) | PD_DATA_LONG)
+
+class IOSerialStreamSync : public IOService{
+protected:
+    void    *fRefCon;
+
+public:
+    IOSerialStreamSync() : fRefCon(0) {}
+    virtual const char* getClassName(void) const { return "IOSerialStreamSync"; }
+
+    virtual bool    init(void *dictionary = 0, void *refCon = 0){ fRefCon = refCon; return IOService::init(); }
+    void*   getRefCon(void) const { return fRefCon; }
+};
+
+#endif
@@ -0,0 +1,5 @@
+// Host build stand-in, see HostKernel.h.
+#ifndef HOST_KERN_THREAD_CALL_H
+#define HOST_KERN_THREAD_CALL_H
+#include "HostKernel.h"
+#endif
@@ -0,0 +1,5 @@
+// Host build stand-in, see HostKernel.h.
+#ifndef HOST_LIBKERN_OSATOMIC_H
+#define HOST_LIBKERN_OSATOMIC_H
+#include "HostKernel.h"
+#endif
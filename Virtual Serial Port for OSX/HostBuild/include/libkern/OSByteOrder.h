@@ -0,0 +1,5 @@
+// Host build stand-in, see HostKernel.h.
+#ifndef HOST_LIBKERN_OSBYTEORDER_H
+#define HOST_LIBKERN_OSBYTEORDER_H
+#include "HostKernel.h"
+#endif
@@ -0,0 +1,1582 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  vspd runs VirtualSerialPort in user space with a pseudo-terminal as its tty. Serial software opens
+//  the pty slave like any other serial device, and clients talk to the port over a local socket with
+//  the user client protocol, see VSPSocket.h.
+//
+//    vspd [-s socket] [-l link | -t address] [-v]
+//
+//  One thread runs the pty master, the listening socket and the client sockets through epoll, moving
+//  data in batches of up to kBatchSize bytes each way. The driver only says there is data for the tty
+//  by clearing PD_S_RXQ_EMPTY, so a watcher thread sits in watchState and wakes the loop through an
+//  eventfd. Each connection's calls run on a thread of its own, as they would on the client's own
+//  thread in the kernel, so a blocking send can't stall the loop. Replies, completions and
+//  notifications go straight to the connection's socket from whichever thread produces them.
+//
+//  Opening the slave acquires the port and closing it releases it, the way IOSerialBSDClient does, and
+//  the queues are sized to hold two batches each.
+//  The slave's termios settings are mirrored into the port, so clients see baud rate, character size,
+//  parity, stop bits and flow control changes in their notifications.
+//
+//  With -t the tty side is served over telnet with the RFC 2217 COM-PORT-OPTION instead of the pty, on
+//  host:port over TCP or on a Unix socket if the address has a '/' in it. One telnet connection at a
+//  time plays the tty: accepting it acquires the port and its closing releases it. Its SET-BAUDRATE,
+//  SET-DATASIZE, SET-PARITY, SET-STOPSIZE and SET-CONTROL become the same executeEvent and setState
+//  calls, and the modem lines the client drives, and line events it sends, come back as NOTIFY-MODEMSTATE
+//  and NOTIFY-LINESTATE. Data still moves in whole batches; a batch without a 0xFF in it is written as it
+//  was dequeued, and replies and notifications go between batches.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+#include "VirtualSerialPort.h"
+#include "VSPSocket.h"
+#include "VSPTelnet.h"
+
+
+#define kBatchSize          (64 * 1024)
+#define kQueueSize          (2 * kBatchSize)    // PD_E_RXQ_SIZE and PD_E_TXQ_SIZE, a batch queued while one moves
+#define kClosedPollInterval 100             // ms between checks for the slave being opened
+#define kTermiosInterval    250             // ms between checks of the slave's termios
+#define kControlSize        4096            // Telnet replies and notifications waiting to go
+#define kControlReserve     128             // Room kept for whatever one command or event adds
+#define kModemLines         (PD_RS232_S_CTS | PD_RS232_S_DSR | PD_RS232_S_CAR | PD_RS232_S_RI)
+
+// What we have agreed to for each telnet option.
+#define kOptionLocal        0x01            // We WILL
+#define kOptionRemote       0x02            // They WILL
+
+// What an epoll event is for, in the top half of its data. Connections have their slot in the bottom half.
+enum{
+    kEventMaster = 1,
+    kEventListener,
+    kEventWakeup,
+    kEventSignal,
+    kEventConnection,
+    kEventTelnet
+};
+
+
+// A frame waiting for the connection's worker.
+typedef struct Frame{
+    struct Frame    *next;
+    VSPFrameHeader  header;
+    UInt8           *payload;
+    UInt32          payloadSize;
+}Frame;
+
+typedef struct{
+    int             socket;
+    UInt32          slot;                   // Index in sConnections
+    mach_port_t     port;                   // Notification port, never reused
+    volatile SInt32 retainCount;            // The loop, the worker and each async call in flight
+    VSPUserClient   *client;
+
+    pthread_t       worker;
+    pthread_mutex_t callLock;               // Protects calls and closing
+    pthread_cond_t  callCond;
+    Frame           *calls;
+    Frame           **lastCall;
+    bool            closing;
+
+    UInt8           *input;                 // Partial frames read from the socket
+    size_t          inputLength;
+    size_t          inputSize;
+
+    pthread_mutex_t outputLock;             // Frames come from the driver's threads as well as the loop
+    UInt8           *output;
+    size_t          outputLength;
+    size_t          outputSize;
+    bool            wantsWrite;             // Output is queued, the loop should watch for EPOLLOUT
+    bool            writing;                // The loop is watching for EPOLLOUT
+}Connection;
+
+// An async call waiting for the driver to complete it.
+typedef struct{
+    Connection  *connection;
+    UInt64      reference;
+    UInt8       *payload;                   // The struct input, which an async send uses until it completes
+    UInt8       *readBuffer;                // kReadAsync reads into here, not into the client's address
+}AsyncCall;
+
+
+static struct{
+    IOService           *nub;
+    VirtualSerialPort   *port;
+    void                *refCon;
+
+    int                 epoll;
+    int                 master;             // The pty master, or with -t the telnet connection
+    int                 listener;
+    int                 wakeup;
+    int                 signals;
+    char                slaveName[128];     // Or with -t the address being served
+    const char          *socketPath;
+    const char          *linkPath;
+    const char          *telnetAddress;
+    int                 telnetListener;
+    bool                ttyOpen;
+    UInt32              masterEvents;       // What the master is registered for, 0 if it isn't
+    struct termios      termios;            // As last mirrored into the port
+
+    UInt8               rxBuffer[kBatchSize];   // From the port to the tty
+    UInt8               *rxWire;                // What goes to the master, rxBuffer or its escaped copy
+    UInt32              rxOffset;
+    UInt32              rxLength;
+    UInt8               txBuffer[kBatchSize];   // From the tty to the port, as read from the master
+    UInt32              txOffset;
+    UInt32              txLength;
+    const UInt8         *txData;                // Data in txBuffer still to be enqueued
+    UInt32              txDataLength;
+
+    // The telnet connection, see the Telnet section.
+    TelnetDecoder       decoder;
+    UInt8               options[256];
+    UInt8               control[kControlSize];
+    UInt32              controlLength;
+    UInt8               wire[2 * kBatchSize];   // A batch with its 0xFF bytes doubled
+    UInt32              lines;                  // kModemLines as last reported
+    UInt8               lineMask;
+    UInt8               modemMask;
+    bool                flowSuspended;          // The client has asked us to stop sending data
+}sDaemon;
+
+static pthread_mutex_t  sConnectionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   sConnectionCond = PTHREAD_COND_INITIALIZER;
+static Connection       *sConnections[kMaxUserClients];
+static UInt32           sNumWorkers;            // Workers still running, including ones tearing down
+static mach_port_t      sNextPort = 1;
+
+static struct{
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           thread;
+    bool                armed;              // The loop wants to hear about the next data for the tty
+    bool                watching;           // The watcher is in watchState
+    bool                quit;
+    UInt32              state;              // What watchState is to wait for
+    UInt32              mask;
+}sWatcher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, pthread_t(), false, false, false, 0, 0 };
+
+
+static void wakeLoop(void){
+    eventfd_t   value = 1;
+
+    if (write(sDaemon.wakeup, &value, sizeof(value)) < 0){}
+}
+
+
+static void setEvents(int fd, UInt64 tag, UInt32 events, UInt32 *current){
+    struct epoll_event  event;
+
+    if (events == *current) return;
+
+    event.events = events;
+    event.data.u64 = tag;
+    if (*current == 0)
+        epoll_ctl(sDaemon.epoll, EPOLL_CTL_ADD, fd, &event);
+    else if (events == 0)
+        epoll_ctl(sDaemon.epoll, EPOLL_CTL_DEL, fd, &event);
+    else
+        epoll_ctl(sDaemon.epoll, EPOLL_CTL_MOD, fd, &event);
+    *current = events;
+}
+
+
+#pragma mark Watcher
+
+static void* watchRX(void *context){
+    UInt32  state, mask;
+
+    pthread_mutex_lock(&sWatcher.lock);
+    for (;;){
+        while (!sWatcher.armed && !sWatcher.quit)
+            pthread_cond_wait(&sWatcher.cond, &sWatcher.lock);
+        if (sWatcher.quit) break;
+        sWatcher.armed = false;
+        sWatcher.watching = true;
+        state = sWatcher.state;
+        mask = sWatcher.mask;
+        pthread_mutex_unlock(&sWatcher.lock);
+
+        // Returns when the RX queue has data, or a watched modem line or line event has turned up, or at
+        // once with an error if the port isn't active.
+        sDaemon.port->watchState(&state, mask, sDaemon.refCon);
+
+        pthread_mutex_lock(&sWatcher.lock);
+        sWatcher.watching = false;
+        wakeLoop();
+    }
+    pthread_mutex_unlock(&sWatcher.lock);
+
+    return NULL;
+}
+
+
+// A telnet client also hears about modem line changes and line events, so the watcher waits for those
+// too. While the client has suspended the flow, data for it is no reason to wake, and while replies are
+// backed up nothing more could go to it, so the loop waits for the connection to take them instead.
+static void armWatcher(void){
+    UInt32  state = 0, mask = PD_S_RXQ_EMPTY;
+
+    if (sDaemon.telnetAddress){
+        if (sDaemon.controlLength + kControlReserve > kControlSize) return;
+        state = (~sDaemon.lines & kModemLines) | PD_S_RX_EVENT;
+        mask = kModemLines | PD_S_RX_EVENT | (sDaemon.flowSuspended ? 0 : PD_S_RXQ_EMPTY);
+    }
+
+    pthread_mutex_lock(&sWatcher.lock);
+    if (!sWatcher.armed && !sWatcher.watching){
+        sWatcher.state = state;
+        sWatcher.mask = mask;
+        sWatcher.armed = true;
+        pthread_cond_signal(&sWatcher.cond);
+    }
+    pthread_mutex_unlock(&sWatcher.lock);
+}
+
+
+#pragma mark Connections
+
+static void retainConnection(Connection *connection){
+
+    __sync_fetch_and_add(&connection->retainCount, 1);
+}
+
+
+static void releaseConnection(Connection *connection){
+
+    if (__sync_sub_and_fetch(&connection->retainCount, 1) == 0){
+        close(connection->socket);
+        pthread_cond_destroy(&connection->callCond);
+        pthread_mutex_destroy(&connection->callLock);
+        pthread_mutex_destroy(&connection->outputLock);
+        free(connection->input);
+        free(connection->output);
+        free(connection);
+    }
+}
+
+
+// Queue a frame for the client, writing as much as the socket takes straight away. Safe to call
+// from any thread, and with driver locks held.
+static void sendFrame(Connection *connection, VSPFrameHeader *header, const void *payload, size_t payloadSize){
+    struct iovec    vector[2];
+    ssize_t         written = 0;
+    size_t          total = sizeof(VSPFrameHeader) + payloadSize;
+    bool            wake = false;
+
+    header->Length = (UInt32)total;
+
+    pthread_mutex_lock(&connection->outputLock);
+    if (connection->outputLength == 0){
+        vector[0].iov_base = header;
+        vector[0].iov_len = sizeof(VSPFrameHeader);
+        vector[1].iov_base = (void*)payload;
+        vector[1].iov_len = payloadSize;
+
+        struct msghdr message;
+        bzero(&message, sizeof(message));
+        message.msg_iov = vector;
+        message.msg_iovlen = payloadSize ? 2 : 1;
+        written = sendmsg(connection->socket, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0){
+            // A dead connection is noticed by the loop, drop the frame.
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)){
+                pthread_mutex_unlock(&connection->outputLock);
+                return;
+            }
+            written = 0;
+        }
+    }
+
+    if ((size_t)written < total){
+        size_t  remaining = total - written;
+
+        if (connection->outputLength + remaining > connection->outputSize){
+            size_t  size = connection->outputSize ? connection->outputSize : kBatchSize;
+            UInt8   *output;
+
+            while (size < connection->outputLength + remaining)
+                size *= 2;
+            output = (UInt8*)realloc(connection->output, size);
+            if (output == NULL){
+                pthread_mutex_unlock(&connection->outputLock);
+                return;
+            }
+            connection->output = output;
+            connection->outputSize = size;
+        }
+
+        // The part of the header that didn't go, then the part of the payload that didn't go.
+        if ((size_t)written < sizeof(VSPFrameHeader)){
+            memcpy(connection->output + connection->outputLength, (UInt8*)header + written, sizeof(VSPFrameHeader) - written);
+            connection->outputLength += sizeof(VSPFrameHeader) - written;
+            written = 0;
+        } else {
+            written -= sizeof(VSPFrameHeader);
+        }
+        memcpy(connection->output + connection->outputLength, (UInt8*)payload + written, payloadSize - written);
+        connection->outputLength += payloadSize - written;
+
+        wake = !connection->wantsWrite;
+        connection->wantsWrite = true;
+    }
+    pthread_mutex_unlock(&connection->outputLock);
+
+    if (wake) wakeLoop();
+}
+
+
+// Returns false if the connection has failed.
+static bool flushConnection(Connection *connection){
+    ssize_t written;
+    bool    ok = true;
+
+    pthread_mutex_lock(&connection->outputLock);
+    while (connection->outputLength){
+        written = send(connection->socket, connection->output, connection->outputLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0){
+            ok = (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+            break;
+        }
+        memmove(connection->output, connection->output + written, connection->outputLength - written);
+        connection->outputLength -= written;
+    }
+    connection->wantsWrite = (connection->outputLength != 0);
+    pthread_mutex_unlock(&connection->outputLock);
+
+    return ok;
+}
+
+
+// Called by sendAsyncResult64 on whichever thread completed the call.
+static void asyncCompletion(void *refcon, IOReturn result, io_user_reference_t *args, UInt32 numArgs){
+    AsyncCall       *call = (AsyncCall*)refcon;
+    VSPFrameHeader  header;
+    UInt32          payloadSize = 0;
+
+    bzero(&header, sizeof(header));
+    header.Type = kVSPFrameCompletion;
+    header.Result = result;
+    header.Reference = call->reference;
+    header.ScalarCount = (numArgs < kVSPMaxScalars) ? numArgs : kVSPMaxScalars;
+    memcpy(header.Scalars, args, header.ScalarCount * sizeof(uint64_t));
+
+    // A read completes with the byte count as its first argument, the bytes themselves go with it.
+    if (call->readBuffer && numArgs)
+        payloadSize = (UInt32)args[0];
+
+    sendFrame(call->connection, &header, call->readBuffer, payloadSize);
+
+    releaseConnection(call->connection);
+    free(call->payload);
+    free(call->readBuffer);
+    free(call);
+}
+
+
+// Notifications arrive addressed to the port the connection registered.
+static void messageHandler(mach_msg_header_t *msg, mach_msg_size_t size, void *context){
+    Connection      *connection = NULL;
+    VSPFrameHeader  header;
+
+    pthread_mutex_lock(&sConnectionLock);
+    for (UInt32 slot = 0; slot < kMaxUserClients; slot++){
+        if (sConnections[slot] && (sConnections[slot]->port == msg->msgh_remote_port)){
+            connection = sConnections[slot];
+            retainConnection(connection);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sConnectionLock);
+    if (connection == NULL) return;
+
+    bzero(&header, sizeof(header));
+    header.Type = kVSPFrameNotification;
+    header.Selector = msg->msgh_id;
+    sendFrame(connection, &header, msg, size);
+    releaseConnection(connection);
+}
+
+
+static void replyToCall(Connection *connection, IOReturn result, const uint64_t *output, UInt32 outputCount,
+                        const void *outputStruct, size_t outputStructSize){
+    VSPFrameHeader  header;
+
+    bzero(&header, sizeof(header));
+    header.Type = kVSPFrameReply;
+    header.Result = result;
+    header.ScalarCount = outputCount;
+    if (outputCount)
+        memcpy(header.Scalars, output, outputCount * sizeof(uint64_t));
+    sendFrame(connection, &header, outputStruct, outputStructSize);
+}
+
+
+static void handleCall(Connection *connection, VSPFrameHeader *header, UInt8 *payload, UInt32 payloadSize){
+    uint64_t            output[kVSPMaxScalars];
+    UInt32              outputCount = header->OutputCount;
+    UInt8               *outputStruct = NULL;
+    size_t              outputStructSize = header->OutputStructSize;
+    OSAsyncReference64  reference;
+    AsyncCall           *call = NULL;
+    IOReturn            result;
+
+    if ((outputCount > kVSPMaxScalars) || (outputStructSize > kVSPMaxPayload)){
+        replyToCall(connection, kIOReturnBadArgument, NULL, 0, NULL, 0);
+        return;
+    }
+    if (outputStructSize){
+        outputStruct = (UInt8*)malloc(outputStructSize);
+        if (outputStruct == NULL){
+            replyToCall(connection, kIOReturnNoMemory, NULL, 0, NULL, 0);
+            return;
+        }
+    }
+
+    // Only calls the driver will complete get a call record, anything else would never be freed.
+    bool async = (header->Selector == kReadAsync) ||
+                 ((header->Selector == kSendBuffer) && header->ScalarCount && (header->Scalars[0] == kSendAsync));
+    if (header->Reference && async){
+        call = (AsyncCall*)calloc(1, sizeof(AsyncCall));
+        call->connection = connection;
+        call->reference = header->Reference;
+
+        // Point the read at a buffer of ours, the client's address means nothing here.
+        if ((header->Selector == kReadAsync) && (header->ScalarCount >= 2) &&
+            (header->Scalars[1] > 0) && (header->Scalars[1] <= kMaxSendBufferSize)){
+            call->readBuffer = (UInt8*)malloc(header->Scalars[1]);
+            header->Scalars[0] = (uint64_t)(uintptr_t)call->readBuffer;
+        }
+
+        // The payload belongs to the call now, an async send reads from it until it completes.
+        call->payload = payload;
+        bzero(reference, sizeof(reference));
+        reference[kIOAsyncCalloutFuncIndex] = (io_user_reference_t)(uintptr_t)&asyncCompletion;
+        reference[kIOAsyncCalloutRefconIndex] = (io_user_reference_t)(uintptr_t)call;
+        retainConnection(connection);
+    }
+
+    result = HostCallMethod(connection->client, header->Selector, header->Scalars, header->ScalarCount,
+                            payloadSize ? payload : NULL, payloadSize,
+                            output, &outputCount, outputStruct, outputStructSize ? &outputStructSize : NULL,
+                            call ? reference : NULL);
+
+    // Calls that fail are never completed.
+    if (call && (result != kIOReturnSuccess)){
+        releaseConnection(connection);
+        free(call->readBuffer);
+        free(call);
+    } else if (call == NULL){
+        free(payload);
+    }
+
+    replyToCall(connection, result, output, outputCount, outputStruct, outputStructSize);
+    free(outputStruct);
+}
+
+
+// Runs the connection's calls one at a time, then takes the connection down once the loop has
+// closed it. A call may block for as long as the tty leaves the port full.
+static void* runCalls(void *context){
+    Connection      *connection = (Connection*)context;
+    IOUserClient    *userClient = connection->client;
+    Frame           *frame;
+
+    pthread_mutex_lock(&connection->callLock);
+    for (;;){
+        while ((connection->calls == NULL) && !connection->closing)
+            pthread_cond_wait(&connection->callCond, &connection->callLock);
+        if (connection->closing) break;
+
+        frame = connection->calls;
+        connection->calls = frame->next;
+        if (connection->calls == NULL)
+            connection->lastCall = &connection->calls;
+        pthread_mutex_unlock(&connection->callLock);
+
+        if (frame->header.Type == kVSPFrameSetNotify){
+            userClient->registerNotificationPort(frame->header.Scalars[0] ? connection->port : MACH_PORT_NULL, 0, 0);
+            replyToCall(connection, kIOReturnSuccess, NULL, 0, NULL, 0);
+            free(frame->payload);
+        } else {
+            handleCall(connection, &frame->header, frame->payload, frame->payloadSize);
+        }
+        free(frame);
+
+        // The call may have made room in the TX queue, or put data in the RX queue.
+        wakeLoop();
+        pthread_mutex_lock(&connection->callLock);
+    }
+
+    // Calls the client sent before it went are dropped.
+    while ((frame = connection->calls) != NULL){
+        connection->calls = frame->next;
+        free(frame->payload);
+        free(frame);
+    }
+    pthread_mutex_unlock(&connection->callLock);
+
+    // Completes anything still pending, which releases the calls' references to the connection.
+    userClient->clientClose();
+    connection->client->release();
+    releaseConnection(connection);
+
+    pthread_mutex_lock(&sConnectionLock);
+    sNumWorkers--;
+    pthread_cond_broadcast(&sConnectionCond);
+    pthread_mutex_unlock(&sConnectionLock);
+
+    return NULL;
+}
+
+
+static void queueCall(Connection *connection, VSPFrameHeader *header, UInt8 *payload, UInt32 payloadSize){
+    Frame   *frame = (Frame*)malloc(sizeof(Frame));
+
+    frame->next = NULL;
+    frame->header = *header;
+    frame->payload = payload;
+    frame->payloadSize = payloadSize;
+
+    pthread_mutex_lock(&connection->callLock);
+    *connection->lastCall = frame;
+    connection->lastCall = &frame->next;
+    pthread_cond_signal(&connection->callCond);
+    pthread_mutex_unlock(&connection->callLock);
+}
+
+
+static void acceptConnections(void){
+    Connection          *connection;
+    VSPUserClient       *client;
+    IOUserClient        *userClient;
+    UInt32              slot;
+    UInt32              events;
+    int                 fd;
+
+    while ((fd = accept4(sDaemon.listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        pthread_mutex_lock(&sConnectionLock);
+        for (slot = 0; (slot < kMaxUserClients) && sConnections[slot]; slot++) {}
+        pthread_mutex_unlock(&sConnectionLock);
+
+        if (slot == kMaxUserClients){
+            fprintf(stderr, "vspd: refusing a connection, all %d user clients are in use\n", kMaxUserClients);
+            close(fd);
+            continue;
+        }
+
+        client = new VSPUserClient;
+        userClient = client;
+        if (!userClient->initWithTask(kernel_task, NULL, 0) || !client->attach(sDaemon.port) || !client->start(sDaemon.port)){
+            fprintf(stderr, "vspd: refusing a connection, the user client failed to start\n");
+            client->release();
+            close(fd);
+            continue;
+        }
+
+        connection = (Connection*)calloc(1, sizeof(Connection));
+        connection->socket = fd;
+        connection->slot = slot;
+        connection->retainCount = 2;
+        connection->client = client;
+        connection->lastCall = &connection->calls;
+        pthread_mutex_init(&connection->outputLock, NULL);
+        pthread_mutex_init(&connection->callLock, NULL);
+        pthread_cond_init(&connection->callCond, NULL);
+
+        pthread_mutex_lock(&sConnectionLock);
+        connection->port = sNextPort++;
+        sConnections[slot] = connection;
+        sNumWorkers++;
+        pthread_mutex_unlock(&sConnectionLock);
+
+        pthread_create(&connection->worker, NULL, runCalls, connection);
+        pthread_detach(connection->worker);
+
+        events = 0;
+        setEvents(fd, ((UInt64)kEventConnection << 32) | slot, EPOLLIN | EPOLLRDHUP, &events);
+    }
+}
+
+
+// The worker finishes whatever call it is in, then takes the connection down.
+static void closeConnection(Connection *connection){
+    UInt32  events = EPOLLIN;
+
+    setEvents(connection->socket, 0, 0, &events);
+
+    pthread_mutex_lock(&sConnectionLock);
+    sConnections[connection->slot] = NULL;
+    pthread_mutex_unlock(&sConnectionLock);
+
+    pthread_mutex_lock(&connection->callLock);
+    connection->closing = true;
+    pthread_cond_signal(&connection->callCond);
+    pthread_mutex_unlock(&connection->callLock);
+
+    releaseConnection(connection);
+}
+
+
+// Returns false if the connection has closed or sent something that isn't a frame.
+static bool readConnection(Connection *connection){
+    VSPFrameHeader  header;
+    ssize_t         count;
+
+    for (;;){
+        if (connection->inputSize - connection->inputLength < kBatchSize){
+            UInt8 *input = (UInt8*)realloc(connection->input, connection->inputSize + kBatchSize);
+            if (input == NULL) return false;
+            connection->input = input;
+            connection->inputSize += kBatchSize;
+        }
+
+        count = read(connection->socket, connection->input + connection->inputLength, connection->inputSize - connection->inputLength);
+        if (count == 0) return false;
+        if (count < 0)
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+        connection->inputLength += count;
+
+        // Handle every complete frame in what has arrived.
+        size_t  offset = 0;
+        while (connection->inputLength - offset >= sizeof(header)){
+            memcpy(&header, connection->input + offset, sizeof(header));
+            if ((header.Length < sizeof(header)) || (header.Length - sizeof(header) > kVSPMaxPayload) ||
+                (header.ScalarCount > kVSPMaxScalars))
+                return false;
+            if (connection->inputLength - offset < header.Length) break;
+
+            UInt32  payloadSize = header.Length - sizeof(header);
+            UInt8   *payload = (UInt8*)malloc(payloadSize ? payloadSize : 1);
+            memcpy(payload, connection->input + offset + sizeof(header), payloadSize);
+            offset += header.Length;
+
+            if ((header.Type != kVSPFrameCall) && (header.Type != kVSPFrameSetNotify)){
+                free(payload);
+                return false;
+            }
+            queueCall(connection, &header, payload, payloadSize);
+        }
+        memmove(connection->input, connection->input + offset, connection->inputLength - offset);
+        connection->inputLength -= offset;
+
+        // Don't hold on to the room a large frame needed.
+        if ((connection->inputLength < kBatchSize) && (connection->inputSize > 2 * kBatchSize)){
+            connection->inputSize = 2 * kBatchSize;
+            connection->input = (UInt8*)realloc(connection->input, connection->inputSize);
+        }
+    }
+}
+
+
+#pragma mark Telnet
+
+static void ttyClosed(void);
+
+
+// Replies and notifications wait in control until the batch being written has gone.
+static void sendControl(const UInt8 *bytes, UInt32 length){
+
+    memcpy(sDaemon.control + sDaemon.controlLength, bytes, length);
+    sDaemon.controlLength += length;
+}
+
+
+static void sendOption(UInt8 verb, UInt8 option){
+    UInt8   command[3] = { kTelnetIAC, verb, option };
+
+    sendControl(command, sizeof(command));
+}
+
+
+// Only once the client has said it will use the COM-PORT-OPTION.
+static void sendComPort(UInt8 code, const UInt8 *value, UInt32 length){
+
+    if (!(sDaemon.options[kTelnetComPort] & kOptionRemote)) return;
+    sDaemon.controlLength += TelnetComPort(sDaemon.control + sDaemon.controlLength, code + kComPortServer, value, length);
+}
+
+
+// Binary and suppress go ahead both ways, and the client's COM-PORT-OPTION; everything else is refused.
+// Only changes are answered, so the two ends can't keep acknowledging each other.
+static void handleOption(UInt8 verb, UInt8 option){
+    bool    remote = (verb == kTelnetWILL) || (verb == kTelnetWONT);
+    bool    enable = (verb == kTelnetWILL) || (verb == kTelnetDO);
+    UInt8   bit = remote ? kOptionRemote : kOptionLocal;
+    bool    supported = (option == kTelnetBinary) || (option == kTelnetSGA) || (remote && (option == kTelnetComPort));
+
+    if (enable && !supported){
+        sendOption(remote ? kTelnetDONT : kTelnetWONT, option);
+        return;
+    }
+    if (enable == bool(sDaemon.options[option] & bit)) return;
+
+    sDaemon.options[option] ^= bit;
+    if (remote)
+        sendOption(enable ? kTelnetDO : kTelnetDONT, option);
+    else
+        sendOption(enable ? kTelnetWILL : kTelnetWONT, option);
+}
+
+
+// SET-CONTROL, returning the value to answer with: what the setting is now, whether it was asked for or
+// set. Each set falls through to the ask for the same setting.
+static UInt8 setControl(UInt8 value){
+    VirtualSerialPort   *port = sDaemon.port;
+    void                *refCon = sDaemon.refCon;
+    UInt32              flow = 0, data = 0;
+
+    port->requestEvent(PD_E_FLOW_CONTROL, &flow, refCon);
+    switch (value){
+        case kComPortControlNoFlow:
+        case kComPortControlXonXoff:
+        case kComPortControlHardware:
+            // Outbound, and inbound with it.
+            flow &= ~(PD_RS232_A_TXO | PD_RS232_A_RXO | PD_RS232_A_XANY | PD_RS232_A_CTS | PD_RS232_A_RFR);
+            if (value == kComPortControlXonXoff)    flow |= PD_RS232_A_TXO | PD_RS232_A_RXO;
+            if (value == kComPortControlHardware)   flow |= PD_RS232_A_CTS | PD_RS232_A_RFR;
+            port->executeEvent(PD_E_FLOW_CONTROL, flow, refCon);
+            port->requestEvent(PD_E_FLOW_CONTROL, &flow, refCon);
+            [[fallthrough]];
+        case kComPortControlAskFlow:
+            if (flow & PD_RS232_A_TXO)  return kComPortControlXonXoff;
+            if (flow & PD_RS232_A_CTS)  return kComPortControlHardware;
+            return kComPortControlNoFlow;
+
+        case kComPortControlInboundNone:
+        case kComPortControlInboundXonXoff:
+        case kComPortControlInboundHardware:
+            flow &= ~(PD_RS232_A_RXO | PD_RS232_A_RFR);
+            if (value == kComPortControlInboundXonXoff)     flow |= PD_RS232_A_RXO;
+            if (value == kComPortControlInboundHardware)    flow |= PD_RS232_A_RFR;
+            port->executeEvent(PD_E_FLOW_CONTROL, flow, refCon);
+            port->requestEvent(PD_E_FLOW_CONTROL, &flow, refCon);
+            [[fallthrough]];
+        case kComPortControlAskInbound:
+            if (flow & PD_RS232_A_RXO)  return kComPortControlInboundXonXoff;
+            if (flow & PD_RS232_A_RFR)  return kComPortControlInboundHardware;
+            return kComPortControlInboundNone;
+
+        case kComPortControlBreakOn:
+        case kComPortControlBreakOff:
+            port->executeEvent(PD_RS232_E_LINE_BREAK, value == kComPortControlBreakOn, refCon);
+            [[fallthrough]];
+        case kComPortControlAskBreak:
+            port->requestEvent(PD_RS232_E_LINE_BREAK, &data, refCon);
+            return data ? kComPortControlBreakOn : kComPortControlBreakOff;
+
+        case kComPortControlDTROn:
+        case kComPortControlDTROff:
+            port->setState((value == kComPortControlDTROn) ? PD_RS232_S_DTR : 0, PD_RS232_S_DTR, refCon);
+            [[fallthrough]];
+        case kComPortControlAskDTR:
+            return (port->getState(refCon) & PD_RS232_S_DTR) ? kComPortControlDTROn : kComPortControlDTROff;
+
+        case kComPortControlRTSOn:
+        case kComPortControlRTSOff:
+            port->setState((value == kComPortControlRTSOn) ? PD_RS232_S_RTS : 0, PD_RS232_S_RTS, refCon);
+            [[fallthrough]];
+        case kComPortControlAskRTS:
+            return (port->getState(refCon) & PD_RS232_S_RTS) ? kComPortControlRTSOn : kComPortControlRTSOff;
+    }
+    return value;
+}
+
+
+// PURGE-DATA drops what we hold as well as asking the port to flush. A batch partly written has to be
+// finished, or the client could be left inside an escape.
+static void purgeData(UInt8 value){
+
+    if (value & 1){
+        sDaemon.port->executeEvent(PD_E_RXQ_FLUSH, 0, sDaemon.refCon);
+        if (sDaemon.rxOffset == 0)
+            sDaemon.rxLength = 0;
+    }
+    if (value & 2){
+        sDaemon.port->executeEvent(PD_E_TXQ_FLUSH, 0, sDaemon.refCon);
+        sDaemon.txDataLength = 0;
+    }
+}
+
+
+// A COM-PORT-OPTION subnegotiation. Settings are read back from the port for the reply, so the client
+// learns the value the port actually took.
+static void handleComPort(const UInt8 *data, UInt32 length){
+    static const UInt8  stopBits[] = { 0, 2, 4, 3 };    // 1, 2 and 1.5 in the port's half bits
+    VirtualSerialPort   *port = sDaemon.port;
+    void                *refCon = sDaemon.refCon;
+    UInt32              current = 0;
+    UInt8               code, value;
+
+    if (length == 0) return;
+    code = data[0];
+    value = (length > 1) ? data[1] : 0;
+
+    switch (code){
+        case kComPortSignature:
+            // The client sending its own needs no answer, an empty one asks for ours.
+            if (length == 1)
+                sendComPort(code, (const UInt8*)"vspd", 4);
+            return;
+
+        case kComPortSetBaudRate:{
+            UInt32  rate;
+            UInt8   reply[4];
+
+            if (length < 5) return;
+            rate = ((UInt32)data[1] << 24) | ((UInt32)data[2] << 16) | ((UInt32)data[3] << 8) | data[4];
+            if (rate)
+                port->executeEvent(PD_E_DATA_RATE, rate << 1, refCon);
+            port->requestEvent(PD_E_DATA_RATE, &current, refCon);
+            current >>= 1;
+            reply[0] = (UInt8)(current >> 24);
+            reply[1] = (UInt8)(current >> 16);
+            reply[2] = (UInt8)(current >> 8);
+            reply[3] = (UInt8)current;
+            sendComPort(code, reply, sizeof(reply));
+            return;
+        }
+
+        case kComPortSetDataSize:
+            if (value)
+                port->executeEvent(PD_E_DATA_SIZE, value << 1, refCon);
+            port->requestEvent(PD_E_DATA_SIZE, &current, refCon);
+            value = (UInt8)(current >> 1);
+            break;
+
+        case kComPortSetParity:
+            // Both run none, odd, even, mark, space.
+            if ((value >= kComPortParityNone) && (value <= kComPortParitySpace))
+                port->executeEvent(PD_E_DATA_INTEGRITY, value - kComPortParityNone + PD_RS232_PARITY_NONE, refCon);
+            port->requestEvent(PD_E_DATA_INTEGRITY, &current, refCon);
+            if ((current >= PD_RS232_PARITY_NONE) && (current <= PD_RS232_PARITY_SPACE))
+                value = (UInt8)(current - PD_RS232_PARITY_NONE + kComPortParityNone);
+            else
+                value = kComPortParityNone;
+            break;
+
+        case kComPortSetStopSize:
+            if ((value >= 1) && (value <= 3))
+                port->executeEvent(PD_RS232_E_STOP_BITS, stopBits[value], refCon);
+            port->requestEvent(PD_RS232_E_STOP_BITS, &current, refCon);
+            value = (current == 4) ? 2 : ((current == 3) ? 3 : 1);
+            break;
+
+        case kComPortSetControl:
+            value = setControl(value);
+            break;
+
+        case kComPortFlowSuspend:
+        case kComPortFlowResume:
+            sDaemon.flowSuspended = (code == kComPortFlowSuspend);
+            return;
+
+        case kComPortSetLineMask:
+            sDaemon.lineMask = value;
+            break;
+
+        case kComPortSetModemMask:
+            sDaemon.modemMask = value;
+            break;
+
+        case kComPortPurgeData:
+            purgeData(value);
+            break;
+
+        default:
+            return;
+    }
+    sendComPort(code, &value, 1);
+}
+
+
+// Takes the next piece of what the client sent: a run of data to enqueue, or a command to act on. Returns
+// false when there is nothing to take, or no room left for what a command might answer.
+static bool decodeTelnet(void){
+    TelnetDecoder   *decoder = &sDaemon.decoder;
+    UInt32          used;
+
+    if ((sDaemon.txLength == 0) || (sDaemon.controlLength + kControlReserve > kControlSize))
+        return false;
+
+    UInt32 result = TelnetNext(decoder, sDaemon.txBuffer + sDaemon.txOffset, sDaemon.txLength, &used,
+                               &sDaemon.txData, &sDaemon.txDataLength);
+    sDaemon.txOffset += used;
+    sDaemon.txLength -= used;
+
+    if (result == kTelnetCommand){
+        if ((decoder->Verb >= kTelnetWILL) && (decoder->Verb <= kTelnetDONT))
+            handleOption(decoder->Verb, decoder->Option);
+        else if ((decoder->Verb == kTelnetSB) && (decoder->Option == kTelnetComPort))
+            handleComPort(decoder->Data, decoder->Length);
+    }
+    return true;
+}
+
+
+// Events due for the tty become NOTIFY-LINESTATE, under the client's mask.
+static void takeLineEvents(void){
+    UInt32  event, data;
+    UInt8   line;
+
+    while (sDaemon.controlLength + kControlReserve <= kControlSize){
+        if ((sDaemon.port->dequeueEvent(&event, &data, false, sDaemon.refCon) != kIOReturnSuccess) || (event == PD_E_EOQ))
+            break;
+
+        switch (event){
+            case PD_RS232_E_LINE_BREAK:     line = data ? kComPortLineBreak : 0;    break;
+            case PD_E_FRAMING_ERROR:
+            case PD_E_FRAMING_BYTE:         line = kComPortLineFraming;             break;
+            case PD_E_INTEGRITY_ERROR:
+            case PD_E_PARITY_ERROR:
+            case PD_E_PARITY_BYTE:          line = kComPortLineParity;              break;
+            case PD_E_HW_OVERRUN_ERROR:
+            case PD_E_SW_OVERRUN_ERROR:     line = kComPortLineOverrun;             break;
+            default:                        line = 0;                               break;
+        }
+        line &= sDaemon.lineMask;
+        if (line)
+            sendComPort(kComPortNotifyLineState, &line, 1);
+    }
+}
+
+
+static UInt8 modemState(UInt32 lines){
+    UInt8   modem = 0;
+
+    if (lines & PD_RS232_S_CAR) modem |= kComPortModemCD;
+    if (lines & PD_RS232_S_RI)  modem |= kComPortModemRI;
+    if (lines & PD_RS232_S_DSR) modem |= kComPortModemDSR;
+    if (lines & PD_RS232_S_CTS) modem |= kComPortModemCTS;
+    return modem;
+}
+
+
+// Modem lines the client of the port has changed become NOTIFY-MODEMSTATE, under the telnet client's mask.
+static void checkModemLines(void){
+    UInt32  lines = sDaemon.port->getState(sDaemon.refCon) & kModemLines;
+    UInt32  changed = lines ^ sDaemon.lines;
+    UInt8   modem;
+
+    if ((changed == 0) || (sDaemon.controlLength + kControlReserve > kControlSize)) return;
+
+    modem = modemState(lines);
+    if (changed & PD_RS232_S_CAR)                           modem |= kComPortModemDeltaCD;
+    if (changed & PD_RS232_S_DSR)                           modem |= kComPortModemDeltaDSR;
+    if (changed & PD_RS232_S_CTS)                           modem |= kComPortModemDeltaCTS;
+    if ((changed & PD_RS232_S_RI) && !(lines & PD_RS232_S_RI)) modem |= kComPortModemRIEnded;
+    sDaemon.lines = lines;
+
+    modem &= sDaemon.modemMask;
+    if (modem)
+        sendComPort(kComPortNotifyModemState, &modem, 1);
+}
+
+
+// Returns false if not all of it could be written.
+static bool flushControl(void){
+    ssize_t written;
+
+    while (sDaemon.controlLength){
+        written = write(sDaemon.master, sDaemon.control, sDaemon.controlLength);
+        if (written < 0){
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                ttyClosed();
+            return false;
+        }
+        memmove(sDaemon.control, sDaemon.control + written, sDaemon.controlLength - written);
+        sDaemon.controlLength -= written;
+    }
+    return true;
+}
+
+
+#pragma mark tty
+
+static UInt32 termiosBaudRate(speed_t speed){
+    static const struct { speed_t speed; UInt32 rate; } rates[] = {
+        { B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 }, { B150, 150 }, { B200, 200 },
+        { B300, 300 }, { B600, 600 }, { B1200, 1200 }, { B1800, 1800 }, { B2400, 2400 },
+        { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+        { B115200, 115200 }, { B230400, 230400 }
+    };
+
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++){
+        if (rates[i].speed == speed)
+            return rates[i].rate;
+    }
+    return 0;
+}
+
+
+// Pass changes to the slave's termios on to the port as the events IOSerialBSDClient would send.
+static void mirrorTermios(bool force){
+    struct termios  termios;
+    tcflag_t        changed;
+    void            *refCon = sDaemon.refCon;
+
+    if (tcgetattr(sDaemon.master, &termios) < 0) return;
+
+    changed = termios.c_cflag ^ sDaemon.termios.c_cflag;
+    if (force || (cfgetospeed(&termios) != cfgetospeed(&sDaemon.termios))){
+        UInt32 rate = termiosBaudRate(cfgetospeed(&termios));
+        if (rate)
+            sDaemon.port->executeEvent(PD_E_DATA_RATE, rate << 1, refCon);
+    }
+    if (force || (changed & CSIZE)){
+        UInt32 size = 8;
+        switch (termios.c_cflag & CSIZE){
+            case CS5:   size = 5;   break;
+            case CS6:   size = 6;   break;
+            case CS7:   size = 7;   break;
+        }
+        sDaemon.port->executeEvent(PD_E_DATA_SIZE, size << 1, refCon);
+    }
+    if (force || (changed & (PARENB | PARODD | CMSPAR))){
+        UInt32 parity = PD_RS232_PARITY_NONE;
+        if (termios.c_cflag & PARENB){
+            if (termios.c_cflag & CMSPAR)
+                parity = (termios.c_cflag & PARODD) ? PD_RS232_PARITY_MARK : PD_RS232_PARITY_SPACE;
+            else
+                parity = (termios.c_cflag & PARODD) ? PD_RS232_PARITY_ODD : PD_RS232_PARITY_EVEN;
+        }
+        sDaemon.port->executeEvent(PD_E_DATA_INTEGRITY, parity, refCon);
+    }
+    if (force || (changed & CSTOPB))
+        sDaemon.port->executeEvent(PD_RS232_E_STOP_BITS, (termios.c_cflag & CSTOPB) ? 4 : 2, refCon);
+    if (force || (changed & CRTSCTS) || ((termios.c_iflag ^ sDaemon.termios.c_iflag) & (IXON | IXOFF | IXANY))){
+        UInt32 flow = 0;
+        if (termios.c_cflag & CRTSCTS)  flow |= PD_RS232_A_CTS | PD_RS232_A_RFR;
+        if (termios.c_iflag & IXON)     flow |= PD_RS232_A_TXO;
+        if (termios.c_iflag & IXOFF)    flow |= PD_RS232_A_RXO;
+        if (termios.c_iflag & IXANY)    flow |= PD_RS232_A_XANY;
+        sDaemon.port->executeEvent(PD_E_FLOW_CONTROL, flow, refCon);
+    }
+
+    sDaemon.termios = termios;
+}
+
+
+static void ttyOpened(void){
+
+    if ((sDaemon.port->acquirePort(false, sDaemon.refCon) != kIOReturnSuccess) ||
+        (sDaemon.port->executeEvent(PD_E_ACTIVE, true, sDaemon.refCon) != kIOReturnSuccess)){
+        fprintf(stderr, "vspd: could not acquire the port\n");
+        return;
+    }
+    // The port starts with 4 KB queues, which would cut every batch into sixteen.
+    if ((sDaemon.port->executeEvent(PD_E_RXQ_SIZE, kQueueSize, sDaemon.refCon) != kIOReturnSuccess) ||
+        (sDaemon.port->executeEvent(PD_E_TXQ_SIZE, kQueueSize, sDaemon.refCon) != kIOReturnSuccess))
+        fprintf(stderr, "vspd: could not size the queues to %u bytes\n", kQueueSize);
+
+    sDaemon.ttyOpen = true;
+    sDaemon.rxLength = 0;
+    sDaemon.txLength = 0;
+    sDaemon.txDataLength = 0;
+    if (sDaemon.telnetAddress){
+        // The settings stay as the port has them until the client sets them.
+        TelnetInit(&sDaemon.decoder);
+        bzero(sDaemon.options, sizeof(sDaemon.options));
+        sDaemon.controlLength = 0;
+        sDaemon.lines = sDaemon.port->getState(sDaemon.refCon) & kModemLines;
+        sDaemon.lineMask = 0;
+        sDaemon.modemMask = 0xFF;
+        sDaemon.flowSuspended = false;
+    } else {
+        mirrorTermios(true);
+    }
+    setEvents(sDaemon.master, (UInt64)kEventMaster << 32, EPOLLIN, &sDaemon.masterEvents);
+    armWatcher();
+}
+
+
+static void ttyClosed(void){
+
+    if (!sDaemon.ttyOpen) return;
+
+    // Anything the tty hadn't read, or the port hadn't taken, goes with it.
+    setEvents(sDaemon.master, 0, 0, &sDaemon.masterEvents);
+    sDaemon.ttyOpen = false;
+    sDaemon.rxLength = 0;
+    sDaemon.txLength = 0;
+    sDaemon.txDataLength = 0;
+    sDaemon.port->releasePort(sDaemon.refCon);
+
+    if (sDaemon.telnetAddress){
+        close(sDaemon.master);
+        sDaemon.master = -1;
+    }
+}
+
+
+// The master reports POLLHUP for as long as nothing has the slave open.
+static void checkSlaveOpened(void){
+    struct pollfd   fd = { sDaemon.master, POLLIN, 0 };
+
+    if ((poll(&fd, 1, 0) >= 0) && !(fd.revents & POLLHUP))
+        ttyOpened();
+}
+
+
+// One telnet client at a time, any more are turned away.
+static void acceptTelnet(void){
+    int one = 1;
+    int fd;
+
+    while ((fd = accept4(sDaemon.telnetListener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        if (sDaemon.ttyOpen){
+            fprintf(stderr, "vspd: refusing a telnet connection, the port is already open\n");
+            close(fd);
+            continue;
+        }
+
+        // Control replies are small and shouldn't wait for more to go with them. Fails harmlessly on a Unix socket.
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sDaemon.master = fd;
+        ttyOpened();
+        if (!sDaemon.ttyOpen){
+            close(fd);
+            sDaemon.master = -1;
+        }
+    }
+}
+
+
+// Port to tty: gather what the port has into one buffer and write it in one go. A telnet client gets
+// replies and notifications between batches, and a batch with 0xFF in it goes as an escaped copy.
+static void drainRX(void){
+    UInt32      count;
+    ssize_t     written;
+
+    while (sDaemon.ttyOpen){
+        if (sDaemon.rxLength == 0){
+            if (sDaemon.telnetAddress){
+                takeLineEvents();
+                if (!flushControl() || sDaemon.flowSuspended) break;
+            }
+
+            sDaemon.rxOffset = 0;
+            do {
+                sDaemon.port->dequeueData(sDaemon.rxBuffer + sDaemon.rxLength, kBatchSize - sDaemon.rxLength, &count, 0, sDaemon.refCon);
+                sDaemon.rxLength += count;
+            } while (count && (sDaemon.rxLength < kBatchSize));
+            if (sDaemon.rxLength == 0) break;
+
+            sDaemon.rxWire = sDaemon.rxBuffer;
+            if (sDaemon.telnetAddress && memchr(sDaemon.rxBuffer, kTelnetIAC, sDaemon.rxLength)){
+                sDaemon.rxLength = TelnetEscape(sDaemon.wire, sDaemon.rxBuffer, sDaemon.rxLength);
+                sDaemon.rxWire = sDaemon.wire;
+            }
+        }
+
+        written = write(sDaemon.master, sDaemon.rxWire + sDaemon.rxOffset, sDaemon.rxLength);
+        if (written < 0){
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) break;
+            ttyClosed();
+            return;
+        }
+        sDaemon.rxOffset += written;
+        sDaemon.rxLength -= written;
+    }
+}
+
+
+// tty to port: push what was read from the master until the port is full. What a telnet client sent
+// comes out of the decoder a run of data at a time, with the commands between runs acted on in order.
+static void pushTX(void){
+    UInt32  count;
+
+    while (sDaemon.ttyOpen){
+        if (sDaemon.txDataLength == 0){
+            if (!sDaemon.telnetAddress || !decodeTelnet()) break;
+            continue;
+        }
+        if (sDaemon.port->enqueueData((UInt8*)sDaemon.txData, sDaemon.txDataLength, &count, false, sDaemon.refCon) != kIOReturnSuccess)
+            count = 0;
+        if (count == 0) break;
+        sDaemon.txData += count;
+        sDaemon.txDataLength -= count;
+    }
+}
+
+
+static void readMaster(void){
+    ssize_t count;
+
+    if (sDaemon.txLength || sDaemon.txDataLength) return;
+
+    count = read(sDaemon.master, sDaemon.txBuffer, kBatchSize);
+    if ((count < 0) || ((count == 0) && sDaemon.telnetAddress)){
+        if ((count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return;
+        ttyClosed();
+        return;
+    }
+    if (sDaemon.telnetAddress){
+        sDaemon.txOffset = 0;
+        sDaemon.txLength = (UInt32)count;
+    } else {
+        sDaemon.txData = sDaemon.txBuffer;
+        sDaemon.txDataLength = (UInt32)count;
+    }
+    pushTX();
+}
+
+
+// Read from the master only while the port can take more, write only while there is something to write.
+static void updateMaster(void){
+    UInt32  events = 0;
+
+    if (!sDaemon.ttyOpen) return;
+
+    if ((sDaemon.txLength == 0) && (sDaemon.txDataLength == 0))   events |= EPOLLIN;
+    if (sDaemon.rxLength || sDaemon.controlLength)                events |= EPOLLOUT;
+    setEvents(sDaemon.master, (UInt64)kEventMaster << 32, events, &sDaemon.masterEvents);
+
+    // Once the tty has taken everything, wait for more.
+    if ((sDaemon.rxLength == 0) && (sDaemon.port->getState(sDaemon.refCon) & PD_S_ACTIVE))
+        armWatcher();
+}
+
+
+#pragma mark Setup
+
+static bool openMaster(void){
+    struct termios  termios;
+    int             slave;
+
+    sDaemon.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if ((sDaemon.master < 0) || (grantpt(sDaemon.master) < 0) || (unlockpt(sDaemon.master) < 0) ||
+        (ptsname_r(sDaemon.master, sDaemon.slaveName, sizeof(sDaemon.slaveName)) != 0)){
+        perror("vspd: posix_openpt");
+        return false;
+    }
+
+    // Start the slave off raw, like a serial port rather than a terminal. Opening and closing it
+    // once also makes the master report POLLHUP until the next open.
+    slave = open(sDaemon.slaveName, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (slave < 0){
+        perror("vspd: open slave");
+        return false;
+    }
+    tcgetattr(slave, &termios);
+    cfmakeraw(&termios);
+    termios.c_cflag |= CLOCAL | CREAD;
+    cfsetspeed(&termios, B9600);
+    tcsetattr(slave, TCSANOW, &termios);
+    close(slave);
+
+    return true;
+}
+
+
+static int listenUnix(const char *path, int backlog){
+    struct sockaddr_un  address;
+    int                 fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "vspd: socket path too long\n");
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    bzero(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if ((fd < 0) || (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) || (listen(fd, backlog) < 0)){
+        perror("vspd: socket");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool openListener(void){
+    UInt32  events = 0;
+
+    sDaemon.listener = listenUnix(sDaemon.socketPath, kMaxUserClients);
+    if (sDaemon.listener < 0) return false;
+
+    setEvents(sDaemon.listener, (UInt64)kEventListener << 32, EPOLLIN, &events);
+    return true;
+}
+
+
+// host:port, where the host may be empty for any and an IPv6 one is in brackets, or a Unix socket's path.
+// Port 0 takes any free port, so the address served is read back for printing.
+static bool openTelnet(void){
+    const char          *address = sDaemon.telnetAddress;
+    const char          *colon = strrchr(address, ':');
+    struct addrinfo     hints, *info;
+    struct sockaddr_storage bound;
+    socklen_t           boundSize = sizeof(bound);
+    char                host[128], name[INET6_ADDRSTRLEN];
+    UInt32              events = 0;
+    int                 one = 1;
+    size_t              length;
+
+    sDaemon.master = -1;
+    if (strchr(address, '/')){
+        sDaemon.telnetListener = listenUnix(address, 1);
+        if (sDaemon.telnetListener < 0) return false;
+        snprintf(sDaemon.slaveName, sizeof(sDaemon.slaveName), "%s", address);
+        setEvents(sDaemon.telnetListener, (UInt64)kEventTelnet << 32, EPOLLIN, &events);
+        return true;
+    }
+
+    length = colon ? (size_t)(colon - address) : 0;
+    if ((colon == NULL) || (length >= sizeof(host))){
+        fprintf(stderr, "vspd: -t takes host:port or a socket path\n");
+        return false;
+    }
+    if ((length >= 2) && (address[0] == '[') && (address[length - 1] == ']')){
+        address++;
+        length -= 2;
+    }
+    memcpy(host, address, length);
+    host[length] = 0;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(length ? host : NULL, colon + 1, &hints, &info) != 0){
+        fprintf(stderr, "vspd: can't serve telnet on %s\n", sDaemon.telnetAddress);
+        return false;
+    }
+    sDaemon.telnetListener = socket(info->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sDaemon.telnetListener >= 0)
+        setsockopt(sDaemon.telnetListener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((sDaemon.telnetListener < 0) || (bind(sDaemon.telnetListener, info->ai_addr, info->ai_addrlen) < 0) ||
+        (listen(sDaemon.telnetListener, 1) < 0) ||
+        (getsockname(sDaemon.telnetListener, (struct sockaddr*)&bound, &boundSize) < 0)){
+        perror("vspd: telnet");
+        freeaddrinfo(info);
+        return false;
+    }
+    freeaddrinfo(info);
+
+    if (bound.ss_family == AF_INET6){
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&bound;
+        inet_ntop(AF_INET6, &in6->sin6_addr, name, sizeof(name));
+        snprintf(sDaemon.slaveName, sizeof(sDaemon.slaveName), "[%s]:%u", name, ntohs(in6->sin6_port));
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in*)&bound;
+        inet_ntop(AF_INET, &in->sin_addr, name, sizeof(name));
+        snprintf(sDaemon.slaveName, sizeof(sDaemon.slaveName), "%s:%u", name, ntohs(in->sin_port));
+    }
+
+    setEvents(sDaemon.telnetListener, (UInt64)kEventTelnet << 32, EPOLLIN, &events);
+    return true;
+}
+
+
+static bool startPort(void){
+
+    sDaemon.nub = new IOService;
+    sDaemon.port = new VirtualSerialPort;
+    if (!sDaemon.port->init() || !sDaemon.port->attach(sDaemon.nub) || !sDaemon.port->start(sDaemon.nub)){
+        fprintf(stderr, "vspd: VirtualSerialPort failed to start\n");
+        return false;
+    }
+    sDaemon.refCon = &sDaemon.port->fPort;
+    return true;
+}
+
+
+static void stopPort(void){
+
+    ttyClosed();
+
+    pthread_mutex_lock(&sWatcher.lock);
+    sWatcher.quit = true;
+    pthread_cond_signal(&sWatcher.cond);
+    pthread_mutex_unlock(&sWatcher.lock);
+    pthread_join(sWatcher.thread, NULL);
+
+    // Releasing the port has ended any blocking sends, so every worker can finish.
+    for (UInt32 slot = 0; slot < kMaxUserClients; slot++){
+        if (sConnections[slot])
+            closeConnection(sConnections[slot]);
+    }
+    pthread_mutex_lock(&sConnectionLock);
+    while (sNumWorkers)
+        pthread_cond_wait(&sConnectionCond, &sConnectionLock);
+    pthread_mutex_unlock(&sConnectionLock);
+
+    sDaemon.port->stop(sDaemon.nub);
+    sDaemon.port->detach(sDaemon.nub);
+    sDaemon.port->release();
+    sDaemon.nub->release();
+}
+
+
+#pragma mark main
+
+static void run(void){
+    struct epoll_event  events[32];
+    int                 count, timeout;
+    bool                quit = false;
+
+    while (!quit){
+        timeout = sDaemon.ttyOpen ? kTermiosInterval : kClosedPollInterval;
+        count = epoll_wait(sDaemon.epoll, events, 32, timeout);
+
+        for (int i = 0; i < count; i++){
+            UInt32 kind = (UInt32)(events[i].data.u64 >> 32);
+            UInt32 slot = (UInt32)events[i].data.u64;
+
+            switch (kind){
+                case kEventMaster:
+                    if (events[i].events & EPOLLIN)
+                        readMaster();
+                    if (events[i].events & EPOLLOUT)
+                        drainRX();
+                    if (events[i].events & (EPOLLHUP | EPOLLERR))
+                        ttyClosed();
+                    break;
+
+                case kEventListener:
+                    acceptConnections();
+                    break;
+
+                case kEventTelnet:
+                    acceptTelnet();
+                    break;
+
+                case kEventWakeup:{
+                    eventfd_t value;
+                    if (read(sDaemon.wakeup, &value, sizeof(value)) < 0){}
+                    break;
+                }
+
+                case kEventSignal:
+                    quit = true;
+                    break;
+
+                case kEventConnection:{
+                    Connection *connection = sConnections[slot];
+                    bool ok = true;
+
+                    if (connection == NULL) break;
+                    if (events[i].events & EPOLLIN)
+                        ok = readConnection(connection);
+                    if (ok && (events[i].events & EPOLLOUT))
+                        ok = flushConnection(connection);
+                    if (!ok || (events[i].events & (EPOLLHUP | EPOLLERR)))
+                        closeConnection(connection);
+                    break;
+                }
+            }
+        }
+
+        // Whatever woke the loop may have made room or data on either side.
+        if (sDaemon.ttyOpen){
+            pushTX();
+            if (sDaemon.telnetAddress)
+                checkModemLines();
+            drainRX();
+            if (!sDaemon.telnetAddress)
+                mirrorTermios(false);
+        } else if (!sDaemon.telnetAddress){
+            checkSlaveOpened();
+        }
+        updateMaster();
+
+        for (UInt32 slot = 0; slot < kMaxUserClients; slot++){
+            Connection *connection = sConnections[slot];
+
+            if (connection == NULL) continue;
+            pthread_mutex_lock(&connection->outputLock);
+            bool wantsWrite = connection->wantsWrite;
+            pthread_mutex_unlock(&connection->outputLock);
+            if (wantsWrite != connection->writing){
+                UInt32 current = EPOLLIN | EPOLLRDHUP | (connection->writing ? (UInt32)EPOLLOUT : 0);
+                setEvents(connection->socket, ((UInt64)kEventConnection << 32) | slot,
+                          EPOLLIN | EPOLLRDHUP | (wantsWrite ? (UInt32)EPOLLOUT : 0), &current);
+                connection->writing = wantsWrite;
+            }
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]){
+    sigset_t    signals;
+    UInt32      events;
+    int         option;
+
+    sDaemon.socketPath = kVSPDefaultSocket;
+    while ((option = getopt(argc, argv, "s:l:t:v")) != -1){
+        switch (option){
+            case 's':   sDaemon.socketPath = optarg;    break;
+            case 'l':   sDaemon.linkPath = optarg;      break;
+            case 't':   sDaemon.telnetAddress = optarg; break;
+            case 'v':   HostSetLogging(true);           break;
+            default:    sDaemon.socketPath = NULL;      break;
+        }
+    }
+    // A link names the pty slave, which -t doesn't have.
+    if ((sDaemon.socketPath == NULL) || (sDaemon.linkPath && sDaemon.telnetAddress)){
+        fprintf(stderr, "usage: %s [-s socket] [-l link | -t address] [-v]\n", argv[0]);
+        return 2;
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    sDaemon.epoll = epoll_create1(EPOLL_CLOEXEC);
+    sDaemon.wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    sDaemon.signals = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    events = 0;
+    setEvents(sDaemon.wakeup, (UInt64)kEventWakeup << 32, EPOLLIN, &events);
+    events = 0;
+    setEvents(sDaemon.signals, (UInt64)kEventSignal << 32, EPOLLIN, &events);
+
+    HostSetMessageHandler(messageHandler, NULL);
+    if (!startPort() || !(sDaemon.telnetAddress ? openTelnet() : openMaster()) || !openListener())
+        return 1;
+    pthread_create(&sWatcher.thread, NULL, watchRX, NULL);
+
+    if (sDaemon.linkPath){
+        unlink(sDaemon.linkPath);
+        if (symlink(sDaemon.slaveName, sDaemon.linkPath) < 0)
+            perror("vspd: symlink");
+    }
+    printf("%s %s\n", sDaemon.slaveName, sDaemon.socketPath);
+    fflush(stdout);
+
+    run();
+
+    stopPort();
+    unlink(sDaemon.socketPath);
+    if (sDaemon.linkPath)
+        unlink(sDaemon.linkPath);
+    if (sDaemon.telnetAddress && strchr(sDaemon.telnetAddress, '/'))
+        unlink(sDaemon.telnetAddress);
+    return 0;
+}
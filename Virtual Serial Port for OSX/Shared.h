@@ -1,4 +1,7 @@
 
+#ifndef VSP_SHARED_H
+#define VSP_SHARED_H
+
 // Data structure passed between the tool and the user client. This structure and its fields need to have
 // the same size and alignment between the user client, 32-bit processes, and 64-bit processes.
 // To avoid invisible compiler padding, align fields on 64-bit boundaries when possible
@@ -11,10 +14,33 @@ enum {
     kClientClose,
     kClientGetInfo,
     kSendData,
+    kSetOverflowPolicy,
+    kRingDoorbell,
+    kSendBuffer,
+    kReadAsync,
+    kSetNotifyWindow,
+    kExecuteBatch,
+    kSetSubscription,
+    kGetCredits,
+    kSetFraming,
+    kSendEvent,
+    kSetLineFormat,
+    kSetFaults,
+    kGetLockStats,
+    kSetResponder,
+    kGetResponderStats,
     kNumberOfMethods // Must be last 
 };
 
 
+// What sendData does when the RX queue (data on its way to the tty) is full.
+enum{
+    kOverflowBlock,         // sleep the sender until the tty has drained enough space
+    kOverflowDropNewest,    // accept what fits and discard the rest of the buffer
+    kOverflowDropOldest     // overwrite the oldest queued bytes so the newest always get through
+};
+
+
 #define kMessageBufferSize  64
 typedef struct{
     UInt64 numBytes;
@@ -22,10 +48,320 @@ typedef struct{
 }TRBufferStruct;
 
 
+// kSendBuffer takes the data itself as a variable sized struct input and a send mode as its scalar input.
+// Outputs are the number of bytes accepted and the free space left in the RX queue.
+#define kMaxSendBufferSize  (1024 * 1024)
+
+enum{
+    kSendNormal,            // queue what the overflow policy allows and return
+    kSendBlocking,          // sleep until every byte is queued, or the tty closes the port (kIOReturnIOError)
+    kSendAsync              // return at once, complete with the byte count once every byte is queued
+};
+// kSendAsync is called with IOConnectCallAsyncMethod. The completion status is kIOReturnSuccess, or
+// kIOReturnNotOpen / kIOReturnAborted if the port or connection closes first. Up to kMaxPendingSends
+// sends can be queued and are completed in order. Neither blocking nor async sends ever drop data.
+#define kMaxPendingSends    8
+
+
+// kReadAsync is called with IOConnectCallAsyncScalarMethod. Scalar inputs are the address and size of the
+// buffer to fill, the minimum number of bytes to wait for, and a timeout in milliseconds (0 waits forever).
+// The read completes with the byte count as its only argument once the minimum has arrived, the timeout
+// expires (kIOReturnTimeout), the tty closes the port (kIOReturnNotOpen) or the connection is closed
+// (kIOReturnAborted). Up to kMaxPendingReads reads can be queued and are completed in order.
+#define kMaxPendingReads    8
+
+
+// Credit based sending. kGetCredits returns the credit limit and the number of bytes queued for the tty so
+// far, both free running totals. Up to (Limit - Sent) bytes can be sent and all of them will be accepted.
+// Once a client has called kGetCredits it gets a kCreditID notification with the new totals each time the
+// tty drains the RX queue below its low water mark, so credit comes back in large batches. A low water mark
+// of 0 is reached when the queue empties.
+// Credit assumes a single producer; bytes queued by anyone else use it up too.
+
+
+// kSetFraming turns the RX queue into a queue of frames. Scalar inputs are a framing mode, its parameter and
+// the longest frame, 0 meaning the queue size; longer frames are cut there. Boundaries are found as the data
+// is queued, and dequeueData then gives the tty one whole frame at a time: PD_S_RXQ_EMPTY stays set until a
+// frame is complete, and each call returns no more than the next frame, over several calls if the tty's
+// buffer is smaller. The bytes themselves are unchanged, delimiters and length prefixes included. At most
+// kMaxQueuedFrames frames are queued, after that the queue counts as full. Framing can only be changed while
+// the RX queue is empty, kIOReturnBusy otherwise.
+enum{
+    kFramingNone,           // a plain byte stream
+    kFramingDelimiter,      // a frame ends with the byte given as the parameter
+    kFramingLengthPrefix,   // a frame starts with its length, not counting the prefix, in 1, 2 or 4 (the parameter) big endian bytes
+    kFramingFixed           // every frame is the longest frame
+};
+
+#define kMaxQueuedFrames    1024
+
+
+// kSendEvent queues an event for the tty (scalar inputs event and data), in band with the data sent so far:
+// the tty's dequeueData stops short of it, and dequeueEvent returns it once everything sent before it has
+// been read. Only the receive events a UART reports can be sent: PD_E_DATA_BYTE, PD_E_FRAMING_BYTE and
+// PD_E_PARITY_BYTE with the byte as data, PD_E_INTEGRITY_ERROR, PD_E_FRAMING_ERROR, PD_E_PARITY_ERROR,
+// PD_E_HW_OVERRUN_ERROR and PD_RS232_E_LINE_BREAK. Up to kEventRingSize events can be waiting, after that
+// kSendEvent returns kIOReturnNoSpace.
+#define kEventRingSize      64          // Must be a power of two
+
+
+// The port behaves like a UART on a line to the client's end, using the tty's data bits (PD_E_DATA_SIZE) and
+// parity (PD_E_DATA_INTEGRITY, checked on receive unless PD_E_RX_DATA_INTEGRITY is PD_RS232_PARITY_ANY).
+// kSetLineFormat sets the data bits and parity of the client's end (scalar inputs; 0 for either follows the
+// tty). Each byte crosses the line as a character of that many data bits, plus its parity bit, and is read
+// at the other end in that end's format. Where the formats agree the bytes just lose their unused high bits;
+// where they don't, the far end reads parity and stop bits as data or the other way round, as a real line
+// would. A character with a bad parity bit or a missing stop bit still reaches the tty, preceded by a
+// PD_E_PARITY_ERROR or PD_E_FRAMING_ERROR event with the byte as data. Stop bits never cause errors, a
+// receiver only checks the first. Errors beyond what the event ring holds are only counted, in the status
+// page. Errors in data the tty writes aren't reported.
+
+
+// kSetFaults corrupts the line one way, for soak testing. The scalar input is the direction and the struct input
+// a FaultConfig; all intervals 0 turns injection off. Each fault strikes on average once per its interval, 0 for
+// never, at points drawn from a generator seeded with Seed. Setting the faults restarts the generator, and so does
+// acquiring the port, so the same data meets the same faults on every run. A flipped bit is reported to the tty
+// the way kSetLineFormat reports a bad character, if its format would notice; a burst garbles BurstLength
+// characters and ends in a framing error. A break reaches the tty as a PD_RS232_E_LINE_BREAK event, and the client
+// as PD_RS232_S_BRK going on and off in band with the data. Jitter holds the bytes from that point back for up to
+// MaxJitter microseconds. Credit and the byte counts follow the bytes that reach the queue, not what was sent.
+enum{
+    kFaultsToTTY,           // Data sent by the client
+    kFaultsFromTTY          // Data written by the tty
+};
+
+#define kMaxFaultJitter     (1000 * 1000)
+#define kMaxFaultBurst      4096
+
+typedef struct{
+    UInt64  Seed;
+    UInt32  BitErrorInterval;       // Mean bits between flipped bits, counting parity and stop bits
+    UInt32  DropInterval;           // Mean characters between lost ones
+    UInt32  DuplicateInterval;      // Mean characters between ones that arrive twice
+    UInt32  BurstInterval;          // Mean characters between bursts
+    UInt32  BurstLength;
+    UInt32  BreakInterval;          // Mean characters between breaks
+    UInt32  JitterInterval;         // Mean characters between delays
+    UInt32  MaxJitter;              // Microseconds
+}FaultConfig;
+
+
+// kGetLockStats reads the counters kept on one of the port's locks, in drivers built with VSP_LOCK_STATS; others
+// return kIOReturnUnsupported. Scalar inputs are a kLock... index and 1 to clear the counters once they are read.
+// The struct output is a list of LockStats, the first for the lock as a whole (no Function, Line 0) and then one
+// for each place in the driver that has taken the lock since the port started, or since it was last cleared.
+// Acquisitions that found the lock held count as contended. Times are in nanoseconds; holding the lock runs from
+// taking it to releasing it, not counting any IOLockSleep on it in between, and is charged to where it was taken.
+enum{
+    kLockSerialRequest,     // serialRequestLock, the port state
+    kLockRXBuffer,          // RXBufferLock, data on its way to the tty
+    kLockTXBuffer,          // TXBufferLock, data written by the tty
+    kLockStatus,            // The status page
+    kLockBatch,
+    kLockClients,
+    kLockResponder,
+    kNumberOfLocks
+};
+
+#define kMaxLockSites       128
+#define kLockFunctionSize   48
+typedef struct{
+    char    Function[kLockFunctionSize];
+    UInt32  Line;
+    UInt32  Reserved;
+    UInt64  Acquisitions;
+    UInt64  Contended;
+    UInt64  WaitTime;               // Total time spent waiting for the lock
+    UInt64  HoldTime;               // Total and longest time it was held
+    UInt64  MaxHoldTime;
+}LockStats;
+
+
+// kSetResponder puts a responder on the port, which answers what the tty writes the way the device the port stands
+// in for would, without a round trip to the client. The struct input is a ResponderHeader followed by Count rules,
+// each a ResponderRule followed by its pattern and its response, padded together to a multiple of 8 bytes; an empty
+// input takes the responder away. What the tty writes is cut into messages the way kSetFraming cuts frames, using
+// the header's Framing, Parameter and MaxSize (0 for kMaxResponderMessage), except that with kFramingNone each write
+// is a message, and a delimiter isn't part of the message it ends. The first rule that matches a message has its
+// response queued for the tty, Delay microseconds later and Interval microseconds per byte, both 0 for at once;
+// paced responses go out in order, behind each other. Whatever the RX queue can't take is dropped as an overrun.
+// Unless kResponderPassThrough is set the client doesn't get what the responder takes. The rules are checked when
+// they are set, kIOReturnBadArgument if any is malformed.
+//
+// A kMatchPattern pattern matches byte for byte, except for these, which capture what they match as $1 to $9:
+//      ?       any byte
+//      *       any run of bytes, the shortest that lets the rest match
+//      #       a run of digits, all of them
+//      \       the next byte, literally
+// kMatchLiteral matches the whole message and kMatchPrefix its start, both byte for byte; the rest of the message
+// after a prefix is $1. A response is copied as it is, except for:
+//      $0      the message
+//      $1..$9  what the pattern captured
+//      $c      the CRC-16/Modbus of the response so far, low byte first
+//      $x      the NMEA checksum of the response so far, two hex digits, leaving out its first byte and a last '*'
+//      $$      a $
+//
+// kGetResponderStats returns a ResponderStats as its struct output, clearing the counts if its scalar input is 1.
+// Both count from when the responder was set; kIOReturnNotFound if there isn't one.
+enum{
+    kMatchLiteral,
+    kMatchPrefix,
+    kMatchPattern
+};
+
+#define kResponderPassThrough   0x01        // ResponderHeader Flags: the client gets the data as well
+#define kRuleCheckCRC           0x01        // ResponderRule Flags: only messages ending in a good CRC-16/Modbus match
+
+#define kMaxResponderRules      64
+#define kMaxResponderMessage    256
+#define kMaxResponderReply      1024        // Longest a response can get, with its captures at their longest
+#define kMaxResponderSize       (64 * 1024)
+#define kMaxResponderDelay      (10 * 1000 * 1000)
+
+typedef struct{
+    UInt32  Count;
+    UInt32  Flags;
+    UInt32  Framing;                // kFraming..., as kSetFraming takes them
+    UInt32  Parameter;
+    UInt32  MaxSize;
+    UInt32  Reserved;
+}ResponderHeader;
+
+typedef struct{
+    UInt16  Match;                  // kMatch...
+    UInt16  Flags;
+    UInt16  PatternSize;
+    UInt16  ResponseSize;
+    UInt32  Delay;                  // Microseconds, up to kMaxResponderDelay
+    UInt32  Interval;
+}ResponderRule;
+
+typedef struct{
+    UInt64  Messages;
+    UInt64  Matched;
+    UInt64  ResponseBytes;          // Bytes of responses queued for the tty
+    UInt64  Dropped;                // and the bytes that didn't fit
+}ResponderStats;
+
+
+// kExecuteBatch takes a packed list of BatchCommand records as its struct input and runs them in order
+// in a single call, returning one BatchResult per command as its struct output. A kBatchSend record is
+// followed by Arg1 bytes of data, padded to a multiple of 8 bytes. The batch stops at the first record
+// that is malformed.
+enum{
+    kBatchExecuteEvent,     // executeEvent(event Arg0, data Arg1)
+    kBatchRequestEvent,     // Value = requestEvent(event Arg0)
+    kBatchSetState,         // Set the lines in mask Arg0, of CTS, DSR, CD and RI, to the values in Arg1
+    kBatchGetState,         // Value = the port state
+    kBatchSend,             // Queue the Arg1 bytes that follow for the tty, Value = bytes accepted
+    kBatchSendEvent,        // sendEvent(event Arg0, data Arg1)
+    kNumberOfBatchCommands
+};
+
+#define kMaxBatchCommands   256
+typedef struct{
+    UInt32  Command;
+    UInt32  Arg0;
+    UInt64  Arg1;
+}BatchCommand;
+
+typedef struct{
+    UInt32  Command;
+    SInt32  Result;         // IOReturn
+    UInt64  Value;
+}BatchResult;
+
+
+// Shared memory rings, mapped with IOConnectMapMemory using these types. Head and Tail are free running
+// byte counts: the producer writes Data[Head & (kSharedRingSize - 1)] then advances Head, the consumer reads
+// Data[Tail & (kSharedRingSize - 1)] then advances Tail. A side that wants to be told when the other side
+// has made progress sets WakeupRequested; the other side clears it and sends a kRingWakeupID notification.
+// kRingDoorbell asks the driver to look at both rings straight away.
+//
+// Head, Tail and WakeupRequested are only touched with sequentially consistent atomics, on both sides.
+// The driver only comes back to a ring it has emptied (RX) or filled (TX) when something rings, so user
+// space rings kRingDoorbell after advancing its index if the ring was empty (RX: Tail was the old Head)
+// or full (TX: Head was the old Tail plus kSharedRingSize), read after the store. To wait, set
+// WakeupRequested, read the other side's index again and only wait for kRingWakeupID if it hasn't moved.
+enum{
+    kSharedRXRing,      // Produced by user space, consumed by the driver and delivered to the tty
+    kSharedTXRing,      // Produced by the driver from data the tty writes, consumed by user space
+    kNumberOfSharedRings
+};
+
+#define kSharedRingSize     (64 * 1024)     // Must be a power of two
+typedef struct{
+    UInt32  Head;
+    UInt32  Tail;
+    UInt32  WakeupRequested;
+    UInt32  Reserved;
+    UInt8   Data[kSharedRingSize];
+}SharedRing;
+
+
+// Fields of a PortDeltaNotification and of the status page. kClientGetInfo still sends the full PortStateNotification and
+// PortInfoNotification, after that changes arrive as deltas against what was last sent.
+enum{
+    kPortFieldState,
+    kPortFieldCharLength,
+    kPortFieldStopBits,
+    kPortFieldTXParity,
+    kPortFieldRXParity,
+    kPortFieldBaudRate,
+    kPortFieldMinLatency,
+    kPortFieldXONchar,
+    kPortFieldXOFFchar,
+    kPortFieldFlowControl,
+    kPortFieldFlowControlState,
+    kPortFieldRXOstate,
+    kPortFieldTXOstate,
+    kPortFieldRXOverflowPolicy,
+    kPortFieldRXOverRuns,
+    kNumberOfPortFields // Must be last
+};
+
+// kSetSubscription takes a mask of port state bits and a mask of (1 << kPortField...) bits. Delta notifications
+// are only sent for changes that match, by default everything. kPortFieldState in the field mask is ignored,
+// the state mask decides which state changes are sent.
+//
+// kSetNotifyWindow sets how long, in microseconds, changes are collected before a delta is sent.
+// 0 sends every change straight away.
+#define kMaxNotifyWindow    (1000 * 1000)
+
+
+// Read only status page, mapped with IOConnectMapMemory type kPortStatusPage. The driver bumps Sequence to an
+// odd value, updates the page, then bumps it to the next even value. To take a consistent snapshot, read
+// Sequence, retry while it is odd, copy the page, then retry if Sequence has changed. Load Sequence and
+// every field with acquire atomics, so the copy stays between the two reads of Sequence.
+#define kPortStatusPage     0x100
+
+typedef struct{
+    UInt32  Sequence;
+    UInt32  Reserved;
+    UInt64  Values[kNumberOfPortFields];    // Indexed by kPortField...
+    UInt64  RXUsed;                         // RX queue, data on its way to the tty
+    UInt64  RXSize;
+    UInt64  TXUsed;                         // TX queue, data written by the tty
+    UInt64  TXSize;
+    UInt64  RXBytesIn;                      // Counters since the driver started
+    UInt64  RXBytesOut;
+    UInt64  TXBytesIn;
+    UInt64  TXBytesOut;
+    UInt64  TXOverRuns;
+    UInt64  RXParityErrors;                 // Characters the tty received with a bad parity bit
+    UInt64  RXFramingErrors;                // or without a stop bit, see kSetLineFormat
+    UInt64  RXFaults;                       // Faults injected each way since the port was acquired, see kSetFaults
+    UInt64  TXFaults;
+}PortStatusPage;
+
+
 //  Notifications
 enum{
     kPortStateID,
-    kPortInfoID
+    kPortInfoID,
+    kRingWakeupID,
+    kPortDeltaID,
+    kCreditID
 };
 
 
@@ -43,6 +379,8 @@ typedef struct{
     UInt64  FlowControlState;       // tx flow control state, one of PAUSE_SEND if paused or CONTINUE_SEND if not blocked
     UInt64  RXOstate;    			// Indicates our receive state.
     UInt64  TXOstate;               // Indicates our transmit state, if we have received any Flow Control.
+    UInt64  RXOverflowPolicy;       // One of kOverflowBlock, kOverflowDropNewest or kOverflowDropOldest
+    UInt64  RXOverRuns;             // Bytes lost to RX queue overruns since the port was acquired
 }PortInfoNotification;
 
 
@@ -51,6 +389,29 @@ typedef struct{
     UInt64  PortState;
 }PortStateNotification;
 
+
+// Only the first n Values are sent, where n is the number of bits set in ChangedFields. They are in
+// field order, so Values[0] belongs to the lowest set bit. Sequence increases by one per message.
+typedef struct{
+    mach_msg_header_t   messageHeader;
+    UInt64  Sequence;
+    UInt64  ChangedFields;          // Bit (1 << kPortField...) set for each field that follows
+    UInt64  Values[kNumberOfPortFields];
+}PortDeltaNotification;
+
+
+typedef struct{
+    mach_msg_header_t   messageHeader;
+    UInt64  Limit;
+    UInt64  Sent;
+}CreditNotification;
+
+
+typedef struct{
+    mach_msg_header_t   messageHeader;
+    UInt64  Ring;                   // kSharedRXRing or kSharedTXRing. Read Head and Tail from the mapping.
+}RingWakeupNotification;
+
 #define DEBUG 1
 
 #ifdef DEBUG
@@ -77,4 +438,6 @@ Debugger("assert(" #ex ") failed");	\
 }						\
 }
 #define	_KERN_ASSERT_H_
-#endif
\ No newline at end of file
+#endif
+
+#endif
@@ -36,6 +36,7 @@
 
 - (void)updatePortState:(UInt32)newState;
 - (void)updatePortInfo:(PortInfoNotification *)info;
+- (void)applyPortDelta:(PortDeltaNotification *)delta;
 - (void)resetPortInfo;
 
 - (IBAction)sendData:(id)sender;
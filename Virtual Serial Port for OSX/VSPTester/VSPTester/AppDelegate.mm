@@ -24,14 +24,21 @@ void MyDriverRequestCallback (CFMachPortRef port, void *msg, CFIndex size, void
         [delegate updatePortState:(UInt32)notify->PortState];
         if(notify->PortState == 0)
             [delegate resetPortInfo];
-    }else{
+    }else if(messageID == kPortInfoID){
         PortInfoNotification *notify = (PortInfoNotification *)msg;
         [delegate updatePortInfo:notify];
+    }else if(messageID == kPortDeltaID){
+        PortDeltaNotification *notify = (PortDeltaNotification *)msg;
+        [delegate applyPortDelta:notify];
     }
 }
 
 
-@implementation AppDelegate
+@implementation AppDelegate{
+    PortInfoNotification    _portInfo;      // Last full info, with any deltas applied
+    UInt64                  _portState;
+    UInt64                  _lastSequence;
+}
 
 
 - (void)applicationDidFinishLaunching:(NSNotification *)aNotification {
@@ -106,6 +113,8 @@ void MyDriverRequestCallback (CFMachPortRef port, void *msg, CFIndex size, void
 
 - (void)updatePortState:(UInt32)newState{
     
+    _portState = newState;
+    
     bitset<32> stateBits (newState);
     string data = stateBits.to_string<char, string::traits_type, string::allocator_type>();
     
@@ -129,8 +138,50 @@ void MyDriverRequestCallback (CFMachPortRef port, void *msg, CFIndex size, void
 }
 
 
+- (void)applyPortDelta:(PortDeltaNotification *)delta{
+    UInt32 next = 0;
+    
+    if(delta->Sequence <= _lastSequence)
+        return;                 // Stale, a later delta has already been applied
+    _lastSequence = delta->Sequence;
+    
+    for(UInt32 field = 0; field < kNumberOfPortFields; field++){
+        if(!(delta->ChangedFields & (1ULL << field)))
+            continue;
+        
+        UInt64 value = delta->Values[next++];
+        switch(field){
+            case kPortFieldState:               _portState = value;                  break;
+            case kPortFieldCharLength:          _portInfo.CharLength = value;        break;
+            case kPortFieldStopBits:            _portInfo.StopBits = value;          break;
+            case kPortFieldTXParity:            _portInfo.TX_Parity = value;         break;
+            case kPortFieldRXParity:            _portInfo.RX_Parity = value;         break;
+            case kPortFieldBaudRate:            _portInfo.BaudRate = value;          break;
+            case kPortFieldMinLatency:          _portInfo.MinLatency = value;        break;
+            case kPortFieldXONchar:             _portInfo.XONchar = value;           break;
+            case kPortFieldXOFFchar:            _portInfo.XOFFchar = value;          break;
+            case kPortFieldFlowControl:         _portInfo.FlowControl = value;       break;
+            case kPortFieldFlowControlState:    _portInfo.FlowControlState = value;  break;
+            case kPortFieldRXOstate:            _portInfo.RXOstate = value;          break;
+            case kPortFieldTXOstate:            _portInfo.TXOstate = value;          break;
+            case kPortFieldRXOverflowPolicy:    _portInfo.RXOverflowPolicy = value;  break;
+            case kPortFieldRXOverRuns:          _portInfo.RXOverRuns = value;        break;
+        }
+    }
+    
+    [self updatePortState:(UInt32)_portState];
+    if(_portState == 0)
+        [self resetPortInfo];
+    else
+        [self updatePortInfo:&_portInfo];
+}
+
+
 - (void)updatePortInfo:(PortInfoNotification *)info{
     
+    if(info != &_portInfo)
+        _portInfo = *info;
+    
     self.charLength = [NSString stringWithFormat:@"%llu",info->CharLength];
     self.stopBits = [NSString stringWithFormat:@"%llu",info->StopBits >> 1];
     self.TXParity = parity[info->TX_Parity];
@@ -164,35 +215,33 @@ void MyDriverRequestCallback (CFMachPortRef port, void *msg, CFIndex size, void
 
 
 - (IBAction)sendData:(id)sender{
-    TRBufferStruct  sendStruct;
-    size_t			structSize = sizeof(TRBufferStruct);
-    uint64_t        numBytesSent;
-    uint32_t        outputCount = 1;
+    uint64_t        output[2];          // bytes accepted, free space left in the RX queue
+    uint32_t        outputCount = 2;
     kern_return_t   result;
     
     NSString *str = [NSString stringWithString:_sendMessage];
     str = [str stringByAppendingString:@"\n"];
     
-    UInt64 len = str.length;
-    if(len > kMessageBufferSize - 1)
-        len = kMessageBufferSize - 1;
-    
-    strncpy((char *)sendStruct.buffer, str.UTF8String, len);
-    sendStruct.numBytes = len;
+    // Send the whole message in one call, kSendBuffer takes up to kMaxSendBufferSize bytes.
+    NSData *data = [str dataUsingEncoding:NSUTF8StringEncoding];
+    size_t len = data.length;
+    if(len > kMaxSendBufferSize)
+        len = kMaxSendBufferSize;
     
-    result = IOConnectCallMethod(_connect, kSendData,
-                                     NULL,              // array of scalar (64-bit) input values.
-                                     0,                 // the number of scalar input values.
-                                     &sendStruct,       // a pointer to the struct input parameter.
-                                     structSize,        // the size of the input structure parameter.
-                                     &numBytesSent,     // array of scalar (64-bit) output values.
+    uint64_t mode = kSendNormal;
+    result = IOConnectCallMethod(_connect, kSendBuffer,
+                                     &mode,             // array of scalar (64-bit) input values.
+                                     1,                 // the number of scalar input values.
+                                     data.bytes,        // a pointer to the struct input parameter.
+                                     len,               // the size of the input structure parameter.
+                                     output,            // array of scalar (64-bit) output values.
                                      &outputCount,      // pointer to the number of scalar output values.
                                      NULL,              // pointer to the struct output parameter.
                                      NULL               // pointer to the size of the output structure parameter.
                                      );
    
     if (result == KERN_SUCCESS)
-        printf("send was successful.\n");
+        printf("send was successful, %llu of %zu bytes accepted, %llu free.\n", output[0], len, output[1]);
     else
         fprintf(stderr, "send returned 0x%08x.\n\n", result);
 }
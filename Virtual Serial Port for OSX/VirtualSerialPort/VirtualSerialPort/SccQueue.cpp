@@ -23,6 +23,61 @@
 #include <IOKit/IOLib.h>
 #include "VirtualSerialPort.h"
 
+/****************************************************************************************************/
+//
+//		Function:	copyToRing
+//
+//		Inputs:		ring - the queue's buffer
+//				size - length of the buffer
+//				offset - where to start copying in ring
+//				from - data to add
+//				count - length of data, no more than size
+//
+//		Outputs:
+//
+//		Desc:		Copy into a ring buffer in at most two runs, wrapping to its start.
+//
+/****************************************************************************************************/
+
+void copyToRing(UInt8 *ring, UInt32 size, UInt32 offset, const UInt8 *from, UInt32 count){
+    UInt32	first = size - offset;
+    
+    if (count <= first){
+        memcpy(ring + offset, from, count);
+        return;
+    }
+    memcpy(ring + offset, from, first);
+    memcpy(ring, from + first, count - first);
+    
+}/* end copyToRing */
+
+/****************************************************************************************************/
+//
+//		Function:	copyFromRing
+//
+//		Inputs:		ring - the queue's buffer
+//				size - length of the buffer
+//				offset - where to start copying in ring
+//				count - length of data, no more than size
+//
+//		Outputs:	to - Where to put the data
+//
+//		Desc:		Copy out of a ring buffer in at most two runs, wrapping to its start.
+//
+/****************************************************************************************************/
+
+void copyFromRing(UInt8 *to, const UInt8 *ring, UInt32 size, UInt32 offset, UInt32 count){
+    UInt32	first = size - offset;
+    
+    if (count <= first){
+        memcpy(to, ring + offset, count);
+        return;
+    }
+    memcpy(to, ring + offset, first);
+    memcpy(to + first, ring, count - first);
+    
+}/* end copyFromRing */
+
 /****************************************************************************************************/
 //
 //		Function:	AddBytetoQueue
@@ -41,20 +96,13 @@
 
 QueueStatus AddBytetoQueue(CirQueue *Queue, char Value){
     // DEBUG_IOLog("AddBytetoQueue - InQueue, inGate\n");
+    UInt8	Byte = (UInt8)Value;
     
-    if ((Queue->NextChar == Queue->LastChar) && Queue->InQueue){
+    if (Queue->add(&Byte, 1) == 0){
         DEBUG_IOLog("AddBytetoQueue - but queue is full!\n");
         return queueFull;
     }
     
-    *Queue->NextChar++ = Value;
-    Queue->InQueue++;
-    
-    // Check to see if we need to wrap the pointer.
-    
-    if (Queue->NextChar >= Queue->End)
-        Queue->NextChar = Queue->Start;
-    
     return queueNoError;
     
 }/* end AddBytetoQueue */
@@ -75,19 +123,11 @@ QueueStatus AddBytetoQueue(CirQueue *Queue, char Value){
 QueueStatus GetBytetoQueue(CirQueue *Queue, UInt8 *Value){
     // DEBUG_IOLog("GetBytetoQueue - InQueue, inGate\n");
     
-    if ((Queue->NextChar == Queue->LastChar) && !Queue->InQueue){
+    if (Queue->remove(Value, 1) == 0){
          // DEBUG_IOLog("GetBytetoQueue - but queue is empty!\n");
         return queueEmpty;
     }
     
-    *Value = *Queue->LastChar++;
-    Queue->InQueue--;
-    
-    // Check to see if we need to wrap the pointer.
-    
-    if (Queue->LastChar >= Queue->End)
-        Queue->LastChar =  Queue->Start;
-    
     return queueNoError;
     
 }/* end GetBytetoQueue */
@@ -110,12 +150,11 @@ QueueStatus GetBytetoQueue(CirQueue *Queue, UInt8 *Value){
 QueueStatus InitQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 Size){
     // DEBUG_IOLog("InitQueue\n");
     
-    Queue->Start	= Buffer;
-    Queue->End		= (UInt8*)((size_t)Buffer + Size);
-    Queue->Size		= Size;
-    Queue->NextChar	= Buffer;
-    Queue->LastChar	= Buffer;
-    Queue->InQueue	= 0;
+    // Masking the free running indices needs a power of two, so use as much of any other size as that
+    // allows. resizeQueue rounds up before it allocates, and never gets here with one.
+    while (Size & (Size - 1))
+        Size &= Size - 1;
+    Queue->init(Buffer, Size);
   
     return queueNoError;
     
@@ -136,11 +175,7 @@ QueueStatus InitQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 Size){
 QueueStatus CloseQueue(CirQueue *Queue){
     // DEBUG_IOLog("CloseQueue\n");
     
-    Queue->Start	= 0;
-    Queue->End		= 0;
-    Queue->NextChar	= 0;
-    Queue->LastChar	= 0;
-    Queue->Size		= 0;
+    Queue->init(NULL, 0);
     
     return queueNoError;
     
@@ -161,9 +196,7 @@ QueueStatus CloseQueue(CirQueue *Queue){
 void ResetQueue(CirQueue *Queue){
     // DEBUG_IOLog("ResetQueue - InQueue, inGate\n");
     
-    Queue->NextChar	= Queue->Start;
-    Queue->LastChar	= Queue->Start;
-    Queue->InQueue	= 0;
+    Queue->reset();
     
 }/* end InitQueue */
 
@@ -177,23 +210,43 @@ void ResetQueue(CirQueue *Queue){
 //
 //		Outputs:	BytesWritten - Number of bytes actually put in the queue.
 //
-//		Desc:		Add an entire buffer to the queue.
+//		Desc:		Add as much of a buffer to the queue as will fit.
 //
 /****************************************************************************************************/
 
 UInt32 AddtoQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 Size){
     // DEBUG_IOLog("AddtoQueue - InQueue, inGate\n");
 
-    UInt32	BytesWritten = 0;
+    return Queue->add(Buffer, Size);
     
-    while (FreeSpaceinQueue(Queue) && (Size > BytesWritten)){
-        AddBytetoQueue(Queue, *Buffer++);
-        BytesWritten++;
-    }
+}/* end AddtoQueue */
+
+/****************************************************************************************************/
+//
+//		Function:	AddtoQueueOverwrite
+//
+//		Inputs:		Queue - the queue to be added to
+//				Buffer - data to add
+//				Size - length of data
+//
+//		Outputs:	BytesDropped - Number of bytes discarded to make room.
+//
+//		Desc:		Add an entire buffer to the queue, discarding the oldest queued
+//				bytes when there is not enough free space. If the buffer is larger
+//				than the queue only its newest bytes are kept.
+//
+/****************************************************************************************************/
 
-    return BytesWritten;
+UInt32 AddtoQueueOverwrite(CirQueue *Queue, UInt8 *Buffer, UInt32 Size){
+    // DEBUG_IOLog("AddtoQueueOverwrite - InQueue, inGate\n");
     
-}/* end AddtoQueue */
+    UInt32	BytesDropped = 0;
+    
+    Queue->addAs<kQueueOverwriteOld>(Buffer, Size, &BytesDropped);
+    
+    return BytesDropped;
+    
+}/* end AddtoQueueOverwrite */
 
 /****************************************************************************************************/
 //
@@ -212,17 +265,29 @@ UInt32 AddtoQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 Size){
 UInt32 RemovefromQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 MaxSize){
     // DEBUG_IOLog("RemovefromQueue - InQueue, inGate\n");
 
-    UInt32	BytesReceived = 0;
-    UInt8	Value;
+    return Queue->remove(Buffer, MaxSize);
     
-    while((MaxSize > BytesReceived) && (GetBytetoQueue(Queue, &Value) == queueNoError)){
-        *Buffer++ = Value;
-        BytesReceived++;
-    }
+}/* end RemovefromQueue */
+
+/****************************************************************************************************/
+//
+//		Function:	DiscardfromQueue
+//
+//		Inputs:		Queue - the queue to be removed from
+//				Size - number of bytes to discard
+//
+//		Outputs:	BytesDiscarded - Number of bytes actually discarded
+//
+//		Desc:		Drop the oldest bytes in the queue without reading them.
+//
+/****************************************************************************************************/
+
+UInt32 DiscardfromQueue(CirQueue *Queue, UInt32 Size){
+    // DEBUG_IOLog("DiscardfromQueue - InQueue, inGate\n");
     
-    return BytesReceived;
+    return Queue->discard(Size);
     
-}/* end RemovefromQueue */
+}/* end DiscardfromQueue */
 
 /****************************************************************************************************/
 //
@@ -239,7 +304,7 @@ UInt32 RemovefromQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 MaxSize){
 UInt32 FreeSpaceinQueue(CirQueue *Queue){
     // DEBUG_IOLog("FreeSpaceinQueue - InQueue, inGate\n");
     
-    return Queue->Size - Queue->InQueue;
+    return Queue->space();
     
 }/* end FreeSpaceinQueue */
 
@@ -258,7 +323,7 @@ UInt32 FreeSpaceinQueue(CirQueue *Queue){
 UInt32 UsedSpaceinQueue(CirQueue *Queue){
     // DEBUG_IOLog("UsedSpaceinQueue - InQueue, inGate\n");
     
-    return Queue->InQueue;
+    return Queue->used();
     
 }/* end UsedSpaceinQueue */
 
@@ -277,7 +342,7 @@ UInt32 UsedSpaceinQueue(CirQueue *Queue){
 UInt32 GetQueueSize(CirQueue *Queue){
     // DEBUG_IOLog("GetQueueSize - InQueue, inGate\n");
     
-    return Queue->Size;
+    return Queue->size();
     
 }/* end GetQueueSize */
 
@@ -296,13 +361,10 @@ UInt32 GetQueueSize(CirQueue *Queue){
 QueueStatus GetQueueStatus(CirQueue *Queue){
     // DEBUG_IOLog("GetQueueStatus - InQueue, inGate\n");
     
-    if ((Queue->NextChar == Queue->LastChar) && Queue->InQueue){
+    if (Queue->used() == 0)
+        return queueEmpty;
+    if (Queue->space() == 0)
         return queueFull;
-    } else {
-        if ((Queue->NextChar == Queue->LastChar) && !Queue->InQueue){
-            return queueEmpty;
-        }
-    }
     
     return queueNoError ;
     
@@ -325,18 +387,10 @@ QueueStatus GetQueueStatus(CirQueue *Queue){
 UInt8* BeginDirectReadFromQueue(CirQueue *Queue, UInt32 *size, bool *queueWrapped){
     // DEBUG_IOLog("BeginDirectReadFromQueue - InQueue, inGate\n");
 
-    UInt8	*queuePtr = NULL;
-    
-    *queueWrapped = false;
+    UInt8	*queuePtr = Queue->peek(size);
     
-    if (Queue->InQueue){
-        *size = min(*size, Queue->InQueue);
-        if ((Queue->LastChar + *size) >= Queue->End){
-            *size = Queue->End - Queue->LastChar;
-            *queueWrapped = true;
-        }
-        queuePtr = Queue->LastChar;
-    }
+    // Reads stop at the end of the buffer, and the next one starts back at its beginning.
+    *queueWrapped = queuePtr && (queuePtr + *size == Queue->buffer() + Queue->size());
     
     return queuePtr;
     
@@ -358,12 +412,208 @@ UInt8* BeginDirectReadFromQueue(CirQueue *Queue, UInt32 *size, bool *queueWrappe
 void EndDirectReadFromQueue(CirQueue *Queue, UInt32 size){    
     // DEBUG_IOLog("EndDirectReadFromQueue - InQueue, inGate\n");
     
-    Queue->LastChar += size;
-    Queue->InQueue -= size;
+    Queue->discard(size);
+        
+}/* end EndDirectReadFromQueue */
+
+/****************************************************************************************************/
+//
+//		Queue buffer pool
+//
+//		Ports take their queue buffers when the tty side acquires them and give them back on
+//		release, so an idle port holds none. Freed buffers wait here, one list per power of two
+//		size class, for the next port to open. Sizes above the largest class, and buffers beyond
+//		kPoolDepth in a class, go straight back to IOFree.
+//
+//		The pool has no object to keep its lock in, so it is a VSPSharedLock, allocated the first
+//		time a queue buffer is asked for. IOMalloc and IOFree are always called with it released.
+//
+/****************************************************************************************************/
+
+#define kPoolMinShift	10			// 1 KB, smaller queues round up to it
+#define kPoolMaxShift	16			// 64 KB
+#define kPoolClasses	(kPoolMaxShift - kPoolMinShift + 1)
+#define kPoolDepth		8			// Buffers kept per class
+
+typedef struct PoolClass{
+    UInt8	*Free;					// Cached buffers, each holding the next one's address
+    UInt32	Count;
+}PoolClass;
+
+static PoolClass		sPoolClasses[kPoolClasses];
+static QueuePoolStats	sPoolStats;
+static IOLock			*sPoolLock = NULL;
+
+
+// False only if the lock could never be allocated, and then no buffer has been handed out either.
+static bool LockPool(void){
+    IOLock	*Lock = VSPSharedLock(&sPoolLock);
+    
+    if (Lock == NULL)
+        return false;
+    IOLockLock(Lock);
+    return true;
+}
+
+
+static void UnlockPool(void){
     
-    // Check to see if we need to wrap the pointer.
+    IOLockUnlock(sPoolLock);
+}
+
+
+// The class for Size, or kPoolClasses if it is too big to pool. *ClassSize is what to allocate.
+static UInt32 PoolClassFor(UInt32 Size, UInt32 *ClassSize){
+    UInt32	Class = 0;
     
-    if (Queue->LastChar >= Queue->End)
-        Queue->LastChar = Queue->Start;
-        
-}/* end EndDirectReadFromQueue */
\ No newline at end of file
+    if (Size > (1U << kPoolMaxShift)){
+        *ClassSize = Size;
+        return kPoolClasses;
+    }
+    while ((1U << (kPoolMinShift + Class)) < Size)
+        Class++;
+    *ClassSize = 1U << (kPoolMinShift + Class);
+    return Class;
+}
+
+/****************************************************************************************************/
+//
+//		Function:	AllocQueueBuffer
+//
+//		Inputs:		Size - length of the queue
+//
+//		Outputs:	Buffer - at least Size bytes, or NULL
+//
+//		Desc:		Take a buffer for a queue from the pool, or from IOMalloc when the pool has
+//				none of that size class. Give it back with FreeQueueBuffer and the same Size.
+//
+/****************************************************************************************************/
+
+UInt8* AllocQueueBuffer(UInt32 Size){
+    UInt32	ClassSize;
+    UInt32	Class = PoolClassFor(Size, &ClassSize);
+    UInt8	*Buffer = NULL;
+    
+    if (!LockPool())
+        return NULL;
+    if ((Class < kPoolClasses) && sPoolClasses[Class].Free){
+        Buffer = sPoolClasses[Class].Free;
+        sPoolClasses[Class].Free = *(UInt8**)Buffer;
+        sPoolClasses[Class].Count--;
+        sPoolStats.Cached -= ClassSize;
+        sPoolStats.Hits++;
+    } else {
+        sPoolStats.Misses++;
+    }
+    UnlockPool();
+    
+    if (Buffer)
+        return Buffer;
+    
+    Buffer = (UInt8*)IOMalloc(ClassSize);
+    if (Buffer){
+        LockPool();
+        sPoolStats.Allocated += ClassSize;
+        UnlockPool();
+    }
+    
+    return Buffer;
+    
+}/* end AllocQueueBuffer */
+
+/****************************************************************************************************/
+//
+//		Function:	FreeQueueBuffer
+//
+//		Inputs:		Buffer - from AllocQueueBuffer, or NULL
+//				Size - the Size it was allocated with
+//
+//		Outputs:
+//
+//		Desc:		Return a queue buffer to the pool, or to IOFree when its class is full.
+//
+/****************************************************************************************************/
+
+void FreeQueueBuffer(UInt8 *Buffer, UInt32 Size){
+    UInt32	ClassSize;
+    UInt32	Class = PoolClassFor(Size, &ClassSize);
+    
+    // A buffer means AllocQueueBuffer had the lock, so LockPool only fails with nothing to free.
+    if ((Buffer == NULL) || !LockPool())
+        return;
+    
+    if ((Class < kPoolClasses) && (sPoolClasses[Class].Count < kPoolDepth)){
+        *(UInt8**)Buffer = sPoolClasses[Class].Free;
+        sPoolClasses[Class].Free = Buffer;
+        sPoolClasses[Class].Count++;
+        sPoolStats.Cached += ClassSize;
+        Buffer = NULL;
+    } else {
+        sPoolStats.Allocated -= ClassSize;
+    }
+    UnlockPool();
+    
+    if (Buffer)
+        IOFree(Buffer, ClassSize);
+    
+}/* end FreeQueueBuffer */
+
+/****************************************************************************************************/
+//
+//		Function:	DrainQueueBuffers
+//
+//		Inputs:
+//
+//		Outputs:
+//
+//		Desc:		Give every cached buffer back to IOFree. Called as each port stops, so
+//				nothing is left behind when the driver unloads.
+//
+/****************************************************************************************************/
+
+void DrainQueueBuffers(void){
+    UInt8	*Lists[kPoolClasses];
+    UInt8	*Buffer;
+    
+    if (!LockPool())
+        return;
+    for (UInt32 Class = 0; Class < kPoolClasses; Class++){
+        Lists[Class] = sPoolClasses[Class].Free;
+        sPoolClasses[Class].Free = NULL;
+        sPoolClasses[Class].Count = 0;
+    }
+    sPoolStats.Allocated -= sPoolStats.Cached;
+    sPoolStats.Cached = 0;
+    UnlockPool();
+    
+    for (UInt32 Class = 0; Class < kPoolClasses; Class++){
+        while ((Buffer = Lists[Class])){
+            Lists[Class] = *(UInt8**)Buffer;
+            IOFree(Buffer, 1U << (kPoolMinShift + Class));
+        }
+    }
+    
+}/* end DrainQueueBuffers */
+
+/****************************************************************************************************/
+//
+//		Function:	GetQueuePoolStats
+//
+//		Inputs:
+//
+//		Outputs:	Stats - the pool's counters as they stand
+//
+//		Desc:		Report how much memory the queues hold and how often the pool was used.
+//
+/****************************************************************************************************/
+
+void GetQueuePoolStats(QueuePoolStats *Stats){
+    
+    if (!LockPool()){
+        bzero(Stats, sizeof(QueuePoolStats));
+        return;
+    }
+    *Stats = sPoolStats;
+    UnlockPool();
+    
+}/* end GetQueuePoolStats */
@@ -25,15 +25,18 @@
 #define __SCCQUEUE__
 
 #include "sys/types.h"
+#include "VSPQueue.h"
 
-typedef struct CirQueue{
-    UInt8	*Start;
-    UInt8	*End;
-    UInt8	*NextChar;
-    UInt8	*LastChar;
-    UInt32	Size;
-    UInt32	InQueue;
-}CirQueue;
+// Sized by InitQueue to a power of two, the caller serializing every call. AddtoQueueOverwrite
+// overwrites, everything else rejects what doesn't fit.
+typedef VSPQueue<kQueueRunTimeSize, kQueueUnlocked, kQueueRejectNew> CirQueue;
+
+typedef struct QueuePoolStats{
+    UInt64	Allocated;		// Bytes taken from IOMalloc, in queues or cached
+    UInt64	Cached;			// Bytes waiting in the pool for the next queue
+    UInt64	Hits;			// Buffers handed out from the pool
+    UInt64	Misses;			// Buffers that had to come from IOMalloc
+}QueuePoolStats;
 
 typedef enum QueueStatus{
     queueNoError = 0,
@@ -46,7 +49,9 @@ QueueStatus	InitQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 Size);
 QueueStatus	CloseQueue(CirQueue *Queue);
 void		ResetQueue(CirQueue *Queue);
 UInt32		AddtoQueue(CirQueue *Queue, UInt8 *Buffer, UInt32 Size);
+UInt32		AddtoQueueOverwrite(CirQueue *Queue, UInt8 *Buffer, UInt32 Size);
 UInt32		RemovefromQueue(CirQueue *Queue, UInt8	*Buffer, UInt32 MaxSize);
+UInt32		DiscardfromQueue(CirQueue *Queue, UInt32 Size);
 UInt32		FreeSpaceinQueue(CirQueue *Queue);
 UInt32		UsedSpaceinQueue(CirQueue *Queue);
 UInt32		GetQueueSize( CirQueue *Queue);
@@ -55,5 +60,9 @@ QueueStatus	GetBytetoQueue(CirQueue *Queue, UInt8 *Value);
 QueueStatus GetQueueStatus(CirQueue *Queue);
 UInt8*		BeginDirectReadFromQueue(CirQueue *Queue, UInt32 *size, bool *queueWrapped);
 void		EndDirectReadFromQueue(CirQueue *Queue, UInt32 size);
+UInt8*		AllocQueueBuffer(UInt32 Size);
+void		FreeQueueBuffer(UInt8 *Buffer, UInt32 Size);
+void		DrainQueueBuffers(void);
+void		GetQueuePoolStats(QueuePoolStats *Stats);
 
 #endif
\ No newline at end of file
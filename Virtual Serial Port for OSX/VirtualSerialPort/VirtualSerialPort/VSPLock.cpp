@@ -0,0 +1,125 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>
+#include "VSPLock.h"
+
+
+IOLock *VSPSharedLock(IOLock **Lock){
+    IOLock  *lock = __atomic_load_n(Lock, __ATOMIC_ACQUIRE);
+
+    if (lock) return lock;
+
+    lock = IOLockAlloc();
+    if (lock == NULL) return NULL;
+    if (!OSCompareAndSwapPtr(NULL, lock, (void* volatile*)Lock)){
+        IOLockFree(lock);
+        lock = __atomic_load_n(Lock, __ATOMIC_ACQUIRE);
+    }
+
+    return lock;
+}
+
+#ifdef VSP_LOCK_STATS
+
+// Sites are numbered from 1 and never forgotten, the driver's code doesn't change while it is loaded.
+static UInt32           sNumLockSites = 0;
+static LockSite         *sLockSites[kMaxLockSites];
+
+
+VSPLock *VSPLockAlloc(void){
+    VSPLock *lock = (VSPLock*)IOMalloc(sizeof(VSPLock));
+
+    if (lock == NULL) return NULL;
+    bzero(lock, sizeof(VSPLock));
+    lock->Lock = IOLockAlloc();
+    if (lock->Lock == NULL){
+        IOFree(lock, sizeof(VSPLock));
+        return NULL;
+    }
+
+    return lock;
+}
+
+
+void VSPLockFree(VSPLock *Lock){
+
+    IOLockFree(Lock->Lock);
+    IOFree(Lock, sizeof(VSPLock));
+}
+
+
+// Two threads can reach a site for the first time together; the one that loses keeps the winner's number
+// and the number it took is left unused. The site's entry is published with its number, a release.
+UInt32 RegisterLockSite(LockSite *Site){
+    UInt32  index = __atomic_load_n(&sNumLockSites, __ATOMIC_RELAXED);
+    UInt32  unset = 0;
+
+    do {
+        if (index + 1 >= kMaxLockSites)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&sNumLockSites, &index, index + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    index++;
+
+    __atomic_store_n(&sLockSites[index], Site, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&Site->Index, &unset, index, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        return index;
+
+    __atomic_store_n(&sLockSites[index], (LockSite*)NULL, __ATOMIC_RELAXED);
+    return unset;                   // The winner's number
+}
+
+
+static void addCounters(LockStats *Stats, const LockCounters *Counters){
+    uint64_t    held, maxHeld, wait;
+
+    absolutetime_to_nanoseconds(Counters->HoldTime, &held);
+    absolutetime_to_nanoseconds(Counters->MaxHoldTime, &maxHeld);
+    absolutetime_to_nanoseconds(Counters->WaitTime, &wait);
+
+    Stats->Acquisitions += Counters->Acquisitions;
+    Stats->Contended += Counters->Contended;
+    Stats->WaitTime += wait;
+    Stats->HoldTime += held;
+    if (maxHeld > Stats->MaxHoldTime)
+        Stats->MaxHoldTime = maxHeld;
+}
+
+
+// Copied under the raw lock, so reading the counters doesn't show up in them.
+UInt32 ReadLockStats(VSPLock *Lock, LockStats *Stats, UInt32 Count, bool Clear){
+    UInt32  numSites = 1;
+
+    if (Count == 0) return 0;
+    bzero(Stats, sizeof(LockStats));
+
+    IOLockLock(Lock->Lock);
+    for (UInt32 index = 0; index < kMaxLockSites; index++){
+        const LockCounters  *counters = &Lock->Sites[index];
+        LockSite            *site = __atomic_load_n(&sLockSites[index], __ATOMIC_RELAXED);
+
+        if (counters->Acquisitions == 0) continue;
+        addCounters(&Stats[0], counters);
+
+        if (numSites < Count){
+            bzero(&Stats[numSites], sizeof(LockStats));
+            if (site){
+                strlcpy(Stats[numSites].Function, site->Function, kLockFunctionSize);
+                Stats[numSites].Line = site->Line;
+            } else {
+                strlcpy(Stats[numSites].Function, "(other)", kLockFunctionSize);
+            }
+            addCounters(&Stats[numSites], counters);
+            numSites++;
+        }
+    }
+    if (Clear)
+        bzero(Lock->Sites, sizeof(Lock->Sites));
+    IOLockUnlock(Lock->Lock);
+
+    return numSites;
+}
+
+#endif
@@ -0,0 +1,135 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  The port's locks. Built with VSP_LOCK_STATS, a VSPLock counts how often it is taken, how often it was
+//  already held, how long takers waited and how long they held it, per lock and per place in the driver
+//  that takes it, for kGetLockStats. Taking a free lock then costs a timestamp and releasing it another.
+//  Without VSP_LOCK_STATS a VSPLock is an IOLock and every call below is the IOLock call itself.
+//
+
+#ifndef VSP_LOCK_H
+#define VSP_LOCK_H
+
+#include <IOKit/IOLib.h>
+#include "Shared.h"
+
+
+// The lock for state that has no object to keep it in. The first caller allocates it, OSCompareAndSwapPtr
+// keeps one allocation if several race, and it is never freed, so callers need no guard of their own.
+// NULL only if IOLockAlloc failed.
+IOLock  *VSPSharedLock(IOLock **Lock);
+
+
+#ifdef VSP_LOCK_STATS
+
+// One per VSPLockLock in the source, numbered the first time it runs. 0 counts places past kMaxLockSites.
+typedef struct{
+    const char      *Function;
+    UInt32          Line;
+    UInt32          Index;              // Set once, with __atomic builtins
+} LockSite;
+
+// Only changed by the holder of the lock, times in absolute time units.
+typedef struct{
+    UInt64  Acquisitions;
+    UInt64  Contended;
+    UInt64  WaitTime;
+    UInt64  HoldTime;
+    UInt64  MaxHoldTime;
+} LockCounters;
+
+typedef struct{
+    IOLock          *Lock;
+    UInt64          HeldSince;
+    UInt32          HeldAt;             // Site of the current holder
+    LockCounters    Sites[kMaxLockSites];
+} VSPLock;
+
+VSPLock *VSPLockAlloc(void);
+void    VSPLockFree(VSPLock *Lock);
+UInt32  RegisterLockSite(LockSite *Site);
+
+// Fills in up to Count LockStats as kGetLockStats describes and returns how many, clearing the counters if
+// Clear is set. Takes the lock.
+UInt32  ReadLockStats(VSPLock *Lock, LockStats *Stats, UInt32 Count, bool Clear);
+
+
+static inline void VSPLockTake(VSPLock *Lock, LockSite *Site){
+    UInt32          index = __atomic_load_n(&Site->Index, __ATOMIC_ACQUIRE);
+    LockCounters    *counters;
+    UInt64          start, now;
+
+    if (index == 0)
+        index = RegisterLockSite(Site);
+
+    if (IOLockTryLock(Lock->Lock)){
+        clock_get_uptime(&now);
+        counters = &Lock->Sites[index];
+    } else {
+        clock_get_uptime(&start);
+        IOLockLock(Lock->Lock);
+        clock_get_uptime(&now);
+        counters = &Lock->Sites[index];
+        counters->Contended++;
+        counters->WaitTime += now - start;
+    }
+    counters->Acquisitions++;
+    Lock->HeldSince = now;
+    Lock->HeldAt = index;
+}
+
+
+static inline void VSPLockHeld(VSPLock *Lock){
+    LockCounters    *counters = &Lock->Sites[Lock->HeldAt];
+    UInt64          now, held;
+
+    clock_get_uptime(&now);
+    held = now - Lock->HeldSince;
+    counters->HoldTime += held;
+    if (held > counters->MaxHoldTime)
+        counters->MaxHoldTime = held;
+}
+
+
+static inline void VSPLockUnlock(VSPLock *Lock){
+
+    VSPLockHeld(Lock);
+    IOLockUnlock(Lock->Lock);
+}
+
+
+// The time asleep isn't held, and the hold that follows is charged to the same place.
+static inline int VSPLockSleep(VSPLock *Lock, void *Event, UInt32 Interruptible){
+    UInt32  at = Lock->HeldAt;
+    int     result;
+
+    VSPLockHeld(Lock);
+    result = IOLockSleep(Lock->Lock, Event, Interruptible);
+    clock_get_uptime(&Lock->HeldSince);
+    Lock->HeldAt = at;
+
+    return result;
+}
+
+
+#define VSPLockLock(lock)   do{                                             \
+        static LockSite vspLockSite = { __FUNCTION__, __LINE__, 0 };        \
+        VSPLockTake(lock, &vspLockSite);                                    \
+    }while (0)
+
+#define VSPLockWakeup(lock, event, oneThread)   IOLockWakeup((lock)->Lock, event, oneThread)
+
+#else
+
+typedef IOLock  VSPLock;
+
+#define VSPLockAlloc()                              IOLockAlloc()
+#define VSPLockFree(lock)                           IOLockFree(lock)
+#define VSPLockLock(lock)                           IOLockLock(lock)
+#define VSPLockUnlock(lock)                         IOLockUnlock(lock)
+#define VSPLockSleep(lock, event, interruptible)    IOLockSleep(lock, event, interruptible)
+#define VSPLockWakeup(lock, event, oneThread)       IOLockWakeup(lock, event, oneThread)
+
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  Byte queues specialised at compile time. VSPQueue<Capacity, Concurrency, Overflow> keeps its bytes
+//  inline, Capacity is a power of two so free running Head and Tail wrap with a mask, and the policies
+//  are template arguments, so each instantiation compiles to its own code with no tests for the cases it
+//  can't meet. A Capacity of kQueueRunTimeSize takes its size and buffer at init instead, still a power of
+//  two; that is the driver's CirQueue (SccQueue.h), which keeps the old C API on top of it.
+//
+
+#ifndef VSP_QUEUE_H
+#define VSP_QUEUE_H
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>
+
+
+enum{
+    kQueueRunTimeSize = 0   // Capacity given to init, with the bytes in the caller's buffer
+};
+
+enum{
+    kQueueUnlocked,         // The caller serializes every call, as the driver does for CirQueue
+    kQueueLocked,           // Every call takes the queue's own lock
+    kQueueSPSC              // One thread adds and one removes, without a lock
+};
+
+enum{
+    kQueueRejectNew,        // add takes what fits, like AddtoQueue
+    kQueueOverwriteOld      // add drops the oldest bytes to make room, like AddtoQueueOverwrite
+};
+
+
+#pragma mark Ring Copies
+
+// Copy count bytes into or out of a ring of size bytes starting at offset, wrapping at most once. count
+// must not be more than size. They are defined in SccQueue.cpp and kept out of line: inlined into a queue
+// whose size is a constant, GCC turns the bounded memcpys into slow inline copies.
+void    copyToRing(UInt8 *ring, UInt32 size, UInt32 offset, const UInt8 *from, UInt32 count);
+void    copyFromRing(UInt8 *to, const UInt8 *ring, UInt32 size, UInt32 offset, UInt32 count);
+
+
+#pragma mark Storage
+
+// Where a queue's bytes live and how big it is, inline for a fixed Capacity.
+template <UInt32 Capacity>
+struct VSPQueueStorage{
+    UInt8           Data[Capacity];
+
+    static constexpr UInt32 size(void){ return Capacity; }
+    bool set(UInt8 *buffer, UInt32 size){ return false; }
+};
+
+// Or in a buffer handed to init. size is 0 with no buffer, and everything on the queue then does nothing.
+template <>
+struct VSPQueueStorage<kQueueRunTimeSize>{
+    UInt8           *Data;
+    UInt32          Size;
+
+    UInt32 size(void) const { return __atomic_load_n(&Size, __ATOMIC_RELAXED); }
+    bool set(UInt8 *buffer, UInt32 size){
+        if (size & (size - 1)) return false;
+        Data = size ? buffer : NULL;
+        __atomic_store_n(&Size, Data ? size : 0, __ATOMIC_RELAXED);
+        return true;
+    }
+};
+
+
+#pragma mark VSPQueue
+
+// Call init before use and free after, as allocateRingBuffer and freeRingBuffer do for CirQueue; only a
+// locked queue allocates anything. An SPSC queue's add and remove may run at the same time on two threads,
+// everything else on it belongs to one side or needs both stopped.
+template <UInt32 Capacity, UInt32 Concurrency, UInt32 Overflow>
+class VSPQueue{
+
+    static_assert(!(Capacity & (Capacity - 1)), "VSPQueue capacity must be a power of two");
+    static_assert(Capacity <= 0x80000000, "VSPQueue capacity must fit free running UInt32 indices");
+    static_assert(!((Concurrency == kQueueSPSC) && (Overflow == kQueueOverwriteOld)),
+                  "overwriting moves Tail, which only the consumer may do in an SPSC queue");
+
+    static constexpr bool   kLocked = (Concurrency == kQueueLocked);
+    static constexpr bool   kSPSC = (Concurrency == kQueueSPSC);
+
+    UInt32          Head;               // Free running, written by add
+    UInt32          Tail;               // Free running, written by remove
+    IOLock          *Lock;
+    VSPQueueStorage<Capacity> Ring;     // A member rather than a base, so the queue stays standard layout
+
+    void lock(void){ if (kLocked) IOLockLock(Lock); }
+    void unlock(void){ if (kLocked) IOLockUnlock(Lock); }
+    UInt32 mask(void) const { return Ring.size() - 1; }
+
+    // Head and Tail are single words that used and space may read from any thread, an SPSC queue's
+    // other side or the driver's status page, so every access is a relaxed atomic; the barriers in
+    // add and remove still order them against the bytes.
+    UInt32 head(void) const { return __atomic_load_n(&Head, __ATOMIC_RELAXED); }
+    UInt32 tail(void) const { return __atomic_load_n(&Tail, __ATOMIC_RELAXED); }
+    void setHead(UInt32 head){ __atomic_store_n(&Head, head, __ATOMIC_RELAXED); }
+    void setTail(UInt32 tail){ __atomic_store_n(&Tail, tail, __ATOMIC_RELAXED); }
+
+public:
+
+    UInt32 size(void) const { return Ring.size(); }
+    UInt8 *buffer(void){ return Ring.Data; }
+
+    bool init(void){
+        setHead(0);
+        setTail(0);
+        Lock = kLocked ? IOLockAlloc() : NULL;
+        return !kLocked || Lock;
+    }
+
+    // kQueueRunTimeSize only. size must be a power of two, or 0 to leave the queue without a buffer.
+    bool init(UInt8 *buffer, UInt32 size){
+        return Ring.set(buffer, size) && init();
+    }
+
+    void free(void){
+        if (Lock){
+            IOLockFree(Lock);
+            Lock = NULL;
+        }
+    }
+
+    UInt32 used(void) const { return head() - tail(); }
+    UInt32 space(void) const { return Ring.size() - used(); }
+
+    void reset(void){
+        lock();
+        setTail(head());
+        unlock();
+    }
+
+    // Returns the bytes queued, all of them when overwriting, and the oldest bytes dropped for them in *dropped.
+    UInt32 add(const UInt8 *buffer, UInt32 size, UInt32 *dropped = NULL){
+        return addAs<Overflow>(buffer, size, dropped);
+    }
+
+    // add with the other overflow policy, for a queue that needs both.
+    template <UInt32 Mode>
+    UInt32 addAs(const UInt8 *buffer, UInt32 size, UInt32 *dropped = NULL){
+        static_assert(!(kSPSC && (Mode == kQueueOverwriteOld)), "an SPSC queue can't overwrite");
+
+        const UInt32    capacity = Ring.size();
+        UInt32          head, tail, lost = 0;
+
+        lock();
+        head = this->head();
+        tail = this->tail();
+        if (kSPSC) OSMemoryBarrier();           // Read Tail before reusing the space it frees
+
+        if (Mode == kQueueOverwriteOld){
+            // Only the newest capacity bytes can survive, then make room for them.
+            if (size > capacity){
+                lost = size - capacity;
+                buffer += lost;
+                size = capacity;
+            }
+            if (size > capacity - (head - tail)){
+                lost += size - (capacity - (head - tail));
+                setTail(head + size - capacity);
+            }
+        } else if (size > capacity - (head - tail)){
+            size = capacity - (head - tail);
+        }
+
+        if (size)
+            copyToRing(Ring.Data, capacity, head & mask(), buffer, size);
+        if (kSPSC) OSMemoryBarrier();           // Finish copying before publishing Head
+        setHead(head + size);
+        unlock();
+
+        if (dropped) *dropped = lost;
+        return (Mode == kQueueOverwriteOld) ? size + lost : size;
+    }
+
+    UInt32 remove(UInt8 *buffer, UInt32 size){
+        UInt32  head, tail;
+
+        lock();
+        head = this->head();
+        tail = this->tail();
+        if (kSPSC) OSMemoryBarrier();           // Read Head before the data it covers
+
+        if (size > head - tail)
+            size = head - tail;
+        if (size)
+            copyFromRing(buffer, Ring.Data, Ring.size(), tail & mask(), size);
+        if (kSPSC) OSMemoryBarrier();           // Finish copying before handing the space back
+        setTail(tail + size);
+        unlock();
+
+        return size;
+    }
+
+    UInt32 discard(UInt32 size){
+
+        lock();
+        if (size > used())
+            size = used();
+        setTail(tail() + size);
+        unlock();
+
+        return size;
+    }
+
+    // The oldest bytes that sit in one run, up to *size of them, to be read in place and then discarded.
+    // Not for a locked queue, whose lock is released before the caller gets to them.
+    UInt8* peek(UInt32 *size){
+        UInt32  tail = this->tail();
+        UInt32  run = Ring.size() - (tail & mask());
+
+        if (*size > head() - tail)
+            *size = head() - tail;
+        if (*size > run)
+            *size = run;
+        return *size ? Ring.Data + (tail & mask()) : NULL;
+    }
+};
+
+#endif
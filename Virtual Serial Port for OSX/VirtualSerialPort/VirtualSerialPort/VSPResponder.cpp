@@ -0,0 +1,507 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+
+#include <IOKit/IOLib.h>
+#include "VSPResponder.h"
+
+
+// Pattern bytes with a meaning of their own, see kSetResponder.
+#define kAnyByte    '?'
+#define kAnyRun     '*'
+#define kDigits     '#'
+#define kEscape     '\\'
+
+// CRC-16/Modbus (reflected 0x8005) a nibble at a time.
+static const UInt16 sCRCNibbles[16] = {
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
+static const char sHexDigits[] = "0123456789ABCDEF";
+
+
+static inline bool isDigit(UInt8 byte){
+
+    return (byte >= '0') && (byte <= '9');
+}
+
+
+static UInt16 crc16(const UInt8 *Data, UInt32 Length){
+    UInt16  crc = 0xFFFF;
+
+    for (UInt32 i = 0; i < Length; i++){
+        crc = (crc >> 4) ^ sCRCNibbles[(crc ^ Data[i]) & 0xF];
+        crc = (crc >> 4) ^ sCRCNibbles[(crc ^ (Data[i] >> 4)) & 0xF];
+    }
+
+    return crc;
+}
+
+
+#pragma mark Compiling
+
+// Counts the wildcards, and the bytes a message needs at least, and notes a literal first byte.
+static bool compilePattern(CompiledRule *Compiled){
+    const UInt8 *pattern = Compiled->Pattern;
+    UInt32      size = Compiled->Rule->PatternSize;
+
+    for (UInt32 i = 0; i < size; i++){
+        switch (pattern[i]){
+            case kAnyRun:
+                Compiled->Captures++;
+                break;
+            case kAnyByte:
+            case kDigits:
+                Compiled->Captures++;
+                Compiled->MinSize++;
+                break;
+            case kEscape:
+                if (++i == size) return false;
+                // fall through
+            default:
+                if ((Compiled->MinSize == 0) && (Compiled->Captures == 0))
+                    Compiled->First = pattern[i];
+                Compiled->MinSize++;
+                break;
+        }
+    }
+
+    return Compiled->Captures <= kMaxCaptures;
+}
+
+
+// Every $ has to start a known escape, and the response at its longest has to fit in Reply.
+static bool compileResponse(CompiledRule *Compiled, UInt32 MaxMessage){
+    const UInt8 *response = Compiled->Response;
+    UInt32      size = Compiled->Rule->ResponseSize;
+    UInt32      longest = 0;
+
+    for (UInt32 i = 0; i < size; i++){
+        if (response[i] != '$'){
+            longest++;
+            continue;
+        }
+        if (++i == size) return false;
+        switch (response[i]){
+            case '$':
+                longest++;
+                break;
+            case 'c':
+            case 'x':
+                longest += 2;
+                break;
+            default:
+                if (!isDigit(response[i]) || ((UInt32)(response[i] - '0') > Compiled->Captures)) return false;
+                longest += MaxMessage;
+                break;
+        }
+    }
+
+    return longest <= kMaxResponderReply;
+}
+
+
+static bool compileRules(Responder *R){
+    ResponderHeader *header = &R->Header;
+    UInt32          offset = sizeof(ResponderHeader);
+
+    bcopy(R->Table, header, sizeof(ResponderHeader));
+    if ((header->Count > kMaxResponderRules) || (header->Flags & ~kResponderPassThrough)) return false;
+    if (header->MaxSize > kMaxResponderMessage) return false;
+    R->MaxSize = header->MaxSize ? header->MaxSize : kMaxResponderMessage;
+
+    switch (header->Framing){
+        case kFramingNone:
+        case kFramingFixed:
+            break;
+        case kFramingDelimiter:
+            if (header->Parameter > 0xFF) return false;
+            break;
+        case kFramingLengthPrefix:
+            if ((header->Parameter != 1) && (header->Parameter != 2) && (header->Parameter != 4)) return false;
+            if (R->MaxSize <= header->Parameter) return false;
+            break;
+        default:
+            return false;
+    }
+
+    for (UInt32 i = 0; i < header->Count; i++){
+        CompiledRule        *compiled = &R->Rules[i];
+        const ResponderRule *rule;
+        UInt32              size;
+
+        if (R->TableSize - offset < sizeof(ResponderRule)) return false;
+        rule = (const ResponderRule*)(R->Table + offset);
+        size = sizeof(ResponderRule) + rule->PatternSize + rule->ResponseSize;
+        if (R->TableSize - offset < size) return false;
+        if ((rule->Match > kMatchPattern) || (rule->Flags & ~kRuleCheckCRC)) return false;
+        if ((rule->Delay > kMaxResponderDelay) || (rule->Interval > kMaxResponderDelay)) return false;
+
+        compiled->Rule = rule;
+        compiled->Pattern = R->Table + offset + sizeof(ResponderRule);
+        compiled->Response = compiled->Pattern + rule->PatternSize;
+        compiled->First = -1;
+        compiled->Delay = rule->Delay * 1000ULL;
+        compiled->Interval = rule->Interval * 1000ULL;
+        if (rule->Match == kMatchPattern){
+            if (!compilePattern(compiled)) return false;
+        } else {
+            compiled->MinSize = rule->PatternSize;
+            if (rule->PatternSize)
+                compiled->First = compiled->Pattern[0];
+            compiled->Captures = (rule->Match == kMatchPrefix) ? 1 : 0;
+        }
+        if (!compileResponse(compiled, R->MaxSize)) return false;
+
+        // The last rule's padding may be left off.
+        offset = min(offset + ((size + 7) & ~7), R->TableSize);
+    }
+
+    return true;
+}
+
+
+// The rules are checked in a copy of the table, which they then point into, so the caller's can't change
+// under them.
+IOReturn CreateResponder(const UInt8 *Table, UInt32 Size, Responder **Result){
+    Responder   *responder;
+
+    *Result = NULL;
+    if ((Size < sizeof(ResponderHeader)) || (Size > kMaxResponderSize)) return kIOReturnBadArgument;
+
+    responder = (Responder*)IOMalloc(sizeof(Responder));
+    if (responder == NULL) return kIOReturnNoMemory;
+    bzero(responder, sizeof(Responder));
+
+    responder->Table = (UInt8*)IOMalloc(Size);
+    if (responder->Table == NULL){
+        IOFree(responder, sizeof(Responder));
+        return kIOReturnNoMemory;
+    }
+    responder->TableSize = Size;
+    bcopy(Table, responder->Table, Size);
+
+    if (!compileRules(responder)){
+        FreeResponder(responder);
+        return kIOReturnBadArgument;
+    }
+
+    *Result = responder;
+    return kIOReturnSuccess;
+}
+
+
+void FreeResponder(Responder *R){
+
+    IOFree(R->Table, R->TableSize);
+    IOFree(R, sizeof(Responder));
+}
+
+
+void ResetResponder(Responder *R){
+
+    R->Length = 0;
+    R->Prefix = 0;
+    R->PendingHead = 0;
+    R->PendingTail = 0;
+    R->FirstReply = 0;
+    R->NumReplies = 0;
+}
+
+
+#pragma mark Messages
+
+// Cut the way scanFrame cuts frames, with the longest message in place of the queue size.
+UInt32 ResponderTake(Responder *R, const UInt8 *Input, UInt32 Length, bool *Complete){
+    UInt32      used = 0;
+    UInt32      end = R->MaxSize;           // Where the message ends, as far as is known yet
+    UInt32      take;
+    const UInt8 *delimiter;
+
+    switch (R->Header.Framing){
+        case kFramingNone:
+            take = min(Length, R->MaxSize - R->Length);
+            bcopy(Input, R->Message + R->Length, take);
+            R->Length += take;
+            *Complete = true;
+            return take;
+
+        case kFramingDelimiter:
+            // The delimiter can come straight after a full message, and still ends it.
+            take = min(Length, R->MaxSize - R->Length + 1);
+            delimiter = (const UInt8*)memchr(Input, R->Header.Parameter, take);
+            if (delimiter){
+                take = (UInt32)(delimiter - Input);
+                bcopy(Input, R->Message + R->Length, take);
+                R->Length += take;
+                *Complete = true;
+                return take + 1;
+            }
+            take = min(take, R->MaxSize - R->Length);
+            break;
+
+        case kFramingLengthPrefix:
+            for (; (used < Length) && (R->Length < R->Header.Parameter); used++){
+                R->Prefix = (R->Prefix << 8) | Input[used];
+                R->Message[R->Length++] = Input[used];
+            }
+            if ((R->Length >= R->Header.Parameter) && (R->Prefix < R->MaxSize - R->Header.Parameter))
+                end = R->Header.Parameter + R->Prefix;
+            take = min(Length - used, end - R->Length);
+            break;
+
+        default:
+            take = min(Length, R->MaxSize - R->Length);
+            break;
+    }
+
+    bcopy(Input + used, R->Message + R->Length, take);
+    R->Length += take;
+    *Complete = (R->Length == end);
+    return used + take;
+}
+
+
+// Star backtracking: when the rest doesn't match, the last * takes one more byte and matching picks up
+// after it. # takes every digit there is and gives none back, so only * ever backtracks.
+static bool matchPattern(Responder *R, const CompiledRule *Rule){
+    const UInt8 *pattern = Rule->Pattern;
+    const UInt8 *text = R->Message;
+    UInt32      patternSize = Rule->Rule->PatternSize;
+    UInt32      size = R->Length;
+    Capture     *captures = R->Captures;
+    UInt32      p = 0, t = 0, n = 1;
+    UInt32      starP = 0, starT = 0, starN = 0;     // The last *, starN 0 for none yet
+
+    while ((p < patternSize) || (t < size)){
+        bool    matched = false;
+
+        if (p < patternSize){
+            UInt8   byte = pattern[p];
+
+            if (byte == kAnyRun){
+                starP = p++;
+                starT = t;
+                starN = n;
+                captures[n].Offset = t;
+                captures[n++].Length = 0;
+                continue;
+            }
+            if (t < size){
+                switch (byte){
+                    case kAnyByte:
+                        captures[n].Offset = t++;
+                        captures[n++].Length = 1;
+                        p++;
+                        matched = true;
+                        break;
+                    case kDigits:
+                        if (!isDigit(text[t]))
+                            break;
+                        captures[n].Offset = t;
+                        while ((t < size) && isDigit(text[t]))
+                            t++;
+                        captures[n].Length = t - captures[n].Offset;
+                        n++;
+                        p++;
+                        matched = true;
+                        break;
+                    case kEscape:
+                        byte = pattern[++p];
+                        // fall through
+                    default:
+                        if (text[t] != byte)
+                            break;
+                        p++;
+                        t++;
+                        matched = true;
+                        break;
+                }
+            }
+        }
+        if (matched)
+            continue;
+
+        if (!starN || (starT == size)) return false;
+        starT++;
+        captures[starN].Length = starT - captures[starN].Offset;
+        p = starP + 1;
+        t = starT;
+        n = starN + 1;
+    }
+
+    return true;
+}
+
+
+static bool matchRule(Responder *R, const CompiledRule *Rule){
+    UInt32  size = Rule->Rule->PatternSize;
+
+    if (R->Length < Rule->MinSize) return false;
+    if ((Rule->First >= 0) && (R->Message[0] != Rule->First)) return false;
+    if (Rule->Rule->Flags & kRuleCheckCRC){
+        if (R->Length < 2) return false;
+        if (crc16(R->Message, R->Length - 2) != (R->Message[R->Length - 2] | (R->Message[R->Length - 1] << 8))) return false;
+    }
+
+    switch (Rule->Rule->Match){
+        case kMatchLiteral:
+            return (R->Length == size) && !memcmp(R->Message, Rule->Pattern, size);
+        case kMatchPrefix:
+            if (memcmp(R->Message, Rule->Pattern, size)) return false;
+            R->Captures[1].Offset = size;
+            R->Captures[1].Length = R->Length - size;
+            return true;
+        default:
+            return matchPattern(R, Rule);
+    }
+}
+
+
+// Literal runs are copied whole, compileResponse has made sure each $ is followed by its escape and that
+// the result fits.
+static UInt32 renderResponse(Responder *R, const CompiledRule *Rule){
+    const UInt8 *response = Rule->Response;
+    UInt32      size = Rule->Rule->ResponseSize;
+    UInt8       *reply = R->Reply;
+    UInt32      length = 0;
+    UInt32      i = 0, run, end;
+    const UInt8 *escape;
+    UInt16      crc;
+    UInt8       sum;
+    Capture     *capture;
+
+    while (i < size){
+        escape = (const UInt8*)memchr(response + i, '$', size - i);
+        run = escape ? (UInt32)(escape - (response + i)) : size - i;
+        bcopy(response + i, reply + length, run);
+        length += run;
+        i += run;
+        if (i == size)
+            break;
+
+        switch (response[i + 1]){
+            case '$':
+                reply[length++] = '$';
+                break;
+            case 'c':
+                crc = crc16(reply, length);
+                reply[length++] = crc & 0xFF;
+                reply[length++] = crc >> 8;
+                break;
+            case 'x':
+                end = (length && (reply[length - 1] == '*')) ? length - 1 : length;
+                sum = 0;
+                for (UInt32 j = 1; j < end; j++)
+                    sum ^= reply[j];
+                reply[length++] = sHexDigits[sum >> 4];
+                reply[length++] = sHexDigits[sum & 0xF];
+                break;
+            default:
+                capture = &R->Captures[response[i + 1] - '0'];
+                bcopy(R->Message + capture->Offset, reply + length, capture->Length);
+                length += capture->Length;
+                break;
+        }
+        i += 2;
+    }
+
+    return length;
+}
+
+
+const CompiledRule* ResponderAnswer(Responder *R, UInt32 *Size){
+    const CompiledRule  *rule = NULL;
+
+    R->Captures[0].Offset = 0;
+    R->Captures[0].Length = R->Length;
+    R->Stats.Messages++;
+    for (UInt32 i = 0; i < R->Header.Count; i++){
+        if (matchRule(R, &R->Rules[i])){
+            rule = &R->Rules[i];
+            break;
+        }
+    }
+    if (rule){
+        R->Stats.Matched++;
+        *Size = renderResponse(R, rule);
+    }
+
+    R->Length = 0;
+    R->Prefix = 0;
+    return rule;
+}
+
+
+#pragma mark Pacing
+
+static void putPending(Responder *R, const UInt8 *Data, UInt32 Size){
+    UInt32  at = R->PendingHead & (kResponderPendingSize - 1);
+    UInt32  first = min(Size, kResponderPendingSize - at);
+
+    bcopy(Data, R->Pending + at, first);
+    bcopy(Data + first, R->Pending, Size - first);
+    R->PendingHead += Size;
+}
+
+
+static void takePending(Responder *R, UInt8 *Data, UInt32 Size){
+    UInt32  at = R->PendingTail & (kResponderPendingSize - 1);
+    UInt32  first = min(Size, kResponderPendingSize - at);
+
+    bcopy(R->Pending + at, Data, first);
+    bcopy(R->Pending, Data + first, Size - first);
+    R->PendingTail += Size;
+}
+
+
+bool ResponderQueue(Responder *R, UInt32 Size, UInt64 Due, UInt64 Interval){
+    PendingReply    *reply;
+
+    if (R->NumReplies == kMaxPendingReplies) return false;
+    if (Size > kResponderPendingSize - (R->PendingHead - R->PendingTail)) return false;
+
+    putPending(R, R->Reply, Size);
+    reply = &R->Replies[(R->FirstReply + R->NumReplies) % kMaxPendingReplies];
+    reply->Size = Size;
+    reply->Due = Due;
+    reply->Interval = Interval;
+    R->NumReplies++;
+
+    return true;
+}
+
+
+// A late call catches up, handing over every byte that fell due since. A response only starts once the one
+// before it has finished, a byte's interval after its last byte.
+UInt32 ResponderDue(Responder *R, UInt64 Now, UInt8 *Output, UInt32 Max, UInt64 *Next){
+    PendingReply    *reply;
+    UInt32          count = 0;
+    UInt32          take;
+
+    while (R->NumReplies && (count < Max)){
+        reply = &R->Replies[R->FirstReply];
+        if (reply->Due > Now)
+            break;
+
+        take = reply->Size;
+        if (reply->Interval && ((Now - reply->Due) / reply->Interval < take))
+            take = (UInt32)((Now - reply->Due) / reply->Interval) + 1;
+        take = min(take, Max - count);
+        takePending(R, Output + count, take);
+        count += take;
+        reply->Size -= take;
+        reply->Due += take * reply->Interval;
+        if (reply->Size)
+            continue;
+
+        R->FirstReply = (R->FirstReply + 1) % kMaxPendingReplies;
+        R->NumReplies--;
+        if (R->NumReplies && (R->Replies[R->FirstReply].Due < reply->Due))
+            R->Replies[R->FirstReply].Due = reply->Due;
+    }
+
+    *Next = R->NumReplies ? R->Replies[R->FirstReply].Due : 0;
+    return count;
+}
@@ -0,0 +1,96 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  The responder kSetResponder puts on a port, see Shared.h. The rules are checked and compiled once, when
+//  they are set: each keeps the first byte and the shortest message it can match, so most rules are passed
+//  over without looking further, and responses are checked so that rendering one can't fail or overrun.
+//  Matching and rendering work in the Responder's own buffers; the port serializes calls with its lock.
+//
+
+#ifndef VSP_RESPONDER_H
+#define VSP_RESPONDER_H
+
+#include <IOKit/IOLib.h>
+#include "Shared.h"
+
+
+#define kMaxCaptures            9
+#define kResponderPendingSize   4096        // Bytes of paced responses waiting, must be a power of two
+#define kMaxPendingReplies      32
+
+typedef struct{
+    const ResponderRule *Rule;
+    const UInt8         *Pattern;
+    const UInt8         *Response;
+    UInt32              MinSize;            // Shortest message the pattern can match
+    SInt32              First;              // The byte a message has to start with, -1 for any
+    UInt32              Captures;           // How many $1 to $9 a match sets
+    UInt64              Delay;              // Nanoseconds
+    UInt64              Interval;
+} CompiledRule;
+
+typedef struct{
+    UInt32      Offset;
+    UInt32      Length;
+} Capture;
+
+// A response waiting for its time. Due is when its next byte goes, by UptimeNanoseconds.
+typedef struct{
+    UInt32      Size;
+    UInt64      Interval;
+    UInt64      Due;
+} PendingReply;
+
+typedef struct Responder{
+    ResponderHeader Header;
+    UInt32          MaxSize;                // Longest message
+    UInt8           *Table;                 // A copy of the rules as they were set
+    UInt32          TableSize;
+    CompiledRule    Rules[kMaxResponderRules];
+
+    UInt8           Message[kMaxResponderMessage];
+    UInt32          Length;                 // Of the message arriving
+    UInt32          Prefix;                 // Its length prefix, as far as it has arrived
+    Capture         Captures[kMaxCaptures + 1];
+    UInt8           Reply[kMaxResponderReply];
+
+    // Paced responses, in order. Head and Tail are free running byte counts.
+    UInt8           Pending[kResponderPendingSize];
+    UInt32          PendingHead;
+    UInt32          PendingTail;
+    PendingReply    Replies[kMaxPendingReplies];
+    UInt32          FirstReply;
+    UInt32          NumReplies;
+
+    ResponderStats  Stats;
+} Responder;
+
+
+// Checks and compiles a kSetResponder table: kIOReturnBadArgument if it is malformed, kIOReturnNoMemory.
+IOReturn    CreateResponder(const UInt8 *Table, UInt32 Size, Responder **Result);
+void        FreeResponder(Responder *R);
+
+// Forgets the message arriving and the responses waiting, for a tty that has gone.
+void        ResetResponder(Responder *R);
+
+// Adds the next of Length bytes the tty wrote to the message, returning how many it used. Complete says
+// whether they ended the message; with kFramingNone the end of Input does.
+UInt32      ResponderTake(Responder *R, const UInt8 *Input, UInt32 Length, bool *Complete);
+
+// Matches the complete message against the rules and starts on the next one. Returns the rule that matched,
+// with its response rendered into Reply and Size set to its length, or NULL.
+const CompiledRule* ResponderAnswer(Responder *R, UInt32 *Size);
+
+// Queues the Size bytes in Reply to go out from Due on, Interval nanoseconds apart. False if there isn't room.
+bool        ResponderQueue(Responder *R, UInt32 Size, UInt64 Due, UInt64 Interval);
+
+// Copies up to Max bytes of the responses due by Now into Output, returning how many. Next is set to when the
+// next byte waiting is due, 0 if there are none.
+UInt32      ResponderDue(Responder *R, UInt64 Now, UInt8 *Output, UInt32 Max, UInt64 *Next);
+
+static inline bool ResponderPending(Responder *R){
+
+    return R->NumReplies != 0;
+}
+
+#endif
@@ -0,0 +1,396 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+
+#include <IOKit/IOLib.h>
+#include <kern/thread_call.h>
+#include <libkern/OSAtomic.h>
+#include "VSPTimer.h"
+#include "VSPLock.h"
+
+
+#define kWheelSlotMask      (kWheelSlots - 1)
+#define kWheelDue           (kWheelLevels * kWheelSlots)
+#define kWheelSpan          (1ULL << (kWheelSlotShift * kWheelLevels))     // Ticks the wheel can hold
+#define kMaxTimerInterval   (1ULL << 62)
+
+// Everything below is under sWheelLock, the users count included, so ports starting and stopping at once
+// agree on who sets the wheel up. The lock itself comes from VSPSharedLock and outlives the wheel.
+static IOLock           *sWheelLock = NULL;
+static UInt32           sWheelUsers = 0;
+static thread_call_t    sWheelCall = NULL;
+
+static WheelTimer       *sSlots[kWheelLevels * kWheelSlots];
+static UInt64           sOccupied[kWheelLevels];    // A bit per slot with a timer in it
+static UInt64           sEarliest[kWheelLevels * kWheelSlots];  // No timer in the slot expires before this
+static WheelTimer       *sDue = NULL;               // Timers due, in the order they are run
+static UInt64           sTick = 0;                  // Every tick up to this one has been run
+static UInt64           sScheduled = 0;             // The tick sWheelCall is entered for, 0 for none
+static bool             sInRun = false;
+static WheelTimer       *sRunning = NULL;           // Whose Action is running now
+static UInt32           sFinishing = 0;             // Threads waiting for sRunning to change
+static TimerWheelStats  sStats;
+
+
+UInt64 UptimeNanoseconds(void){
+    uint64_t    now;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &now);
+    return now;
+}
+
+
+#pragma mark Slots
+
+static void linkTimer(WheelTimer *Timer, WheelTimer **Head, UInt32 Slot){
+
+    Timer->Next = *Head;
+    if (Timer->Next)
+        Timer->Next->Link = &Timer->Next;
+    *Head = Timer;
+    Timer->Link = Head;
+    Timer->Slot = Slot;
+}
+
+
+static void unlinkTimer(WheelTimer *Timer){
+
+    *Timer->Link = Timer->Next;
+    if (Timer->Next)
+        Timer->Next->Link = Timer->Link;
+    if ((Timer->Slot < kWheelDue) && (sSlots[Timer->Slot] == NULL))
+        sOccupied[Timer->Slot >> kWheelSlotShift] &= ~(1ULL << (Timer->Slot & kWheelSlotMask));
+    Timer->Next = NULL;
+    Timer->Link = NULL;
+    sStats.Pending--;
+}
+
+
+// File a timer by how far off it is: the lowest level whose span covers it, in the slot for its tick at
+// that level's step. A timer beyond the top level waits in the last slot that comes round before the
+// wheel's span runs out, and is filed again from there.
+static void placeTimer(WheelTimer *Timer){
+    UInt64  expires = Timer->Expires;
+    UInt32  level, slot;
+
+    if (expires <= sTick){
+        linkTimer(Timer, &sDue, kWheelDue);
+        return;
+    }
+    if (expires - sTick >= kWheelSpan)
+        expires = sTick + kWheelSpan - 1;
+
+    for (level = 0; level < kWheelLevels - 1; level++){
+        if (expires - sTick < (1ULL << (kWheelSlotShift * (level + 1))))
+            break;
+    }
+    slot = (UInt32)(expires >> (kWheelSlotShift * level)) & kWheelSlotMask;
+    if (!(sOccupied[level] & (1ULL << slot)) || (Timer->Expires < sEarliest[(level * kWheelSlots) + slot]))
+        sEarliest[(level * kWheelSlots) + slot] = Timer->Expires;
+    linkTimer(Timer, &sSlots[(level * kWheelSlots) + slot], (level * kWheelSlots) + slot);
+    sOccupied[level] |= 1ULL << slot;
+}
+
+
+// Empty one slot, filing its timers again now that they are closer.
+static void cascadeSlot(UInt32 level, UInt32 slot){
+    WheelTimer  *Timer = sSlots[(level * kWheelSlots) + slot];
+    WheelTimer  *Next;
+
+    sSlots[(level * kWheelSlots) + slot] = NULL;
+    sOccupied[level] &= ~(1ULL << slot);
+    for (; Timer; Timer = Next){
+        Next = Timer->Next;
+        placeTimer(Timer);
+        sStats.Cascaded++;
+    }
+}
+
+
+// The first tick after sTick where a slot of this level with timers in it comes round, 0 if it has none.
+// For level 0 the timers are due then, above it they are cascaded. The slot goes in *slot.
+static UInt64 nextSlotTick(UInt32 level, UInt32 *slot){
+    UInt32  shift = kWheelSlotShift * level;
+    UInt64  position = sTick >> shift;
+    UInt32  index = (UInt32)(position + 1) & kWheelSlotMask;
+    UInt64  bits = sOccupied[level];
+
+    if (bits == 0) return 0;
+    if (index)
+        bits = (bits >> index) | (bits << (kWheelSlots - index));
+    *slot = (index + __builtin_ctzll(bits)) & kWheelSlotMask;
+    return (position + 1 + __builtin_ctzll(bits)) << shift;
+}
+
+
+// The next tick with anything to do, 0 when the slots are empty. With waking true, the next tick a timer
+// can expire on: a cascade with nothing due straight after it can wait for the earliest timer it brings
+// down, so a lone timer above level 0 costs one run and not two.
+static UInt64 nextTick(bool waking){
+    UInt64  next = 0, tick;
+    UInt32  slot = 0;
+
+    for (UInt32 level = 0; level < kWheelLevels; level++){
+        tick = nextSlotTick(level, &slot);
+        if (tick == 0) continue;
+        if (waking && level && (sEarliest[(level * kWheelSlots) + slot] > tick))
+            tick = sEarliest[(level * kWheelSlots) + slot];
+        if (!next || (tick < next))
+            next = tick;
+    }
+    return next;
+}
+
+
+// Run the ticks up to now, moving whatever falls due onto sDue. Only ticks with something to do are
+// visited, however long the wheel slept.
+static void advanceWheel(UInt64 Now){
+    UInt64      tick;
+    UInt32      index;
+    WheelTimer  *Timer, *Next;
+
+    while (sTick < Now){
+        tick = nextTick(false);
+        if ((tick == 0) || (tick > Now)){
+            sTick = Now;
+            break;
+        }
+        sTick = tick;
+        index = (UInt32)tick & kWheelSlotMask;
+
+        // A level only wraps when the one below it does.
+        if (index == 0){
+            for (UInt32 level = 1; level < kWheelLevels; level++){
+                UInt32  slot = (UInt32)(tick >> (kWheelSlotShift * level)) & kWheelSlotMask;
+
+                cascadeSlot(level, slot);
+                if (slot) break;
+            }
+        }
+
+        // Everything in level 0 is within a turn of the wheel, so the whole slot is due.
+        Timer = sSlots[index];
+        sSlots[index] = NULL;
+        sOccupied[0] &= ~(1ULL << index);
+        for (; Timer; Timer = Next){
+            Next = Timer->Next;
+            linkTimer(Timer, &sDue, kWheelDue);
+        }
+    }
+}
+
+
+// The next tick the wheel has to run on, 0 when nothing is armed.
+static UInt64 nextWake(void){
+
+    if (sStats.Pending == 0) return 0;
+    if (sDue) return sTick;
+    return nextTick(true);
+}
+
+
+// Enter the thread call for the next wake, unless it is already due by then. While the wheel is running
+// it schedules itself when it is done.
+static void scheduleWheel(void){
+    UInt64      wake = nextWake();
+    uint64_t    deadline;
+
+    if ((wake == 0) || sInRun || !sWheelCall) return;
+    if (sScheduled && (sScheduled <= wake)) return;
+
+    sScheduled = wake;
+    nanoseconds_to_absolutetime(wake << kWheelTickShift, &deadline);
+    thread_call_enter_delayed(sWheelCall, deadline);
+}
+
+
+// The wheel's thread call. Actions run one at a time without the wheel lock, so they can take port locks
+// and arm timers, their own included.
+static void runWheel(thread_call_param_t unused0, thread_call_param_t unused1){
+    WheelTimer  *Timer;
+    TimerAction Action;
+    void        *Owner, *Argument;
+
+    IOLockLock(sWheelLock);
+    sScheduled = 0;
+    sInRun = true;
+    sStats.Runs++;
+    advanceWheel(UptimeNanoseconds() >> kWheelTickShift);
+
+    while ((Timer = sDue)){
+        unlinkTimer(Timer);
+        sStats.Expired++;
+        Action = Timer->Action;
+        Owner = Timer->Owner;
+        Argument = Timer->Argument;
+        sRunning = Timer;
+        IOLockUnlock(sWheelLock);
+
+        Action(Owner, Argument);
+
+        IOLockLock(sWheelLock);
+        sRunning = NULL;
+        if (sFinishing)
+            IOLockWakeup(sWheelLock, &sRunning, false);
+    }
+
+    sInRun = false;
+    if (sFinishing)
+        IOLockWakeup(sWheelLock, &sRunning, false);
+    scheduleWheel();
+    IOLockUnlock(sWheelLock);
+}
+
+
+#pragma mark Timers
+
+bool StartTimerWheel(void){
+    IOLock  *lock = VSPSharedLock(&sWheelLock);
+    bool    ok = true;
+
+    if (lock == NULL) return false;
+
+    IOLockLock(lock);
+    if (sWheelUsers == 0){
+        sWheelCall = thread_call_allocate(&runWheel, NULL);
+        if (sWheelCall){
+            bzero(sSlots, sizeof(sSlots));
+            bzero(sOccupied, sizeof(sOccupied));
+            sDue = NULL;
+            sTick = UptimeNanoseconds() >> kWheelTickShift;
+            sScheduled = 0;
+            sStats.Pending = 0;
+        } else {
+            ok = false;
+        }
+    }
+    if (ok)
+        sWheelUsers++;
+    IOLockUnlock(lock);
+
+    return ok;
+}
+
+
+// By the time the last port stops it has finished all its timers, so only a run already under way has
+// to be waited for.
+void StopTimerWheel(void){
+    IOLock  *lock = VSPSharedLock(&sWheelLock);
+
+    if (lock == NULL) return;
+
+    IOLockLock(lock);
+    if (sWheelUsers && (--sWheelUsers == 0)){
+        thread_call_cancel(sWheelCall);
+        while (sInRun){
+            sFinishing++;
+            IOLockSleep(lock, &sRunning, THREAD_UNINT);
+            sFinishing--;
+        }
+        thread_call_free(sWheelCall);
+        sWheelCall = NULL;
+    }
+    IOLockUnlock(lock);
+}
+
+
+void InitTimer(WheelTimer *Timer, TimerAction Action, void *Owner, void *Argument){
+
+    Timer->Next = NULL;
+    Timer->Link = NULL;
+    Timer->Expires = 0;
+    Timer->Slot = kWheelDue;
+    Timer->Action = Action;
+    Timer->Owner = Owner;
+    Timer->Argument = Argument;
+}
+
+
+void ArmTimer(WheelTimer *Timer, UInt64 Nanoseconds){
+    IOLock  *lock = VSPSharedLock(&sWheelLock);
+    UInt64  now, slack;
+
+    if (lock == NULL) return;
+    if (Nanoseconds > kMaxTimerInterval)
+        Nanoseconds = kMaxTimerInterval;
+
+    IOLockLock(lock);
+    if (sWheelUsers == 0){
+        IOLockUnlock(lock);
+        return;
+    }
+    now = UptimeNanoseconds();
+    if (Timer->Link)
+        unlinkTimer(Timer);
+    else if ((sStats.Pending == 0) && ((now >> kWheelTickShift) > sTick))
+        sTick = now >> kWheelTickShift;                 // An empty wheel has nothing to catch up on
+
+    // Round up, a timer never fires early. Within its slack it goes to the coarsest tick it can, so
+    // timers armed at about the same time for about the same interval fire on the same run.
+    Timer->Expires = (now + Nanoseconds + (1ULL << kWheelTickShift) - 1) >> kWheelTickShift;
+    slack = Nanoseconds >> (kWheelSlackShift + kWheelTickShift);
+    if (slack){
+        slack = 1ULL << (63 - __builtin_clzll(slack));
+        Timer->Expires = (Timer->Expires + slack - 1) & ~(slack - 1);
+    }
+    // It can't fire on a tick the wheel has already run.
+    if (Timer->Expires <= sTick)
+        Timer->Expires = sTick + 1;
+    placeTimer(Timer);
+    sStats.Pending++;
+    sStats.Armed++;
+    scheduleWheel();
+    IOLockUnlock(lock);
+}
+
+
+bool CancelTimer(WheelTimer *Timer){
+    IOLock  *lock = VSPSharedLock(&sWheelLock);
+    bool    armed;
+
+    if (lock == NULL) return false;
+
+    IOLockLock(lock);
+    armed = (Timer->Link != NULL);
+    if (armed){
+        unlinkTimer(Timer);
+        sStats.Cancelled++;
+    }
+    IOLockUnlock(lock);
+
+    return armed;
+}
+
+
+void FinishTimer(WheelTimer *Timer){
+    IOLock  *lock = VSPSharedLock(&sWheelLock);
+
+    if (lock == NULL) return;
+
+    IOLockLock(lock);
+    if (Timer->Link){
+        unlinkTimer(Timer);
+        sStats.Cancelled++;
+    }
+    while (sRunning == Timer){
+        sFinishing++;
+        IOLockSleep(lock, &sRunning, THREAD_UNINT);
+        sFinishing--;
+    }
+    IOLockUnlock(lock);
+}
+
+
+void GetTimerWheelStats(TimerWheelStats *Stats){
+    IOLock  *lock = VSPSharedLock(&sWheelLock);
+
+    if (lock == NULL){
+        bzero(Stats, sizeof(TimerWheelStats));
+        return;
+    }
+
+    IOLockLock(lock);
+    *Stats = sStats;
+    IOLockUnlock(lock);
+}
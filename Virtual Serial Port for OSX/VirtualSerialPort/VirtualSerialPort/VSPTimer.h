@@ -0,0 +1,72 @@
+//
+//  Copyright © 2016 FracturedSoftware. All rights reserved.
+//
+//  One timer wheel shared by every port the driver has. Ports arm WheelTimers that they own (inside the
+//  driver, or on the stack of a call that waits), and a single thread call wakes only when the earliest of
+//  them is due, running every timer that falls in the same tick together. Arming and cancelling are O(1):
+//  the wheel has kWheelLevels levels of kWheelSlots slots, each level counting in steps kWheelSlots times
+//  longer than the one below, and a timer moves down a level when the slot it waits in comes round.
+//
+
+#ifndef VSP_TIMER_H
+#define VSP_TIMER_H
+
+#include <IOKit/IOLib.h>
+
+
+#define kWheelTickShift     16          // A tick is 2^16 ns, about 65 us; timers are rounded up to one
+#define kWheelSlotShift     6
+#define kWheelSlots         (1 << kWheelSlotShift)
+#define kWheelLevels        4           // 2^24 ticks, about 18 minutes, later timers wait at the top
+#define kWheelSlackShift    5           // A timer may fire up to 1/32 of its interval late
+
+
+typedef void (*TimerAction)(void *Owner, void *Argument);
+
+// Set up with InitTimer, then only touched through the calls below.
+typedef struct WheelTimer{
+    struct WheelTimer   *Next;
+    struct WheelTimer   **Link;         // What points at this timer, NULL when it isn't armed
+    UInt64              Expires;        // The tick it fires on
+    UInt32              Slot;           // Level * kWheelSlots + slot, or kWheelDue once it is due
+    TimerAction         Action;
+    void                *Owner;
+    void                *Argument;
+} WheelTimer;
+
+typedef struct TimerWheelStats{
+    UInt64  Armed;
+    UInt64  Cancelled;                  // Timers disarmed before they fired
+    UInt64  Expired;
+    UInt64  Runs;                       // Times the wheel's thread call ran, each running all the timers then due
+    UInt64  Cascaded;                   // Timers moved down a level
+    UInt32  Pending;
+} TimerWheelStats;
+
+
+// Each port starts the wheel when it starts and stops it when it stops, the last one stopping frees its
+// thread call. Timers are only armed while the wheel is started.
+bool    StartTimerWheel(void);
+void    StopTimerWheel(void);
+
+void    InitTimer(WheelTimer *Timer, TimerAction Action, void *Owner, void *Argument);
+
+// Fire Action(Owner, Argument) on the wheel's thread once Nanoseconds and at most the slack have passed,
+// moving the timer if it is already armed. May be called with locks held that Action takes; the wheel
+// lock comes after them.
+void    ArmTimer(WheelTimer *Timer, UInt64 Nanoseconds);
+
+// Disarm a timer, returning whether it was armed. Like thread_call_cancel it doesn't wait for an
+// Action already running, so it is safe under the locks Action takes.
+bool    CancelTimer(WheelTimer *Timer);
+
+// Disarm a timer and wait for its Action to return, before the timer's memory goes away. Must not be
+// called with a lock the Action takes, nor from the Action itself.
+void    FinishTimer(WheelTimer *Timer);
+
+void    GetTimerWheelStats(TimerWheelStats *Stats);
+
+// The clock the wheel runs on, for working out deadlines.
+UInt64  UptimeNanoseconds(void);
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <IOKit/IOLib.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/serial/IORS232SerialStreamSync.h>
 #include <libkern/OSByteOrder.h>
 #include "VSPUserClient.h"
 
@@ -42,6 +43,96 @@ const IOExternalMethodDispatch UserClientClassName::sMethods[kNumberOfMethods] =
         sizeof(TRBufferStruct),                                                 // Size of input struct.
         1,																		// One scalar output value.
         0                                                                       // No struct output value.
+    },	{   // kSetOverflowPolicy
+        (IOExternalMethodAction) &UserClientClassName::sSetOverflowPolicy,   // Method pointer.
+        1,																		// One scalar input value.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kRingDoorbell
+        (IOExternalMethodAction) &UserClientClassName::sRingDoorbell,        // Method pointer.
+        0,																		// No scalar input values.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kSendBuffer
+        (IOExternalMethodAction) &UserClientClassName::sSendBuffer,          // Method pointer.
+        1,																		// Send mode.
+        kIOUCVariableStructureSize,                                             // Variable sized input struct.
+        2,																		// Two scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kReadAsync
+        (IOExternalMethodAction) &UserClientClassName::sReadAsync,           // Method pointer.
+        4,																		// Address, size, minimum and timeout.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kSetNotifyWindow
+        (IOExternalMethodAction) &UserClientClassName::sSetNotifyWindow,     // Method pointer.
+        1,																		// One scalar input value.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kExecuteBatch
+        (IOExternalMethodAction) &UserClientClassName::sExecuteBatch,        // Method pointer.
+        0,																		// No scalar input values.
+        kIOUCVariableStructureSize,                                             // Packed BatchCommand list.
+        0,																		// No scalar output values.
+        kIOUCVariableStructureSize                                              // Packed BatchResult list.
+    },	{   // kSetSubscription
+        (IOExternalMethodAction) &UserClientClassName::sSetSubscription,     // Method pointer.
+        2,																		// State mask and field mask.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kGetCredits
+        (IOExternalMethodAction) &UserClientClassName::sGetCredits,          // Method pointer.
+        0,																		// No scalar input values.
+        0,																		// No struct input value.
+        2,																		// Credit limit and bytes sent.
+        0                                                                       // No struct output value.
+    },	{   // kSetFraming
+        (IOExternalMethodAction) &UserClientClassName::sSetFraming,          // Method pointer.
+        3,																		// Mode, parameter and longest frame.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kSendEvent
+        (IOExternalMethodAction) &UserClientClassName::sSendEvent,           // Method pointer.
+        2,																		// Event and data.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kSetLineFormat
+        (IOExternalMethodAction) &UserClientClassName::sSetLineFormat,       // Method pointer.
+        2,																		// Data bits and parity.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kSetFaults
+        (IOExternalMethodAction) &UserClientClassName::sSetFaults,           // Method pointer.
+        1,																		// Direction.
+        sizeof(FaultConfig),                                                    // Size of input struct.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kGetLockStats
+        (IOExternalMethodAction) &UserClientClassName::sGetLockStats,        // Method pointer.
+        2,																		// Lock and whether to clear it.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        kIOUCVariableStructureSize                                              // LockStats list.
+    },	{   // kSetResponder
+        (IOExternalMethodAction) &UserClientClassName::sSetResponder,        // Method pointer.
+        0,																		// No scalar input values.
+        kIOUCVariableStructureSize,                                             // Header and rules, or nothing.
+        0,																		// No scalar output values.
+        0                                                                       // No struct output value.
+    },	{   // kGetResponderStats
+        (IOExternalMethodAction) &UserClientClassName::sGetResponderStats,   // Method pointer.
+        1,																		// Whether to clear the counts.
+        0,																		// No struct input value.
+        0,																		// No scalar output values.
+        sizeof(ResponderStats)                                                  // Size of output struct.
     }
 };
 
@@ -75,11 +166,76 @@ bool UserClientClassName::initWithTask(task_t owningTask, void* securityToken, U
     fTask = owningTask;
     fProvider = NULL;
     m_notificationPort = 0;
+    
+    fReadHead = 0;
+    fReadCount = 0;
+    fReadLock = IOLockAlloc();
+    fReadTimer = thread_call_allocate(&UserClientClassName::readTimerFired, this);
+    
+    fSendHead = 0;
+    fSendCount = 0;
+    fSendLock = IOLockAlloc();
+    fSendCall = thread_call_allocate(&UserClientClassName::sendCallFired, this);
+    
+    fStateMask = 0xFFFFFFFF;
+    fFieldMask = ~0ULL;
+    fCreditsEnabled = false;
+    fNotifyWindow = 0;
+    fNotifyPending = false;
+    fNotifySequence = 0;
+    bzero(fLastSent, sizeof(fLastSent));
+    fNotifyLock = IOLockAlloc();
+    fNotifyTimer = thread_call_allocate(&UserClientClassName::notifyTimerFired, this);
+    
+    if (!fReadLock || !fReadTimer || !fSendLock || !fSendCall || !fNotifyLock || !fNotifyTimer)
+        success = false;
         
     return success;
 }
 
 
+// free is called when the last reference goes away, after the user process has closed the connection.
+// The calls were given this unretained, so any of them already running has to finish before it goes.
+void UserClientClassName::free(void){
+    IOLog("%s::%s\n", getName(), __FUNCTION__);
+    
+    if (fReadTimer){
+        thread_call_cancel_wait(fReadTimer);
+        thread_call_free(fReadTimer);
+        fReadTimer = NULL;
+    }
+    
+    if (fReadLock){
+        IOLockFree(fReadLock);
+        fReadLock = NULL;
+    }
+    
+    if (fSendCall){
+        thread_call_cancel_wait(fSendCall);
+        thread_call_free(fSendCall);
+        fSendCall = NULL;
+    }
+    
+    if (fSendLock){
+        IOLockFree(fSendLock);
+        fSendLock = NULL;
+    }
+    
+    if (fNotifyTimer){
+        thread_call_cancel_wait(fNotifyTimer);
+        thread_call_free(fNotifyTimer);
+        fNotifyTimer = NULL;
+    }
+    
+    if (fNotifyLock){
+        IOLockFree(fNotifyLock);
+        fNotifyLock = NULL;
+    }
+    
+    super::free();
+}
+
+
 #pragma mark start
 
 // start is called after initWithTask as a result of the user process calling IOServiceOpen.
@@ -93,7 +249,6 @@ bool UserClientClassName::start(IOService* provider){
     if (success){
 		success = super::start(provider);
 	}
-    fProvider->client = this;
 	
     return success;
 }
@@ -133,6 +288,10 @@ IOReturn UserClientClassName::closeUserClient(void){
     
     IOReturn	result = kIOReturnSuccess;
     
+    // Nothing more will be delivered on this connection.
+    completeReads(kIOReturnAborted, true);
+    completeSends(kIOReturnAborted);
+    
     if (fProvider == NULL) {
         // Return an error if we don't have a provider. This could happen if the user process
         // called closeUserClient without calling IOServiceOpen first.
@@ -142,7 +301,6 @@ IOReturn UserClientClassName::closeUserClient(void){
     else if (fProvider->isOpen(this)) {
         // Make sure we're the one who opened our provider before we tell it to close.
         fProvider->close(this);
-        fProvider->client = NULL;
     }
     else {
         result = kIOReturnNotOpen;
@@ -196,8 +354,8 @@ IOReturn UserClientClassName::openUserClient(void){
         result = kIOReturnNotAttached;
 	}
     else if (!fProvider->open(this)) {
-		// The most common reason this open call will fail is because the provider is already open
-		// and it doesn't support being opened by more than one client at a time.
+		// The provider takes up to kMaxUserClients clients, so the most common reason this open
+		// call will fail is that they are all in use.
 		result = kIOReturnExclusiveAccess;
 	}
         
@@ -265,6 +423,441 @@ IOReturn UserClientClassName::send(TRBufferStruct* inStruct, UInt32* sendCount){
 }
 
 
+// Small buffers arrive inline in structureInput. Anything over a page arrives as a memory descriptor
+// for the caller's buffer, which is mapped read only into the kernel and queued straight from there.
+// An async send keeps the mapping, or a copy of inline data, until the last byte has been queued.
+IOReturn UserClientClassName::sSendBuffer(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    
+    return target->sendBuffer(arguments);
+}
+
+
+IOReturn UserClientClassName::sendBuffer(IOExternalMethodArguments* arguments){
+    IOMemoryDescriptor  *descriptor = arguments->structureInputDescriptor;
+    IOMemoryMap         *map = NULL;
+    UInt32              mode = (UInt32)arguments->scalarInput[0];
+    UInt8               *buffer;
+    UInt32              size;
+    UInt32              sendCount = 0;
+    IOReturn            result;
+    
+    if (mode > kSendAsync) return kIOReturnBadArgument;
+    if ((mode == kSendAsync) && (arguments->asyncWakePort == MACH_PORT_NULL)) return kIOReturnBadArgument;
+    
+    if (descriptor){
+        if (descriptor->getLength() > kMaxSendBufferSize) return kIOReturnBadArgument;
+        
+        result = descriptor->prepare(kIODirectionOut);
+        if (result != kIOReturnSuccess) return result;
+        
+        map = descriptor->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapReadOnly);
+        if (map == NULL){
+            descriptor->complete(kIODirectionOut);
+            return kIOReturnVMError;
+        }
+        buffer = (UInt8*)map->getVirtualAddress();
+        size = (UInt32)descriptor->getLength();
+    } else {
+        buffer = (UInt8*)arguments->structureInput;
+        size = arguments->structureInputSize;
+    }
+    
+    switch (mode){
+        case kSendBlocking:
+            result = fProvider->sendBufferBlocking(buffer, size, &sendCount);
+            break;
+        case kSendAsync:
+            result = queueSend(arguments, descriptor, map, buffer, size, &sendCount);
+            break;
+        case kSendNormal:
+        default:
+            result = fProvider->sendBuffer(buffer, size, &sendCount);
+            break;
+    }
+    
+    if (map){
+        map->release();
+        descriptor->complete(kIODirectionOut);
+    }
+    
+    arguments->scalarOutput[0] = sendCount;
+    arguments->scalarOutput[1] = fProvider->getRXFreeSpace();
+    
+    return result;
+}
+
+
+#pragma mark Asynchronous Reads
+
+IOReturn UserClientClassName::sReadAsync(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    
+    return target->readAsync(arguments);
+}
+
+
+IOReturn UserClientClassName::readAsync(IOExternalMethodArguments* arguments){
+    mach_vm_address_t   address = arguments->scalarInput[0];
+    UInt64              size = arguments->scalarInput[1];
+    UInt64              minimum = arguments->scalarInput[2];
+    UInt64              timeout = arguments->scalarInput[3];
+    IOMemoryDescriptor  *memory;
+    IOMemoryMap         *map;
+    PendingRead         *read;
+    IOReturn            result;
+    
+    if (arguments->asyncWakePort == MACH_PORT_NULL) return kIOReturnBadArgument;
+    if ((size == 0) || (size > kMaxSendBufferSize) || (minimum > size)) return kIOReturnBadArgument;
+    
+    memory = IOMemoryDescriptor::withAddressRange(address, size, kIODirectionIn, fTask);
+    if (memory == NULL) return kIOReturnNoMemory;
+    
+    result = memory->prepare(kIODirectionIn);
+    if (result != kIOReturnSuccess){
+        memory->release();
+        return result;
+    }
+    
+    map = memory->createMappingInTask(kernel_task, 0, kIOMapAnywhere);
+    if (map == NULL){
+        memory->complete(kIODirectionIn);
+        memory->release();
+        return kIOReturnVMError;
+    }
+    
+    IOLockLock(fReadLock);
+    if (fReadCount == kMaxPendingReads){
+        IOLockUnlock(fReadLock);
+        map->release();
+        memory->complete(kIODirectionIn);
+        memory->release();
+        return kIOReturnNoResources;
+    }
+    
+    read = &fReads[(fReadHead + fReadCount) % kMaxPendingReads];
+    bcopy(arguments->asyncReference, read->reference, sizeof(OSAsyncReference64));
+    read->memory = memory;
+    read->map = map;
+    read->buffer = (UInt8*)map->getVirtualAddress();
+    read->size = (UInt32)size;
+    read->minimum = minimum ? (UInt32)minimum : 1;
+    read->count = 0;
+    read->deadline = 0;
+    if (timeout)
+        clock_interval_to_deadline((UInt32)timeout, kMillisecondScale, &read->deadline);
+    fReadCount++;
+    IOLockUnlock(fReadLock);
+    
+    armReadTimer();
+    
+    // The tty may already have written something.
+    dataAvailable();
+    
+    return kIOReturnSuccess;
+}
+
+
+// Fill reads from the front of the queue. Data only ever goes to the oldest read, so
+// reads complete in the order they were posted.
+void UserClientClassName::dataAvailable(void){
+    PendingRead done[kMaxPendingReads];
+    UInt32      numDone = 0;
+    UInt32      count;
+    
+    if (fProvider == NULL) return;
+    
+    IOLockLock(fReadLock);
+    while (fReadCount){
+        PendingRead *read = &fReads[fReadHead];
+        
+        fProvider->receiveData(read->buffer + read->count, read->size - read->count, &count);
+        read->count += count;
+        if (read->count < read->minimum)
+            break;
+        
+        done[numDone++] = *read;
+        fReadHead = (fReadHead + 1) % kMaxPendingReads;
+        fReadCount--;
+    }
+    IOLockUnlock(fReadLock);
+    
+    // Events the tty queued behind what we just read. Not under fReadLock, executeEvent may call back.
+    fProvider->runTXEvents();
+    
+    for (UInt32 i = 0; i < numDone; i++)
+        finishRead(&done[i], kIOReturnSuccess);
+}
+
+
+void UserClientClassName::portClosed(void){
+    
+    completeReads(kIOReturnNotOpen, true);
+    completeSends(kIOReturnNotOpen);
+}
+
+
+// Complete every pending read, or only those whose deadline has passed, with status.
+void UserClientClassName::completeReads(IOReturn status, bool all){
+    PendingRead done[kMaxPendingReads];
+    UInt32      numDone = 0;
+    UInt32      numKept = 0;
+    UInt64      now;
+    
+    if (fReadLock == NULL) return;
+    
+    clock_get_uptime(&now);
+    
+    IOLockLock(fReadLock);
+    for (UInt32 i = 0; i < fReadCount; i++){
+        PendingRead *read = &fReads[(fReadHead + i) % kMaxPendingReads];
+        
+        if (all || (read->deadline && (read->deadline <= now)))
+            done[numDone++] = *read;
+        else
+            fReads[(fReadHead + numKept++) % kMaxPendingReads] = *read;
+    }
+    fReadCount = numKept;
+    IOLockUnlock(fReadLock);
+    
+    for (UInt32 i = 0; i < numDone; i++)
+        finishRead(&done[i], status);
+    
+    if (!all)
+        armReadTimer();
+}
+
+
+void UserClientClassName::finishRead(PendingRead* read, IOReturn status){
+    io_user_reference_t args[1];
+    
+    args[0] = read->count;
+    sendAsyncResult64(read->reference, status, args, 1);
+    
+    read->map->release();
+    read->memory->complete(kIODirectionIn);
+    read->memory->release();
+}
+
+
+// Keep the timer set for the earliest deadline of any pending read.
+void UserClientClassName::armReadTimer(void){
+    UInt64  deadline = 0;
+    
+    IOLockLock(fReadLock);
+    for (UInt32 i = 0; i < fReadCount; i++){
+        UInt64 readDeadline = fReads[(fReadHead + i) % kMaxPendingReads].deadline;
+        if (readDeadline && (!deadline || (readDeadline < deadline)))
+            deadline = readDeadline;
+    }
+    IOLockUnlock(fReadLock);
+    
+    if (deadline)
+        thread_call_enter_delayed(fReadTimer, deadline);
+    else
+        thread_call_cancel(fReadTimer);
+}
+
+
+void UserClientClassName::readTimerFired(thread_call_param_t owner, thread_call_param_t unused){
+    
+    ((UserClientClassName*)owner)->completeReads(kIOReturnTimeout, false);
+}
+
+
+#pragma mark Asynchronous Sends
+
+// sendCount is what was queued straight away. If that was everything the send completes before this returns.
+IOReturn UserClientClassName::queueSend(IOExternalMethodArguments* arguments, IOMemoryDescriptor* memory, IOMemoryMap* map,
+                                        UInt8* buffer, UInt32 size, UInt32* sendCount){
+    PendingSend *send;
+    IOReturn    result;
+    
+    // Nobody would drain the rest.
+    if (!(fProvider->readPortState() & PD_S_ACTIVE)) return kIOReturnNotOpen;
+    
+    IOLockLock(fSendLock);
+    if (fSendCount == kMaxPendingSends){
+        IOLockUnlock(fSendLock);
+        return kIOReturnNoResources;
+    }
+    
+    send = &fSends[(fSendHead + fSendCount) % kMaxPendingSends];
+    if (memory){
+        result = memory->prepare(kIODirectionOut);
+        if (result != kIOReturnSuccess){
+            IOLockUnlock(fSendLock);
+            return result;
+        }
+        memory->retain();
+        map->retain();
+        send->buffer = buffer;
+    } else {
+        send->buffer = (UInt8*)IOMalloc(size ? size : 1);
+        if (send->buffer == NULL){
+            IOLockUnlock(fSendLock);
+            return kIOReturnNoMemory;
+        }
+        bcopy(buffer, send->buffer, size);
+    }
+    bcopy(arguments->asyncReference, send->reference, sizeof(OSAsyncReference64));
+    send->memory = memory;
+    send->map = map;
+    send->size = size;
+    send->count = 0;
+    VSPAddRelaxed(fSendCount, 1);
+    
+    // Only the oldest send makes progress, so this one may have to wait its turn.
+    if (fSendCount == 1)
+        fProvider->sendBufferPartial(send->buffer, send->size, &send->count);
+    *sendCount = send->count;
+    IOLockUnlock(fSendLock);
+    
+    pumpSends();
+    
+    return kIOReturnSuccess;
+}
+
+
+// Queue what fits from the front of the list, completing each send once its last byte is in.
+void UserClientClassName::pumpSends(void){
+    PendingSend done[kMaxPendingSends];
+    UInt32      numDone = 0;
+    UInt32      count;
+    
+    if ((fProvider == NULL) || (fSendLock == NULL)) return;
+    
+    IOLockLock(fSendLock);
+    while (fSendCount){
+        PendingSend *send = &fSends[fSendHead];
+        
+        if (send->count < send->size){
+            fProvider->sendBufferPartial(send->buffer + send->count, send->size - send->count, &count);
+            send->count += count;
+            if (send->count < send->size)
+                break;
+        }
+        
+        done[numDone++] = *send;
+        fSendHead = (fSendHead + 1) % kMaxPendingSends;
+        VSPStoreRelaxed(fSendCount, fSendCount - 1);
+    }
+    IOLockUnlock(fSendLock);
+    
+    for (UInt32 i = 0; i < numDone; i++)
+        finishSend(&done[i], kIOReturnSuccess);
+}
+
+
+void UserClientClassName::completeSends(IOReturn status){
+    PendingSend done[kMaxPendingSends];
+    UInt32      numDone = 0;
+    
+    if (fSendLock == NULL) return;
+    
+    IOLockLock(fSendLock);
+    while (fSendCount){
+        done[numDone++] = fSends[fSendHead];
+        fSendHead = (fSendHead + 1) % kMaxPendingSends;
+        VSPStoreRelaxed(fSendCount, fSendCount - 1);
+    }
+    IOLockUnlock(fSendLock);
+    
+    for (UInt32 i = 0; i < numDone; i++)
+        finishSend(&done[i], status);
+}
+
+
+void UserClientClassName::finishSend(PendingSend* send, IOReturn status){
+    io_user_reference_t args[1];
+    
+    args[0] = send->count;
+    sendAsyncResult64(send->reference, status, args, 1);
+    
+    if (send->memory){
+        send->map->release();
+        send->memory->complete(kIODirectionOut);
+        send->memory->release();
+    } else {
+        IOFree(send->buffer, send->size ? send->size : 1);
+    }
+}
+
+
+void UserClientClassName::sendCallFired(thread_call_param_t owner, thread_call_param_t unused){
+    
+    ((UserClientClassName*)owner)->pumpSends();
+}
+
+
+#pragma mark Batches
+
+IOReturn UserClientClassName::sExecuteBatch(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    
+    return target->executeBatch(arguments);
+}
+
+
+// The command list arrives inline or, if it carries a lot of data to send, as a descriptor which is
+// mapped the same way sendBuffer does. Results are collected in a kernel buffer and copied out once.
+IOReturn UserClientClassName::executeBatch(IOExternalMethodArguments* arguments){
+    IOMemoryDescriptor  *input = arguments->structureInputDescriptor;
+    IOMemoryDescriptor  *output = arguments->structureOutputDescriptor;
+    IOMemoryMap         *map = NULL;
+    UInt8               *commands;
+    UInt32              size;
+    UInt32              maxResults;
+    UInt32              numResults = 0;
+    BatchResult         *results;
+    IOReturn            result;
+    
+    maxResults = (UInt32)((output ? output->getLength() : arguments->structureOutputSize) / sizeof(BatchResult));
+    if (maxResults > kMaxBatchCommands)
+        maxResults = kMaxBatchCommands;
+    if (maxResults == 0) return kIOReturnBadArgument;
+    
+    if (input){
+        if (input->getLength() > kMaxSendBufferSize) return kIOReturnBadArgument;
+        
+        result = input->prepare(kIODirectionOut);
+        if (result != kIOReturnSuccess) return result;
+        
+        map = input->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapReadOnly);
+        if (map == NULL){
+            input->complete(kIODirectionOut);
+            return kIOReturnVMError;
+        }
+        commands = (UInt8*)map->getVirtualAddress();
+        size = (UInt32)input->getLength();
+    } else {
+        commands = (UInt8*)arguments->structureInput;
+        size = arguments->structureInputSize;
+    }
+    
+    results = (BatchResult*)IOMalloc(maxResults * sizeof(BatchResult));
+    if (results){
+        result = fProvider->executeBatch(commands, size, results, maxResults, &numResults);
+        
+        if (output){
+            output->writeBytes(0, results, numResults * sizeof(BatchResult));
+            arguments->structureOutputDescriptorSize = numResults * sizeof(BatchResult);
+        } else {
+            bcopy(results, arguments->structureOutput, numResults * sizeof(BatchResult));
+            arguments->structureOutputSize = numResults * sizeof(BatchResult);
+        }
+        
+        IOFree(results, maxResults * sizeof(BatchResult));
+    } else {
+        result = kIOReturnNoMemory;
+    }
+    
+    if (map){
+        map->release();
+        input->complete(kIODirectionOut);
+    }
+    
+    return result;
+}
+
+
 #pragma mark GetInfo
 
 IOReturn UserClientClassName::sGetInfo(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
@@ -276,7 +869,233 @@ IOReturn UserClientClassName::sGetInfo(UserClientClassName* target, void* refere
 
 IOReturn UserClientClassName::getInfo(void){
     
-    return fProvider->getInfo();
+    IOReturn result = fProvider->getInfo();
+    
+    // The client now has everything, so later deltas are measured from here.
+    IOLockLock(fNotifyLock);
+    readPortFields(fLastSent);
+    IOLockUnlock(fNotifyLock);
+    
+    return result;
+}
+
+
+#pragma mark Overflow Policy
+
+IOReturn UserClientClassName::sSetOverflowPolicy(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetOverflowPolicy\n");
+    
+    return target->setOverflowPolicy((UInt32)arguments->scalarInput[0]);
+}
+
+
+IOReturn UserClientClassName::setOverflowPolicy(UInt32 policy){
+    
+    return fProvider->setOverflowPolicy(policy);
+}
+
+
+#pragma mark Framing
+
+IOReturn UserClientClassName::sSetFraming(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetFraming\n");
+    
+    return target->setFraming((UInt32)arguments->scalarInput[0], (UInt32)arguments->scalarInput[1], (UInt32)arguments->scalarInput[2]);
+}
+
+
+IOReturn UserClientClassName::setFraming(UInt32 mode, UInt32 parameter, UInt32 maxSize){
+    
+    return fProvider->setFraming(mode, parameter, maxSize);
+}
+
+
+#pragma mark Events
+
+IOReturn UserClientClassName::sSendEvent(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSendEvent\n");
+    
+    return target->sendEvent((UInt32)arguments->scalarInput[0], (UInt32)arguments->scalarInput[1]);
+}
+
+
+IOReturn UserClientClassName::sendEvent(UInt32 event, UInt32 data){
+    
+    return fProvider->sendEvent(event, data);
+}
+
+
+#pragma mark Line Format
+
+IOReturn UserClientClassName::sSetLineFormat(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetLineFormat\n");
+    
+    return target->setLineFormat((UInt32)arguments->scalarInput[0], (UInt32)arguments->scalarInput[1]);
+}
+
+
+IOReturn UserClientClassName::setLineFormat(UInt32 charLength, UInt32 parity){
+    
+    return fProvider->setLineFormat(charLength, parity);
+}
+
+
+#pragma mark Faults
+
+IOReturn UserClientClassName::sSetFaults(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetFaults\n");
+    
+    return target->setFaults((UInt32)arguments->scalarInput[0], (const FaultConfig*)arguments->structureInput);
+}
+
+
+IOReturn UserClientClassName::setFaults(UInt32 direction, const FaultConfig* config){
+    
+    return fProvider->setFaults(direction, config);
+}
+
+
+#pragma mark Lock Stats
+
+IOReturn UserClientClassName::sGetLockStats(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sGetLockStats\n");
+    
+    return target->getLockStats(arguments);
+}
+
+
+// Collected in a kernel buffer and copied out once, as executeBatch does with its results.
+IOReturn UserClientClassName::getLockStats(IOExternalMethodArguments* arguments){
+    IOMemoryDescriptor  *output = arguments->structureOutputDescriptor;
+    UInt32              maxStats;
+    UInt32              numStats = 0;
+    LockStats           *stats;
+    IOReturn            result;
+    
+    maxStats = (UInt32)((output ? output->getLength() : arguments->structureOutputSize) / sizeof(LockStats));
+    if (maxStats > kMaxLockSites + 1)
+        maxStats = kMaxLockSites + 1;
+    if (maxStats == 0) return kIOReturnBadArgument;
+    
+    stats = (LockStats*)IOMalloc(maxStats * sizeof(LockStats));
+    if (stats == NULL) return kIOReturnNoMemory;
+    
+    result = fProvider->getLockStats((UInt32)arguments->scalarInput[0], arguments->scalarInput[1] != 0, stats, maxStats, &numStats);
+    if (output){
+        output->writeBytes(0, stats, numStats * sizeof(LockStats));
+        arguments->structureOutputDescriptorSize = numStats * sizeof(LockStats);
+    } else {
+        bcopy(stats, arguments->structureOutput, numStats * sizeof(LockStats));
+        arguments->structureOutputSize = numStats * sizeof(LockStats);
+    }
+    
+    IOFree(stats, maxStats * sizeof(LockStats));
+    
+    return result;
+}
+
+
+#pragma mark Responder
+
+IOReturn UserClientClassName::sSetResponder(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetResponder\n");
+    
+    return target->setResponder(arguments);
+}
+
+
+// A long rule table arrives as a descriptor, mapped the way executeBatch maps its commands.
+IOReturn UserClientClassName::setResponder(IOExternalMethodArguments* arguments){
+    IOMemoryDescriptor  *input = arguments->structureInputDescriptor;
+    IOMemoryMap         *map = NULL;
+    const UInt8         *table;
+    UInt32              size;
+    IOReturn            result;
+    
+    if (input){
+        if (input->getLength() > kMaxResponderSize) return kIOReturnBadArgument;
+        
+        result = input->prepare(kIODirectionOut);
+        if (result != kIOReturnSuccess) return result;
+        
+        map = input->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapReadOnly);
+        if (map == NULL){
+            input->complete(kIODirectionOut);
+            return kIOReturnVMError;
+        }
+        table = (const UInt8*)map->getVirtualAddress();
+        size = (UInt32)input->getLength();
+    } else {
+        table = (const UInt8*)arguments->structureInput;
+        size = arguments->structureInputSize;
+    }
+    
+    result = fProvider->setResponder(table, size);
+    
+    if (map){
+        map->release();
+        input->complete(kIODirectionOut);
+    }
+    
+    return result;
+}
+
+
+IOReturn UserClientClassName::sGetResponderStats(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sGetResponderStats\n");
+    
+    return target->getResponderStats(arguments->scalarInput[0] != 0, (ResponderStats*)arguments->structureOutput);
+}
+
+
+IOReturn UserClientClassName::getResponderStats(bool clear, ResponderStats* stats){
+    
+    return fProvider->getResponderStats(clear, stats);
+}
+
+
+#pragma mark Shared Rings
+
+// clientMemoryForType is called as a result of the user process calling IOConnectMapMemory.
+// Besides the rings, type kPortStatusPage maps the driver's read only status page. The caller releases the descriptor once it has been mapped, so hand back a retained reference.
+IOReturn UserClientClassName::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory){
+    IOLog("%s::%s(%u)\n", getName(), __FUNCTION__, (unsigned int)type);
+    
+    if (fProvider == NULL || isInactive()) return kIOReturnNotAttached;
+    
+    if (type == kPortStatusPage){
+        IOBufferMemoryDescriptor *status = fProvider->getStatusPage();
+        if (status == NULL) return kIOReturnNotReady;
+        
+        // Observers only ever read the page.
+        *options |= kIOMapReadOnly;
+        status->retain();
+        *memory = status;
+        return kIOReturnSuccess;
+    }
+    
+    if (type >= kNumberOfSharedRings) return kIOReturnBadArgument;
+    
+    IOBufferMemoryDescriptor *ring = fProvider->getSharedRing(type);
+    if (ring == NULL) return kIOReturnNoMemory;
+    
+    ring->retain();
+    *memory = ring;
+    
+    return kIOReturnSuccess;
+}
+
+
+IOReturn UserClientClassName::sRingDoorbell(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    
+    return target->ringDoorbell();
+}
+
+
+IOReturn UserClientClassName::ringDoorbell(void){
+    
+    fProvider->pumpSharedRings();
+    return kIOReturnSuccess;
 }
 
 
@@ -285,22 +1104,188 @@ IOReturn UserClientClassName::getInfo(void){
 IOReturn UserClientClassName::registerNotificationPort (mach_port_t port, UInt32 type, io_user_reference_t refCon){
     DEBUG_IOLog("VSPUserClient::registerNotificationPort\n");
     
-    m_notificationPort = port;
+    VSPStoreRelaxed(m_notificationPort, port);     // Senders load it once each, without a lock
+    return kIOReturnSuccess;
+}
+
+
+IOReturn UserClientClassName::sSetNotifyWindow(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetNotifyWindow\n");
+    
+    if (arguments->scalarInput[0] > kMaxNotifyWindow) return kIOReturnBadArgument;
+    
+    return target->setNotifyWindow((UInt32)arguments->scalarInput[0]);
+}
+
+
+IOReturn UserClientClassName::setNotifyWindow(UInt32 window){
+    
+    IOLockLock(fNotifyLock);
+    fNotifyWindow = window;
+    IOLockUnlock(fNotifyLock);
+    
+    return kIOReturnSuccess;
+}
+
+
+IOReturn UserClientClassName::sSetSubscription(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    IOLog("VSPUserClient::sSetSubscription\n");
+    
+    return target->setSubscription((UInt32)arguments->scalarInput[0], arguments->scalarInput[1]);
+}
+
+
+IOReturn UserClientClassName::setSubscription(UInt32 stateMask, UInt64 fieldMask){
+    
+    IOLockLock(fNotifyLock);
+    VSPStoreRelaxed(fStateMask, stateMask);
+    VSPStoreRelaxed(fFieldMask, fieldMask);
+    IOLockUnlock(fNotifyLock);
+    
+    return kIOReturnSuccess;
+}
+
+
+IOReturn UserClientClassName::sGetCredits(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments){
+    DEBUG_IOLog("VSPUserClient::sGetCredits\n");
+    
+    return target->getCredits(&arguments->scalarOutput[0], &arguments->scalarOutput[1]);
+}
+
+
+IOReturn UserClientClassName::getCredits(UInt64* limit, UInt64* sent){
+    
+    if (!fProvider) return kIOReturnNotAttached;
+    
+    VSPStoreRelaxed(fCreditsEnabled, true);
+    fProvider->getCredits(limit, sent);
     return kIOReturnSuccess;
 }
 
 
+// Pending sends are retried from fSendCall rather than from here, the caller may be the tty's own read.
+// fSendCount is read without the send lock; a send queued after the read starts fSendCall itself.
+void UserClientClassName::creditsAvailable(UInt64 limit, UInt64 sent){
+    
+    if (VSPLoadRelaxed(fCreditsEnabled))
+        sendCredits(limit, sent);
+    if (VSPLoadRelaxed(fSendCount))
+        thread_call_enter(fSendCall);
+}
+
+
+void UserClientClassName::sendSpaceAvailable(void){
+    
+    if (VSPLoadRelaxed(fSendCount))
+        thread_call_enter(fSendCall);
+}
+
+
+// Either send the delta now, or start the window if one isn't already running. Everything that
+// changes before the window closes goes out in the same message. Changes this client hasn't
+// subscribed to are dropped here, before any work is done. The masks are read without the lock,
+// a change racing with setSubscription may go either way.
+void UserClientClassName::portChanged(UInt32 stateDelta, UInt64 fields){
+    bool    sendNow = false;
+    UInt64  deadline;
+    
+    if (fNotifyLock == NULL) return;
+    if (!(stateDelta & VSPLoadRelaxed(fStateMask)) &&
+        !(fields & VSPLoadRelaxed(fFieldMask) & ~(1ULL << kPortFieldState))) return;
+    
+    IOLockLock(fNotifyLock);
+    if (fNotifyWindow == 0){
+        sendNow = true;
+    } else if (!fNotifyPending){
+        fNotifyPending = true;
+        clock_interval_to_deadline(fNotifyWindow, kMicrosecondScale, &deadline);
+        thread_call_enter_delayed(fNotifyTimer, deadline);
+    }
+    IOLockUnlock(fNotifyLock);
+    
+    if (sendNow)
+        sendPortDelta();
+}
+
+
+void UserClientClassName::notifyTimerFired(thread_call_param_t owner, thread_call_param_t unused){
+    UserClientClassName *target = (UserClientClassName*)owner;
+    
+    IOLockLock(target->fNotifyLock);
+    target->fNotifyPending = false;
+    IOLockUnlock(target->fNotifyLock);
+    
+    target->sendPortDelta();
+}
+
+
+// Called with fNotifyLock held. Values are indexed by kPortField... and come from the driver's
+// status page, so they are a consistent snapshot rather than a read of fPort while it changes.
+void UserClientClassName::readPortFields(UInt64* values){
+    
+    fProvider->readStatus(values);
+}
+
+
+IOReturn UserClientClassName::sendPortDelta(void){
+    PortDeltaNotification   notification;
+    UInt64                  values[kNumberOfPortFields];
+    UInt64                  changed = 0;
+    UInt32                  numValues = 0;
+    mach_msg_size_t         size;
+    mach_port_t             port = VSPLoadRelaxed(m_notificationPort);
+    
+    if ((port == MACH_PORT_NULL) || (fProvider == NULL)) return kIOReturnError;
+    
+    // Compare and update under the lock so that two senders can't both report the same change,
+    // or report an older value after a newer one.
+    IOLockLock(fNotifyLock);
+    readPortFields(values);
+    for (UInt32 field = 0; field < kNumberOfPortFields; field++){
+        bool subscribed = (field == kPortFieldState) ? ((values[field] ^ fLastSent[field]) & fStateMask)
+                                                     : (fFieldMask & (1ULL << field));
+        
+        if (subscribed && (values[field] != fLastSent[field])){
+            changed |= (1ULL << field);
+            notification.Values[numValues++] = values[field];
+            fLastSent[field] = values[field];
+        }
+    }
+    if (changed)
+        notification.Sequence = ++fNotifySequence;
+    IOLockUnlock(fNotifyLock);
+    
+    if (!changed) return kIOReturnSuccess;
+    
+    size = (mach_msg_size_t)(offsetof(PortDeltaNotification, Values) + (numValues * sizeof(UInt64)));
+    
+    // Set up the standard mach_msg_header_t fields.
+    notification.messageHeader.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+    notification.messageHeader.msgh_size = size;
+    notification.messageHeader.msgh_remote_port = port;
+    notification.messageHeader.msgh_local_port = MACH_PORT_NULL;
+    notification.messageHeader.msgh_reserved = 0;
+    
+    notification.messageHeader.msgh_id = kPortDeltaID;
+    notification.ChangedFields = changed;
+    
+    // Send the request to user space
+    return mach_msg_send_from_kernel(&notification.messageHeader, size);
+}
+
+
 IOReturn UserClientClassName::sendPortState(UInt32 state){
     DEBUG_IOLog("VSPUserClient::portStateNotification\n");
     PortStateNotification   notification;
     IOReturn                result;
+    mach_port_t             port = VSPLoadRelaxed(m_notificationPort);
     
-    if (m_notificationPort == MACH_PORT_NULL) return kIOReturnError;
+    if (port == MACH_PORT_NULL) return kIOReturnError;
     
     // Set up the standard mach_msg_header_t fields.
     notification.messageHeader.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
     notification.messageHeader.msgh_size = sizeof(PortStateNotification);
-    notification.messageHeader.msgh_remote_port = m_notificationPort;
+    notification.messageHeader.msgh_remote_port = port;
     notification.messageHeader.msgh_local_port = MACH_PORT_NULL;
     notification.messageHeader.msgh_reserved = 0;
     
@@ -318,34 +1303,87 @@ IOReturn UserClientClassName::sendPortState(UInt32 state){
 IOReturn UserClientClassName::sendPortInfo(void){
     DEBUG_IOLog("VSPUserClient::portInfoNotification\n");
     PortInfoNotification    notification;
+    UInt64                  values[kNumberOfPortFields];
     IOReturn                result;
+    mach_port_t             port = VSPLoadRelaxed(m_notificationPort);
     
-    if (m_notificationPort == MACH_PORT_NULL) return kIOReturnError;
+    if (port == MACH_PORT_NULL) return kIOReturnError;
     
     // Set up the standard mach_msg_header_t fields.
     notification.messageHeader.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
     notification.messageHeader.msgh_size = sizeof(PortInfoNotification);
-    notification.messageHeader.msgh_remote_port = m_notificationPort;
+    notification.messageHeader.msgh_remote_port = port;
     notification.messageHeader.msgh_local_port = MACH_PORT_NULL;
     notification.messageHeader.msgh_reserved = 0;
     
-    // Fill in the port info
+    // Fill in the port info from a consistent snapshot
+    fProvider->readStatus(values);
     notification.messageHeader.msgh_id = kPortInfoID;
-    notification.CharLength = fProvider->fPort.CharLength;
-    notification.StopBits = fProvider->fPort.StopBits;
-    notification.TX_Parity = fProvider->fPort.TX_Parity;
-    notification.RX_Parity = fProvider->fPort.RX_Parity;
-    notification.BaudRate = fProvider->fPort.BaudRate;
-    notification.MinLatency = fProvider->fPort.MinLatency;
-    notification.XONchar = fProvider->fPort.XONchar;
-    notification.XOFFchar = fProvider->fPort.XOFFchar;
-    notification.FlowControl = fProvider->fPort.FlowControl;
-    notification.FlowControlState = fProvider->fPort.FlowControlState;
-    notification.RXOstate = fProvider->fPort.RXOstate;
-    notification.TXOstate = fProvider->fPort.TXOstate;
+    notification.CharLength = values[kPortFieldCharLength];
+    notification.StopBits = values[kPortFieldStopBits];
+    notification.TX_Parity = values[kPortFieldTXParity];
+    notification.RX_Parity = values[kPortFieldRXParity];
+    notification.BaudRate = values[kPortFieldBaudRate];
+    notification.MinLatency = values[kPortFieldMinLatency];
+    notification.XONchar = values[kPortFieldXONchar];
+    notification.XOFFchar = values[kPortFieldXOFFchar];
+    notification.FlowControl = values[kPortFieldFlowControl];
+    notification.FlowControlState = values[kPortFieldFlowControlState];
+    notification.RXOstate = values[kPortFieldRXOstate];
+    notification.TXOstate = values[kPortFieldTXOstate];
+    notification.RXOverflowPolicy = values[kPortFieldRXOverflowPolicy];
+    notification.RXOverRuns = values[kPortFieldRXOverRuns];
     
     // Send the request to user space
     result = mach_msg_send_from_kernel(&notification.messageHeader, sizeof(PortInfoNotification));
     return result;
 }
 
+
+IOReturn UserClientClassName::sendCredits(UInt64 limit, UInt64 sent){
+    DEBUG_IOLog("VSPUserClient::sendCredits\n");
+    CreditNotification  notification;
+    IOReturn            result;
+    mach_port_t         port = VSPLoadRelaxed(m_notificationPort);
+    
+    if (port == MACH_PORT_NULL) return kIOReturnError;
+    
+    // Set up the standard mach_msg_header_t fields.
+    notification.messageHeader.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+    notification.messageHeader.msgh_size = sizeof(CreditNotification);
+    notification.messageHeader.msgh_remote_port = port;
+    notification.messageHeader.msgh_local_port = MACH_PORT_NULL;
+    notification.messageHeader.msgh_reserved = 0;
+    
+    notification.messageHeader.msgh_id = kCreditID;
+    notification.Limit = limit;
+    notification.Sent = sent;
+    
+    // Send the request to user space
+    result = mach_msg_send_from_kernel(&notification.messageHeader, sizeof(CreditNotification));
+    return result;
+}
+
+
+IOReturn UserClientClassName::sendRingWakeup(UInt32 ring){
+    DEBUG_IOLog("VSPUserClient::sendRingWakeup\n");
+    RingWakeupNotification  notification;
+    IOReturn                result;
+    mach_port_t             port = VSPLoadRelaxed(m_notificationPort);
+    
+    if (port == MACH_PORT_NULL) return kIOReturnError;
+    
+    // Set up the standard mach_msg_header_t fields.
+    notification.messageHeader.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+    notification.messageHeader.msgh_size = sizeof(RingWakeupNotification);
+    notification.messageHeader.msgh_remote_port = port;
+    notification.messageHeader.msgh_local_port = MACH_PORT_NULL;
+    notification.messageHeader.msgh_reserved = 0;
+    
+    notification.messageHeader.msgh_id = kRingWakeupID;
+    notification.Ring = ring;
+    
+    // Send the request to user space
+    result = mach_msg_send_from_kernel(&notification.messageHeader, sizeof(RingWakeupNotification));
+    return result;
+}
@@ -7,11 +7,34 @@
 #define VSP_CLIENT_H
 
 #include <IOKit/IOUserClient.h>
+#include <kern/thread_call.h>
 #include "VirtualSerialPort.h"
 
 
 class VirtualSerialPort;
 
+
+typedef struct{
+    OSAsyncReference64  reference;
+    IOMemoryDescriptor  *memory;        // The caller's buffer, prepared
+    IOMemoryMap         *map;           // ...and mapped into the kernel
+    UInt8               *buffer;
+    UInt32              size;
+    UInt32              minimum;
+    UInt32              count;
+    UInt64              deadline;       // Absolute time, 0 for none
+}PendingRead;
+
+
+typedef struct{
+    OSAsyncReference64  reference;
+    IOMemoryDescriptor  *memory;        // The caller's buffer, prepared, or NULL if buffer is a copy
+    IOMemoryMap         *map;           // ...and mapped into the kernel
+    UInt8               *buffer;
+    UInt32              size;
+    UInt32              count;
+}PendingSend;
+
 #define UserClientClassName VSPUserClient
 
 class UserClientClassName : public IOUserClient{
@@ -22,6 +45,36 @@ protected:
     VirtualSerialPort*  fProvider;
     task_t              fTask;
     mach_port_t         m_notificationPort;
+    
+    // Asynchronous reads, completed in the order they were posted.
+    IOLock              *fReadLock;
+    PendingRead         fReads[kMaxPendingReads];
+    UInt32              fReadHead;
+    UInt32              fReadCount;
+    thread_call_t       fReadTimer;
+    
+    // Asynchronous sends, also completed in order. fSendCall retries them once the tty has drained the RX queue.
+    IOLock              *fSendLock;
+    PendingSend         fSends[kMaxPendingSends];
+    UInt32              fSendHead;
+    UInt32              fSendCount;
+    thread_call_t       fSendCall;
+    
+    // Delta notifications. fLastSent is what the client has been told, changes are
+    // collected for fNotifyWindow microseconds before a PortDeltaNotification is built.
+    IOLock              *fNotifyLock;
+    thread_call_t       fNotifyTimer;
+    UInt32              fNotifyWindow;
+    bool                fNotifyPending;
+    UInt64              fNotifySequence;
+    UInt64              fLastSent[kNumberOfPortFields];
+    
+    // Subscription, only changes to these state bits and kPortField... fields are sent.
+    UInt32              fStateMask;
+    UInt64              fFieldMask;
+    
+    // Set once the client has asked for send credit.
+    bool                fCreditsEnabled;
 
     static const IOExternalMethodDispatch	sMethods[kNumberOfMethods];
       
@@ -37,6 +90,23 @@ public:
     // for sending data back to VSPTester
     IOReturn sendPortInfo(void);
     IOReturn sendPortState(UInt32 state);
+    IOReturn sendRingWakeup(UInt32 ring);
+    IOReturn sendCredits(UInt64 limit, UInt64 sent);
+    
+    // Called by VirtualSerialPort when the tty has written data, or has closed the port.
+    void dataAvailable(void);
+    void portClosed(void);
+    
+    // Called by VirtualSerialPort, once it has dropped RXBufferLock, when the RX queue drains below low water.
+    void creditsAvailable(UInt64 limit, UInt64 sent);
+    
+    // Called by VirtualSerialPort, with RXBufferLock held, when the tty makes room after a send came up short.
+    void sendSpaceAvailable(void);
+    
+    // Called by VirtualSerialPort, without its state lock held, when the port state or configuration changes.
+    void portChanged(UInt32 stateDelta, UInt64 fields);
+    
+    virtual void free(void) override;
     
     // only for testing
     virtual bool terminate(IOOptionBits options = 0) override;
@@ -58,6 +128,68 @@ protected:
     static  IOReturn sSendData(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
     virtual IOReturn send(TRBufferStruct* inStruct, UInt32* sendCount);
     
+    static  IOReturn sSendBuffer(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn sendBuffer(IOExternalMethodArguments* arguments);
+    
+    static  IOReturn sSetOverflowPolicy(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setOverflowPolicy(UInt32 policy);
+    
+    static  IOReturn sSetFraming(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setFraming(UInt32 mode, UInt32 parameter, UInt32 maxSize);
+    
+    static  IOReturn sSendEvent(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn sendEvent(UInt32 event, UInt32 data);
+    
+    static  IOReturn sSetLineFormat(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setLineFormat(UInt32 charLength, UInt32 parity);
+    
+    static  IOReturn sSetFaults(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setFaults(UInt32 direction, const FaultConfig* config);
+    
+    static  IOReturn sGetLockStats(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn getLockStats(IOExternalMethodArguments* arguments);
+    
+    static  IOReturn sSetResponder(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setResponder(IOExternalMethodArguments* arguments);
+    
+    static  IOReturn sGetResponderStats(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn getResponderStats(bool clear, ResponderStats* stats);
+    
+    static  IOReturn sRingDoorbell(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn ringDoorbell(void);
+    
+    // map the shared RX and TX rings into VSPTester
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) override;
+    
+    static  IOReturn sReadAsync(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn readAsync(IOExternalMethodArguments* arguments);
+    void    completeReads(IOReturn status, bool all);
+    void    finishRead(PendingRead* read, IOReturn status);
+    void    armReadTimer(void);
+    static  void readTimerFired(thread_call_param_t owner, thread_call_param_t unused);
+    
+    IOReturn queueSend(IOExternalMethodArguments* arguments, IOMemoryDescriptor* memory, IOMemoryMap* map,
+                       UInt8* buffer, UInt32 size, UInt32* sendCount);
+    void    pumpSends(void);
+    void    completeSends(IOReturn status);
+    void    finishSend(PendingSend* send, IOReturn status);
+    static  void sendCallFired(thread_call_param_t owner, thread_call_param_t unused);
+    
+    static  IOReturn sExecuteBatch(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn executeBatch(IOExternalMethodArguments* arguments);
+    
+    static  IOReturn sSetSubscription(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setSubscription(UInt32 stateMask, UInt64 fieldMask);
+    
+    static  IOReturn sGetCredits(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn getCredits(UInt64* limit, UInt64* sent);
+    
+    static  IOReturn sSetNotifyWindow(UserClientClassName* target, void* reference, IOExternalMethodArguments* arguments);
+    virtual IOReturn setNotifyWindow(UInt32 window);
+    void    readPortFields(UInt64* values);
+    IOReturn sendPortDelta(void);
+    static  void notifyTimerFired(thread_call_param_t owner, thread_call_param_t unused);
+    
     // register a notification callback from VSPTester
     virtual IOReturn registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon) override;
 };
@@ -5,6 +5,7 @@
 
 #include <IOKit/IOLib.h>
 #include <IOKit/serial/IORS232SerialStreamSync.h>
+#include <libkern/OSAtomic.h>
 #include "VirtualSerialPort.h"
 
 // Define the superclass.
@@ -17,7 +18,27 @@ bool DriverClassName::start(IOService *provider){
     
     fTerminate = false;
     fStopping = false;
-    client = NULL;
+    fNumClients = 0;
+    fClientLock = NULL;
+    RXBufferLock = NULL;
+    TXBufferLock = NULL;
+    fStatusMemory = NULL;
+    fStatus = NULL;
+    fStatusLock = NULL;
+    fBatchLock = NULL;
+    fWheelStarted = false;
+    fRXReaders = 0;
+    fSendWaiting = false;
+    fCreditsDue = false;
+    fResponderLock = NULL;
+    fResponder = NULL;
+    InitTimer(&fHoldTimer[kFaultsToTTY], &DriverClassName::rxHoldExpired, this, NULL);
+    InitTimer(&fHoldTimer[kFaultsFromTTY], &DriverClassName::txHoldExpired, this, NULL);
+    InitTimer(&fResponderTimer, &DriverClassName::responderTimerFired, this, NULL);
+    for (int ring = 0; ring < kNumberOfSharedRings; ring++){
+        fSharedMemory[ring] = NULL;
+        fShared[ring] = NULL;
+    }
     
     initStructure();
     
@@ -69,12 +90,12 @@ IOReturn DriverClassName::acquirePort(bool sleep, void *refCon){
     
     UInt32 	busyState = 0;
     
+    if (!fPort.serialRequestLock) return kIOReturnNotReady;
+    
     retain(); 								// Hold reference till releasePort(), unless we fail to acquire
     while (true){
-        busyState = (readPortState() & PD_S_ACQUIRED);
-        if (!busyState){
-            // Set busy bit (acquired), and clear everything else
-            writePortState(PD_S_ACQUIRED | DEFAULT_STATE, STATE_ALL);
+        // Set busy bit (acquired), and clear everything else, unless someone beat us to it
+        if (testAndSetPortState(PD_S_ACQUIRED, PD_S_ACQUIRED | DEFAULT_STATE, STATE_ALL)){
             break;
         } else {
             if (!sleep){
@@ -93,11 +114,48 @@ IOReturn DriverClassName::acquirePort(bool sleep, void *refCon){
         }
     }
     
+    // A reader from the last session can still be on its way out of dequeueData, so empty the
+    // queues under their locks. What was left is counted out, or the credit a client was owed
+    // for it would never come back.
+    if (TXBufferLock){
+        VSPLockLock(TXBufferLock);
+        VSPAddRelaxed(fPort.TXStats.BytesOut, UsedSpaceinQueue(&fPort.TX));
+        ResetQueue(&fPort.TX);
+        resetEvents(&fPort.TXEvents);
+        CancelTimer(&fHoldTimer[kFaultsFromTTY]);
+        resetFaults(&fPort.TXFaults);
+        VSPLockUnlock(TXBufferLock);
+    }
+    if (RXBufferLock){
+        VSPLockLock(RXBufferLock);
+        VSPAddRelaxed(fPort.RXStats.BytesOut, UsedSpaceinQueue(&fPort.RX));
+        ResetQueue(&fPort.RX);
+        resetFrames();
+        resetEvents(&fPort.RXEvents);
+        CancelTimer(&fHoldTimer[kFaultsToTTY]);
+        resetFaults(&fPort.RXFaults);
+        VSPLockUnlock(RXBufferLock);
+    }
+    
+    // The rings were given back when the last owner released the port, take default sized ones.
+    if ((resizeQueue(&fPort.TX, &fPort.TXStats, TXBufferLock, kMaxCirBufferSize) != kIOReturnSuccess) ||
+        (resizeQueue(&fPort.RX, &fPort.RXStats, RXBufferLock, kMaxCirBufferSize) != kIOReturnSuccess)){
+        freeRingBuffer(&fPort.TX, &fPort.TXStats, TXBufferLock);
+        freeRingBuffer(&fPort.RX, &fPort.RXStats, RXBufferLock);
+        writePortState(0, STATE_ALL);
+        release();
+        return kIOReturnNoMemory;
+    }
     setStructureDefaults();
-    ResetQueue(&fPort.TX);
-    ResetQueue(&fPort.RX);
+    fPort.RXStats.OverRun = false;
+    VSPStoreRelaxed(fPort.RXStats.OverRunCount, 0);
+    fPort.TXStats.OverRun = false;
+    VSPStoreRelaxed(fPort.TXStats.OverRunCount, 0);
+    VSPStoreRelaxed(fPort.RXParityErrors, 0);
+    VSPStoreRelaxed(fPort.RXFramingErrors, 0);
     
     writePortState(PD_RS232_S_CTS, PD_RS232_S_CTS);
+    notifyCredits();                // The credit limit moves with the new RX queue
     
     DEBUG_IOLog("VirtualSerialPort::acquirePort - OK\n");
     
@@ -121,7 +179,40 @@ IOReturn DriverClassName::releasePort(void *refCon){
     
     writePortState(0, STATE_ALL);   // Clear the entire state word
     
+    VSPLockLock(fPort.serialRequestLock);
     fPort.WatchStateMask = 0;
+    VSPLockUnlock(fPort.serialRequestLock);
+    
+    // Nothing will drain the RX queue now, so release any sender blocked on it.
+    if (RXBufferLock){
+        VSPLockLock(RXBufferLock);
+        VSPLockWakeup(RXBufferLock, &fPort.RX, false);
+        VSPLockWakeup(RXBufferLock, &fRXReaders, false);     // and any reader waiting for data
+        VSPLockUnlock(RXBufferLock);
+    }
+    
+    if (TXBufferLock){
+        VSPLockLock(TXBufferLock);
+        VSPLockWakeup(TXBufferLock, &fPort.TX, false);
+        VSPLockUnlock(TXBufferLock);
+    }
+    
+    // Finish off any reads the clients have waiting, there will be no more data.
+    notifyPortClosed();
+    
+    // Responses still waiting were for this session's tty, and so was any message half written.
+    if (fResponderLock){
+        VSPLockLock(fResponderLock);
+        CancelTimer(&fResponderTimer);
+        if (fResponder)
+            ResetResponder(fResponder);
+        VSPLockUnlock(fResponderLock);
+    }
+    
+    // An idle port holds no queue memory, acquirePort takes the rings again.
+    freeRingBuffer(&fPort.RX, &fPort.RXStats, RXBufferLock);
+    freeRingBuffer(&fPort.TX, &fPort.TXStats, TXBufferLock);
+    updateStatus();
     
     release();                      // Dispose of the self-reference we took in acquirePort()
     
@@ -147,7 +238,7 @@ IOReturn DriverClassName::setState(UInt32 state, UInt32 mask, void *refCon){
     
     if (readPortState() & PD_S_ACQUIRED ){
         // ignore any bits that are read-only
-        mask &= (~fPort.FlowControl & PD_RS232_A_MASK) | PD_S_MASK;
+        mask &= (~VSPLoadRelaxed(fPort.FlowControl) & PD_RS232_A_MASK) | PD_S_MASK;
         if (mask)
             writePortState(state, mask);
         
@@ -166,7 +257,17 @@ UInt32 DriverClassName::getState(void *refCon){
     if (fTerminate || fStopping)
         return 0;
     
-    checkQueues();
+    if (TXBufferLock){
+        VSPLockLock(TXBufferLock);
+        checkQueue(&fPort.TX);
+        VSPLockUnlock(TXBufferLock);
+    }
+    if (RXBufferLock){
+        VSPLockLock(RXBufferLock);
+        checkQueue(&fPort.RX);
+        VSPLockUnlock(RXBufferLock);
+        sendCreditsDue();
+    }
     
     return (readPortState() & EXTERNAL_MASK);
 }
@@ -232,32 +333,50 @@ IOReturn DriverClassName::executeEvent(UInt32 event, UInt32 data, void *refCon){
             }
             break;
         case PD_RS232_E_XON_BYTE:
-            fPort.XONchar = data;
+            if (data > 0xFF){
+                ret = kIOReturnBadArgument;
+            } else {
+                VSPStoreRelaxed(fPort.XONchar, data);
+            }
             break;
         case PD_RS232_E_XOFF_BYTE:
-            fPort.XOFFchar = data;
+            if (data > 0xFF){
+                ret = kIOReturnBadArgument;
+            } else {
+                VSPStoreRelaxed(fPort.XOFFchar, data);
+            }
             break;
         case PD_E_SPECIAL_BYTE:
-            fPort.SWspecial[ data >> SPECIAL_SHIFT ] |= (1 << (data & SPECIAL_MASK));
+            // data arrives unchecked from user space through kExecuteBatch, and indexes SWspecial.
+            if (data > 0xFF){
+                ret = kIOReturnBadArgument;
+            } else {
+                fPort.SWspecial[ data >> SPECIAL_SHIFT ] |= (1 << (data & SPECIAL_MASK));
+            }
             break;
         case PD_E_VALID_DATA_BYTE:
-            fPort.SWspecial[ data >> SPECIAL_SHIFT ] &= ~(1 << (data & SPECIAL_MASK));
+            if (data > 0xFF){
+                ret = kIOReturnBadArgument;
+            } else {
+                fPort.SWspecial[ data >> SPECIAL_SHIFT ] &= ~(1 << (data & SPECIAL_MASK));
+            }
             break;
         case PD_E_FLOW_CONTROL:
-            fPort.FlowControl = data;
+            VSPStoreRelaxed(fPort.FlowControl, data);
             break;
         case PD_E_DATA_LATENCY:
-            fPort.DataLatInterval = long2tval(data * 1000);
+            VSPStoreRelaxed(fPort.DataLatency, (UInt64)data * 1000);
             break;
         case PD_RS232_E_MIN_LATENCY:
-            fPort.MinLatency = bool(data);
+            VSPStoreRelaxed(fPort.MinLatency, bool(data));
             break;
         case PD_E_DATA_INTEGRITY:
             if ((data < PD_RS232_PARITY_NONE) || (data > PD_RS232_PARITY_SPACE)){
                 ret = kIOReturnBadArgument;
             } else {
-                fPort.TX_Parity = data;
-                fPort.RX_Parity = PD_RS232_PARITY_DEFAULT;
+                VSPStoreRelaxed(fPort.TX_Parity, data);
+                VSPStoreRelaxed(fPort.RX_Parity, PD_RS232_PARITY_DEFAULT);
+                setLineCoding();
             }
             break;
         case PD_E_DATA_RATE:
@@ -265,7 +384,7 @@ IOReturn DriverClassName::executeEvent(UInt32 event, UInt32 data, void *refCon){
             if ((data < MIN_BAUD) || (data > kMaxBaudRate)){
                 ret = kIOReturnBadArgument;
             } else {
-                fPort.BaudRate = data;
+                VSPStoreRelaxed(fPort.BaudRate, data);
             }
             break;
         case PD_E_DATA_SIZE:
@@ -273,14 +392,15 @@ IOReturn DriverClassName::executeEvent(UInt32 event, UInt32 data, void *refCon){
             if ((data < 5) || (data > 8)){
                 ret = kIOReturnBadArgument;
             } else {
-                fPort.CharLength = data;
+                VSPStoreRelaxed(fPort.CharLength, data);
+                setLineCoding();
             }
             break;
         case PD_RS232_E_STOP_BITS:
             if ((data < 0) || (data > 20)){
                 ret = kIOReturnBadArgument;
             } else {
-                fPort.StopBits = data;
+                VSPStoreRelaxed(fPort.StopBits, data);
             }
             break;
         case PD_E_RXQ_FLUSH:
@@ -289,7 +409,8 @@ IOReturn DriverClassName::executeEvent(UInt32 event, UInt32 data, void *refCon){
             if ((data != PD_RS232_PARITY_DEFAULT) &&  (data != PD_RS232_PARITY_ANY)){
                 ret = kIOReturnBadArgument;
             } else {
-                fPort.RX_Parity = data;
+                VSPStoreRelaxed(fPort.RX_Parity, data);
+                setLineCoding();
             }
             break;
         case PD_E_RX_DATA_RATE:
@@ -311,18 +432,32 @@ IOReturn DriverClassName::executeEvent(UInt32 event, UInt32 data, void *refCon){
             break;
         case PD_RS232_E_LINE_BREAK:
             state &= ~PD_RS232_S_BRK;
+            if (data) state |= PD_RS232_S_BRK;
             delta |= PD_RS232_S_BRK;
             writePortState(state, delta);
             break;
         case PD_E_DELAY:
-            fPort.CharLatInterval = long2tval(data * 1000);
+            VSPStoreRelaxed(fPort.CharLatency, (UInt64)data * 1000);
             break;
         case PD_E_RXQ_SIZE:
+            ret = resizeQueue(&fPort.RX, &fPort.RXStats, RXBufferLock, data);
+            if (ret == kIOReturnSuccess)
+                notifyCredits();            // The credit limit moves with the queue size
+            break;
         case PD_E_TXQ_SIZE:
+            ret = resizeQueue(&fPort.TX, &fPort.TXStats, TXBufferLock, data);
+            break;
         case PD_E_RXQ_HIGH_WATER:
+            ret = setWaterMarks(&fPort.RX, &fPort.RXStats, RXBufferLock, data, fPort.RXStats.LowWater);
+            break;
         case PD_E_RXQ_LOW_WATER:
+            ret = setWaterMarks(&fPort.RX, &fPort.RXStats, RXBufferLock, fPort.RXStats.HighWater, data);
+            break;
         case PD_E_TXQ_HIGH_WATER:
+            ret = setWaterMarks(&fPort.TX, &fPort.TXStats, TXBufferLock, data, fPort.TXStats.LowWater);
+            break;
         case PD_E_TXQ_LOW_WATER:
+            ret = setWaterMarks(&fPort.TX, &fPort.TXStats, TXBufferLock, fPort.TXStats.HighWater, data);
             break;
         default:
             ret = kIOReturnBadArgument;
@@ -330,7 +465,9 @@ IOReturn DriverClassName::executeEvent(UInt32 event, UInt32 data, void *refCon){
     }
     
     debugEvent("executeEvent - ", event, data);
-    if(client) client->sendPortInfo();
+    updateStatus();
+    if (ret == kIOReturnSuccess)
+        notifyPortChanged(0, eventFields(event));
     return ret;
 }
 
@@ -345,29 +482,29 @@ IOReturn DriverClassName::requestEvent(UInt32 event, UInt32 *data, void *refCon)
     
     switch (event) {
         case PD_E_ACTIVE:               *data = bool(readPortState() & PD_S_ACTIVE);                    break;
-        case PD_E_FLOW_CONTROL:         *data = fPort.FlowControl;                                      break;
-        case PD_E_DELAY:                *data = (UInt32)tval2long(fPort.CharLatInterval)/1000;          break;
-        case PD_E_DATA_LATENCY:         *data = (UInt32)tval2long(fPort.DataLatInterval)/1000;          break;
-        case PD_E_TXQ_SIZE:             *data = GetQueueSize(&fPort.TX);                                break;
-        case PD_E_RXQ_SIZE:             *data = GetQueueSize(&fPort.RX);                                break;
-        case PD_E_TXQ_LOW_WATER:        *data = (UInt32)fPort.TXStats.LowWater;  ret = kIOReturnBadArgument;    break;
-        case PD_E_RXQ_LOW_WATER:        *data = (UInt32)fPort.RXStats.LowWater;  ret = kIOReturnBadArgument;    break;
-        case PD_E_TXQ_HIGH_WATER:       *data = (UInt32)fPort.TXStats.HighWater; ret = kIOReturnBadArgument;    break;
-        case PD_E_RXQ_HIGH_WATER:       *data = (UInt32)fPort.RXStats.HighWater; ret = kIOReturnBadArgument;    break;
-        case PD_E_TXQ_AVAILABLE:        *data = FreeSpaceinQueue(&fPort.TX);                            break;
-        case PD_E_RXQ_AVAILABLE:        *data = UsedSpaceinQueue(&fPort.RX);                            break;
-        case PD_E_DATA_RATE:            *data = fPort.BaudRate << 1;                                    break;
+        case PD_E_FLOW_CONTROL:         *data = VSPLoadRelaxed(fPort.FlowControl);                      break;
+        case PD_E_DELAY:                *data = (UInt32)(VSPLoadRelaxed(fPort.CharLatency)/1000);       break;
+        case PD_E_DATA_LATENCY:         *data = (UInt32)(VSPLoadRelaxed(fPort.DataLatency)/1000);       break;
+        case PD_E_TXQ_SIZE:
+        case PD_E_TXQ_LOW_WATER:
+        case PD_E_TXQ_HIGH_WATER:
+        case PD_E_TXQ_AVAILABLE:        *data = readQueueEvent(&fPort.TX, &fPort.TXStats, TXBufferLock, event);    break;
+        case PD_E_RXQ_SIZE:
+        case PD_E_RXQ_LOW_WATER:
+        case PD_E_RXQ_HIGH_WATER:
+        case PD_E_RXQ_AVAILABLE:        *data = readQueueEvent(&fPort.RX, &fPort.RXStats, RXBufferLock, event);    break;
+        case PD_E_DATA_RATE:            *data = VSPLoadRelaxed(fPort.BaudRate) << 1;                    break;
         case PD_E_RX_DATA_RATE:         *data = 0;                                                      break;
-        case PD_E_DATA_SIZE:            *data = fPort.CharLength << 1;                                  break;
+        case PD_E_DATA_SIZE:            *data = VSPLoadRelaxed(fPort.CharLength) << 1;                  break;
         case PD_E_RX_DATA_SIZE:         *data = 0;                                                      break;
-        case PD_E_DATA_INTEGRITY:       *data = fPort.TX_Parity;                                        break;
-        case PD_E_RX_DATA_INTEGRITY:    *data = 0;                                                      break;
-        case PD_RS232_E_STOP_BITS:      *data = fPort.StopBits << 1;                                    break;
+        case PD_E_DATA_INTEGRITY:       *data = VSPLoadRelaxed(fPort.TX_Parity);                        break;
+        case PD_E_RX_DATA_INTEGRITY:    *data = VSPLoadRelaxed(fPort.RX_Parity);                        break;
+        case PD_RS232_E_STOP_BITS:      *data = VSPLoadRelaxed(fPort.StopBits);                         break;
         case PD_RS232_E_RX_STOP_BITS:   *data = 0;                                                      break;
-        case PD_RS232_E_XON_BYTE:       *data = fPort.XONchar;                                          break;
-        case PD_RS232_E_XOFF_BYTE:      *data = fPort.XOFFchar;                                         break;
+        case PD_RS232_E_XON_BYTE:       *data = VSPLoadRelaxed(fPort.XONchar);                          break;
+        case PD_RS232_E_XOFF_BYTE:      *data = VSPLoadRelaxed(fPort.XOFFchar);                         break;
         case PD_RS232_E_LINE_BREAK:     *data = bool(readPortState() & PD_RS232_S_BRK);                 break;
-        case PD_RS232_E_MIN_LATENCY:    *data = bool(fPort.MinLatency);                                 break;
+        case PD_RS232_E_MIN_LATENCY:    *data = VSPLoadRelaxed(fPort.MinLatency);                       break;
         default :                       *data = 0;                               ret = kIOReturnBadArgument;    break;
     }
    
@@ -376,43 +513,180 @@ IOReturn DriverClassName::requestEvent(UInt32 event, UInt32 *data, void *refCon)
 }
 
 
-#pragma mark enqueueEvent - Not Used. Events are passed to executeEvent
+// A queue's size, water marks or room, read under its lock so they agree with resizeQueue and setWaterMarks.
+UInt32 DriverClassName::readQueueEvent(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock, UInt32 event){
+    UInt32  value = 0;
+    
+    if (Lock == NULL) return 0;
+    
+    VSPLockLock(Lock);
+    switch (event){
+        case PD_E_TXQ_SIZE:
+        case PD_E_RXQ_SIZE:             value = GetQueueSize(Queue);                                    break;
+        case PD_E_TXQ_LOW_WATER:
+        case PD_E_RXQ_LOW_WATER:        value = (UInt32)Marks->LowWater;                                break;
+        case PD_E_TXQ_HIGH_WATER:
+        case PD_E_RXQ_HIGH_WATER:       value = (UInt32)Marks->HighWater;                               break;
+        case PD_E_TXQ_AVAILABLE:        value = FreeSpaceinQueue(Queue);                                break;
+        case PD_E_RXQ_AVAILABLE:        value = readableRX();                                           break;
+    }
+    VSPLockUnlock(Lock);
+    
+    return value;
+}
+
+
+#pragma mark enqueueEvent
 
-// Not used by this driver. Events are passed on to executeEvent for immediate action.
+// Events go behind whatever the tty has already written, and are run by executeEvent once the client
+// has taken all of it. With nothing ahead of it, an event is run straight away.
 IOReturn DriverClassName::enqueueEvent(UInt32 event, UInt32 data, bool sleep, void *refCon){
     DEBUG_IOLog("VirtualSerialPort::enqueueEvent\n");
     
+    IOReturn    ret = kIOReturnSuccess;
+    bool        queued = false;
+    
     if (fTerminate || fStopping) return kIOReturnOffline;
+    if (!TXBufferLock) return kIOReturnNotReady;
+    
+    VSPLockLock(TXBufferLock);
+    while (eventsQueued(&fPort.TXEvents) || UsedSpaceinQueue(&fPort.TX)){
+        queued = putEvent(&fPort.TXEvents, event, data, fPort.TXStats.BytesIn);
+        if (queued)
+            break;
+        
+        if (!sleep || !(readPortState() & PD_S_ACTIVE)){
+            ret = kIOReturnNoSpace;
+            break;
+        }
+        
+        // runTXEvents and releasePort wake us.
+        if (VSPLockSleep(TXBufferLock, &fPort.TX, THREAD_ABORTSAFE) != THREAD_AWAKENED){
+            ret = kIOReturnAborted;
+            break;
+        }
+    }
+    VSPLockUnlock(TXBufferLock);
+    
+    if (ret != kIOReturnSuccess)
+        return ret;
+    if (!queued)
+        return executeEvent(event, data, refCon);
     
-    return executeEvent(event, data, refCon);
+    // The client may have caught up while we waited.
+    runTXEvents();
+    
+    return kIOReturnSuccess;
 }
 
 
-#pragma mark dequeueEvent - Not Used
+#pragma mark dequeueEvent
 
-// Not used by this driver.
+// Events from kSendEvent and RX queue overruns, each returned once the tty has read the data sent
+// before it. PD_E_EOQ when there is nothing due, unless sleep is set.
 IOReturn DriverClassName::dequeueEvent(UInt32 *event, UInt32 *data, bool sleep, void *refCon){
     //  DEBUG_IOLog("VirtualSerialPort::dequeueEvent\n");
     
+    UInt32  state;
+    
     if (fTerminate || fStopping) return kIOReturnOffline;
     if ((event == NULL) || (data == NULL)) return kIOReturnBadArgument;
-    if (readPortState() & PD_S_ACTIVE)  return kIOReturnSuccess;
     
-    return kIOReturnNotOpen;
+    *event = PD_E_EOQ;
+    *data = 0;
+    if (!(readPortState() & PD_S_ACTIVE))  return kIOReturnNotOpen;
+    if (!RXBufferLock) return kIOReturnNotReady;
+    
+    while (!takeEvent(&fPort.RXEvents, fPort.RXStats.BytesOut, event, data)){
+        if (!sleep)
+            return kIOReturnSuccess;
+        
+        // checkQueue sets PD_S_RX_EVENT once an event is due, a closed port ends the wait.
+        state = PD_S_RX_EVENT;
+        IOReturn ret = privateWatchState(&state, PD_S_RX_EVENT);
+        if (ret != kIOReturnSuccess)
+            return ret;
+    }
+    
+    VSPLockLock(RXBufferLock);
+    if (*event == PD_E_SW_OVERRUN_ERROR){
+        // Everything lost up to now, including any since the event was queued.
+        fPort.RXStats.OverRun = false;
+        *data = (UInt32)fPort.RXStats.OverRunCount;
+    }
+    checkQueue(&fPort.RX);
+    VSPLockUnlock(RXBufferLock);
+    sendCreditsDue();
+    
+    return kIOReturnSuccess;
 }
 
 
-#pragma mark enqueueData - NOT WORKING
+#pragma mark enqueueData
 
+// Data written by the tty goes into the TX queue, where the user client picks it up, either to complete
+// pending asynchronous reads or through the shared TX ring.
 IOReturn DriverClassName::enqueueData(UInt8 *buffer, UInt32 size, UInt32 *count, bool sleep, void *refCon){
-    DEBUG_IOLog("VirtualSerialPort::enqueueData\n");
+    DEBUG_IOLog("VirtualSerialPort::enqueueData %u bytes\n", size);
+    
+    IOReturn    ret = kIOReturnSuccess;
+    UInt32      added;
+    
+    if (fTerminate || fStopping) return kIOReturnOffline;
+    if ((count == NULL) || (buffer == NULL)) return kIOReturnBadArgument;
+    
     *count = 0;
-    return kIOReturnSuccess;
+    if (!(readPortState() & PD_S_ACTIVE)) return kIOReturnNotOpen;
+    if (!TXBufferLock) return kIOReturnNotReady;
+    
+    // A responder answers for the device, and unless it passes the data on the client never sees it.
+    if (respond(buffer, size)){
+        *count = size;
+        return kIOReturnSuccess;
+    }
+    
+    for (;;){
+        VSPLockLock(TXBufferLock);
+        added = addToTX(buffer + *count, size - *count);
+        *count += added;
+        VSPAddRelaxed(fPort.TXStats.BytesIn, added);
+        checkQueue(&fPort.TX);
+        VSPLockUnlock(TXBufferLock);
+        
+        // Hand the data on before we think about sleeping, the clients are what free space.
+        notifyDataAvailable();
+        pumpSharedRings();
+        
+        if ((*count == size) || !sleep)
+            break;
+        
+        // Check ACTIVE under the lock releasePort takes to wake us, or its wakeup can land
+        // between our last look and the sleep.
+        VSPLockLock(TXBufferLock);
+        if ((FreeSpaceinQueue(&fPort.TX) == 0) && (readPortState() & PD_S_ACTIVE)){
+            // receiveData, pumpSharedRings and releasePort wake us.
+            if (VSPLockSleep(TXBufferLock, &fPort.TX, THREAD_ABORTSAFE) != THREAD_AWAKENED)
+                ret = kIOReturnAborted;
+        }
+        VSPLockUnlock(TXBufferLock);
+        
+        if (ret != kIOReturnSuccess)
+            break;
+        if (fTerminate || fStopping || !(readPortState() & PD_S_ACTIVE)){
+            ret = kIOReturnNotOpen;
+            break;
+        }
+    }
+    
+    return ret;
 }
 
 
 #pragma mark dequeueData
 
+// Takes what is there and, while that is less than min, waits for more. PD_E_DATA_LATENCY bounds the
+// whole wait and PD_E_DELAY the gap between characters once the first has arrived; both are timers on
+// the shared wheel, so a thousand waiting readers cost no more than the timers that are due.
 IOReturn DriverClassName::dequeueData(UInt8 *buffer, UInt32 size, UInt32 *count, UInt32 min, void *refCon){
     //  DEBUG_IOLog("VirtualSerialPort::dequeueData\n");
     
@@ -422,16 +696,92 @@ IOReturn DriverClassName::dequeueData(UInt8 *buffer, UInt32 size, UInt32 *count,
     // If the port is not active then there should not be any chars.
     *count = 0;
     if (!(readPortState() & PD_S_ACTIVE)) return kIOReturnNotOpen;
+    if (!RXBufferLock) return kIOReturnSuccess;
+    
+    IOReturn    ret = kIOReturnSuccess;
+    UInt64      dataLatency = VSPLoadRelaxed(fPort.DataLatency);
+    UInt64      charLatency = VSPLoadRelaxed(fPort.CharLatency);
+    bool        expired = false;
+    WheelTimer  dataTimer, charTimer;
+    
+    InitTimer(&dataTimer, &DriverClassName::readTimedOut, this, &expired);
+    InitTimer(&charTimer, &DriverClassName::readTimedOut, this, &expired);
+    if (min && dataLatency)
+        ArmTimer(&dataTimer, dataLatency);
+    
+    VSPLockLock(RXBufferLock);
+    for (;;){
+        bool    pulled, wakeup = false;
+        UInt32  got, want;
         
-    if (RXBufferLock){
-        IOLockLock(RXBufferLock);
-        *count = RemovefromQueue(&fPort.RX, buffer, size);
-        if(*count)
-            checkQueues();
-        IOLockUnlock(RXBufferLock);
+        // Stop short of the next event, so the tty can take it in order, and of bytes jitter is holding back.
+        want = bytesBeforeEvent(&fPort.RXEvents, fPort.RXStats.BytesOut, size - *count);
+        want = bytesBeforeHold(&fPort.RXFaults, fPort.RXStats.BytesOut, want);
+        got = removeFromRX(buffer + *count, want);
+        *count += got;
+        VSPAddRelaxed(fPort.RXStats.BytesOut, got);
+        
+        // Refill from the shared ring so user space can keep streaming without a doorbell.
+        pulled = pullSharedRX();
+        if (pulled)
+            wakeup = takeWakeup(fShared[kSharedRXRing]);
+        
+        if(got || pulled){
+            checkQueue(&fPort.RX);
+            VSPLockWakeup(RXBufferLock, &fPort.RX, false);   // space for a blocked sendData
+        }
+        
+        // Drop the lock to send, a client waiting for credit won't refill the queue until it hears.
+        if (wakeup || VSPLoadRelaxed(fCreditsDue)){
+            VSPLockUnlock(RXBufferLock);
+            if (wakeup)
+                notifyRingWakeup(kSharedRXRing);
+            sendCreditsDue();
+            VSPLockLock(RXBufferLock);
+        }
+        
+        // An event in the way is for the tty to take before anything more is read.
+        if ((*count >= min) || expired || eventDue(&fPort.RXEvents, fPort.RXStats.BytesOut))
+            break;
+        if (got || pulled){
+            if (got && charLatency)
+                ArmTimer(&charTimer, charLatency);
+            continue;
+        }
+        
+        // Check ACTIVE under the lock releasePort takes to wake us, as enqueueData does.
+        if (fTerminate || fStopping || !(readPortState() & PD_S_ACTIVE)){
+            ret = kIOReturnNotOpen;
+            break;
+        }
+        fRXReaders++;
+        int woken = VSPLockSleep(RXBufferLock, &fRXReaders, THREAD_ABORTSAFE);
+        fRXReaders--;
+        if (woken != THREAD_AWAKENED){
+            ret = kIOReturnAborted;
+            break;
+        }
     }
+    VSPLockUnlock(RXBufferLock);
     
-    return kIOReturnSuccess;
+    // The timers live on our stack, so neither may still be running when we return.
+    if (min){
+        FinishTimer(&dataTimer);
+        FinishTimer(&charTimer);
+    }
+    
+    return ret;
+}
+
+
+// A read timeout from dequeueData, expired is its flag.
+void DriverClassName::readTimedOut(void *owner, void *expired){
+    DriverClassName *port = (DriverClassName*)owner;
+    
+    VSPLockLock(port->RXBufferLock);
+    *(bool*)expired = true;
+    VSPLockWakeup(port->RXBufferLock, &port->fRXReaders, false);
+    VSPLockUnlock(port->RXBufferLock);
 }
 
 
@@ -444,6 +794,31 @@ void DriverClassName::initStructure(void){
     fPort.State = (PD_S_TXQ_EMPTY | PD_S_TXQ_LOW_WATER | PD_S_RXQ_EMPTY | PD_S_RXQ_LOW_WATER);
     fPort.WatchStateMask = 0x00000000;
     fPort.serialRequestLock = 0;
+    VSPStoreRelaxed(fPort.RXOverflowPolicy, kOverflowDropNewest);
+    fPort.RXFrames.Mode = kFramingNone;
+    resetFrames();
+    fPort.RemoteCharLength = 0;
+    fPort.RemoteParity = 0;
+    InitQueue(&fPort.RX, NULL, 0);          // acquirePort allocates the rings
+    InitQueue(&fPort.TX, NULL, 0);
+    fPort.RXLine.Mode = kLineTransparent;
+    fPort.TXLine.Mode = kLineTransparent;
+    fPort.RXLine.Direct = true;
+    fPort.TXLine.Direct = true;
+    bzero(&fPort.RXFaults, sizeof(FaultState));
+    bzero(&fPort.TXFaults, sizeof(FaultState));
+    setLineBits(&fPort.RXFaults, 8, PD_RS232_PARITY_NONE, false);
+    setLineBits(&fPort.TXFaults, 8, PD_RS232_PARITY_NONE, true);
+    VSPStoreRelaxed(fPort.RXParityErrors, 0);
+    VSPStoreRelaxed(fPort.RXFramingErrors, 0);
+    fPort.RXStats.OverRun = false;
+    VSPStoreRelaxed(fPort.RXStats.OverRunCount, 0);
+    fPort.TXStats.OverRun = false;
+    VSPStoreRelaxed(fPort.TXStats.OverRunCount, 0);
+    VSPStoreRelaxed(fPort.RXStats.BytesIn, 0);
+    VSPStoreRelaxed(fPort.RXStats.BytesOut, 0);
+    VSPStoreRelaxed(fPort.TXStats.BytesIn, 0);
+    VSPStoreRelaxed(fPort.TXStats.BytesOut, 0);
 }
 
 
@@ -455,17 +830,44 @@ bool DriverClassName::allocateResources(){
         return false;
     }
     
-    if (!allocateRingBuffer(&(fPort.TX)) || !allocateRingBuffer(&(fPort.RX))){
-        return false;
-    }
-    
-    fPort.serialRequestLock = IOLockAlloc();	// init lock used to protect code on MP
+    fPort.serialRequestLock = VSPLockAlloc();	// init lock used to protect code on MP
     if (!fPort.serialRequestLock)
         return false;
     
-    RXBufferLock = IOLockAlloc();
+    RXBufferLock = VSPLockAlloc();
     if(!RXBufferLock)
         return false;
+    
+    TXBufferLock = VSPLockAlloc();
+    if(!TXBufferLock)
+        return false;
+    
+    fStatusLock = VSPLockAlloc();
+    if(!fStatusLock)
+        return false;
+    
+    fBatchLock = VSPLockAlloc();
+    if(!fBatchLock)
+        return false;
+    
+    fClientLock = VSPLockAlloc();
+    if(!fClientLock)
+        return false;
+    
+    fResponderLock = VSPLockAlloc();
+    if(!fResponderLock)
+        return false;
+    
+    fWheelStarted = StartTimerWheel();
+    if (!fWheelStarted)
+        return false;
+    
+    fStatusMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                          sizeof(PortStatusPage), page_size);
+    if(!fStatusMemory)
+        return false;
+    fStatus = (PortStatusPage*)fStatusMemory->getBytesNoCopy();
+    bzero(fStatus, sizeof(PortStatusPage));
 
     return true;
 }
@@ -481,17 +883,71 @@ void DriverClassName::releaseResources(void){
     }
     
     if (fPort.serialRequestLock){
-        IOLockFree(fPort.serialRequestLock);
+        VSPLockFree(fPort.serialRequestLock);
         fPort.serialRequestLock = 0;
     }
     
+    if (fWheelStarted){
+        FinishTimer(&fHoldTimer[kFaultsToTTY]);
+        FinishTimer(&fHoldTimer[kFaultsFromTTY]);
+        FinishTimer(&fResponderTimer);
+        StopTimerWheel();
+        fWheelStarted = false;
+    }
+    
+    // Only left if the port is stopped while it is open.
+    freeRingBuffer(&fPort.TX, &fPort.TXStats, TXBufferLock);
+    freeRingBuffer(&fPort.RX, &fPort.RXStats, RXBufferLock);
+    DrainQueueBuffers();
+    
+    for (int ring = 0; ring < kNumberOfSharedRings; ring++){
+        fShared[ring] = NULL;
+        if (fSharedMemory[ring]){
+            fSharedMemory[ring]->release();
+            fSharedMemory[ring] = NULL;
+        }
+    }
+    
     if(RXBufferLock){
-        IOLockFree(RXBufferLock);
+        VSPLockFree(RXBufferLock);
         RXBufferLock = 0;
     }
     
-    freeRingBuffer(&fPort.TX);
-    freeRingBuffer(&fPort.RX);
+    if(TXBufferLock){
+        VSPLockFree(TXBufferLock);
+        TXBufferLock = 0;
+    }
+    
+    fStatus = NULL;
+    if(fStatusMemory){
+        fStatusMemory->release();
+        fStatusMemory = NULL;
+    }
+    
+    if(fStatusLock){
+        VSPLockFree(fStatusLock);
+        fStatusLock = 0;
+    }
+    
+    if(fBatchLock){
+        VSPLockFree(fBatchLock);
+        fBatchLock = 0;
+    }
+    
+    if(fClientLock){
+        VSPLockFree(fClientLock);
+        fClientLock = 0;
+    }
+    
+    if (fResponder){
+        FreeResponder(fResponder);
+        fResponder = NULL;
+    }
+    
+    if(fResponderLock){
+        VSPLockFree(fResponderLock);
+        fResponderLock = 0;
+    }
 }
 
 
@@ -523,52 +979,78 @@ bool DriverClassName::createSerialStream(void){
 void DriverClassName::setStructureDefaults(void){
     DEBUG_IOLog("VirtualSerialPort::setStructureDefaults\n");
     
-    fPort.BaudRate = kDefaultBaudRate;			// 9600 bps
-    fPort.CharLength = 8;                       // 8 Data bits
-    fPort.StopBits = 1;                         // 1 Stop bit
-    fPort.TX_Parity = PD_RS232_PARITY_NONE;     // No Parity
-    fPort.RX_Parity = PD_RS232_PARITY_NONE;     // --ditto--
-    fPort.MinLatency = false;
-    fPort.XONchar = '\x11';
-    fPort.XOFFchar = '\x13';
-    fPort.RXOstate = IDLE_XO;
-    fPort.TXOstate = IDLE_XO;
-    fPort.FlowControl = (DEFAULT_AUTO | DEFAULT_NOTIFY);
+    VSPStoreRelaxed(fPort.BaudRate, kDefaultBaudRate);          // 9600 bps
+    VSPStoreRelaxed(fPort.CharLength, 8);                       // 8 Data bits
+    VSPStoreRelaxed(fPort.StopBits, 2);                         // 1 Stop bit, counted in half bits
+    VSPStoreRelaxed(fPort.TX_Parity, PD_RS232_PARITY_NONE);     // No Parity
+    VSPStoreRelaxed(fPort.RX_Parity, PD_RS232_PARITY_NONE);     // --ditto--
+    VSPStoreRelaxed(fPort.MinLatency, false);
+    VSPStoreRelaxed(fPort.DataLatency, 0);                      // dequeueData waits for min bytes without a timeout
+    VSPStoreRelaxed(fPort.CharLatency, 0);
+    VSPStoreRelaxed(fPort.XONchar, '\x11');
+    VSPStoreRelaxed(fPort.XOFFchar, '\x13');
+    VSPStoreRelaxed(fPort.RXOstate, IDLE_XO);
+    VSPStoreRelaxed(fPort.TXOstate, IDLE_XO);
+    VSPStoreRelaxed(fPort.FlowControl, (DEFAULT_AUTO | DEFAULT_NOTIFY));
    // fPort.FlowControlState = ;
     
-    fPort.RXStats.BufferSize = kMaxCirBufferSize;
-    fPort.RXStats.HighWater = (fPort.RXStats.BufferSize << 1) / 3;
-    fPort.RXStats.LowWater = fPort.RXStats.HighWater >> 1;
+    // checkQueue reads the marks with the queue lock held, so they are set the same way.
+    UInt32 highWater;
+    
+    fPort.RXStats.BufferSize = GetQueueSize(&fPort.RX);
+    highWater = (fPort.RXStats.BufferSize << 1) / 3;
+    setWaterMarks(&fPort.RX, &fPort.RXStats, RXBufferLock, highWater, highWater >> 1);
     
-    fPort.TXStats.BufferSize = kMaxCirBufferSize;
-    fPort.TXStats.HighWater = (fPort.TXStats.BufferSize << 1) / 3;
-    fPort.TXStats.LowWater = fPort.TXStats.HighWater >> 1;
+    fPort.TXStats.BufferSize = GetQueueSize(&fPort.TX);
+    highWater = (fPort.TXStats.BufferSize << 1) / 3;
+    setWaterMarks(&fPort.TX, &fPort.TXStats, TXBufferLock, highWater, highWater >> 1);
     
     for (UInt32 tmp = 0; tmp < (256>>SPECIAL_SHIFT); tmp++){
         fPort.SWspecial[tmp] = 0;
     }
+    
+    setLineCoding();
 }
                            
                            
 void DriverClassName::writePortState(UInt32 state, UInt32 mask){
     //  DEBUG_IOLog("VirtualSerialPort::writePortState\n");
+    testAndSetPortState(0, state, mask);
+}
+
+
+// Apply the update only if none of the busy bits are set, all under the one lock so that
+// two callers can't both see the port free.
+bool DriverClassName::testAndSetPortState(UInt32 busy, UInt32 state, UInt32 mask){
     UInt32  delta;
     
-    if (!fPort.serialRequestLock) return;
+    if (!fPort.serialRequestLock) return false;
+    
+    VSPLockLock(fPort.serialRequestLock);
+    if (fPort.State & busy){
+        VSPLockUnlock(fPort.serialRequestLock);
+        return false;
+    }
     
-    IOLockLock(fPort.serialRequestLock);
     state = (fPort.State & ~mask) | (state & mask); // compute the new state
     delta = state ^ fPort.State;		    		// keep a copy of the diffs
     fPort.State = state;
     
-    if(delta && client) client->sendPortState(state);
-
     // Wake up all threads asleep on WatchStateMask
     
     if (delta & fPort.WatchStateMask)
         thread_wakeup_with_result( &fPort.WatchStateMask, THREAD_RESTART );
     
-    IOLockUnlock(fPort.serialRequestLock);
+    VSPLockUnlock(fPort.serialRequestLock);
+    
+    // The client reads the state back from the status page when it builds the
+    // notification, so there is no need to hold the lock across the send.
+    if(delta){
+        updateStatus();
+        notifyPortChanged(delta, 0);
+    }
+    
+    return true;
 }
 
                            
@@ -576,9 +1058,9 @@ UInt32 DriverClassName::readPortState(void){
     UInt32	returnState = 0;
     
     if (fPort.serialRequestLock){
-        IOLockLock(fPort.serialRequestLock );
+        VSPLockLock(fPort.serialRequestLock );
         returnState = fPort.State;
-        IOLockUnlock(fPort.serialRequestLock);
+        VSPLockUnlock(fPort.serialRequestLock);
     }
     
     return returnState;
@@ -591,7 +1073,7 @@ IOReturn DriverClassName::privateWatchState(UInt32 *state, UInt32 mask){
     IOReturn    rtn = kIOReturnSuccess;
     
     watchState  = *state;
-    IOLockLock(fPort.serialRequestLock);
+    VSPLockLock(fPort.serialRequestLock);
     
     // hack to get around problem with carrier detection
     
@@ -637,11 +1119,11 @@ IOReturn DriverClassName::privateWatchState(UInt32 *state, UInt32 mask){
         //  -- this problem was causing dequeueData to wait for a change in
         // PD_E_RXQ_EMPTY to 0 after an interrupt had already changed it to 0.
         
-     //   assert_wait(fPort.WatchStateMask, true);	/* assert event */
+        assert_wait(&fPort.WatchStateMask, THREAD_ABORTSAFE);	/* assert event */
         
-        IOLockUnlock(fPort.serialRequestLock);
+        VSPLockUnlock(fPort.serialRequestLock);
         rtn = thread_block(THREAD_CONTINUE_NULL);			/* block ourselves */
-        IOLockLock(fPort.serialRequestLock);
+        VSPLockLock(fPort.serialRequestLock);
         
         if (rtn == THREAD_RESTART){
             continue;
@@ -658,104 +1140,171 @@ IOReturn DriverClassName::privateWatchState(UInt32 *state, UInt32 mask){
     fPort.WatchStateMask = 0;
     
     thread_wakeup_with_result(&fPort.WatchStateMask, THREAD_RESTART);
-    IOLockUnlock(fPort.serialRequestLock);
+    VSPLockUnlock(fPort.serialRequestLock);
     
     return rtn;
 }
 
 
-void DriverClassName::checkQueues(void){
-    //  DEBUG_IOLog("VirtualSerialPort::checkQueues\n");
+// Update the state bits for one queue. The caller holds that queue's lock, the other queue may
+// be changing under us, so its bits are left to whoever holds its lock.
+void DriverClassName::checkQueue(CirQueue *Queue){
+    //  DEBUG_IOLog("VirtualSerialPort::checkQueue\n");
+    
+    bool        isTX = (Queue == &fPort.TX);
+    BufferMarks *Marks = isTX ? &fPort.TXStats : &fPort.RXStats;
+    UInt32      full = isTX ? PD_S_TXQ_FULL : PD_S_RXQ_FULL;
+    UInt32      empty = isTX ? PD_S_TXQ_EMPTY : PD_S_RXQ_EMPTY;
+    UInt32      lowWater = isTX ? PD_S_TXQ_LOW_WATER : PD_S_RXQ_LOW_WATER;
+    UInt32      highWater = isTX ? PD_S_TXQ_HIGH_WATER : PD_S_RXQ_HIGH_WATER;
+    UInt32      mask = isTX ? PD_S_TXQ_MASK : (PD_S_RXQ_MASK | PD_S_RX_EVENT);
+    UInt32      queuingState = 0;
+    
+    // Check to see if there is anything in the buffer.
+    UInt32 used = UsedSpaceinQueue(Queue);
+    UInt32 free = FreeSpaceinQueue(Queue);
+    UInt32 readable = used;
+    
+    // A framed RX queue is empty to the tty until a frame is complete.
+    if (!isTX){
+        readable = readableRX();
+        if (fPort.RXFrames.Count == kMaxQueuedFrames)
+            free = 0;
+        if (eventDue(&fPort.RXEvents, fPort.RXStats.BytesOut))
+            queuingState |= PD_S_RX_EVENT;
+    }
     
-    // Initialise the QueueState with the current state.
-    UInt32 queuingState = readPortState();
+    if (free == 0)
+        queuingState |= full;
+    else if (readable == 0)
+        queuingState |= empty;
     
-    // Check to see if there is anything in the Transmit buffer.
-    UInt32 used = UsedSpaceinQueue(&fPort.TX);
-    UInt32 free = FreeSpaceinQueue(&fPort.TX);
+    // Check to see if we are below the low water mark. A mark of 0 is reached once the queue empties,
+    // or the bit would never be set.
+    if ((used < Marks->LowWater) || ((used == 0) && Marks->BufferSize))
+        queuingState |= lowWater;
     
-    if (free == 0){
-        queuingState |=  PD_S_TXQ_FULL;
-        queuingState &= ~PD_S_TXQ_EMPTY;
-    } else {
-        if (used == 0){
-            queuingState &= ~PD_S_TXQ_FULL;
-            queuingState |=  PD_S_TXQ_EMPTY;
-        } else {
-            queuingState &= ~PD_S_TXQ_FULL;
-            queuingState &= ~PD_S_TXQ_EMPTY;
-        }
-    }
+    if (used > Marks->HighWater)
+        queuingState |= highWater;
     
-    // Check to see if we are below the low water mark.
-    if (used < fPort.TXStats.LowWater)
-        queuingState |=  PD_S_TXQ_LOW_WATER;
+    // Figure out what has changed to get mask. Only this queue's bits are written, anything else
+    // read back now may be stale by the time we write and could undo a releasePort.
+    UInt32 deltaState = (queuingState ^ readPortState()) & mask;
+    if (deltaState)
+        writePortState(queuingState, deltaState);
     else
-        queuingState &= ~PD_S_TXQ_LOW_WATER;
+        updateStatus();                 // Queue levels and counters still changed
+    
+    // Readers waiting in dequeueData look again at whatever changed.
+    if (!isTX && fRXReaders)
+        VSPLockWakeup(RXBufferLock, &fRXReaders, false);
+    
+    // Hand back send credit in one go when the tty drains the RX queue past low water. Pending sends
+    // don't wait for that, any room the tty makes lets them go on.
+    if ((deltaState & PD_S_RXQ_LOW_WATER) && (queuingState & PD_S_RXQ_LOW_WATER)){
+        fSendWaiting = false;               // creditsAvailable retries them as well
+        VSPStoreRelaxed(fCreditsDue, true);
+    } else if (!isTX && fSendWaiting && free){
+        fSendWaiting = false;
+        notifySendSpace();
+    }
+}
+
+
+// PD_E_RXQ_SIZE and PD_E_TXQ_SIZE. Only an empty queue can be resized, so no data is ever lost or
+// reordered; the water marks go back to their defaults for the new size. Sizes round up to a power of
+// two, which is what the pool hands out anyway, and reading the size back gives the rounded one.
+IOReturn DriverClassName::resizeQueue(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock, UInt32 Size){
+    DEBUG_IOLog("VirtualSerialPort::resizeQueue %u\n", Size);
     
-    if (used > fPort.TXStats.HighWater)
-        queuingState |= PD_S_TXQ_HIGH_WATER;
-    else
-        queuingState &= ~PD_S_TXQ_HIGH_WATER;
+    UInt8   *OldBuffer;
+    UInt32  OldSize;
     
+    if ((Size < kMinCirBufferSize) || (Size > kMaxCirBufferLimit)) return kIOReturnBadArgument;
+    if (Lock == NULL) return kIOReturnNotReady;
+    while (Size & (Size - 1))
+        Size += Size & -Size;
+    if (Size == GetQueueSize(Queue)) return kIOReturnSuccess;
     
-    // Check to see if there is anything in the Receive buffer.
-    used = UsedSpaceinQueue(&fPort.RX);
-    free = FreeSpaceinQueue(&fPort.RX);
+    UInt8   *Buffer = AllocQueueBuffer(Size);
+    if (Buffer == NULL) return kIOReturnNoMemory;
     
-    if (free == 0){
-        queuingState |= PD_S_RXQ_FULL;
-        queuingState &= ~PD_S_RXQ_EMPTY;
-    } else {
-        if (used == 0){
-            queuingState &= ~PD_S_RXQ_FULL;
-            queuingState |= PD_S_RXQ_EMPTY;
-        } else {
-            queuingState &= ~PD_S_RXQ_FULL;
-            queuingState &= ~PD_S_RXQ_EMPTY;
-        }
+    VSPLockLock(Lock);
+    if (UsedSpaceinQueue(Queue)){
+        VSPLockUnlock(Lock);
+        FreeQueueBuffer(Buffer, Size);
+        return kIOReturnBusy;
     }
+    OldBuffer = Queue->buffer();
+    OldSize = GetQueueSize(Queue);
+    InitQueue(Queue, Buffer, Size);
+    Marks->BufferSize = Size;
+    Marks->HighWater = (Size << 1) / 3;
+    Marks->LowWater = Marks->HighWater >> 1;
+    checkQueue(Queue);
+    VSPLockUnlock(Lock);
+    sendCreditsDue();
+    
+    FreeQueueBuffer(OldBuffer, OldSize);
+    return kIOReturnSuccess;
+}
+
+
+// The PD_S_..._WATER bits are set above HighWater and below LowWater.
+IOReturn DriverClassName::setWaterMarks(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock, UInt32 HighWater, UInt32 LowWater){
     
-    // Check to see if we are below the low water mark.
-    if (used < fPort.RXStats.LowWater)
-        queuingState |= PD_S_RXQ_LOW_WATER;
-    else
-        queuingState &= ~PD_S_RXQ_LOW_WATER;
+    if (Lock == NULL) return kIOReturnNotReady;
     
-    if (used > fPort.RXStats.HighWater)
-        queuingState |= PD_S_RXQ_HIGH_WATER;
-    else
-        queuingState &= ~PD_S_RXQ_HIGH_WATER;
+    VSPLockLock(Lock);
+    if ((LowWater > HighWater) || (HighWater >= Marks->BufferSize)){
+        VSPLockUnlock(Lock);
+        return kIOReturnBadArgument;
+    }
+    Marks->HighWater = HighWater;
+    Marks->LowWater = LowWater;
+    checkQueue(Queue);
+    VSPLockUnlock(Lock);
+    sendCreditsDue();
     
-    // Figure out what has changed to get mask.
-    UInt32 deltaState = queuingState ^ readPortState();
-    writePortState(queuingState, deltaState);
+    return kIOReturnSuccess;
 }
 
 
-bool DriverClassName::allocateRingBuffer(CirQueue *Queue){
-    DEBUG_IOLog("VirtualSerialPort::allocateRingBuffer\n");
+// Give a queue's buffer back to the pool, leaving it empty and zero sized. Anything still queued is
+// counted out, so BytesIn - BytesOut stays what is in the queue.
+void DriverClassName::freeRingBuffer(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock){
+    DEBUG_IOLog("VirtualSerialPort::freeRingBuffer\n");
     
-    UInt8   *Buffer = (UInt8*)IOMalloc(kMaxCirBufferSize);
+    UInt8   *Buffer;
+    UInt32  Size;
     
-    InitQueue(Queue, Buffer, kMaxCirBufferSize);
+    if (Lock == NULL) return;
     
-    if (Buffer)
-        return true;
+    VSPLockLock(Lock);
+    Buffer = Queue->buffer();
+    Size = GetQueueSize(Queue);
+    VSPAddRelaxed(Marks->BytesOut, UsedSpaceinQueue(Queue));
+    InitQueue(Queue, NULL, 0);
+    if (Queue == &fPort.RX)
+        resetFrames();                  // The frames it described are gone
+    Marks->BufferSize = 0;
+    Marks->HighWater = 0;
+    Marks->LowWater = 0;
+    VSPLockUnlock(Lock);
     
-    return false;
+    FreeQueueBuffer(Buffer, Size);
 }
 
 
-void DriverClassName::freeRingBuffer(CirQueue *Queue){
-    DEBUG_IOLog("VirtualSerialPort::freeRingBuffer\n");
+// Called with RXBufferLock held whenever bytes bound for the tty are thrown away, position being where
+// in the stream they went missing. One overrun event is queued at a time, dequeueEvent reports the count
+// as it stands when the tty takes it. The caller's checkQueue sets PD_S_RX_EVENT.
+void DriverClassName::noteOverrun(UInt32 dropped, UInt64 position){
+    DEBUG_IOLog("VirtualSerialPort::noteOverrun dropped %u\n", dropped);
     
-    if (Queue){
-        if (Queue->Start){
-            IOFree(Queue->Start, Queue->Size);
-        }
-        CloseQueue(Queue);
-    }
+    VSPAddRelaxed(fPort.RXStats.OverRunCount, dropped);
+    if (!fPort.RXStats.OverRun)
+        fPort.RXStats.OverRun = putEvent(&fPort.RXEvents, PD_E_SW_OVERRUN_ERROR, 0, position);
 }
 
 
@@ -803,27 +1352,1804 @@ void DriverClassName::debugEvent(char const *str, UInt32 event, UInt32 data){
 IOReturn DriverClassName::sendData(TRBufferStruct* inStruct, UInt32* sendCount){
     DEBUG_IOLog("VirtualSerialPort::send\n");
     
-    if (RXBufferLock){
-        IOLockLock(RXBufferLock);
-        *sendCount = AddtoQueue(&fPort.RX, inStruct->buffer, inStruct->numBytes);
-        checkQueues();
+    UInt32  size = (inStruct->numBytes < kMessageBufferSize) ? (UInt32)inStruct->numBytes : kMessageBufferSize;
+    
+    return sendBuffer(inStruct->buffer, size, sendCount);
+}
+
+
+IOReturn DriverClassName::sendBuffer(UInt8* buffer, UInt32 size, UInt32* sendCount){
+    DEBUG_IOLog("VirtualSerialPort::sendBuffer %u bytes\n", size);
+    
+    IOReturn    ret = kIOReturnSuccess;
+    UInt32      dropped = 0;
+    UInt32      added;
+    
+    *sendCount = 0;
+    if (!RXBufferLock) return kIOReturnNotReady;
+    
+    VSPLockLock(RXBufferLock);
+    switch (VSPLoadRelaxed(fPort.RXOverflowPolicy)){
+        case kOverflowBlock:
+            for (;;){
+                // Counted before any sleep, so events sent meanwhile and the credit see these bytes.
+                added = addToRX(buffer + *sendCount, size - *sendCount);
+                *sendCount += added;
+                VSPAddRelaxed(fPort.RXStats.BytesIn, added);
+                if (*sendCount == size)
+                    break;
+                
+                // Nobody will drain the queue if the tty side is not active, so don't wait for it.
+                checkQueue(&fPort.RX);
+                if (fTerminate || fStopping || !(readPortState() & PD_S_ACTIVE))
+                    break;
+                
+                // dequeueData and releasePort wake us once space may have been freed.
+                if (VSPLockSleep(RXBufferLock, &fPort.RX, THREAD_ABORTSAFE) != THREAD_AWAKENED){
+                    ret = kIOReturnAborted;
+                    break;
+                }
+            }
+            break;
+        case kOverflowDropOldest:
+            dropped = addToRXOverwrite(buffer, size);
+            *sendCount = size;
+            VSPAddRelaxed(fPort.RXStats.BytesIn, size);
+            VSPAddRelaxed(fPort.RXStats.BytesOut, dropped); // as if the tty had read them
+            break;
+        case kOverflowDropNewest:
+        default:
+            *sendCount = addToRX(buffer, size);
+            VSPAddRelaxed(fPort.RXStats.BytesIn, *sendCount);
+            dropped = size - *sendCount;
+            break;
+    }
+    
+    // Dropping the oldest loses bytes at the read point, dropping the newest loses them at the end.
+    if (dropped)
+        noteOverrun(dropped, (VSPLoadRelaxed(fPort.RXOverflowPolicy) == kOverflowDropOldest) ? fPort.RXStats.BytesOut : fPort.RXStats.BytesIn);
+    checkQueue(&fPort.RX);
+    writePortState(256,256);
+    VSPLockUnlock(RXBufferLock);
+    sendCreditsDue();
+    
+    // Let the clients see the updated overrun count.
+    if (dropped) notifyPortChanged(0, 1ULL << kPortFieldRXOverRuns);
+    
+    return ret;
+}
+
+
+// Never drops anything; sleeps in privateWatchState until the tty clears PD_S_RXQ_FULL, then tries again.
+// privateWatchState also watches for PD_S_ACTIVE going low, so a closed port ends the wait with kIOReturnIOError.
+IOReturn DriverClassName::sendBufferBlocking(UInt8* buffer, UInt32 size, UInt32* sendCount){
+    DEBUG_IOLog("VirtualSerialPort::sendBufferBlocking %u bytes\n", size);
+    
+    IOReturn    ret = kIOReturnSuccess;
+    UInt32      count, state;
+    
+    *sendCount = 0;
+    while (*sendCount < size){
+        ret = sendBufferPartial(buffer + *sendCount, size - *sendCount, &count);
+        *sendCount += count;
+        if ((ret != kIOReturnSuccess) || (*sendCount == size))
+            break;
+        
+        state = 0;
+        ret = privateWatchState(&state, PD_S_RXQ_FULL);
+        if (ret != kIOReturnSuccess)
+            break;
+    }
+    
+    return ret;
+}
+
+
+// Queue as much as fits and leave the rest to the caller. Unlike kOverflowDropNewest the
+// remainder isn't counted as an overrun, the blocking and async sends come back for it.
+IOReturn DriverClassName::sendBufferPartial(UInt8* buffer, UInt32 size, UInt32* sendCount){
+    
+    *sendCount = 0;
+    if (!RXBufferLock) return kIOReturnNotReady;
+    
+    VSPLockLock(RXBufferLock);
+    *sendCount = addToRX(buffer, size);
+    VSPAddRelaxed(fPort.RXStats.BytesIn, *sendCount);
+    checkQueue(&fPort.RX);
+    if (*sendCount < size)
+        fSendWaiting = true;
+    if (*sendCount)
         writePortState(256,256);
-        IOLockUnlock(RXBufferLock);
+    VSPLockUnlock(RXBufferLock);
+    sendCreditsDue();
+    
+    return kIOReturnSuccess;
+}
+
+
+// Called by the user client to take data the tty has written. It calls runTXEvents afterwards, once
+// it has dropped its own locks.
+IOReturn DriverClassName::receiveData(UInt8* buffer, UInt32 size, UInt32* count){
+    
+    *count = 0;
+    if (!TXBufferLock) return kIOReturnNotReady;
+    
+    VSPLockLock(TXBufferLock);
+    size = bytesBeforeHold(&fPort.TXFaults, fPort.TXStats.BytesOut, size);
+    *count = RemovefromQueue(&fPort.TX, buffer, size);
+    VSPAddRelaxed(fPort.TXStats.BytesOut, *count);
+    if (*count){
+        checkQueue(&fPort.TX);
+        VSPLockWakeup(TXBufferLock, &fPort.TX, false);       // space for a blocked enqueueData
     }
+    VSPLockUnlock(TXBufferLock);
     
     return kIOReturnSuccess;
 }
 
 
-IOReturn DriverClassName::getInfo(void){
-    DEBUG_IOLog("VirtualSerialPort::getInfo\n");
+UInt32 DriverClassName::getRXFreeSpace(void){
+    UInt32  free = 0;
     
-    if(client){
-        client->sendPortInfo();
-        client->sendPortState(readPortState());
+    if (RXBufferLock){
+        VSPLockLock(RXBufferLock);
+        free = (fPort.RXFrames.Count < kMaxQueuedFrames) ? FreeSpaceinQueue(&fPort.RX) : 0;
+        VSPLockUnlock(RXBufferLock);
     }
+    
+    return free;
+}
+
+
+// Sending up to limit - sent more bytes can't overflow the RX queue, because limit only moves on
+// as the tty takes bytes out. The totals are read without RXBufferLock as checkQueue calls this
+// with it held, so they are relaxed loads.
+void DriverClassName::getCredits(UInt64* limit, UInt64* sent){
+    
+    *sent = VSPLoadRelaxed(fPort.RXStats.BytesIn);
+    *limit = VSPLoadRelaxed(fPort.RXStats.BytesOut) + GetQueueSize(&fPort.RX);
+}
 
+
+IOReturn DriverClassName::setOverflowPolicy(UInt32 policy){
+    DEBUG_IOLog("VirtualSerialPort::setOverflowPolicy %u\n", policy);
+    
+    if (policy > kOverflowDropOldest) return kIOReturnBadArgument;
+    
+    VSPStoreRelaxed(fPort.RXOverflowPolicy, policy);
+    
+    // A sender blocked under the old policy should re-evaluate.
+    if (RXBufferLock){
+        VSPLockLock(RXBufferLock);
+        VSPLockWakeup(RXBufferLock, &fPort.RX, false);
+        VSPLockUnlock(RXBufferLock);
+    }
+    
+    updateStatus();
+    notifyPortChanged(0, 1ULL << kPortFieldRXOverflowPolicy);
     return kIOReturnSuccess;
 }
 
 
+#pragma mark Framing
+
+IOReturn DriverClassName::setFraming(UInt32 mode, UInt32 parameter, UInt32 maxSize){
+    DEBUG_IOLog("VirtualSerialPort::setFraming %u %u %u\n", mode, parameter, maxSize);
+    
+    switch (mode){
+        case kFramingNone:
+        case kFramingFixed:
+            break;
+        case kFramingDelimiter:
+            if (parameter > 0xFF) return kIOReturnBadArgument;
+            break;
+        case kFramingLengthPrefix:
+            if ((parameter != 1) && (parameter != 2) && (parameter != 4)) return kIOReturnBadArgument;
+            if (maxSize && (maxSize <= parameter)) return kIOReturnBadArgument;
+            break;
+        default:
+            return kIOReturnBadArgument;
+    }
+    if (!RXBufferLock) return kIOReturnNotReady;
+    
+    // Bytes already queued were never scanned for boundaries.
+    VSPLockLock(RXBufferLock);
+    if (UsedSpaceinQueue(&fPort.RX)){
+        VSPLockUnlock(RXBufferLock);
+        return kIOReturnBusy;
+    }
+    fPort.RXFrames.Mode = mode;
+    fPort.RXFrames.Parameter = parameter;
+    fPort.RXFrames.MaxSize = maxSize;
+    resetFrames();
+    VSPLockUnlock(RXBufferLock);
+    
+    return kIOReturnSuccess;
+}
+
+
+// Called with RXBufferLock held whenever the RX queue is emptied.
+void DriverClassName::resetFrames(void){
+    
+    fPort.RXFrames.Partial = 0;
+    fPort.RXFrames.Prefix = 0;
+    fPort.RXFrames.First = 0;
+    fPort.RXFrames.Count = 0;
+}
+
+
+// Called with RXBufferLock held. Bytes the tty can read: everything queued, less the frame still arriving
+// and anything jitter is holding back. Partial is always 0 when the queue isn't framed.
+UInt32 DriverClassName::readableRX(void){
+    
+    return bytesBeforeHold(&fPort.RXFaults, fPort.RXStats.BytesOut, UsedSpaceinQueue(&fPort.RX) - fPort.RXFrames.Partial);
+}
+
+
+// Called with RXBufferLock held. How many of the next size bytes belong to the frame being queued, and
+// whether they complete it. The caller must queue all of them.
+UInt32 DriverClassName::scanFrame(UInt8 *buffer, UInt32 size, bool *complete){
+    FrameQueue  *frames = &fPort.RXFrames;
+    UInt32      limit = GetQueueSize(&fPort.RX);
+    UInt32      start = frames->Partial;
+    UInt32      take = 0;
+    UInt8       *delimiter;
+    
+    if (frames->MaxSize && (frames->MaxSize < limit))
+        limit = frames->MaxSize;
+    if (size > limit - start)
+        size = limit - start;
+    
+    UInt32  end = limit;                // Where the frame ends, as far as is known yet
+    
+    switch (frames->Mode){
+        case kFramingDelimiter:
+            delimiter = (UInt8*)memchr(buffer, frames->Parameter, size);
+            if (delimiter)
+                end = start + (UInt32)(delimiter - buffer) + 1;
+            break;
+        case kFramingLengthPrefix:
+            for (; (take < size) && (start + take < frames->Parameter); take++)
+                frames->Prefix = (frames->Prefix << 8) | buffer[take];
+            if ((start + take >= frames->Parameter) && (frames->Prefix < limit - frames->Parameter))
+                end = frames->Parameter + frames->Prefix;
+            break;
+        default:
+            break;
+    }
+    
+    take = min(size, end - start);
+    frames->Partial = start + take;
+    *complete = (frames->Partial == end);
+    return take;
+}
+
+
+// Called with RXBufferLock held, with bytes as the tty reads them. Returns the number of bytes queued; a
+// framed queue stops short once it holds kMaxQueuedFrames frames.
+UInt32 DriverClassName::queueRX(UInt8 *buffer, UInt32 size){
+    FrameQueue  *frames = &fPort.RXFrames;
+    UInt32      added = 0;
+    UInt32      take, free;
+    bool        complete;
+    
+    if (frames->Mode == kFramingNone)
+        return AddtoQueue(&fPort.RX, buffer, size);
+    
+    while ((added < size) && (frames->Count < kMaxQueuedFrames)){
+        free = FreeSpaceinQueue(&fPort.RX);
+        if (!free)
+            break;
+        
+        take = scanFrame(buffer + added, min(size - added, free), &complete);
+        AddtoQueue(&fPort.RX, buffer + added, take);
+        added += take;
+        if (complete){
+            frames->Lengths[(frames->First + frames->Count) % kMaxQueuedFrames] = frames->Partial;
+            frames->Count++;
+            frames->Partial = 0;
+            frames->Prefix = 0;
+        }
+    }
+    
+    return added;
+}
+
+
+// kOverflowDropOldest. A framed queue makes room by dropping whole frames, so the tty never sees
+// the tail of one. Returns the number of bytes dropped, queued or not.
+UInt32 DriverClassName::queueRXOverwrite(UInt8 *buffer, UInt32 size){
+    FrameQueue  *frames = &fPort.RXFrames;
+    UInt32      added = 0;
+    UInt32      dropped = 0;
+    UInt32      length;
+    
+    if (frames->Mode == kFramingNone)
+        return AddtoQueueOverwrite(&fPort.RX, buffer, size);
+    
+    for (;;){
+        added += queueRX(buffer + added, size - added);
+        if ((added == size) || !frames->Count)
+            break;
+        
+        length = frames->Lengths[frames->First];
+        DiscardfromQueue(&fPort.RX, length);
+        frames->First = (frames->First + 1) % kMaxQueuedFrames;
+        frames->Count--;
+        dropped += length;
+    }
+    
+    // Only the frame still arriving is left, and it can't fill the queue by itself.
+    return dropped + (size - added);
+}
+
+
+// Called with RXBufferLock held instead of RemovefromQueue. A framed queue gives at most the rest
+// of the oldest complete frame.
+UInt32 DriverClassName::removeFromRX(UInt8 *buffer, UInt32 size){
+    FrameQueue  *frames = &fPort.RXFrames;
+    UInt32      count;
+    
+    if (frames->Mode == kFramingNone)
+        return RemovefromQueue(&fPort.RX, buffer, size);
+    
+    if (!frames->Count)
+        return 0;
+    
+    count = RemovefromQueue(&fPort.RX, buffer, min(size, frames->Lengths[frames->First]));
+    frames->Lengths[frames->First] -= count;
+    if (!frames->Lengths[frames->First]){
+        frames->First = (frames->First + 1) % kMaxQueuedFrames;
+        frames->Count--;
+    }
+    
+    return count;
+}
+
+
+#pragma mark Events
+
+// kSendEvent. Queued under RXBufferLock at the end of the data sent so far.
+IOReturn DriverClassName::sendEvent(UInt32 event, UInt32 data){
+    DEBUG_IOLog("VirtualSerialPort::sendEvent 0x%x %u\n", event, data);
+    
+    bool    queued;
+    
+    switch (event){
+        case PD_E_DATA_BYTE:
+        case PD_E_FRAMING_BYTE:
+        case PD_E_PARITY_BYTE:
+            if (data > 0xFF) return kIOReturnBadArgument;
+            break;
+        case PD_E_INTEGRITY_ERROR:
+        case PD_E_FRAMING_ERROR:
+        case PD_E_PARITY_ERROR:
+        case PD_E_HW_OVERRUN_ERROR:
+        case PD_RS232_E_LINE_BREAK:
+            break;
+        default:
+            return kIOReturnBadArgument;
+    }
+    if (!RXBufferLock) return kIOReturnNotReady;
+    
+    VSPLockLock(RXBufferLock);
+    queued = putEvent(&fPort.RXEvents, event, data, fPort.RXStats.BytesIn);
+    checkQueue(&fPort.RX);
+    VSPLockUnlock(RXBufferLock);
+    sendCreditsDue();
+    
+    return queued ? kIOReturnSuccess : kIOReturnNoSpace;
+}
+
+
+// Called with the ring's queue lock held, which keeps producers in order. Positions never go backwards,
+// an event can't be due before one queued ahead of it.
+bool DriverClassName::putEvent(EventRing *ring, UInt32 event, UInt32 data, UInt64 position){
+    UInt32      head = __atomic_load_n(&ring->Head, __ATOMIC_RELAXED);
+    UInt32      tail = __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE);     // Consumers are done with the slots behind it
+    EventEntry  *entry;
+    UInt64      last;
+    
+    if ((head - tail) >= kEventRingSize) return false;
+    
+    if (head != tail){
+        last = __atomic_load_n(&ring->Entries[(head - 1) & (kEventRingSize - 1)].Position, __ATOMIC_RELAXED);
+        if (position < last)
+            position = last;
+    }
+    
+    entry = &ring->Entries[head & (kEventRingSize - 1)];
+    __atomic_store_n(&entry->Event, event, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->Data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->Position, position, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->Head, head + 1, __ATOMIC_RELEASE);             // Publish the entry with it
+    
+    return true;
+}
+
+
+// Take the oldest event if the stream has reached position. Needs no lock: the entry is copied before
+// Tail is moved on, and a producer only reuses a slot after Tail has passed it, in which case our
+// compare and swap fails and we look again.
+bool DriverClassName::takeEvent(EventRing *ring, UInt64 position, UInt32 *event, UInt32 *data){
+    UInt32      tail = __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE);
+    EventEntry  *slot;
+    EventEntry  entry;
+    
+    for (;;){
+        if (tail == __atomic_load_n(&ring->Head, __ATOMIC_ACQUIRE))
+            return false;
+        
+        slot = &ring->Entries[tail & (kEventRingSize - 1)];
+        entry.Position = __atomic_load_n(&slot->Position, __ATOMIC_RELAXED);
+        if (entry.Position > position)
+            return false;
+        entry.Event = __atomic_load_n(&slot->Event, __ATOMIC_RELAXED);
+        entry.Data = __atomic_load_n(&slot->Data, __ATOMIC_RELAXED);
+        
+        // Hand the slot back once copied. On failure tail is reloaded and the copy may be stale, so go round.
+        if (__atomic_compare_exchange_n(&ring->Tail, &tail, tail + 1, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)){
+            *event = entry.Event;
+            *data = entry.Data;
+            return true;
+        }
+    }
+}
+
+
+// Called with the ring's queue lock held. Whether the oldest event is due at position.
+bool DriverClassName::eventDue(EventRing *ring, UInt64 position){
+    UInt32  tail = __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE);
+    
+    if (tail == __atomic_load_n(&ring->Head, __ATOMIC_ACQUIRE)) return false;
+    
+    return (__atomic_load_n(&ring->Entries[tail & (kEventRingSize - 1)].Position, __ATOMIC_RELAXED) <= position);
+}
+
+
+// Called with the ring's queue lock held. How many of size bytes can be taken from position without
+// passing an event that isn't due yet. Events already due don't hold the data up, the tty has been
+// told about them through PD_S_RX_EVENT.
+UInt32 DriverClassName::bytesBeforeEvent(EventRing *ring, UInt64 position, UInt32 size){
+    UInt32  head = __atomic_load_n(&ring->Head, __ATOMIC_ACQUIRE);
+    UInt64  next;
+    
+    for (UInt32 tail = __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE); tail != head; tail++){
+        next = __atomic_load_n(&ring->Entries[tail & (kEventRingSize - 1)].Position, __ATOMIC_RELAXED);
+        if (next > position)
+            return ((next - position) < size) ? (UInt32)(next - position) : size;
+    }
+    
+    return size;
+}
+
+
+// Called with the ring's queue lock held whenever the queue is emptied. A consumer may be taking an
+// event at the same time, so Tail is moved on to Head with a compare and swap like theirs rather than
+// stored over whatever they just did.
+void DriverClassName::resetEvents(EventRing *ring){
+    UInt32  head = __atomic_load_n(&ring->Head, __ATOMIC_RELAXED);
+    UInt32  tail = __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE);
+    
+    while ((tail != head) &&
+           !__atomic_compare_exchange_n(&ring->Tail, &tail, head, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)){}
+}
+
+
+// Run the tty's queued events that the client has now read past, in the order they were queued. Called
+// without locks held, executeEvent takes what it needs; BytesOut may move on under us, which only
+// leaves an event for the next call.
+void DriverClassName::runTXEvents(void){
+    UInt32  event, data;
+    bool    ran = false;
+    
+    while (takeEvent(&fPort.TXEvents, VSPLoadRelaxed(fPort.TXStats.BytesOut), &event, &data)){
+        executeEvent(event, data, NULL);
+        ran = true;
+    }
+    
+    // Room for an enqueueEvent waiting on a full ring.
+    if (ran && TXBufferLock){
+        VSPLockLock(TXBufferLock);
+        VSPLockWakeup(TXBufferLock, &fPort.TX, false);
+        VSPLockUnlock(TXBufferLock);
+    }
+}
+
+
+#pragma mark Line Coding
+
+// Kernel code can't use the vector registers, so the bulk paths work on eight bytes at a time in ordinary ones.
+
+static inline UInt32 parityBit(UInt32 parity, UInt32 data){
+    
+    switch (parity){
+        case PD_RS232_PARITY_ODD:   return !(__builtin_popcount(data) & 1);
+        case PD_RS232_PARITY_EVEN:  return __builtin_popcount(data) & 1;
+        case PD_RS232_PARITY_MARK:  return 1;
+        default:                    return 0;
+    }
+}
+
+
+// Characters sent with fromLength data bits and fromParity, read with toLength and toParity. check is false
+// when the reader ignores the parity bit.
+static void buildLineCoding(LineCoding *line, UInt32 fromLength, UInt32 fromParity, UInt32 toLength, UInt32 toParity, bool check){
+    UInt32  wire, data, position, errors;
+    
+    line->Mask = (UInt8)((1 << toLength) - 1);
+    if ((fromLength == toLength) && (fromParity == toParity)){
+        line->Mode = (toLength == 8) ? kLineTransparent : kLineMask;
+        return;
+    }
+    
+    line->Mode = kLineDecode;
+    for (UInt32 byte = 0; byte < 256; byte++){
+        // The data bits, low bit first, then parity, then stop bits and idle line, all ones.
+        wire = byte & ((1 << fromLength) - 1);
+        position = fromLength;
+        if (fromParity != PD_RS232_PARITY_NONE){
+            wire |= parityBit(fromParity, wire) << position;
+            position++;
+        }
+        wire |= ~0U << position;
+        
+        data = wire & line->Mask;
+        errors = 0;
+        position = toLength;
+        if (toParity != PD_RS232_PARITY_NONE){
+            if (check && (((wire >> position) & 1) != parityBit(toParity, data)))
+                errors |= kLineParityError;
+            position++;
+        }
+        if (!((wire >> position) & 1))
+            errors |= kLineFramingError;
+        
+        line->Map[byte] = (UInt8)data;
+        line->Errors[byte] = (UInt8)errors;
+    }
+}
+
+
+static void maskBytes(UInt8 *to, const UInt8 *from, UInt32 size, UInt8 mask){
+    UInt64  wide = 0x0101010101010101ULL * mask;
+    UInt64  word;
+    UInt32  i = 0;
+    
+    for (; i + 8 <= size; i += 8){
+        memcpy(&word, from + i, 8);
+        word &= wide;
+        memcpy(to + i, &word, 8);
+    }
+    for (; i < size; i++)
+        to[i] = from[i] & mask;
+}
+
+
+// Returns the errors found in any of the bytes.
+static UInt8 decodeBytes(UInt8 *to, const UInt8 *from, UInt32 size, const LineCoding *line){
+    UInt8   errors = 0;
+    UInt32  i = 0;
+    
+    for (; i + 4 <= size; i += 4){
+        to[i] = line->Map[from[i]];
+        to[i + 1] = line->Map[from[i + 1]];
+        to[i + 2] = line->Map[from[i + 2]];
+        to[i + 3] = line->Map[from[i + 3]];
+        errors |= line->Errors[from[i]] | line->Errors[from[i + 1]] | line->Errors[from[i + 2]] | line->Errors[from[i + 3]];
+    }
+    for (; i < size; i++){
+        to[i] = line->Map[from[i]];
+        errors |= line->Errors[from[i]];
+    }
+    
+    return errors;
+}
+
+
+static UInt8 codeBytes(UInt8 *to, const UInt8 *from, UInt32 size, const LineCoding *line){
+    
+    if (line->Mode == kLineMask){
+        maskBytes(to, from, size, line->Mask);
+        return 0;
+    }
+    
+    return decodeBytes(to, from, size, line);
+}
+
+
+// kSetLineFormat.
+IOReturn DriverClassName::setLineFormat(UInt32 charLength, UInt32 parity){
+    DEBUG_IOLog("VirtualSerialPort::setLineFormat %u %u\n", charLength, parity);
+    
+    if (charLength && ((charLength < 5) || (charLength > 8))) return kIOReturnBadArgument;
+    if (parity && ((parity < PD_RS232_PARITY_NONE) || (parity > PD_RS232_PARITY_SPACE))) return kIOReturnBadArgument;
+    
+    fPort.RemoteCharLength = charLength;
+    fPort.RemoteParity = parity;
+    setLineCoding();
+    
+    return kIOReturnSuccess;
+}
+
+
+// Called whenever either end's format changes. The tty reads with its own parity, checked unless
+// RX_Parity is PD_RS232_PARITY_ANY.
+void DriverClassName::setLineCoding(void){
+    UInt32  charLength = VSPLoadRelaxed(fPort.CharLength);
+    UInt32  parity = VSPLoadRelaxed(fPort.TX_Parity);
+    UInt32  remoteLength = fPort.RemoteCharLength ? fPort.RemoteCharLength : charLength;
+    UInt32  remoteParity = fPort.RemoteParity ? fPort.RemoteParity : parity;
+    bool    check = (VSPLoadRelaxed(fPort.RX_Parity) != PD_RS232_PARITY_ANY);
+    
+    if (RXBufferLock){
+        VSPLockLock(RXBufferLock);
+        buildLineCoding(&fPort.RXLine, remoteLength, remoteParity, charLength, parity, check);
+        setLineBits(&fPort.RXFaults, charLength, parity, check);
+        fPort.RXLine.Direct = (fPort.RXLine.Mode == kLineTransparent) && !fPort.RXFaults.Enabled;
+        VSPLockUnlock(RXBufferLock);
+    }
+    
+    if (TXBufferLock){
+        VSPLockLock(TXBufferLock);
+        buildLineCoding(&fPort.TXLine, charLength, parity, remoteLength, remoteParity, true);
+        setLineBits(&fPort.TXFaults, remoteLength, remoteParity, true);
+        fPort.TXLine.Direct = (fPort.TXLine.Mode == kLineTransparent) && !fPort.TXFaults.Enabled;
+        VSPLockUnlock(TXBufferLock);
+    }
+}
+
+
+#pragma mark Fault Injection
+
+static inline UInt64 nextRandom(FaultState *faults){
+    UInt64  x = faults->Random;
+    
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    faults->Random = x;
+    
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+// How many characters, or bits, pass before the next fault. Gaps are spread evenly from 0 to twice the
+// interval, so they average out to it. An interval of 0 never comes round.
+static UInt64 drawInterval(FaultState *faults, UInt32 interval){
+    
+    if (!interval) return ~0ULL;
+    
+    return nextRandom(faults) % (2 * (UInt64)interval - 1);
+}
+
+
+// Count down to a fault, drawing the next one once it strikes.
+static inline bool faultDue(FaultState *faults, UInt64 *next, UInt32 interval){
+    
+    if (*next){
+        (*next)--;
+        return false;
+    }
+    
+    *next = drawInterval(faults, interval);
+    return true;
+}
+
+
+// Copy size bytes from `from` to `to`, which has room bytes, with the faults that strike along the way.
+// errors, if not NULL, has the line coding's errors for each byte. Events to queue and jitter holds go in
+// marks, at their offset in `to`. Returns the bytes of from used, *produced is set to the bytes written.
+// Between faults the bytes are copied in runs, so a clean line costs little more than a memcpy.
+static UInt32 injectFaults(FaultState *faults, const UInt8 *from, const UInt8 *errors, UInt32 size,
+                           UInt8 *to, UInt32 room, UInt32 *produced, FaultMark *marks, UInt32 *numMarks){
+    FaultConfig *config = &faults->Config;
+    UInt32      in = 0;
+    UInt32      out = 0;
+    UInt32      count = 0;
+    UInt32      run, bit;
+    UInt64      gap, rest;
+    UInt8       byte, error;
+    bool        dropped, doubled, broken, delayed;
+    
+    while ((in < size) && (out < room)){
+        gap = faults->BurstLeft ? 0 : faults->NextBitError / faults->CharBits;
+        gap = ulmin(gap, ulmin(faults->NextDrop, faults->NextDuplicate));
+        gap = ulmin(gap, ulmin(faults->NextBurst, ulmin(faults->NextBreak, faults->NextJitter)));
+        run = (UInt32)ulmin(gap, min(size - in, room - out));
+        if (errors){
+            for (UInt32 i = 0; i < run; i++){
+                if (errors[in + i]){
+                    run = i;
+                    break;
+                }
+            }
+        }
+        
+        if (run){
+            memcpy(to + out, from + in, run);
+            in += run;
+            out += run;
+            faults->NextBitError -= (UInt64)run * faults->CharBits;
+            faults->NextDrop -= run;
+            faults->NextDuplicate -= run;
+            faults->NextBurst -= run;
+            faults->NextBreak -= run;
+            faults->NextJitter -= run;
+            continue;
+        }
+        
+        // This character meets a fault or an error. It can leave up to three marks.
+        if (count + 3 > kMaxFaultMarks)
+            break;
+        byte = from[in];
+        error = errors ? errors[in] : 0;
+        in++;
+        
+        dropped = faultDue(faults, &faults->NextDrop, config->DropInterval);
+        doubled = faultDue(faults, &faults->NextDuplicate, config->DuplicateInterval);
+        broken = faultDue(faults, &faults->NextBreak, config->BreakInterval);
+        delayed = faultDue(faults, &faults->NextJitter, config->MaxJitter ? config->JitterInterval : 0);
+        if (faultDue(faults, &faults->NextBurst, config->BurstLength ? config->BurstInterval : 0)){
+            faults->BurstLeft = config->BurstLength;
+            VSPAddRelaxed(faults->Injected, 1);
+        }
+        VSPAddRelaxed(faults->Injected, dropped + doubled + broken + delayed);
+        
+        // At most one flipped bit a character, the rest of the gap starts after it.
+        if (faults->NextBitError < faults->CharBits){
+            bit = (UInt32)faults->NextBitError;
+            rest = faults->CharBits - bit - 1;
+            gap = drawInterval(faults, config->BitErrorInterval);
+            faults->NextBitError = (gap > rest) ? gap - rest : 0;
+            VSPAddRelaxed(faults->Injected, 1);
+            
+            if (bit < faults->DataBits){
+                byte ^= (UInt8)(1 << bit);
+                if (faults->Check && ((faults->Parity == PD_RS232_PARITY_ODD) || (faults->Parity == PD_RS232_PARITY_EVEN)))
+                    error |= kLineParityError;
+            } else if ((bit == faults->DataBits) && (faults->Parity != PD_RS232_PARITY_NONE)){
+                if (faults->Check)
+                    error |= kLineParityError;
+            } else {
+                error |= kLineFramingError;             // The stop bit
+            }
+        } else {
+            faults->NextBitError -= faults->CharBits;
+        }
+        
+        if (faults->BurstLeft){
+            byte ^= (UInt8)((nextRandom(faults) | 1) & ((1 << faults->DataBits) - 1));
+            if (!--faults->BurstLeft)
+                error |= kLineFramingError;
+        }
+        
+        if (broken){
+            marks[count].Offset = out;
+            marks[count].Event = PD_RS232_E_LINE_BREAK;
+            marks[count].Data = true;
+            count++;
+        }
+        if (delayed){
+            marks[count].Offset = out;
+            marks[count].Event = kFaultHold;
+            marks[count].Data = 0;
+            count++;
+        }
+        if (dropped)
+            continue;
+        
+        if (error){
+            marks[count].Offset = out;
+            marks[count].Event = (error & kLineFramingError) ? PD_E_FRAMING_ERROR : PD_E_PARITY_ERROR;
+            marks[count].Data = byte;
+            count++;
+        }
+        to[out++] = byte;
+        if (doubled && (out < room))
+            to[out++] = byte;
+    }
+    
+    *produced = out;
+    *numMarks = count;
+    return in;
+}
+
+
+// The far end's format, for working out what a flipped bit does. Called with the direction's queue lock held.
+void DriverClassName::setLineBits(FaultState *faults, UInt32 charLength, UInt32 parity, bool check){
+    
+    faults->DataBits = charLength;
+    faults->Parity = parity;
+    faults->Check = check;
+    faults->CharBits = charLength + (parity != PD_RS232_PARITY_NONE) + 1;
+}
+
+
+// Restart the generator from the seed. Called with the direction's queue lock held.
+void DriverClassName::resetFaults(FaultState *faults){
+    FaultConfig *config = &faults->Config;
+    
+    faults->Enabled = config->BitErrorInterval || config->DropInterval || config->DuplicateInterval ||
+                      (config->BurstInterval && config->BurstLength) || config->BreakInterval ||
+                      (config->JitterInterval && config->MaxJitter);
+    faults->Random = config->Seed ? config->Seed : 0x9E3779B97F4A7C15ULL;     // xorshift is stuck at 0
+    faults->NextBitError = drawInterval(faults, config->BitErrorInterval);
+    faults->NextDrop = drawInterval(faults, config->DropInterval);
+    faults->NextDuplicate = drawInterval(faults, config->DuplicateInterval);
+    faults->NextBurst = drawInterval(faults, config->BurstLength ? config->BurstInterval : 0);
+    faults->NextBreak = drawInterval(faults, config->BreakInterval);
+    faults->NextJitter = drawInterval(faults, config->MaxJitter ? config->JitterInterval : 0);
+    faults->BurstLeft = 0;
+    faults->Holding = false;
+    VSPStoreRelaxed(faults->Injected, 0);
+}
+
+
+// kSetFaults.
+IOReturn DriverClassName::setFaults(UInt32 direction, const FaultConfig *config){
+    DEBUG_IOLog("VirtualSerialPort::setFaults %u\n", direction);
+    
+    if (direction > kFaultsFromTTY) return kIOReturnBadArgument;
+    if ((config->MaxJitter > kMaxFaultJitter) || (config->BurstLength > kMaxFaultBurst)) return kIOReturnBadArgument;
+    
+    VSPLock     *lock = (direction == kFaultsToTTY) ? RXBufferLock : TXBufferLock;
+    FaultState  *faults = (direction == kFaultsToTTY) ? &fPort.RXFaults : &fPort.TXFaults;
+    LineCoding  *line = (direction == kFaultsToTTY) ? &fPort.RXLine : &fPort.TXLine;
+    
+    if (!lock) return kIOReturnNotReady;
+    
+    VSPLockLock(lock);
+    CancelTimer(&fHoldTimer[direction]);
+    faults->Config = *config;
+    resetFaults(faults);
+    line->Direct = (line->Mode == kLineTransparent) && !faults->Enabled;
+    VSPLockUnlock(lock);
+    
+    // Let go of anything a hold under the old settings kept back.
+    releaseHold(direction);
+    updateStatus();
+    
+    return kIOReturnSuccess;
+}
+
+
+// Called with the direction's queue lock held. Keep the bytes from position on back for a random time,
+// unless they are already being held.
+void DriverClassName::holdBytes(UInt32 direction, UInt64 position){
+    FaultState  *faults = (direction == kFaultsToTTY) ? &fPort.RXFaults : &fPort.TXFaults;
+    
+    if (faults->Holding || !fWheelStarted) return;
+    
+    faults->Holding = true;
+    faults->HoldPosition = position;
+    ArmTimer(&fHoldTimer[direction], (nextRandom(faults) % (faults->Config.MaxJitter + 1)) * 1000);
+}
+
+
+// Called with the direction's queue lock held. How many of size bytes from position aren't held back.
+UInt32 DriverClassName::bytesBeforeHold(FaultState *faults, UInt64 position, UInt32 size){
+    
+    if (!faults->Holding || (faults->HoldPosition >= position + size)) return size;
+    
+    return (faults->HoldPosition > position) ? (UInt32)(faults->HoldPosition - position) : 0;
+}
+
+
+// Hand on whatever was held, the way new data would be.
+void DriverClassName::releaseHold(UInt32 direction){
+    
+    if (direction == kFaultsToTTY){
+        if (!RXBufferLock) return;
+        VSPLockLock(RXBufferLock);
+        fPort.RXFaults.Holding = false;
+        checkQueue(&fPort.RX);
+        VSPLockUnlock(RXBufferLock);
+        sendCreditsDue();
+        return;
+    }
+    
+    if (!TXBufferLock) return;
+    VSPLockLock(TXBufferLock);
+    fPort.TXFaults.Holding = false;
+    VSPLockUnlock(TXBufferLock);
+    
+    notifyDataAvailable();
+    pumpSharedRings();
+}
+
+
+void DriverClassName::rxHoldExpired(void *owner, void *unused){
+    
+    ((DriverClassName*)owner)->releaseHold(kFaultsToTTY);
+}
+
+
+void DriverClassName::txHoldExpired(void *owner, void *unused){
+    
+    ((DriverClassName*)owner)->releaseHold(kFaultsFromTTY);
+}
+
+
+#pragma mark Queue Path
+
+// Called with RXBufferLock held instead of AddtoQueue. Returns the number of bytes queued.
+UInt32 DriverClassName::addToRX(UInt8 *buffer, UInt32 size){
+    UInt32  dropped;
+    
+    if (fPort.RXLine.Direct)
+        return queueRX(buffer, size);
+    
+    return lineToRX(buffer, size, false, &dropped);
+}
+
+
+// kOverflowDropOldest, as addToRX. Returns the number of bytes dropped.
+UInt32 DriverClassName::addToRXOverwrite(UInt8 *buffer, UInt32 size){
+    UInt32  dropped;
+    
+    if (fPort.RXLine.Direct)
+        return queueRXOverwrite(buffer, size);
+    
+    lineToRX(buffer, size, true, &dropped);
+    return dropped;
+}
+
+
+// Called with RXBufferLock held, for bytes that don't cross the line unchanged. They are coded and faults
+// injected a chunk at a time on their way in. Returns the number of bytes of buffer used, all of them when
+// overwriting, and the bytes overwritten in *dropped. With faults the number queued can differ; the
+// difference is counted in BytesIn here, so the caller can add what was used as usual.
+UInt32 DriverClassName::lineToRX(UInt8 *buffer, UInt32 size, bool overwrite, UInt32 *dropped){
+    LineCoding  *line = &fPort.RXLine;
+    FaultState  *faults = &fPort.RXFaults;
+    UInt8       coded[kLineChunk];
+    UInt8       errors[kLineChunk];
+    UInt8       faulted[kLineChunk];
+    FaultMark   marks[kMaxFaultMarks];
+    UInt8       *data;
+    UInt32      added = 0;
+    UInt32      chunk, room, used, produced, queued, numMarks;
+    UInt8       found;
+    
+    *dropped = 0;
+    
+    // Dropped bytes still count in, so the stream position moves on by every byte queued.
+    UInt64 position = fPort.RXStats.BytesOut + UsedSpaceinQueue(&fPort.RX);
+    while (added < size){
+        chunk = min(size - added, kLineChunk);
+        data = buffer + added;
+        found = 0;
+        if (line->Mode != kLineTransparent){
+            found = codeBytes(coded, data, chunk, line);
+            data = coded;
+        }
+        
+        if (!faults->Enabled){
+            if (overwrite){
+                *dropped += queueRXOverwrite(data, chunk);
+                queued = chunk;
+            } else {
+                queued = queueRX(data, chunk);
+            }
+            if (found)
+                noteLineErrors(buffer + added, queued, position);
+            added += queued;
+            position += queued;
+            if (queued < chunk)
+                break;
+            continue;
+        }
+        
+        if (found){
+            for (UInt32 i = 0; i < chunk; i++)
+                errors[i] = line->Errors[buffer[added + i]];
+        }
+        
+        // Only produce what will fit, so every byte used is either queued or lost to a fault.
+        room = overwrite ? kLineChunk : min(FreeSpaceinQueue(&fPort.RX), kLineChunk);
+        if (!room)
+            break;
+        used = injectFaults(faults, data, found ? errors : NULL, chunk, faulted, room, &produced, marks, &numMarks);
+        if (overwrite){
+            *dropped += queueRXOverwrite(faulted, produced);
+            queued = produced;
+        } else {
+            queued = queueRX(faulted, produced);    // Short only when the frame queue fills
+        }
+        VSPStoreRelaxed(fPort.RXStats.BytesIn, fPort.RXStats.BytesIn + queued - used);
+        
+        for (UInt32 i = 0; i < numMarks; i++){
+            if (marks[i].Offset > queued)
+                break;
+            if (marks[i].Event == kFaultHold){
+                holdBytes(kFaultsToTTY, position + marks[i].Offset);
+                continue;
+            }
+            if (marks[i].Event == PD_E_PARITY_ERROR)
+                VSPAddRelaxed(fPort.RXParityErrors, 1);
+            if (marks[i].Event == PD_E_FRAMING_ERROR)
+                VSPAddRelaxed(fPort.RXFramingErrors, 1);
+            putEvent(&fPort.RXEvents, marks[i].Event, marks[i].Data, position + marks[i].Offset);
+        }
+        
+        added += used;
+        position += queued;
+        if (queued < produced)
+            break;
+    }
+    
+    return added;
+}
+
+
+// Called with RXBufferLock held. Queue an event just ahead of each byte that was read with an error,
+// position being the first byte's place in the stream.
+void DriverClassName::noteLineErrors(const UInt8 *buffer, UInt32 size, UInt64 position){
+    LineCoding  *line = &fPort.RXLine;
+    UInt8       errors;
+    
+    for (UInt32 i = 0; i < size; i++){
+        errors = line->Errors[buffer[i]];
+        if (!errors)
+            continue;
+        
+        if (errors & kLineParityError)
+            VSPAddRelaxed(fPort.RXParityErrors, 1);
+        if (errors & kLineFramingError)
+            VSPAddRelaxed(fPort.RXFramingErrors, 1);
+        putEvent(&fPort.RXEvents, (errors & kLineFramingError) ? PD_E_FRAMING_ERROR : PD_E_PARITY_ERROR,
+                 line->Map[buffer[i]], position + i);
+    }
+}
+
+
+// Called with TXBufferLock held instead of AddtoQueue.
+UInt32 DriverClassName::addToTX(UInt8 *buffer, UInt32 size){
+    
+    if (fPort.TXLine.Direct)
+        return AddtoQueue(&fPort.TX, buffer, size);
+    
+    return lineToTX(buffer, size);
+}
+
+
+// Called with TXBufferLock held, coding the bytes as the client's end reads them and injecting faults, as
+// lineToRX does. Breaks become a pair of events in the TX ring, so the client sees PD_RS232_S_BRK go on and
+// off at that point in the data.
+UInt32 DriverClassName::lineToTX(UInt8 *buffer, UInt32 size){
+    LineCoding  *line = &fPort.TXLine;
+    FaultState  *faults = &fPort.TXFaults;
+    UInt8       coded[kLineChunk];
+    UInt8       faulted[kLineChunk];
+    FaultMark   marks[kMaxFaultMarks];
+    UInt8       *data;
+    UInt32      added = 0;
+    UInt32      chunk, room, used, produced, queued, numMarks;
+    UInt64      at;
+    
+    UInt64 position = fPort.TXStats.BytesOut + UsedSpaceinQueue(&fPort.TX);
+    while (added < size){
+        chunk = min(size - added, kLineChunk);
+        data = buffer + added;
+        if (line->Mode != kLineTransparent){
+            codeBytes(coded, data, chunk, line);
+            data = coded;
+        }
+        
+        if (!faults->Enabled){
+            queued = AddtoQueue(&fPort.TX, data, chunk);
+            added += queued;
+            if (queued < chunk)
+                break;
+            continue;
+        }
+        
+        room = min(FreeSpaceinQueue(&fPort.TX), kLineChunk);
+        if (!room)
+            break;
+        used = injectFaults(faults, data, NULL, chunk, faulted, room, &produced, marks, &numMarks);
+        queued = AddtoQueue(&fPort.TX, faulted, produced);
+        VSPStoreRelaxed(fPort.TXStats.BytesIn, fPort.TXStats.BytesIn + queued - used);
+        
+        for (UInt32 i = 0; i < numMarks; i++){
+            at = position + marks[i].Offset;
+            if (marks[i].Event == kFaultHold){
+                holdBytes(kFaultsFromTTY, at);
+            } else if ((marks[i].Event == PD_RS232_E_LINE_BREAK) &&
+                       (eventsQueued(&fPort.TXEvents) <= kEventRingSize - 2)){
+                // Both halves or neither, a break left on would stay on.
+                putEvent(&fPort.TXEvents, PD_RS232_E_LINE_BREAK, true, at);
+                putEvent(&fPort.TXEvents, PD_RS232_E_LINE_BREAK, false, at);
+            }
+        }
+        
+        added += used;
+        position += queued;
+    }
+    
+    return added;
+}
+
+
+#pragma mark Shared Rings
+
+IOBufferMemoryDescriptor* DriverClassName::getSharedRing(UInt32 type){
+    DEBUG_IOLog("VirtualSerialPort::getSharedRing %u\n", type);
+    
+    if (type >= kNumberOfSharedRings) return NULL;
+    
+    VSPLock *lock = (type == kSharedRXRing) ? RXBufferLock : TXBufferLock;
+    if (!lock) return NULL;
+    
+    VSPLockLock(lock);
+    if (!fSharedMemory[type]){
+        IOBufferMemoryDescriptor *memory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                                                 sizeof(SharedRing), page_size);
+        if (memory){
+            bzero(memory->getBytesNoCopy(), sizeof(SharedRing));
+            fSharedMemory[type] = memory;
+            VSPStoreRelaxed(fShared[type], (SharedRing*)memory->getBytesNoCopy());
+        }
+    }
+    VSPLockUnlock(lock);
+    
+    return fSharedMemory[type];
+}
+
+
+// Called with RXBufferLock held. Moves as much of the shared RX ring into the RX queue as will fit.
+// Only the driver writes Tail, but user space can scribble on the whole page, so every index read
+// from it is masked and a nonsensical fill level is ignored.
+bool DriverClassName::pullSharedRX(void){
+    SharedRing  *ring = fShared[kSharedRXRing];
+    UInt32      head, tail, used, offset, chunk, added;
+    UInt32      moved = 0;
+    
+    if (!ring) return false;
+    
+    tail = __atomic_load_n(&ring->Tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&ring->Head, __ATOMIC_SEQ_CST);     // before the data it covers
+    
+    used = head - tail;
+    if (used > kSharedRingSize) return false;
+    
+    while (used){
+        offset = tail & (kSharedRingSize - 1);
+        chunk = kSharedRingSize - offset;
+        if (chunk > used)
+            chunk = used;
+        
+        added = addToRX(&ring->Data[offset], chunk);
+        tail += added;
+        used -= added;
+        moved += added;
+        if (added < chunk)
+            break;                  // RX queue is full
+    }
+    
+    if (!moved) return false;
+    
+    VSPAddRelaxed(fPort.RXStats.BytesIn, moved);
+    __atomic_store_n(&ring->Tail, tail, __ATOMIC_SEQ_CST);     // once the copy is done
+    
+    return true;
+}
+
+
+// Called with TXBufferLock held. Moves as much of the TX queue into the shared TX ring as will fit.
+bool DriverClassName::pushSharedTX(void){
+    SharedRing  *ring = fShared[kSharedTXRing];
+    UInt32      head, tail, space, offset, chunk, removed;
+    UInt32      moved = 0;
+    
+    if (!ring) return false;
+    
+    head = __atomic_load_n(&ring->Head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&ring->Tail, __ATOMIC_SEQ_CST);     // before reusing the space it frees
+    
+    if ((head - tail) > kSharedRingSize) return false;
+    space = kSharedRingSize - (head - tail);
+    space = bytesBeforeHold(&fPort.TXFaults, fPort.TXStats.BytesOut, space);
+    
+    while (space && UsedSpaceinQueue(&fPort.TX)){
+        offset = head & (kSharedRingSize - 1);
+        chunk = kSharedRingSize - offset;
+        if (chunk > space)
+            chunk = space;
+        
+        removed = RemovefromQueue(&fPort.TX, &ring->Data[offset], chunk);
+        head += removed;
+        space -= removed;
+        moved += removed;
+        if (removed < chunk)
+            break;                  // TX queue is empty
+    }
+    
+    if (!moved) return false;
+    
+    VSPAddRelaxed(fPort.TXStats.BytesOut, moved); // runTXEvents picks up any events this makes due
+    __atomic_store_n(&ring->Head, head, __ATOMIC_SEQ_CST);     // publishes the data
+    
+    return true;
+}
+
+
+// Called after pullSharedRX or pushSharedTX has stored its index. Sequentially consistent with that store,
+// so a waiter that set WakeupRequested either sees the new index or is seen here.
+bool DriverClassName::takeWakeup(SharedRing *ring){
+    
+    if (!ring || !__atomic_load_n(&ring->WakeupRequested, __ATOMIC_SEQ_CST)) return false;
+    
+    return __atomic_exchange_n(&ring->WakeupRequested, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+
+// Called for kRingDoorbell, and whenever either queue may have room to move data to or from the rings.
+void DriverClassName::pumpSharedRings(void){
+    bool    wakeRX = false;
+    bool    wakeTX = false;
+    
+    // Only looked at here, the rings are used under the queue locks.
+    if (RXBufferLock && VSPLoadRelaxed(fShared[kSharedRXRing])){
+        VSPLockLock(RXBufferLock);
+        if (pullSharedRX()){
+            checkQueue(&fPort.RX);
+            wakeRX = takeWakeup(fShared[kSharedRXRing]);
+        }
+        VSPLockUnlock(RXBufferLock);
+        sendCreditsDue();
+    }
+    
+    if (TXBufferLock && VSPLoadRelaxed(fShared[kSharedTXRing])){
+        VSPLockLock(TXBufferLock);
+        if (pushSharedTX()){
+            checkQueue(&fPort.TX);
+            wakeTX = takeWakeup(fShared[kSharedTXRing]);
+            VSPLockWakeup(TXBufferLock, &fPort.TX, false);   // space for a blocked enqueueData
+        }
+        VSPLockUnlock(TXBufferLock);
+    }
+    
+    if (wakeRX) notifyRingWakeup(kSharedRXRing);
+    if (wakeTX) notifyRingWakeup(kSharedTXRing);
+    
+    runTXEvents();
+}
+
+
+#pragma mark User Clients
+
+// VSPUserClients open us to register for notifications and data. Any number up to kMaxUserClients
+// can be attached at once, each holding a reference while it is in the list. Anything else gets
+// IOService's usual exclusive open.
+bool DriverClassName::handleOpen(IOService *forClient, IOOptionBits options, void *arg){
+    VSPUserClient   *userClient = OSDynamicCast(VSPUserClient, forClient);
+    bool            opened = false;
+    
+    if (!userClient)
+        return super::handleOpen(forClient, options, arg);
+    if (!fClientLock)
+        return false;
+    
+    VSPLockLock(fClientLock);
+    if (fNumClients < kMaxUserClients){
+        userClient->retain();
+        fClients[fNumClients++] = userClient;
+        opened = true;
+    }
+    VSPLockUnlock(fClientLock);
+    
+    return opened;
+}
+
+
+void DriverClassName::handleClose(IOService *forClient, IOOptionBits options){
+    VSPUserClient   *userClient = OSDynamicCast(VSPUserClient, forClient);
+    bool            found = false;
+    
+    if (!userClient){
+        super::handleClose(forClient, options);
+        return;
+    }
+    
+    VSPLockLock(fClientLock);
+    for (UInt32 i = 0; i < fNumClients; i++){
+        if (fClients[i] == userClient){
+            fClients[i] = fClients[--fNumClients];
+            found = true;
+            break;
+        }
+    }
+    VSPLockUnlock(fClientLock);
+    
+    if (found)
+        userClient->release();
+}
+
+
+bool DriverClassName::handleIsOpen(const IOService *forClient) const{
+    bool    open = false;
+    
+    if (!fClientLock)
+        return super::handleIsOpen(forClient);
+    
+    VSPLockLock(fClientLock);
+    for (UInt32 i = 0; i < fNumClients; i++){
+        if ((forClient == NULL) || (fClients[i] == forClient)){
+            open = true;
+            break;
+        }
+    }
+    VSPLockUnlock(fClientLock);
+    
+    return open || super::handleIsOpen(forClient);
+}
+
+
+// Take a retained copy of the client list so that clients can be called without holding fClientLock,
+// and can't go away while we are calling them. Pair with releaseClients.
+UInt32 DriverClassName::copyClients(VSPUserClient **clients){
+    UInt32  count = 0;
+    
+    if (!fClientLock) return 0;
+    
+    VSPLockLock(fClientLock);
+    for (count = 0; count < fNumClients; count++){
+        clients[count] = fClients[count];
+        clients[count]->retain();
+    }
+    VSPLockUnlock(fClientLock);
+    
+    return count;
+}
+
+
+void DriverClassName::releaseClients(VSPUserClient **clients, UInt32 count){
+    
+    for (UInt32 i = 0; i < count; i++)
+        clients[i]->release();
+}
+
+
+// stateDelta are the state bits that changed, fields the kPortField... bits. Each client drops
+// the notification straight away if it isn't subscribed to any of them.
+void DriverClassName::notifyPortChanged(UInt32 stateDelta, UInt64 fields){
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    
+    for (UInt32 i = 0; i < numClients; i++)
+        clients[i]->portChanged(stateDelta, fields);
+    releaseClients(clients, numClients);
+}
+
+
+void DriverClassName::notifyDataAvailable(void){
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    
+    for (UInt32 i = 0; i < numClients; i++)
+        clients[i]->dataAvailable();
+    releaseClients(clients, numClients);
+}
+
+
+void DriverClassName::notifyPortClosed(void){
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    
+    for (UInt32 i = 0; i < numClients; i++)
+        clients[i]->portClosed();
+    releaseClients(clients, numClients);
+}
+
+
+void DriverClassName::notifyRingWakeup(UInt32 ring){
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    
+    for (UInt32 i = 0; i < numClients; i++)
+        clients[i]->sendRingWakeup(ring);
+    releaseClients(clients, numClients);
+}
+
+
+void DriverClassName::notifyCredits(void){
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    UInt64          limit, sent;
+    
+    getCredits(&limit, &sent);
+    for (UInt32 i = 0; i < numClients; i++)
+        clients[i]->creditsAvailable(limit, sent);
+    releaseClients(clients, numClients);
+}
+
+
+// Sends the credit checkQueue left owing, with RXBufferLock dropped. The totals are read now, they only
+// grow, so a later read hands back at least what was due.
+void DriverClassName::sendCreditsDue(void){
+    
+    if (__atomic_exchange_n(&fCreditsDue, false, __ATOMIC_RELAXED))
+        notifyCredits();
+}
+
+
+void DriverClassName::notifySendSpace(void){
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    
+    for (UInt32 i = 0; i < numClients; i++)
+        clients[i]->sendSpaceAvailable();
+    releaseClients(clients, numClients);
+}
+
+
+// The kPortField... bits an executeEvent can change.
+UInt64 DriverClassName::eventFields(UInt32 event){
+    
+    switch (event){
+        case PD_E_ACTIVE:               return ~0ULL & ~(1ULL << kPortFieldState);     // setStructureDefaults
+        case PD_RS232_E_XON_BYTE:       return 1ULL << kPortFieldXONchar;
+        case PD_RS232_E_XOFF_BYTE:      return 1ULL << kPortFieldXOFFchar;
+        case PD_E_FLOW_CONTROL:         return 1ULL << kPortFieldFlowControl;
+        case PD_RS232_E_MIN_LATENCY:    return 1ULL << kPortFieldMinLatency;
+        case PD_E_DATA_INTEGRITY:       return (1ULL << kPortFieldTXParity) | (1ULL << kPortFieldRXParity);
+        case PD_E_RX_DATA_INTEGRITY:    return 1ULL << kPortFieldRXParity;
+        case PD_E_DATA_RATE:            return 1ULL << kPortFieldBaudRate;
+        case PD_E_DATA_SIZE:            return 1ULL << kPortFieldCharLength;
+        case PD_RS232_E_STOP_BITS:      return 1ULL << kPortFieldStopBits;
+        default:                        return 0;
+    }
+}
+
+
+#pragma mark Status Page
+
+IOBufferMemoryDescriptor* DriverClassName::getStatusPage(void){
+    
+    return fStatusMemory;
+}
+
+
+// Rewrite the status page from fPort. Writers are serialised by fStatusLock, readers in user space
+// use the sequence count and never block us. Every field is stored atomically, as readers load them
+// while we write.
+void DriverClassName::updateStatus(void){
+    PortStatusPage  *status = fStatus;
+    
+    if (!status || !fStatusLock) return;
+    
+    VSPLockLock(fStatusLock);
+    VSPStoreRelaxed(status->Sequence, status->Sequence + 1);   // Odd, update in progress
+    OSMemoryBarrier();
+    
+    VSPStoreRelaxed(status->Values[kPortFieldState], readPortState());
+    VSPStoreRelaxed(status->Values[kPortFieldCharLength], VSPLoadRelaxed(fPort.CharLength));
+    VSPStoreRelaxed(status->Values[kPortFieldStopBits], VSPLoadRelaxed(fPort.StopBits));
+    VSPStoreRelaxed(status->Values[kPortFieldTXParity], VSPLoadRelaxed(fPort.TX_Parity));
+    VSPStoreRelaxed(status->Values[kPortFieldRXParity], VSPLoadRelaxed(fPort.RX_Parity));
+    VSPStoreRelaxed(status->Values[kPortFieldBaudRate], VSPLoadRelaxed(fPort.BaudRate));
+    VSPStoreRelaxed(status->Values[kPortFieldMinLatency], VSPLoadRelaxed(fPort.MinLatency));
+    VSPStoreRelaxed(status->Values[kPortFieldXONchar], VSPLoadRelaxed(fPort.XONchar));
+    VSPStoreRelaxed(status->Values[kPortFieldXOFFchar], VSPLoadRelaxed(fPort.XOFFchar));
+    VSPStoreRelaxed(status->Values[kPortFieldFlowControl], VSPLoadRelaxed(fPort.FlowControl));
+    VSPStoreRelaxed(status->Values[kPortFieldFlowControlState], VSPLoadRelaxed(fPort.FlowControlState));
+    VSPStoreRelaxed(status->Values[kPortFieldRXOstate], VSPLoadRelaxed(fPort.RXOstate));
+    VSPStoreRelaxed(status->Values[kPortFieldTXOstate], VSPLoadRelaxed(fPort.TXOstate));
+    VSPStoreRelaxed(status->Values[kPortFieldRXOverflowPolicy], VSPLoadRelaxed(fPort.RXOverflowPolicy));
+    VSPStoreRelaxed(status->Values[kPortFieldRXOverRuns], VSPLoadRelaxed(fPort.RXStats.OverRunCount));
+    
+    VSPStoreRelaxed(status->RXUsed, UsedSpaceinQueue(&fPort.RX));
+    VSPStoreRelaxed(status->RXSize, GetQueueSize(&fPort.RX));
+    VSPStoreRelaxed(status->TXUsed, UsedSpaceinQueue(&fPort.TX));
+    VSPStoreRelaxed(status->TXSize, GetQueueSize(&fPort.TX));
+    VSPStoreRelaxed(status->RXBytesIn, VSPLoadRelaxed(fPort.RXStats.BytesIn));
+    VSPStoreRelaxed(status->RXBytesOut, VSPLoadRelaxed(fPort.RXStats.BytesOut));
+    VSPStoreRelaxed(status->TXBytesIn, VSPLoadRelaxed(fPort.TXStats.BytesIn));
+    VSPStoreRelaxed(status->TXBytesOut, VSPLoadRelaxed(fPort.TXStats.BytesOut));
+    VSPStoreRelaxed(status->TXOverRuns, VSPLoadRelaxed(fPort.TXStats.OverRunCount));
+    VSPStoreRelaxed(status->RXParityErrors, VSPLoadRelaxed(fPort.RXParityErrors));
+    VSPStoreRelaxed(status->RXFramingErrors, VSPLoadRelaxed(fPort.RXFramingErrors));
+    VSPStoreRelaxed(status->RXFaults, VSPLoadRelaxed(fPort.RXFaults.Injected));
+    VSPStoreRelaxed(status->TXFaults, VSPLoadRelaxed(fPort.TXFaults.Injected));
+    
+    OSMemoryBarrier();
+    VSPStoreRelaxed(status->Sequence, status->Sequence + 1);   // Even, page is consistent
+    VSPLockUnlock(fStatusLock);
+}
+
+
+// Kernel side readers can simply take the writer lock.
+void DriverClassName::readStatus(UInt64* values){
+    
+    if (!fStatus || !fStatusLock){
+        bzero(values, sizeof(fStatus->Values));
+        return;
+    }
+    
+    VSPLockLock(fStatusLock);
+    bcopy(fStatus->Values, values, sizeof(fStatus->Values));
+    VSPLockUnlock(fStatusLock);
+}
+
+
+#pragma mark Batches
+
+// Run a packed list of BatchCommand records (see Shared.h) in order, filling in one result per record.
+IOReturn DriverClassName::executeBatch(UInt8* commands, UInt32 size, BatchResult* results, UInt32 maxResults, UInt32* numResults){
+    DEBUG_IOLog("VirtualSerialPort::executeBatch %u bytes\n", size);
+    
+    IOReturn    ret = kIOReturnSuccess;
+    UInt32      offset = 0;
+    UInt32      count = 0;
+    UInt32      value;
+    bool        malformed = false;
+    
+    *numResults = 0;
+    if (!fBatchLock) return kIOReturnNotReady;
+    
+    VSPLockLock(fBatchLock);
+    while (!malformed && ((size - offset) >= sizeof(BatchCommand))){
+        BatchCommand    *command = (BatchCommand*)(commands + offset);
+        BatchResult     *result = &results[*numResults];
+        
+        if (*numResults == maxResults){
+            ret = kIOReturnNoSpace;
+            break;
+        }
+        
+        offset += sizeof(BatchCommand);
+        result->Command = command->Command;
+        result->Value = 0;
+        
+        switch (command->Command){
+            case kBatchExecuteEvent:
+                result->Result = executeEvent(command->Arg0, (UInt32)command->Arg1, NULL);
+                break;
+            case kBatchRequestEvent:
+                value = 0;
+                result->Result = requestEvent(command->Arg0, &value, NULL);
+                result->Value = value;
+                break;
+            case kBatchSetState:
+                // DTR and RTS are the tty's, it sets them with setState.
+                if (command->Arg0 & ~CLIENT_STATE_MASK){
+                    result->Result = kIOReturnBadArgument;
+                } else if (!(readPortState() & PD_S_ACQUIRED)){
+                    result->Result = kIOReturnNotOpen;
+                } else {
+                    writePortState((UInt32)command->Arg1, command->Arg0);
+                    result->Result = kIOReturnSuccess;
+                }
+                break;
+            case kBatchGetState:
+                result->Value = readPortState();
+                result->Result = kIOReturnSuccess;
+                break;
+            case kBatchSendEvent:
+                result->Result = sendEvent(command->Arg0, (UInt32)command->Arg1);
+                break;
+            case kBatchSend:
+                if (command->Arg1 > (size - offset)){
+                    result->Result = kIOReturnBadArgument;
+                    malformed = true;
+                    break;
+                }
+                result->Result = sendBuffer(commands + offset, (UInt32)command->Arg1, &count);
+                result->Value = count;
+                offset += (UInt32)command->Arg1;
+                offset += min((-offset) & 7, size - offset);    // Padding, the last record may omit it
+                break;
+            default:
+                // The rest of the list can't be trusted.
+                result->Result = kIOReturnBadArgument;
+                malformed = true;
+                break;
+        }
+        
+        (*numResults)++;
+    }
+    VSPLockUnlock(fBatchLock);
+    
+    return ret;
+}
+
+
+IOReturn DriverClassName::getInfo(void){
+    DEBUG_IOLog("VirtualSerialPort::getInfo\n");
+    
+    updateStatus();
+    
+    VSPUserClient   *clients[kMaxUserClients];
+    UInt32          numClients = copyClients(clients);
+    
+    for (UInt32 i = 0; i < numClients; i++){
+        clients[i]->sendPortInfo();
+        clients[i]->sendPortState(readPortState());
+    }
+    releaseClients(clients, numClients);
+
+    return kIOReturnSuccess;
+}
+
+
+
+
+#pragma mark Lock Stats
+
+// See kGetLockStats.
+IOReturn DriverClassName::getLockStats(UInt32 index, bool clear, LockStats* stats, UInt32 maxStats, UInt32* numStats){
+    
+    *numStats = 0;
+    if (index >= kNumberOfLocks) return kIOReturnBadArgument;
+    
+#ifdef VSP_LOCK_STATS
+    VSPLock *locks[kNumberOfLocks] = { fPort.serialRequestLock, RXBufferLock, TXBufferLock, fStatusLock, fBatchLock, fClientLock, fResponderLock };
+    
+    if (!locks[index]) return kIOReturnNotReady;
+    if (maxStats == 0) return kIOReturnBadArgument;
+    
+    *numStats = ReadLockStats(locks[index], stats, maxStats, clear);
+    return kIOReturnSuccess;
+#else
+    return kIOReturnUnsupported;
+#endif
+}
+
+
+#pragma mark Responder
+
+// kSetResponder. The rules are compiled before the lock is taken; the old responder can only be in use
+// under the lock, and so can be freed once it is swapped out.
+IOReturn DriverClassName::setResponder(const UInt8* table, UInt32 size){
+    DEBUG_IOLog("VirtualSerialPort::setResponder %u bytes\n", size);
+    
+    Responder   *responder = NULL;
+    Responder   *old;
+    IOReturn    result;
+    
+    if (!fResponderLock) return kIOReturnNotReady;
+    
+    if (size){
+        result = CreateResponder(table, size, &responder);
+        if (result != kIOReturnSuccess) return result;
+    }
+    
+    VSPLockLock(fResponderLock);
+    CancelTimer(&fResponderTimer);
+    old = fResponder;
+    fResponder = responder;
+    VSPLockUnlock(fResponderLock);
+    
+    if (old)
+        FreeResponder(old);
+    
+    return kIOReturnSuccess;
+}
+
+
+IOReturn DriverClassName::getResponderStats(bool clear, ResponderStats* stats){
+    IOReturn    result = kIOReturnNotFound;
+    
+    bzero(stats, sizeof(ResponderStats));
+    if (!fResponderLock) return kIOReturnNotReady;
+    
+    VSPLockLock(fResponderLock);
+    if (fResponder){
+        *stats = fResponder->Stats;
+        if (clear)
+            bzero(&fResponder->Stats, sizeof(ResponderStats));
+        result = kIOReturnSuccess;
+    }
+    VSPLockUnlock(fResponderLock);
+    
+    return result;
+}
+
+
+// Called by enqueueData with what the tty wrote. Returns whether a responder took the data for itself.
+bool DriverClassName::respond(UInt8 *buffer, UInt32 size){
+    Responder   *responder;
+    UInt32      taken = 0;
+    UInt32      dropped = 0;
+    bool        complete, consumed;
+    
+    if (!fResponderLock) return false;
+    
+    VSPLockLock(fResponderLock);
+    responder = fResponder;
+    if (!responder){
+        VSPLockUnlock(fResponderLock);
+        return false;
+    }
+    while (taken < size){
+        taken += ResponderTake(responder, buffer + taken, size - taken, &complete);
+        if (complete)
+            dropped += answer(responder);
+    }
+    consumed = !(responder->Header.Flags & kResponderPassThrough);
+    VSPLockUnlock(fResponderLock);
+    
+    // Let the clients see the updated overrun count, as sendBuffer does.
+    if (dropped) notifyPortChanged(0, 1ULL << kPortFieldRXOverRuns);
+    
+    return consumed;
+}
+
+
+// Called with fResponderLock held once a message is complete. Returns the bytes the RX queue had no room for.
+UInt32 DriverClassName::answer(Responder *responder){
+    const CompiledRule  *rule;
+    UInt32              size;
+    
+    rule = ResponderAnswer(responder, &size);
+    if (!rule) return 0;
+    
+    // Responses go out in order, so one that is due at once still waits behind any that are paced.
+    if (!rule->Delay && !rule->Interval && !ResponderPending(responder))
+        return sendReply(responder, size);
+    
+    if (!fWheelStarted || !ResponderQueue(responder, size, UptimeNanoseconds() + rule->Delay, rule->Interval)){
+        responder->Stats.Dropped += size;
+        return 0;
+    }
+    
+    return sendDueReplies(responder);
+}
+
+
+// Called with fResponderLock held. Queues the first size bytes of the responder's Reply for the tty the way
+// sendBuffer does under kOverflowDropNewest, and returns how many were dropped.
+UInt32 DriverClassName::sendReply(Responder *responder, UInt32 size){
+    UInt32  added, dropped;
+    
+    VSPLockLock(RXBufferLock);
+    added = addToRX(responder->Reply, size);
+    dropped = size - added;
+    VSPAddRelaxed(fPort.RXStats.BytesIn, added);
+    if (dropped)
+        noteOverrun(dropped, fPort.RXStats.BytesIn);
+    checkQueue(&fPort.RX);
+    writePortState(256,256);
+    VSPLockUnlock(RXBufferLock);
+    
+    responder->Stats.ResponseBytes += added;
+    responder->Stats.Dropped += dropped;
+    
+    return dropped;
+}
+
+
+// Called with fResponderLock held. Sends what the paced responses have due and sets the timer for the rest.
+UInt32 DriverClassName::sendDueReplies(Responder *responder){
+    UInt64  now = UptimeNanoseconds();
+    UInt64  next;
+    UInt32  count;
+    UInt32  dropped = 0;
+    
+    // Reply is free once answer has queued it, so the bytes due are gathered there.
+    for (;;){
+        count = ResponderDue(responder, now, responder->Reply, kMaxResponderReply, &next);
+        if (!count)
+            break;
+        dropped += sendReply(responder, count);
+    }
+    if (next)
+        ArmTimer(&fResponderTimer, next - now);
+    
+    return dropped;
+}
+
+
+void DriverClassName::responderTimerFired(void *owner, void *unused){
+    DriverClassName *port = (DriverClassName*)owner;
+    UInt32          dropped = 0;
+    
+    VSPLockLock(port->fResponderLock);
+    if (port->fResponder)
+        dropped = port->sendDueReplies(port->fResponder);
+    VSPLockUnlock(port->fResponderLock);
+    
+    if (dropped) port->notifyPortChanged(0, 1ULL << kPortFieldRXOverRuns);
+}
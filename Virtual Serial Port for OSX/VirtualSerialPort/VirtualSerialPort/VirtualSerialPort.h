@@ -7,8 +7,12 @@
 #define VIRTUAL_SERIAL_PORT_H
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/serial/IOSerialDriverSync.h> // superclass
 #include "SccQueue.h"
+#include "VSPTimer.h"
+#include "VSPLock.h"
+#include "VSPResponder.h"
 #include "Shared.h"
 #include "VSPUserClient.h"
 
@@ -21,10 +25,14 @@
 #define DEFAULT_STATE		(PD_S_TX_ENABLE | PD_S_RX_ENABLE | PD_RS232_A_TXO | PD_RS232_A_RXO)
 #define STATE_ALL           (PD_RS232_S_MASK | PD_S_MASK)
 #define EXTERNAL_MASK   	(PD_S_MASK | (PD_RS232_S_MASK & ~PD_RS232_S_LOOP))
+#define CLIENT_STATE_MASK	(PD_RS232_S_CTS | PD_RS232_S_DSR | PD_RS232_S_CAR | PD_RS232_S_RNG)    // The DCE's lines, which the user client drives
 #define MIN_BAUD (50 << 1)
 #define kDefaultBaudRate	9600
 #define kMaxBaudRate		230400
-#define kMaxCirBufferSize	kMessageBufferSize
+#define kMaxCirBufferSize	(4 * 1024)          // Default queue size, PD_E_RXQ_SIZE and PD_E_TXQ_SIZE change it
+#define kMinCirBufferSize	64
+#define kMaxCirBufferLimit	(1024 * 1024)
+#define kMaxUserClients     8
 
 
 #define IDLE_XO	   			0
@@ -39,17 +47,12 @@
 #define kPortName               "VirtualSerialPort"
 
 
-static inline mach_timespec long2tval(unsigned long val){
-    mach_timespec tval;
-    
-    tval.tv_sec = val / NSEC_PER_SEC;
-    tval.tv_nsec = val % NSEC_PER_SEC;
-    return tval;
-}
-
-static inline unsigned long tval2long(mach_timespec val){
-    return (val.tv_sec * NSEC_PER_SEC) + val.tv_nsec;
-}
+// Fields the status page and the user client read without the lock their writers hold, one aligned
+// word each, so these are plain loads and stores that tell the compiler and ThreadSanitizer as much.
+// VSPAddRelaxed is not an atomic add, writers still serialize among themselves.
+#define VSPLoadRelaxed(field)           __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define VSPStoreRelaxed(field, value)   __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define VSPAddRelaxed(field, value)     VSPStoreRelaxed(field, (field) + (value))
 
 
 
@@ -57,16 +60,111 @@ typedef struct BufferMarks{
     unsigned long	BufferSize;
     unsigned long	HighWater;
     unsigned long	LowWater;
-    bool		OverRun;
+    bool		OverRun;            // An overrun event is queued that the tty has not yet taken
+    UInt64		OverRunCount;       // Bytes lost to overruns since the port was acquired
+    UInt64		BytesIn;            // Bytes added to the queue since the driver started
+    UInt64		BytesOut;           // Bytes taken out of, or discarded from, the queue since the driver started
 } BufferMarks;
 
 
+// Frame boundaries in a framed RX queue, see kSetFraming in Shared.h. Lengths is a ring of the complete
+// frames in the queue, oldest first; the bytes after them belong to a frame still arriving.
+typedef struct FrameQueue{
+    UInt32      Mode;                   // kFramingNone, kFramingDelimiter, kFramingLengthPrefix or kFramingFixed
+    UInt32      Parameter;              // The delimiter, or the width of the length prefix
+    UInt32      MaxSize;                // Longest frame, 0 for the queue size
+    UInt32      Partial;                // Bytes queued of the frame still arriving
+    UInt32      Prefix;                 // Its length prefix, as far as it has arrived
+    UInt32      First;                  // Index in Lengths of the oldest complete frame
+    UInt32      Count;                  // Complete frames queued
+    UInt32      Lengths[kMaxQueuedFrames];
+} FrameQueue;
+
+
+// Events in band with the data, one ring each way: events for the tty from kSendEvent and overruns, and
+// events the tty queued with enqueueEvent behind data it wrote. Position is where the event belongs in the
+// stream, mostly the queue's BytesIn when it was queued, and the event is due once BytesOut reaches it. Head and Tail are free running counts.
+// Producers are serialized by the queue's lock, which they hold anyway to read BytesIn; consumers take
+// events without a lock by moving Tail on with a compare and swap. Head, Tail and the entries' fields
+// are only touched with __atomic builtins: Head is stored with release once its entry is written, Tail
+// with release once its entry is copied, and each side loads the other's with acquire.
+typedef struct EventEntry{
+    UInt32      Event;
+    UInt32      Data;
+    UInt64      Position;
+} EventEntry;
+
+typedef struct EventRing{
+    UInt32          Head;
+    UInt32          Tail;
+    EventEntry      Entries[kEventRingSize];
+} EventRing;
+
+static inline UInt32 eventsQueued(EventRing *ring){
+    return __atomic_load_n(&ring->Head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE);
+}
+
+
+// How the bytes crossing the line in one direction are read at the far end, see kSetLineFormat in Shared.h.
+// Rebuilt whenever either end's format changes, under that direction's queue lock.
+enum{
+    kLineTransparent,       // 8 data bits and the same parity at both ends, bytes cross unchanged
+    kLineMask,              // Same format at both ends, only the data bits cross
+    kLineDecode             // Formats differ, look each byte up in Map and Errors
+};
+
+#define kLineParityError    0x01
+#define kLineFramingError   0x02
+#define kLineChunk          256         // Bytes coded at a time on the stack
+
+typedef struct LineCoding{
+    UInt32      Mode;
+    bool        Direct;                 // Transparent and no faults, bytes go straight into the queue
+    UInt8       Mask;                   // Data bits, for kLineMask
+    UInt8       Map[256];               // What each byte is read as, for kLineDecode
+    UInt8       Errors[256];            // kLineParityError and kLineFramingError found reading it
+} LineCoding;
+
+
+// Fault injection one way, see kSetFaults in Shared.h. Each Next... counts down the characters, or for bit
+// errors the bits, before that fault strikes. Used under the direction's queue lock.
+typedef struct FaultState{
+    FaultConfig Config;
+    bool        Enabled;
+    UInt64      Random;                 // xorshift64* state
+    UInt64      NextBitError;
+    UInt64      NextDrop;
+    UInt64      NextDuplicate;
+    UInt64      NextBurst;
+    UInt64      NextBreak;
+    UInt64      NextJitter;
+    UInt32      BurstLeft;              // Characters still to garble
+    UInt32      CharBits;               // A character on the line, data, parity and one stop bit
+    UInt32      DataBits;               // The far end's format
+    UInt32      Parity;
+    bool        Check;                  // Whether the far end checks parity
+    bool        Holding;                // Jitter, bytes from HoldPosition on wait for fHoldTimer
+    UInt64      HoldPosition;
+    UInt64      Injected;               // Faults since the port was acquired
+} FaultState;
+
+// Something for the queue path to do at Offset in the bytes injectFaults produced.
+#define kMaxFaultMarks      32
+#define kFaultHold          0xFFFFFFFF  // Event for a jitter hold
+
+typedef struct FaultMark{
+    UInt32      Offset;
+    UInt32      Event;
+    UInt32      Data;
+} FaultMark;
+
+
 typedef struct{
     // State and serialization variables
     
     UInt32		State;
     UInt32		WatchStateMask;
-    IOLock      *serialRequestLock;
+    VSPLock     *serialRequestLock;
     
     // queue control structures:
     
@@ -75,6 +173,10 @@ typedef struct{
     
     BufferMarks RXStats;
     BufferMarks TXStats;
+    UInt32      RXOverflowPolicy;       // kOverflowBlock, kOverflowDropNewest or kOverflowDropOldest
+    FrameQueue  RXFrames;
+    EventRing   RXEvents;               // For the tty, taken by dequeueEvent
+    EventRing   TXEvents;               // From the tty's enqueueEvent, run as the client reads past them
     
     // UART configuration info:
     
@@ -84,6 +186,14 @@ typedef struct{
     UInt32		RX_Parity;
     UInt32		BaudRate;
     bool        MinLatency;
+    UInt32      RemoteCharLength;       // The client's end of the line, 0 follows CharLength
+    UInt32      RemoteParity;           // 0 follows TX_Parity
+    LineCoding  RXLine;                 // Client to tty
+    LineCoding  TXLine;                 // tty to client
+    UInt64      RXParityErrors;         // Since the port was acquired
+    UInt64      RXFramingErrors;
+    FaultState  RXFaults;               // Client to tty
+    FaultState  TXFaults;               // tty to client
     
     // flow control state & configuration:
     
@@ -96,8 +206,8 @@ typedef struct{
     SInt16		RXOstate;    			// Indicates our receive state.
     SInt16		TXOstate;               // Indicates our transmit state, if we have received any Flow Control.
     
-    mach_timespec	DataLatInterval;
-    mach_timespec	CharLatInterval;
+    UInt64      DataLatency;            // Nanoseconds, PD_E_DATA_LATENCY
+    UInt64      CharLatency;            // and PD_E_DELAY, one word each so they can be read unlocked
     
 } PortInfo;
 
@@ -112,11 +222,72 @@ private:
     
     bool        fTerminate;				// Are we being terminated (ie the device was unplugged)
     bool        fStopping;				// Are we being "stopped"
-    IOLock      *RXBufferLock;
+    VSPLock     *RXBufferLock;
+    VSPLock     *TXBufferLock;
+    
+    // Rings shared with user space, allocated the first time a client maps them.
+    IOBufferMemoryDescriptor    *fSharedMemory[kNumberOfSharedRings];
+    SharedRing                  *fShared[kNumberOfSharedRings];
+    
+    // Read only status page mirrored from fPort, see PortStatusPage in Shared.h.
+    IOBufferMemoryDescriptor    *fStatusMemory;
+    PortStatusPage              *fStatus;
+    VSPLock                     *fStatusLock;
+    
+    VSPLock     *fBatchLock;            // Keeps batches from different clients from interleaving
+    
+    // Attached user clients, each retained while it is in the list.
+    VSPLock         *fClientLock;
+    VSPUserClient   *fClients[kMaxUserClients];
+    UInt32          fNumClients;
+    
+    UInt32  copyClients(VSPUserClient **clients);
+    void    releaseClients(VSPUserClient **clients, UInt32 count);
+    void    notifyPortChanged(UInt32 stateDelta, UInt64 fields);
+    void    notifyDataAvailable(void);
+    void    notifyPortClosed(void);
+    void    notifyRingWakeup(UInt32 ring);
+    void    notifyCredits(void);
+    void    notifySendSpace(void);
+    static  UInt64  eventFields(UInt32 event);
+    
+    bool    pullSharedRX(void);
+    bool    pushSharedTX(void);
+    bool    takeWakeup(SharedRing *ring);
+    
+    // Deadlines go on the driver's shared timer wheel, see VSPTimer.h.
+    bool        fWheelStarted;
+    
+    // Releases a jitter hold, one each way indexed by kFaultsToTTY and kFaultsFromTTY.
+    WheelTimer      fHoldTimer[2];
+    static  void    rxHoldExpired(void *owner, void *unused);
+    static  void    txHoldExpired(void *owner, void *unused);
+    
+    // dequeueData calls waiting for their min bytes, under RXBufferLock. checkQueue wakes them on &fRXReaders.
+    UInt32          fRXReaders;
+    static  void    readTimedOut(void *owner, void *expired);
+    
+    // sendBufferPartial left bytes behind for want of RX space, under RXBufferLock. checkQueue hands the next
+    // room the tty makes to the clients' pending sends.
+    bool            fSendWaiting;
+    
+    // checkQueue owes the clients their send credit. It is set under RXBufferLock and sent by sendCreditsDue
+    // once the lock is dropped, so no message goes out while the tty's side waits on the lock.
+    bool            fCreditsDue;
+    void            sendCreditsDue(void);
+    
+    // Answers for the device the port stands in for, see kSetResponder. fResponderLock comes before RXBufferLock.
+    VSPLock         *fResponderLock;
+    Responder       *fResponder;
+    WheelTimer      fResponderTimer;            // The next paced response byte is due
+    static  void    responderTimerFired(void *owner, void *unused);
+    bool    respond(UInt8 *buffer, UInt32 size);
+    UInt32  answer(Responder *responder);
+    UInt32  sendReply(Responder *responder, UInt32 size);
+    UInt32  sendDueReplies(Responder *responder);
 
 public:
     
-    VSPUserClient *client;
     IOService   *fProvider;
     PortInfo    fPort;
 
@@ -135,6 +306,10 @@ public:
     virtual IOReturn dequeueEvent(UInt32 *event, UInt32 *data, bool sleep, void *refCon) override;
     virtual IOReturn enqueueData(UInt8 *buffer, UInt32 size, UInt32 *count, bool sleep, void *refCon) override;
     virtual IOReturn dequeueData(UInt8 *buffer, UInt32 size, UInt32 *count, UInt32 min, void *refCon) override;
+    
+    virtual bool    handleOpen(IOService *forClient, IOOptionBits options, void *arg) override;
+    virtual void    handleClose(IOService *forClient, IOOptionBits options) override;
+    virtual bool    handleIsOpen(const IOService *forClient) const override;
  
     void    initStructure(void);
     bool    allocateResources(void);
@@ -142,15 +317,63 @@ public:
     bool    createSerialStream(void);
     void    setStructureDefaults(void);
     void    writePortState(UInt32 state, UInt32 mask);
+    bool    testAndSetPortState(UInt32 busy, UInt32 state, UInt32 mask);
     UInt32  readPortState(void);
     IOReturn    privateWatchState(UInt32 *state, UInt32 mask);
-    void    checkQueues(void);
-    bool    allocateRingBuffer(CirQueue *Queue);
-    void    freeRingBuffer(CirQueue *Queue);
+    void    checkQueue(CirQueue *Queue);
+    void    freeRingBuffer(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock);
+    IOReturn    resizeQueue(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock, UInt32 Size);
+    IOReturn    setWaterMarks(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock, UInt32 HighWater, UInt32 LowWater);
+    void    noteOverrun(UInt32 dropped, UInt64 position);
+    UInt32  addToRX(UInt8 *buffer, UInt32 size);
+    UInt32  addToRXOverwrite(UInt8 *buffer, UInt32 size);
+    UInt32  queueRX(UInt8 *buffer, UInt32 size);
+    UInt32  queueRXOverwrite(UInt8 *buffer, UInt32 size);
+    UInt32  removeFromRX(UInt8 *buffer, UInt32 size);
+    UInt32  scanFrame(UInt8 *buffer, UInt32 size, bool *complete);
+    void    resetFrames(void);
+    UInt32  readableRX(void);
+    UInt32  readQueueEvent(CirQueue *Queue, BufferMarks *Marks, VSPLock *Lock, UInt32 event);
+    bool    putEvent(EventRing *ring, UInt32 event, UInt32 data, UInt64 position);
+    bool    takeEvent(EventRing *ring, UInt64 position, UInt32 *event, UInt32 *data);
+    bool    eventDue(EventRing *ring, UInt64 position);
+    UInt32  bytesBeforeEvent(EventRing *ring, UInt64 position, UInt32 size);
+    void    resetEvents(EventRing *ring);
+    void    setLineCoding(void);
+    void    noteLineErrors(const UInt8 *buffer, UInt32 size, UInt64 position);
+    UInt32  lineToRX(UInt8 *buffer, UInt32 size, bool overwrite, UInt32 *dropped);
+    UInt32  addToTX(UInt8 *buffer, UInt32 size);
+    UInt32  lineToTX(UInt8 *buffer, UInt32 size);
+    void    setLineBits(FaultState *faults, UInt32 charLength, UInt32 parity, bool check);
+    void    resetFaults(FaultState *faults);
+    UInt32  bytesBeforeHold(FaultState *faults, UInt64 position, UInt32 size);
+    void    holdBytes(UInt32 direction, UInt64 position);
+    void    releaseHold(UInt32 direction);
     
     // Called from VSPTester via VSPUserClient
     virtual IOReturn sendData(TRBufferStruct* inStruct, UInt32* sendCount);
+    virtual IOReturn sendBuffer(UInt8* buffer, UInt32 size, UInt32* sendCount);
+    virtual IOReturn sendBufferBlocking(UInt8* buffer, UInt32 size, UInt32* sendCount);
+    virtual IOReturn sendBufferPartial(UInt8* buffer, UInt32 size, UInt32* sendCount);
+    UInt32  getRXFreeSpace(void);
+    void    getCredits(UInt64* limit, UInt64* sent);
+    IOReturn    receiveData(UInt8* buffer, UInt32 size, UInt32* count);
+    void    runTXEvents(void);
     virtual IOReturn getInfo(void);
+    virtual IOReturn setOverflowPolicy(UInt32 policy);
+    IOReturn    setFraming(UInt32 mode, UInt32 parameter, UInt32 maxSize);
+    IOReturn    sendEvent(UInt32 event, UInt32 data);
+    IOReturn    setLineFormat(UInt32 charLength, UInt32 parity);
+    IOReturn    setFaults(UInt32 direction, const FaultConfig *config);
+    IOBufferMemoryDescriptor*   getSharedRing(UInt32 type);
+    void    pumpSharedRings(void);
+    IOBufferMemoryDescriptor*   getStatusPage(void);
+    IOReturn    executeBatch(UInt8* commands, UInt32 size, BatchResult* results, UInt32 maxResults, UInt32* numResults);
+    void    updateStatus(void);
+    void    readStatus(UInt64* values);
+    IOReturn    getLockStats(UInt32 index, bool clear, LockStats* stats, UInt32 maxStats, UInt32* numStats);
+    IOReturn    setResponder(const UInt8* table, UInt32 size);
+    IOReturn    getResponderStats(bool clear, ResponderStats* stats);
     
     // Debug
     